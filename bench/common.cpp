@@ -0,0 +1,66 @@
+#include "common.h"
+
+#include <hpke/random.h>
+
+#include <cstdlib>
+#include <fstream>
+#include <map>
+
+namespace mls_bench {
+
+const CipherSuite default_suite{
+  CipherSuite::ID::X25519_AES128GCM_SHA256_Ed25519
+};
+
+const std::vector<int64_t> group_sizes{ 2, 16, 128, 1024, 8192, 50000 };
+
+Member
+new_member(CipherSuite suite)
+{
+  return Member::generate(suite);
+}
+
+bytes
+fresh_secret(CipherSuite suite)
+{
+  return random_bytes(suite.get().hpke.kdf.hash_size());
+}
+
+static SyntheticGroup
+load_or_build(uint32_t size, uint32_t blank_percent)
+{
+  const auto* dir = std::getenv("MLSPP_BENCH_SNAPSHOTS");
+  if (dir != nullptr) {
+    auto file_name = std::string(dir) + "/group_" + std::to_string(size) +
+                     "_" + std::to_string(blank_percent) + ".bin";
+    if (std::ifstream(file_name).good()) {
+      return SyntheticGroup::load(file_name);
+    }
+  }
+
+  auto opts = SyntheticGroup::Options{};
+  opts.suite = default_suite;
+  opts.size = size;
+  opts.blank_fraction = blank_percent / 100.0;
+  return SyntheticGroup::build(opts);
+}
+
+const Group&
+cached_group(uint32_t size, uint32_t blank_percent)
+{
+  static auto groups = std::map<std::tuple<uint32_t, uint32_t>, Group>{};
+
+  auto key = std::make_tuple(size, blank_percent);
+  auto it = groups.find(key);
+  if (it == groups.end()) {
+    auto synthetic = load_or_build(size, blank_percent);
+    auto creator = synthetic.state(0);
+    auto joiner = synthetic.state(1);
+    auto group =
+      Group{ std::move(synthetic), std::move(creator), std::move(joiner) };
+    it = groups.emplace(key, std::move(group)).first;
+  }
+  return it->second;
+}
+
+} // namespace mls_bench
@@ -0,0 +1,38 @@
+#pragma once
+
+#include "synthetic_group.h"
+
+#include <vector>
+
+namespace mls_bench {
+
+using Member = SyntheticGroup::Member;
+
+// The suite used wherever a benchmark is not about the cipher suite itself
+extern const CipherSuite default_suite;
+
+// Group sizes for the benchmarks that scale with the group
+extern const std::vector<int64_t> group_sizes;
+
+Member
+new_member(CipherSuite suite);
+
+bytes
+fresh_secret(CipherSuite suite);
+
+// A synthetic group of the given size, with the States of its first two
+// members
+struct Group
+{
+  SyntheticGroup synthetic;
+  State creator;
+  State joiner;
+};
+
+// Groups are built once per size and blank percentage, and cached.  If
+// MLSPP_BENCH_SNAPSHOTS names a directory, groups are loaded from snapshots
+// there written by group_gen, named group_<size>_<blank_percent>.bin.
+const Group&
+cached_group(uint32_t size, uint32_t blank_percent = 0);
+
+} // namespace mls_bench
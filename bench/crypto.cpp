@@ -0,0 +1,110 @@
+#include "common.h"
+
+#include <benchmark/benchmark.h>
+#include <hpke/random.h>
+
+using namespace mls_bench;
+
+// Each benchmark here runs once per supported suite, indexed by its argument
+static CipherSuite
+suite_arg(benchmark::State& state)
+{
+  auto suite = CipherSuite{ all_supported_suites.at(state.range(0)) };
+  state.SetLabel(std::to_string(static_cast<uint16_t>(suite.id)));
+  return suite;
+}
+
+static constexpr size_t message_size = 1024;
+
+static void
+BM_Hash(benchmark::State& state)
+{
+  auto suite = suite_arg(state);
+  auto data = random_bytes(message_size);
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(suite.get().digest.hash(data));
+  }
+  state.SetBytesProcessed(state.iterations() * message_size);
+}
+BENCHMARK(BM_Hash)->DenseRange(0, all_supported_suites.size() - 1);
+
+static void
+BM_HMAC(benchmark::State& state)
+{
+  auto suite = suite_arg(state);
+  auto key = random_bytes(suite.get().digest.hash_size());
+  auto data = random_bytes(message_size);
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(suite.get().digest.hmac(key, data));
+  }
+  state.SetBytesProcessed(state.iterations() * message_size);
+}
+BENCHMARK(BM_HMAC)->DenseRange(0, all_supported_suites.size() - 1);
+
+static void
+BM_AEADSeal(benchmark::State& state)
+{
+  auto suite = suite_arg(state);
+  const auto& aead = suite.get().hpke.aead;
+  auto key = random_bytes(aead.key_size());
+  auto nonce = random_bytes(aead.nonce_size());
+  auto aad = random_bytes(32);
+  auto data = random_bytes(message_size);
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(aead.seal(key, nonce, aad, data));
+  }
+  state.SetBytesProcessed(state.iterations() * message_size);
+}
+BENCHMARK(BM_AEADSeal)->DenseRange(0, all_supported_suites.size() - 1);
+
+static void
+BM_Sign(benchmark::State& state)
+{
+  auto suite = suite_arg(state);
+  auto priv = SignaturePrivateKey::generate(suite);
+  auto data = random_bytes(message_size);
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(priv.sign(suite, data));
+  }
+}
+BENCHMARK(BM_Sign)->DenseRange(0, all_supported_suites.size() - 1);
+
+static void
+BM_Verify(benchmark::State& state)
+{
+  auto suite = suite_arg(state);
+  auto priv = SignaturePrivateKey::generate(suite);
+  auto data = random_bytes(message_size);
+  auto signature = priv.sign(suite, data);
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(priv.public_key.verify(suite, data, signature));
+  }
+}
+BENCHMARK(BM_Verify)->DenseRange(0, all_supported_suites.size() - 1);
+
+static void
+BM_HPKEEncrypt(benchmark::State& state)
+{
+  auto suite = suite_arg(state);
+  auto priv = HPKEPrivateKey::generate(suite);
+  auto aad = random_bytes(32);
+  auto data = random_bytes(suite.get().hpke.kdf.hash_size());
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(priv.public_key.encrypt(suite, aad, data));
+  }
+}
+BENCHMARK(BM_HPKEEncrypt)->DenseRange(0, all_supported_suites.size() - 1);
+
+static void
+BM_HPKEDecrypt(benchmark::State& state)
+{
+  auto suite = suite_arg(state);
+  auto priv = HPKEPrivateKey::generate(suite);
+  auto aad = random_bytes(32);
+  auto data = random_bytes(suite.get().hpke.kdf.hash_size());
+  auto ct = priv.public_key.encrypt(suite, aad, data);
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(priv.decrypt(suite, aad, ct));
+  }
+}
+BENCHMARK(BM_HPKEDecrypt)->DenseRange(0, all_supported_suites.size() - 1);
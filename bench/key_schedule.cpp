@@ -0,0 +1,36 @@
+#include "common.h"
+
+#include <benchmark/benchmark.h>
+#include <hpke/random.h>
+
+using namespace mls_bench;
+
+static void
+BM_HashRatchetNext(benchmark::State& state)
+{
+  auto suite = default_suite;
+  auto secret = random_bytes(suite.get().hpke.kdf.hash_size());
+  auto ratchet = HashRatchet{ suite, NodeIndex{ 0 }, secret };
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(ratchet.next());
+  }
+}
+BENCHMARK(BM_HashRatchetNext);
+
+static void
+BM_HashRatchetSkip(benchmark::State& state)
+{
+  // Deriving a generation far ahead of the last one used, as for a message
+  // that arrives after many others were lost
+  auto suite = default_suite;
+  auto secret = random_bytes(suite.get().hpke.kdf.hash_size());
+  auto skip = static_cast<uint32_t>(state.range(0));
+  auto ratchet = HashRatchet{ suite, NodeIndex{ 0 }, secret };
+  auto generation = uint32_t(0);
+  for (auto _ : state) {
+    generation += skip;
+    benchmark::DoNotOptimize(ratchet.get(generation));
+    ratchet.erase(generation);
+  }
+}
+BENCHMARK(BM_HashRatchetSkip)->Arg(16)->Arg(128)->Arg(1024);
@@ -0,0 +1,93 @@
+#include "common.h"
+
+#include <benchmark/benchmark.h>
+
+using namespace mls_bench;
+
+// Each benchmark runs on synthetic groups of increasing size, with and
+// without blank leaves
+static void
+group_args(benchmark::internal::Benchmark* bench)
+{
+  for (auto size : group_sizes) {
+    bench->Args({ size, 0 });
+    bench->Args({ size, 50 });
+  }
+  bench->ArgNames({ "size", "blank_percent" });
+  bench->Unit(benchmark::kMillisecond);
+}
+
+static const Group&
+group_arg(benchmark::State& state)
+{
+  return cached_group(static_cast<uint32_t>(state.range(0)),
+                      static_cast<uint32_t>(state.range(1)));
+}
+
+static void
+BM_Commit(benchmark::State& state)
+{
+  const auto& group = group_arg(state);
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(group.joiner.commit(fresh_secret(default_suite)));
+  }
+}
+BENCHMARK(BM_Commit)->Apply(group_args);
+
+static void
+BM_Handle(benchmark::State& state)
+{
+  const auto& group = group_arg(state);
+  auto [commit, welcome, next] =
+    group.joiner.commit(fresh_secret(default_suite));
+  silence_unused(welcome);
+  silence_unused(next);
+
+  for (auto _ : state) {
+    state.PauseTiming();
+    auto receiver = group.creator;
+    state.ResumeTiming();
+
+    benchmark::DoNotOptimize(receiver.handle(commit));
+  }
+}
+BENCHMARK(BM_Handle)->Apply(group_args);
+
+static void
+BM_WelcomeJoin(benchmark::State& state)
+{
+  const auto& group = group_arg(state);
+  auto joiner = new_member(default_suite);
+  auto adder = group.creator;
+  adder.handle(adder.add(joiner.key_package));
+  auto [commit, welcome, next] = adder.commit(fresh_secret(default_suite));
+  silence_unused(commit);
+  silence_unused(next);
+
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(State{
+      joiner.init_priv, joiner.identity_priv, joiner.key_package, welcome });
+  }
+}
+BENCHMARK(BM_WelcomeJoin)->Apply(group_args);
+
+static void
+BM_GroupTreeMarshal(benchmark::State& state)
+{
+  const auto& tree = group_arg(state).synthetic.tree;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(tls::marshal(tree));
+  }
+}
+BENCHMARK(BM_GroupTreeMarshal)->Apply(group_args);
+
+static void
+BM_GroupTreeUnmarshal(benchmark::State& state)
+{
+  auto data = tls::marshal(group_arg(state).synthetic.tree);
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(tls::get<TreeKEMPublicKey>(data));
+  }
+  state.SetBytesProcessed(state.iterations() * data.size());
+}
+BENCHMARK(BM_GroupTreeUnmarshal)->Apply(group_args);
@@ -0,0 +1,84 @@
+#include "common.h"
+
+#include <benchmark/benchmark.h>
+#include <hpke/random.h>
+
+using namespace mls_bench;
+
+static const std::vector<int64_t> payload_sizes{ 16, 256, 4096, 65536 };
+
+static void
+payload_args(benchmark::internal::Benchmark* bench)
+{
+  for (auto size : payload_sizes) {
+    bench->Arg(size);
+  }
+}
+
+static void
+BM_Protect(benchmark::State& state)
+{
+  auto sender = cached_group(2).creator;
+  auto payload = random_bytes(state.range(0));
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(sender.protect(payload));
+  }
+  state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_Protect)->Apply(payload_args);
+
+static void
+BM_ProtectInto(benchmark::State& state)
+{
+  auto sender = cached_group(2).creator;
+  auto payload = random_bytes(state.range(0));
+  auto out = bytes{};
+  for (auto _ : state) {
+    sender.protect_into(payload, out);
+    benchmark::DoNotOptimize(out);
+  }
+  state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_ProtectInto)->Apply(payload_args);
+
+static void
+BM_Unprotect(benchmark::State& state)
+{
+  const auto& group = cached_group(2);
+  auto sender = group.creator;
+  auto receiver = group.joiner;
+  auto payload = random_bytes(state.range(0));
+
+  // Each message key can be used once, so every iteration needs a fresh
+  // ciphertext
+  for (auto _ : state) {
+    state.PauseTiming();
+    auto ct = sender.protect(payload);
+    state.ResumeTiming();
+
+    benchmark::DoNotOptimize(receiver.unprotect(ct));
+  }
+  state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_Unprotect)->Apply(payload_args);
+
+static void
+BM_UnprotectInPlace(benchmark::State& state)
+{
+  const auto& group = cached_group(2);
+  auto sender = group.creator;
+  auto receiver = group.joiner;
+  auto payload = random_bytes(state.range(0));
+  auto message = bytes{};
+
+  for (auto _ : state) {
+    state.PauseTiming();
+    sender.protect_into(payload, message);
+    state.ResumeTiming();
+
+    receiver.unprotect_in_place(message);
+    benchmark::DoNotOptimize(message);
+  }
+  state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_UnprotectInPlace)->Apply(payload_args);
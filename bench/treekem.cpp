@@ -0,0 +1,228 @@
+#include "common.h"
+
+#include <benchmark/benchmark.h>
+#include <hpke/random.h>
+
+#include <algorithm>
+#include <map>
+#include <numeric>
+#include <random>
+
+using namespace mls_bench;
+
+// A tree with every leaf occupied and every parent blank, the worst case for
+// encap, since each copath resolution is a full subtree of leaves.  Leaf 0
+// encaps once to populate its direct path.
+struct BenchTree
+{
+  TreeKEMPublicKey pub;
+  std::vector<Member> members;
+};
+
+static const BenchTree&
+cached_tree(uint32_t size)
+{
+  static auto trees = std::map<uint32_t, BenchTree>{};
+
+  auto it = trees.find(size);
+  if (it != trees.end()) {
+    return it->second;
+  }
+
+  auto tree = BenchTree{ TreeKEMPublicKey{ default_suite }, {} };
+  for (uint32_t i = 0; i < size; i++) {
+    tree.members.push_back(new_member(default_suite));
+    tree.pub.add_leaf(tree.members.back().key_package);
+  }
+  tree.pub.set_hash_all();
+
+  return trees.emplace(size, std::move(tree)).first->second;
+}
+
+static const std::vector<int64_t> tree_sizes{ 2, 16, 128, 1024 };
+
+static void
+tree_args(benchmark::internal::Benchmark* bench)
+{
+  for (auto size : tree_sizes) {
+    bench->Arg(size);
+  }
+  bench->Unit(benchmark::kMicrosecond);
+}
+
+static const auto context = bytes{ 0, 1, 2, 3 };
+
+static void
+BM_Encap(benchmark::State& state)
+{
+  const auto& tree = cached_tree(state.range(0));
+  const auto& sig_priv = tree.members.at(0).identity_priv;
+  for (auto _ : state) {
+    state.PauseTiming();
+    auto pub = tree.pub;
+    auto leaf_secret = fresh_secret(default_suite);
+    state.ResumeTiming();
+
+    benchmark::DoNotOptimize(
+      pub.encap(LeafIndex{ 0 }, context, leaf_secret, sig_priv, std::nullopt));
+  }
+}
+BENCHMARK(BM_Encap)->Apply(tree_args);
+
+static void
+BM_Decap(benchmark::State& state)
+{
+  const auto& tree = cached_tree(state.range(0));
+  const auto& sig_priv = tree.members.at(0).identity_priv;
+  auto pub = tree.pub;
+  auto [sender_priv, path] = pub.encap(
+    LeafIndex{ 0 }, context, fresh_secret(default_suite), sig_priv, std::nullopt);
+  silence_unused(sender_priv);
+  pub.merge(LeafIndex{ 0 }, path);
+  pub.set_hash_all();
+
+  // The last member shares only the root with the sender
+  auto receiver = LeafIndex{ static_cast<uint32_t>(state.range(0) - 1) };
+  const auto& init_priv = tree.members.at(receiver.val).init_priv;
+  auto receiver_priv =
+    TreeKEMPrivateKey::solo(default_suite, receiver, init_priv);
+
+  for (auto _ : state) {
+    state.PauseTiming();
+    auto priv = receiver_priv;
+    state.ResumeTiming();
+
+    priv.decap(LeafIndex{ 0 }, pub, context, path);
+    benchmark::DoNotOptimize(priv);
+  }
+}
+BENCHMARK(BM_Decap)->Apply(tree_args);
+
+static void
+BM_TreeMarshal(benchmark::State& state)
+{
+  const auto& tree = cached_tree(state.range(0));
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(tls::marshal(tree.pub));
+  }
+}
+BENCHMARK(BM_TreeMarshal)->Apply(tree_args);
+
+static void
+BM_TreeUnmarshal(benchmark::State& state)
+{
+  const auto& tree = cached_tree(state.range(0));
+  auto data = tls::marshal(tree.pub);
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(tls::get<TreeKEMPublicKey>(data));
+  }
+  state.SetBytesProcessed(state.iterations() * data.size());
+}
+BENCHMARK(BM_TreeUnmarshal)->Apply(tree_args);
+
+// A tree after churn under each placement policy.  In a tree whose every
+// eighth member has committed, a quarter of the members leave, each removal
+// committed by a remaining member.  Half as many join under the policy, and
+// then a tenth of the original members commit, as they would in the
+// following epochs.  The counter is the mean number of ciphertexts in an
+// UpdatePath from a member, i.e., the size of its copath resolutions.
+static const std::vector<std::shared_ptr<const LeafPlacement>> placements{
+  std::make_shared<LeftmostPlacement>(),
+  std::make_shared<MinResolutionPlacement>(),
+  std::make_shared<ClusteredPlacement>(),
+};
+
+static const BenchTree&
+churned_tree(size_t placement)
+{
+  static constexpr uint32_t size = 256;
+  static auto trees = std::map<size_t, BenchTree>{};
+
+  auto it = trees.find(placement);
+  if (it != trees.end()) {
+    return it->second;
+  }
+
+  auto tree = BenchTree{ TreeKEMPublicKey{ default_suite }, {} };
+  tree.pub.leaf_placement(placements.at(placement));
+  for (uint32_t i = 0; i < size; i++) {
+    tree.members.push_back(new_member(default_suite));
+    tree.pub.add_leaf(tree.members.back().key_package);
+  }
+
+  auto commit = [&](LeafIndex from) {
+    const auto& sig_priv = tree.members.at(from.val).identity_priv;
+    auto [priv, path] = tree.pub.encap(
+      from, context, fresh_secret(default_suite), sig_priv, std::nullopt);
+    silence_unused(priv);
+    tree.pub.merge(from, path);
+  };
+
+  for (uint32_t i = 0; i < size; i += 8) {
+    commit(LeafIndex{ i });
+  }
+
+  // The same members leave and commit under every policy
+  auto rng = std::mt19937(0x5eed);
+  auto order = std::vector<uint32_t>(size);
+  std::iota(order.begin(), order.end(), uint32_t(0));
+  std::shuffle(order.begin(), order.end(), rng);
+
+  const auto leaving = size / 4;
+  for (uint32_t i = 0; i < leaving; i++) {
+    tree.pub.blank_path(LeafIndex{ order.at(i) });
+    commit(LeafIndex{ order.at(size - 1 - i) });
+  }
+
+  for (uint32_t i = 0; i < leaving / 2; i++) {
+    auto joiner = new_member(default_suite);
+    auto index = tree.pub.add_leaf(joiner.key_package);
+    tree.members.at(index.val) = std::move(joiner);
+  }
+
+  for (uint32_t i = leaving; i < leaving + size / 10; i++) {
+    commit(LeafIndex{ order.at(i) });
+  }
+  tree.pub.set_hash_all();
+
+  return trees.emplace(placement, std::move(tree)).first->second;
+}
+
+static void
+BM_EncapAfterChurn(benchmark::State& state)
+{
+  const auto& tree = churned_tree(static_cast<size_t>(state.range(0)));
+  const auto width = NodeCount(tree.pub.size());
+
+  auto ciphertexts = size_t(0);
+  auto senders = std::vector<LeafIndex>{};
+  for (auto i = LeafIndex{ 0 }; i < tree.pub.size(); i.val++) {
+    if (tree.pub.blank(NodeIndex(i))) {
+      continue;
+    }
+
+    for (auto n : tree_math::copath(NodeIndex(i), width)) {
+      ciphertexts += tree.pub.resolve(n).size();
+    }
+    senders.push_back(i);
+  }
+
+  // Time an UpdatePath from the first remaining member
+  const auto from = senders.front();
+  const auto& sig_priv = tree.members.at(from.val).identity_priv;
+  for (auto _ : state) {
+    state.PauseTiming();
+    auto pub = tree.pub;
+    auto leaf_secret = fresh_secret(default_suite);
+    state.ResumeTiming();
+
+    benchmark::DoNotOptimize(
+      pub.encap(from, context, leaf_secret, sig_priv, std::nullopt));
+  }
+
+  state.counters["ciphertexts"] =
+    static_cast<double>(ciphertexts) / static_cast<double>(senders.size());
+}
+BENCHMARK(BM_EncapAfterChurn)
+  ->DenseRange(0, static_cast<int64_t>(placements.size()) - 1)
+  ->Unit(benchmark::kMicrosecond);
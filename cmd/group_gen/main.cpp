@@ -0,0 +1,30 @@
+#include "synthetic_group.h"
+
+#include <iostream>
+#include <string>
+
+// Writes a snapshot of a synthetic group, for benchmarks and tests that need
+// a large group without the cost of building one
+//
+//   group_gen <size> <blank_fraction> <file_name>
+int
+main(int argc, char* argv[]) // NOLINT(bugprone-exception-escape)
+{
+  if (argc != 4) {
+    std::cerr << "Usage: " << argv[0] << " <size> <blank_fraction> <file_name>"
+              << std::endl;
+    return 1;
+  }
+
+  auto opts = SyntheticGroup::Options{};
+  opts.size = static_cast<uint32_t>(std::stoul(argv[1]));
+  opts.blank_fraction = std::stod(argv[2]);
+  const auto file_name = std::string(argv[3]);
+
+  auto group = SyntheticGroup::build(opts);
+  group.save(file_name);
+
+  std::cout << "Wrote " << opts.size << "-member group to " << file_name
+            << std::endl;
+  return 0;
+}
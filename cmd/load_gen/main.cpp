@@ -0,0 +1,631 @@
+#include "mls/session.h"
+#include "mls/session_manager.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <future>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <shared_mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace mls;
+
+// Simulates many members across many groups in one process, running a mix of
+// operations on them from several threads, and reports the throughput and
+// latency of each kind of operation
+//
+//   load_gen [--groups=M] [--members=N] [--threads=T] [--fanout=F]
+//            [--ops=K] [--payload=B] [--seed=S] [--manager]
+//            [--mix=protect:50,unprotect:40,update:5,add:3,remove:2]
+//
+// The members are split evenly between the groups.  Application messages are
+// protected by one member and unprotected by another.  An update, add, or
+// remove is proposed and committed by one member and handled by all of the
+// others; its latency covers the whole fan-out, which runs on F threads, and
+// each member's handle() is measured on its own.  With --manager, the first
+// member of each group is driven through a SessionManager.
+
+using Clock = std::chrono::steady_clock;
+
+static const auto suite =
+  CipherSuite{ CipherSuite::ID::X25519_AES128GCM_SHA256_Ed25519 };
+
+enum struct Op : uint8_t
+{
+  protect = 0,
+  unprotect,
+  update,
+  add,
+  remove,
+  handle,
+};
+static constexpr size_t op_count = 6;
+
+static const std::array<const char*, op_count> op_names = {
+  "protect", "unprotect", "update", "add", "remove", "handle",
+};
+
+struct Options
+{
+  size_t groups = 4;
+  size_t members = 64;
+  size_t threads = std::max(std::thread::hardware_concurrency(), 1U);
+  size_t fanout = std::max(std::thread::hardware_concurrency(), 1U);
+  size_t ops = 10000;
+  size_t payload = 256;
+  uint64_t seed = 1;
+  bool manager = false;
+
+  // Relative weights of the operations that are chosen directly
+  std::array<size_t, op_count> mix = { 50, 40, 5, 3, 2, 0 };
+};
+
+static Options
+parse_options(int argc, char* argv[])
+{
+  auto opts = Options{};
+  for (int i = 1; i < argc; i++) {
+    const auto arg = std::string(argv[i]);
+    if (arg == "--manager") {
+      opts.manager = true;
+      continue;
+    }
+
+    const auto eq = arg.find('=');
+    if (arg.rfind("--", 0) != 0 || eq == std::string::npos) {
+      throw std::invalid_argument("Unknown argument: " + arg);
+    }
+
+    const auto name = arg.substr(2, eq - 2);
+    const auto value = arg.substr(eq + 1);
+    if (name == "groups") {
+      opts.groups = std::stoul(value);
+    } else if (name == "members") {
+      opts.members = std::stoul(value);
+    } else if (name == "threads") {
+      opts.threads = std::stoul(value);
+    } else if (name == "fanout") {
+      opts.fanout = std::stoul(value);
+    } else if (name == "ops") {
+      opts.ops = std::stoul(value);
+    } else if (name == "payload") {
+      opts.payload = std::stoul(value);
+    } else if (name == "seed") {
+      opts.seed = std::stoull(value);
+    } else if (name == "mix") {
+      opts.mix = {};
+      auto entries = std::istringstream(value);
+      auto entry = std::string{};
+      while (std::getline(entries, entry, ',')) {
+        const auto colon = entry.find(':');
+        const auto op_name = entry.substr(0, colon);
+        const auto* last = op_names.end() - 1;
+        const auto* it = std::find(op_names.begin(), last, op_name);
+        if (colon == std::string::npos || it == last) {
+          throw std::invalid_argument("Bad mix entry: " + entry);
+        }
+
+        const auto weight = std::stoul(entry.substr(colon + 1));
+        opts.mix.at(it - op_names.begin()) = weight;
+      }
+    } else {
+      throw std::invalid_argument("Unknown option: " + name);
+    }
+  }
+
+  if (opts.groups == 0 || opts.members < 2 * opts.groups) {
+    throw std::invalid_argument("Each group needs at least two members");
+  }
+
+  if (std::all_of(opts.mix.begin(), opts.mix.end(), [](auto w) {
+        return w == 0;
+      })) {
+    throw std::invalid_argument("The mix must include some operation");
+  }
+
+  if (opts.threads == 0 || opts.fanout == 0) {
+    throw std::invalid_argument("Thread counts must be positive");
+  }
+
+  return opts;
+}
+
+static Client
+create_client(size_t number)
+{
+  const auto name = "member-" + std::to_string(number);
+  auto sig_priv = SignaturePrivateKey::generate(suite);
+  auto id = bytes(name.begin(), name.end());
+  auto cred = Credential::basic(id, sig_priv.public_key);
+  return { suite, sig_priv, cred, std::nullopt };
+}
+
+///
+/// Latency samples, kept per thread and merged at the end
+///
+
+struct Samples
+{
+  std::array<std::vector<Clock::duration>, op_count> latencies;
+  std::array<size_t, op_count> errors = {};
+  std::array<std::string, op_count> first_error;
+
+  void record(Op op, Clock::duration elapsed)
+  {
+    latencies.at(static_cast<size_t>(op)).push_back(elapsed);
+  }
+
+  void fail(Op op, const std::exception& e)
+  {
+    const auto i = static_cast<size_t>(op);
+    if (errors.at(i) == 0) {
+      first_error.at(i) = e.what();
+    }
+    errors.at(i) += 1;
+  }
+
+  Samples& operator+=(const Samples& other)
+  {
+    for (size_t i = 0; i < op_count; i++) {
+      auto& mine = latencies.at(i);
+      const auto& theirs = other.latencies.at(i);
+      mine.insert(mine.end(), theirs.begin(), theirs.end());
+      if (errors.at(i) == 0) {
+        first_error.at(i) = other.first_error.at(i);
+      }
+      errors.at(i) += other.errors.at(i);
+    }
+    return *this;
+  }
+};
+
+static double
+micros(Clock::duration d)
+{
+  return std::chrono::duration<double, std::micro>(d).count();
+}
+
+static void
+report(Samples& samples, Clock::duration wall)
+{
+  const auto seconds = std::chrono::duration<double>(wall).count();
+  std::cout << std::left << std::setw(10) << "op" << std::right
+            << std::setw(9) << "count" << std::setw(8) << "errors"
+            << std::setw(11) << "ops/s" << std::setw(11) << "p50 us"
+            << std::setw(11) << "p90 us" << std::setw(11) << "p99 us"
+            << std::setw(11) << "max us" << std::endl;
+
+  std::cout << std::fixed << std::setprecision(1);
+  for (size_t i = 0; i < op_count; i++) {
+    auto& latencies = samples.latencies.at(i);
+    if (latencies.empty() && samples.errors.at(i) == 0) {
+      continue;
+    }
+
+    std::sort(latencies.begin(), latencies.end());
+    const auto percentile = [&](double p) {
+      if (latencies.empty()) {
+        return 0.0;
+      }
+      const auto rank = static_cast<size_t>(p * (latencies.size() - 1));
+      return micros(latencies.at(rank));
+    };
+
+    std::cout << std::left << std::setw(10) << op_names.at(i) << std::right
+              << std::setw(9) << latencies.size() << std::setw(8)
+              << samples.errors.at(i) << std::setw(11)
+              << latencies.size() / seconds << std::setw(11)
+              << percentile(0.50) << std::setw(11) << percentile(0.90)
+              << std::setw(11) << percentile(0.99) << std::setw(11)
+              << percentile(1.0) << std::endl;
+  }
+
+  for (size_t i = 0; i < op_count; i++) {
+    if (samples.errors.at(i) > 0) {
+      std::cout << "First " << op_names.at(i)
+                << " error: " << samples.first_error.at(i) << std::endl;
+    }
+  }
+}
+
+///
+/// The simulation
+///
+
+class LoadGenerator
+{
+public:
+  explicit LoadGenerator(const Options& opts_in)
+    : opts(opts_in)
+    , fanout(opts.fanout)
+    , manager(opts.manager ? opts.threads : 1)
+  {
+    for (size_t g = 0; g < opts.groups; g++) {
+      const auto size =
+        opts.members / opts.groups + (g < opts.members % opts.groups ? 1 : 0);
+      groups.push_back(build_group(g, size));
+    }
+  }
+
+  Samples run()
+  {
+    auto remaining = std::atomic<int64_t>(static_cast<int64_t>(opts.ops));
+    auto samples = std::vector<Samples>(opts.threads);
+    auto workers = std::vector<std::thread>{};
+    for (size_t t = 0; t < opts.threads; t++) {
+      workers.emplace_back([&, t]() {
+        auto rng = std::mt19937_64(opts.seed + t);
+        while (remaining.fetch_sub(1) > 0) {
+          step(rng, samples.at(t));
+        }
+      });
+    }
+
+    for (auto& worker : workers) {
+      worker.join();
+    }
+
+    auto total = Samples{};
+    for (const auto& s : samples) {
+      total += s;
+    }
+    return total;
+  }
+
+  size_t member_count() const
+  {
+    auto count = size_t(0);
+    for (const auto& group : groups) {
+      count += group->members.size();
+    }
+    return count;
+  }
+
+private:
+  struct Sent
+  {
+    size_t sender;
+    bytes ciphertext;
+  };
+
+  // Application messages run under a shared lock, and changes of epoch
+  // under an exclusive one, so that every member is in the same epoch
+  // whenever a message is sent.  With a SessionManager, the first member is
+  // held by the manager, and its slot is empty.
+  struct Group
+  {
+    bytes id;
+    std::shared_mutex mutex;
+    std::vector<std::unique_ptr<Session>> members;
+
+    // Messages protected but not yet unprotected, for the current epoch
+    std::mutex sent_mutex;
+    std::deque<Sent> sent;
+  };
+
+  static constexpr size_t max_sent = 256;
+
+  const Options& opts;
+  ThreadPool fanout;
+  SessionManager manager;
+  std::vector<std::unique_ptr<Group>> groups;
+  std::atomic<size_t> next_client{ 0 };
+
+  std::unique_ptr<Group> build_group(size_t index, size_t size)
+  {
+    auto group = std::make_unique<Group>();
+    group->id = bytes(8, 0);
+    for (size_t i = 0; i < 8; i++) {
+      group->id.at(7 - i) = static_cast<uint8_t>(index >> (8 * i));
+    }
+
+    auto creator = create_client(next_client++);
+    auto session = creator.begin_session(group->id);
+
+    auto joins = std::vector<PendingJoin>{};
+    auto adds = std::vector<bytes>{};
+    for (size_t i = 1; i < size; i++) {
+      joins.push_back(create_client(next_client++).start_join());
+      adds.push_back(session.add(joins.back().key_package()));
+    }
+
+    const auto [welcome, commit] = session.commit(adds);
+    session.handle(commit);
+    const auto& welcome_data = welcome;
+
+    group->members.resize(size);
+    group->members.at(0) = std::make_unique<Session>(std::move(session));
+    fanout.run(joins.size(), [&](size_t i) {
+      group->members.at(i + 1) =
+        std::make_unique<Session>(joins.at(i).complete(welcome_data));
+    });
+
+    if (opts.manager) {
+      manager.add(std::move(*group->members.at(0)));
+      group->members.at(0).reset();
+    }
+
+    return group;
+  }
+
+  bool managed(const Group& group, size_t slot) const
+  {
+    return opts.manager && slot == 0 && !group.members.empty();
+  }
+
+  // Wait for a message submitted to the manager, rethrowing any error
+  template<typename F>
+  SessionManager::Result via_manager(F&& submit)
+  {
+    auto done = std::make_shared<std::promise<SessionManager::Result>>();
+    auto result = done->get_future();
+    submit([done](SessionManager::Result r) { done->set_value(std::move(r)); });
+
+    auto r = result.get();
+    if (r.error) {
+      std::rethrow_exception(r.error);
+    }
+    return r;
+  }
+
+  bytes protect(Group& group, size_t slot, const bytes& pt)
+  {
+    if (managed(group, slot)) {
+      return manager.protect(group.id, pt);
+    }
+    return group.members.at(slot)->protect(pt);
+  }
+
+  bytes unprotect(Group& group, size_t slot, const bytes& ct)
+  {
+    if (managed(group, slot)) {
+      return via_manager([&](auto done) {
+               manager.submit_application(ct, std::move(done));
+             })
+        .data;
+    }
+    return group.members.at(slot)->unprotect(ct);
+  }
+
+  void handle(Group& group, size_t slot, const bytes& message)
+  {
+    if (managed(group, slot)) {
+      via_manager([&](auto done) {
+        manager.submit_handshake(message, std::move(done));
+      });
+      return;
+    }
+    group.members.at(slot)->handle(message);
+  }
+
+  // Pick a member other than `other` that this process drives directly
+  static size_t pick(std::mt19937_64& rng,
+                     const Group& group,
+                     size_t first,
+                     size_t other)
+  {
+    const auto last = group.members.size() - 1;
+    auto dist = std::uniform_int_distribution<size_t>(first, last);
+    auto slot = dist(rng);
+    while (slot == other) {
+      slot = dist(rng);
+    }
+    return slot;
+  }
+
+  Op choose(std::mt19937_64& rng) const
+  {
+    auto dist = std::discrete_distribution<size_t>(opts.mix.begin(),
+                                                   opts.mix.end());
+    return static_cast<Op>(dist(rng));
+  }
+
+  void step(std::mt19937_64& rng, Samples& samples)
+  {
+    auto op = choose(rng);
+    const auto last = groups.size() - 1;
+    auto group_dist = std::uniform_int_distribution<size_t>(0, last);
+    auto& group = *groups.at(group_dist(rng));
+
+    // A group is never shrunk below two members
+    if (op == Op::remove && group.members.size() <= 2) {
+      op = Op::add;
+    }
+
+    const auto start = Clock::now();
+    try {
+      switch (op) {
+        case Op::protect:
+          send(rng, group);
+          break;
+
+        case Op::unprotect:
+          receive(rng, group, samples);
+          return;
+
+        default:
+          change_epoch(rng, group, op, samples);
+          break;
+      }
+      samples.record(op, Clock::now() - start);
+    } catch (const std::exception& e) {
+      samples.fail(op, e);
+    }
+  }
+
+  void send(std::mt19937_64& rng, Group& group)
+  {
+    const auto lock = std::shared_lock(group.mutex);
+    const auto sender = pick(rng, group, 0, group.members.size());
+    auto ct = protect(group, sender, bytes(opts.payload, 0xa0));
+
+    const auto sent_lock = std::lock_guard(group.sent_mutex);
+    group.sent.push_back({ sender, std::move(ct) });
+    if (group.sent.size() > max_sent) {
+      group.sent.pop_front();
+    }
+  }
+
+  // Unprotect a message sent earlier, sending one first, untimed, if none is
+  // waiting
+  void receive(std::mt19937_64& rng, Group& group, Samples& samples)
+  {
+    const auto lock = std::shared_lock(group.mutex);
+    auto sent = std::optional<Sent>{};
+    while (!sent.has_value()) {
+      {
+        const auto sent_lock = std::lock_guard(group.sent_mutex);
+        if (!group.sent.empty()) {
+          sent = std::move(group.sent.front());
+          group.sent.pop_front();
+          break;
+        }
+      }
+
+      const auto sender = pick(rng, group, 0, group.members.size());
+      auto ct = protect(group, sender, bytes(opts.payload, 0xa0));
+      sent = Sent{ sender, std::move(ct) };
+    }
+
+    const auto receiver = pick(rng, group, 0, sent->sender);
+    const auto start = Clock::now();
+    try {
+      const auto pt = unprotect(group, receiver, sent->ciphertext);
+      if (pt.size() != opts.payload) {
+        throw std::runtime_error("Wrong plaintext");
+      }
+      samples.record(Op::unprotect, Clock::now() - start);
+    } catch (const std::exception& e) {
+      samples.fail(Op::unprotect, e);
+    }
+  }
+
+  void change_epoch(std::mt19937_64& rng,
+                    Group& group,
+                    Op op,
+                    Samples& samples)
+  {
+    const auto lock = std::unique_lock(group.mutex);
+    {
+      const auto sent_lock = std::lock_guard(group.sent_mutex);
+      group.sent.clear();
+    }
+
+    // The committer is driven directly, since a SessionManager only handles
+    // messages for the Sessions it holds
+    const auto first = size_t(opts.manager ? 1 : 0);
+    const auto committer = pick(rng, group, first, group.members.size());
+    auto& session = *group.members.at(committer);
+
+    auto proposal = bytes{};
+    auto join = std::optional<PendingJoin>{};
+    auto removed = group.members.size();
+    switch (op) {
+      case Op::update:
+        proposal = session.update();
+        break;
+
+      case Op::add:
+        join.emplace(create_client(next_client++).start_join());
+        proposal = session.add(join->key_package());
+        break;
+
+      case Op::remove: {
+        // Session::remove() takes a position in the roster, which skips the
+        // leaves blanked by earlier removes.  The manager's member is the
+        // creator, in the first leaf.
+        removed = pick(rng, group, first, committer);
+        const auto leaf = group.members.at(removed)->index();
+        auto position = uint32_t(0);
+        for (const auto& member : group.members) {
+          const auto member_leaf = member ? member->index() : 0;
+          position += (member_leaf < leaf) ? 1 : 0;
+        }
+        proposal = session.remove(position);
+        break;
+      }
+
+      default:
+        throw std::logic_error("Not an epoch change");
+    }
+
+    const auto [welcome_data, commit_data] = session.commit(proposal);
+    const auto& welcome = welcome_data;
+    const auto& commit = commit_data;
+    session.handle(commit);
+
+    // Everyone else, apart from a removed member, handles both messages
+    auto others = std::vector<size_t>{};
+    for (size_t i = 0; i < group.members.size(); i++) {
+      if (i != committer && i != removed) {
+        others.push_back(i);
+      }
+    }
+
+    auto handle_times = std::vector<Clock::duration>(others.size());
+    fanout.run(others.size(), [&](size_t i) {
+      const auto start = Clock::now();
+      handle(group, others.at(i), proposal);
+      handle(group, others.at(i), commit);
+      handle_times.at(i) = Clock::now() - start;
+    });
+
+    for (const auto elapsed : handle_times) {
+      samples.record(Op::handle, elapsed);
+    }
+
+    if (removed < group.members.size()) {
+      group.members.erase(group.members.begin() + removed);
+    }
+
+    if (join.has_value()) {
+      auto joined = join->complete(welcome);
+      group.members.push_back(std::make_unique<Session>(std::move(joined)));
+    }
+  }
+};
+
+int
+main(int argc, char* argv[]) // NOLINT(bugprone-exception-escape)
+{
+  auto opts = Options{};
+  try {
+    opts = parse_options(argc, argv);
+  } catch (const std::exception& e) {
+    std::cerr << e.what() << std::endl;
+    return 1;
+  }
+
+  std::cout << "Building " << opts.groups << " groups of " << opts.members
+            << " members in total" << std::endl;
+  const auto setup_start = Clock::now();
+  auto generator = LoadGenerator(opts);
+  const auto setup = Clock::now() - setup_start;
+  std::cout << "Setup took " << std::fixed << std::setprecision(1)
+            << std::chrono::duration<double>(setup).count() << " s"
+            << std::endl;
+
+  std::cout << "Running " << opts.ops << " operations on " << opts.threads
+            << " threads" << (opts.manager ? ", through a SessionManager" : "")
+            << std::endl;
+  const auto run_start = Clock::now();
+  auto samples = generator.run();
+  const auto wall = Clock::now() - run_start;
+
+  std::cout << "Finished in " << std::chrono::duration<double>(wall).count()
+            << " s, with " << generator.member_count() << " members"
+            << std::endl;
+  report(samples, wall);
+  return 0;
+}
@@ -0,0 +1,326 @@
+#include "mls/metrics.h"
+#include "mls/session.h"
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <iterator>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+using namespace mls;
+
+// Re-runs a SessionCapture offline, e.g., one attached to a bug report, and
+// reports how long each kind of input took, next to the times recorded in
+// the capture
+//
+//   replay <capture-file> <capture-secret-hex> [--repeat=N] [--verbose]
+//
+// Each repetition restores the snapshot and feeds it the captured inputs in
+// order.  An input that fails on replay but did not fail when captured, or
+// the other way round, is reported, since the timings after it are then not
+// comparable.  When the library is built with the METRICS option, the time
+// spent in each costly step is reported as well.
+
+using Clock = std::chrono::steady_clock;
+using Input = SessionCapture::Input;
+
+static constexpr size_t input_count = 6;
+
+static const std::array<const char*, input_count> input_names = {
+  "", "welcome", "handshake", "catch_up", "application", "app_batch",
+};
+
+struct Options
+{
+  std::string path;
+  bytes secret;
+  size_t repeat = 1;
+  bool verbose = false;
+};
+
+static Options
+parse_options(int argc, char* argv[])
+{
+  auto opts = Options{};
+  auto positional = std::vector<std::string>{};
+  for (int i = 1; i < argc; i++) {
+    const auto arg = std::string(argv[i]);
+    if (arg == "--verbose") {
+      opts.verbose = true;
+    } else if (arg.rfind("--repeat=", 0) == 0) {
+      opts.repeat = std::stoul(arg.substr(9));
+    } else if (arg.rfind("--", 0) == 0) {
+      throw std::invalid_argument("Unknown option: " + arg);
+    } else {
+      positional.push_back(arg);
+    }
+  }
+
+  if (positional.size() != 2) {
+    throw std::invalid_argument(
+      "Usage: replay <capture-file> <capture-secret-hex> [--repeat=N] "
+      "[--verbose]");
+  }
+
+  if (opts.repeat == 0) {
+    throw std::invalid_argument("The repeat count must be positive");
+  }
+
+  opts.path = positional.at(0);
+  opts.secret = from_hex(positional.at(1));
+  return opts;
+}
+
+static bytes
+read_file(const std::string& path)
+{
+  auto file = std::ifstream(path, std::ios::binary);
+  if (!file) {
+    throw std::runtime_error("Cannot open " + path);
+  }
+
+  return { std::istreambuf_iterator<char>(file),
+           std::istreambuf_iterator<char>() };
+}
+
+static std::vector<bytes>
+messages_of(const SessionCapture::Entry& entry)
+{
+  auto out = std::vector<bytes>{};
+  out.reserve(entry.messages.size());
+  for (const auto& message : entry.messages) {
+    out.push_back(message.data);
+  }
+  return out;
+}
+
+///
+/// Timings, by input
+///
+
+struct Timings
+{
+  std::array<std::vector<Clock::duration>, input_count> replayed;
+  std::array<std::vector<Clock::duration>, input_count> recorded;
+  size_t mismatches = 0;
+};
+
+static double
+micros(Clock::duration d)
+{
+  return std::chrono::duration<double, std::micro>(d).count();
+}
+
+static double
+percentile(std::vector<Clock::duration>& samples, double p)
+{
+  if (samples.empty()) {
+    return 0.0;
+  }
+
+  std::sort(samples.begin(), samples.end());
+  const auto rank = static_cast<size_t>(p * (samples.size() - 1));
+  return micros(samples.at(rank));
+}
+
+static void
+report(Timings& timings)
+{
+  std::cout << std::left << std::setw(12) << "input" << std::right
+            << std::setw(8) << "count" << std::setw(13) << "recorded p50"
+            << std::setw(11) << "p50 us" << std::setw(11) << "p90 us"
+            << std::setw(11) << "p99 us" << std::setw(11) << "max us"
+            << std::endl;
+
+  std::cout << std::fixed << std::setprecision(1);
+  for (size_t i = 1; i < input_count; i++) {
+    auto& replayed = timings.replayed.at(i);
+    if (replayed.empty()) {
+      continue;
+    }
+
+    auto& recorded = timings.recorded.at(i);
+    std::cout << std::left << std::setw(12) << input_names.at(i) << std::right
+              << std::setw(8) << replayed.size() << std::setw(13)
+              << percentile(recorded, 0.50) << std::setw(11)
+              << percentile(replayed, 0.50) << std::setw(11)
+              << percentile(replayed, 0.90) << std::setw(11)
+              << percentile(replayed, 0.99) << std::setw(11)
+              << percentile(replayed, 1.0) << std::endl;
+  }
+
+  if (timings.mismatches > 0) {
+    std::cout << timings.mismatches
+              << " inputs did not fail or succeed as they did when captured"
+              << std::endl;
+  }
+}
+
+static const std::array<const char*, Metrics::operation_count>
+  operation_names = { "other", "commit", "handle", "protect", "unprotect" };
+
+static const std::array<const char*, Metrics::event_count> event_names = {
+  "hpke_encap", "hpke_decap",  "sign",      "verify",    "aead_seal",
+  "aead_open",  "hkdf_expand", "tree_hash", "state_copy"
+};
+
+static void
+report_metrics(const Metrics::Counters& counters)
+{
+  std::cout << std::endl
+            << std::left << std::setw(12) << "operation" << std::setw(12)
+            << "step" << std::right << std::setw(10) << "count"
+            << std::setw(12) << "total ms" << std::endl;
+
+  for (size_t op = 0; op < Metrics::operation_count; op++) {
+    for (size_t ev = 0; ev < Metrics::event_count; ev++) {
+      const auto entry = counters.get(static_cast<Metrics::Operation>(op),
+                                      static_cast<Metrics::Event>(ev));
+      if (entry.count == 0) {
+        continue;
+      }
+
+      const auto ms =
+        std::chrono::duration<double, std::milli>(entry.elapsed).count();
+      std::cout << std::left << std::setw(12) << operation_names.at(op)
+                << std::setw(12) << event_names.at(ev) << std::right
+                << std::setw(10) << entry.count << std::setw(12) << ms
+                << std::endl;
+    }
+  }
+}
+
+///
+/// Replay
+///
+
+static void
+replay_entry(Session& session, const SessionCapture::Entry& entry)
+{
+  switch (entry.input) {
+    case Input::handshake:
+      session.handle(entry.messages.at(0).data);
+      break;
+
+    case Input::catch_up:
+      session.catch_up(messages_of(entry));
+      break;
+
+    case Input::application: {
+      auto message = entry.messages.at(0).data;
+      session.unprotect_in_place(message);
+      break;
+    }
+
+    case Input::application_batch:
+      session.unprotect_batch(messages_of(entry));
+      break;
+
+    default:
+      throw std::runtime_error("Unexpected input in capture");
+  }
+}
+
+static void
+replay_once(const SessionCapture& capture,
+            const Options& opts,
+            Timings& timings)
+{
+  auto record = [&](const SessionCapture::Entry& entry,
+                    Clock::duration elapsed,
+                    bool failed,
+                    const std::string& error) {
+    const auto i = static_cast<size_t>(entry.input);
+    timings.replayed.at(i).push_back(elapsed);
+    timings.recorded.at(i).push_back(
+      std::chrono::nanoseconds(entry.elapsed_ns));
+
+    if (failed != (entry.failed != 0)) {
+      timings.mismatches += 1;
+      if (opts.verbose) {
+        std::cout << input_names.at(i) << " input "
+                  << (failed ? "failed on replay: " + error
+                             : "succeeded on replay")
+                  << std::endl;
+      }
+    }
+  };
+
+  auto first = capture.entries.begin();
+  auto session = std::optional<Session>{};
+  if (capture.origin == SessionCapture::Origin::session) {
+    session.emplace(Session::restore(capture.snapshot, opts.secret));
+  } else {
+    if (first == capture.entries.end() || first->input != Input::welcome) {
+      throw std::runtime_error("Join capture does not start with a Welcome");
+    }
+
+    const auto join = PendingJoin::restore(capture.snapshot, opts.secret);
+    const auto start = Clock::now();
+    session.emplace(join.complete(first->messages.at(0).data));
+    record(*first, Clock::now() - start, false, "");
+    first++;
+  }
+
+  for (auto it = first; it != capture.entries.end(); it++) {
+    auto failed = false;
+    auto error = std::string{};
+    const auto start = Clock::now();
+    try {
+      replay_entry(session.value(), *it);
+    } catch (const std::exception& e) {
+      failed = true;
+      error = e.what();
+    }
+    record(*it, Clock::now() - start, failed, error);
+  }
+}
+
+int
+main(int argc, char* argv[]) // NOLINT(bugprone-exception-escape)
+{
+  auto opts = Options{};
+  auto capture = SessionCapture{};
+  try {
+    opts = parse_options(argc, argv);
+    capture = SessionCapture::decode(read_file(opts.path));
+  } catch (const std::exception& e) {
+    std::cerr << e.what() << std::endl;
+    return 1;
+  }
+
+  std::cout << "Replaying " << capture.entries.size() << " inputs "
+            << opts.repeat << " times, from a "
+            << (capture.origin == SessionCapture::Origin::join ? "PendingJoin"
+                                                               : "Session")
+            << std::endl;
+
+  auto counters = Metrics::Counters{};
+  if (Metrics::enabled()) {
+    Metrics::set_sink(&counters);
+  }
+
+  auto timings = Timings{};
+  try {
+    for (size_t i = 0; i < opts.repeat; i++) {
+      replay_once(capture, opts, timings);
+    }
+  } catch (const std::exception& e) {
+    Metrics::set_sink(nullptr);
+    std::cerr << e.what() << std::endl;
+    return 1;
+  }
+  Metrics::set_sink(nullptr);
+
+  report(timings);
+  if (Metrics::enabled()) {
+    report_metrics(counters);
+  }
+  return 0;
+}
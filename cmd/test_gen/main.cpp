@@ -189,14 +189,14 @@ generate_key_schedule()
         epoch.epoch_secret,
         epoch.sender_data_secret,
         epoch.encryption_secret,
-        epoch.exporter_secret,
-        epoch.authentication_secret,
-        epoch.external_secret,
+        epoch.exporter_secret(),
+        epoch.authentication_secret(),
+        epoch.external_secret(),
         epoch.confirmation_key,
         epoch.membership_key,
-        epoch.resumption_secret,
+        epoch.resumption_secret(),
         epoch.init_secret,
-        epoch.external_priv.public_key,
+        epoch.external_priv().public_key,
         handshake_keys,
         application_keys,
         sender_data_key,
@@ -330,7 +330,7 @@ generate_messages()
     group_info.signer_index = LeafIndex(tv.sender.sender);
     group_info.signature = tv.random;
 
-    auto group_secrets = GroupSecrets{ tv.random, std::nullopt };
+    auto group_secrets = GroupSecrets{ tv.random, std::nullopt, {} };
     auto encrypted_group_secrets =
       EncryptedGroupSecrets{ tv.random,
                              HPKECiphertext{ tv.random, tv.random } };
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <mls/executor.h>
+#include <mls/session.h>
+
+#include <future>
+#include <memory>
+#include <type_traits>
+#include <vector>
+
+namespace mls {
+
+// Runs a Session's calls on the workers of a ThreadPool rather than on the
+// calling thread, e.g., so that an event loop is not held up by a Commit in
+// a large group.  Each call returns a future for its result, and any
+// exception it throws is delivered through the future.  Calls run one at a
+// time, in the order they were made, so a message protected after a commit()
+// sees the epoch that the commit() produced once it is handled.
+//
+// The parallel crypto within each call runs on the Session's crypto
+// executor, which must not be the pool given here.  Destroying an
+// AsyncSession waits for the calls already made to finish.
+class AsyncSession
+{
+public:
+  AsyncSession(Session session, ThreadPool& pool);
+
+  AsyncSession(const AsyncSession&) = delete;
+  AsyncSession& operator=(const AsyncSession&) = delete;
+
+  // Join a group off the calling thread, with the joiner's checks of the
+  // tree run across the crypto executor
+  static std::future<Session> join(PendingJoin pending,
+                                   bytes welcome,
+                                   ThreadPool& pool,
+                                   Executor& crypto);
+
+  // Message producers
+  std::future<bytes> add(bytes key_package_data);
+  std::future<bytes> update();
+  std::future<bytes> remove(uint32_t index);
+  std::future<std::tuple<bytes, bytes>> commit(std::vector<bytes> proposals);
+  std::future<std::tuple<bytes, bytes>> commit();
+
+  // Message consumers
+  std::future<bool> handle(bytes handshake_data);
+
+  // Application message protection
+  std::future<bytes> protect(bytes plaintext);
+  std::future<bytes> unprotect(bytes ciphertext);
+
+  // Any other use of the Session, run in order with the calls above
+  template<typename F>
+  auto call(F&& f) -> std::future<std::invoke_result_t<F, Session&>>
+  {
+    using Result = std::invoke_result_t<F, Session&>;
+    auto task = std::make_shared<std::packaged_task<Result()>>(
+      [this, f = std::forward<F>(f)]() mutable { return f(session); });
+    auto result = task->get_future();
+    strand.post([task]() { (*task)(); });
+    return result;
+  }
+
+private:
+  Session session;
+
+  // Declared last, so that it is destroyed first, waiting for the queued
+  // calls while the Session is still alive
+  Strand strand;
+};
+
+} // namespace mls
@@ -2,6 +2,8 @@
 
 #include <array>
 #include <iomanip>
+#include <limits>
+#include <mutex>
 #include <sstream>
 #include <stdexcept>
 #include <vector>
@@ -127,6 +129,178 @@ public:
   using parent::parent;
 };
 
+///
+/// Approximate memory held by a State or Session, in bytes, by component
+///
+struct MemoryUsage
+{
+  // Public tree nodes and their cached hashes
+  size_t tree = 0;
+
+  // Private tree state: HPKE keys for the path, and the path secrets they are
+  // derived from
+  size_t private_key_cache = 0;
+  size_t path_secrets = 0;
+
+  // Epoch secrets, excluding the message ratchets
+  size_t key_schedule = 0;
+
+  // The secret tree and the hash ratchets' cached keys
+  size_t ratchets = 0;
+
+  // Cached proposals and the leaf secrets for this member's Updates
+  size_t pending_proposals = 0;
+
+  // For a Session, past epochs and the State cached for an outbound Commit
+  size_t history = 0;
+
+  // Everything else: the fixed-size object, group ID, transcript hashes,
+  // extensions, and identity key
+  size_t other = 0;
+
+  size_t total() const;
+  MemoryUsage& operator+=(const MemoryUsage& rhs);
+};
+
+///
+/// Limits on what is accepted when decoding messages from untrusted sources.
+/// They are checked as the declared lengths are read, so that a malformed
+/// message is rejected, with tls::ReadError, before memory is allocated for
+/// the items beyond a limit.  By default, nothing is limited beyond the size
+/// of the input.
+///
+struct DecodeLimits
+{
+  static constexpr size_t unlimited = std::numeric_limits<size_t>::max();
+
+  // Encoded size of a whole message
+  size_t max_message_size = unlimited;
+
+  // Nodes in a ratchet tree, and in the direct path of an UpdatePath
+  size_t max_tree_nodes = unlimited;
+
+  // Proposals covered by a Commit
+  size_t max_proposals = unlimited;
+
+  // Encoded size of a credential, including any certificate chain
+  size_t max_credential_size = unlimited;
+
+  // Joiners that a Welcome carries secrets for
+  size_t max_joiners = unlimited;
+
+  // The limits in force on the calling thread
+  static const DecodeLimits& current();
+
+  // Puts a set of limits in force on the calling thread until destroyed.
+  // The limits must outlive the scope.
+  class Scope
+  {
+  public:
+    explicit Scope(const DecodeLimits& limits);
+    ~Scope();
+
+    Scope(const Scope&) = delete;
+    Scope& operator=(const Scope&) = delete;
+
+  private:
+    const DecodeLimits* _prior;
+  };
+};
+
+// A cap for tls::bounded_vector, taken from one of the current limits
+template<size_t DecodeLimits::*Limit>
+struct DecodeLimit
+{
+  static size_t max_items() { return DecodeLimits::current().*Limit; }
+};
+
+// Decode a message under the given limits
+template<typename T, typename... Tp>
+T
+decode(const bytes& data, const DecodeLimits& limits, Tp&&... args)
+{
+  if (data.size() > limits.max_message_size) {
+    throw tls::ReadError("Message too large");
+  }
+
+  const auto scope = DecodeLimits::Scope(limits);
+  return tls::get<T>(data, std::forward<Tp>(args)...);
+}
+
+///
+/// A hash of byte strings, for unordered containers keyed by values that
+/// peers choose, such as init keys and group IDs.  It is SipHash-2-4 under a
+/// random key drawn once per process, so that peers cannot pick values that
+/// collide.
+///
+
+struct BytesHash
+{
+  size_t operator()(const bytes& data) const;
+};
+
+///
+/// A value held under a lock, for caches kept on objects that are otherwise
+/// immutable and may be used from several threads.  Copies take the lock on
+/// the source and copy the value.
+///
+
+template<typename T>
+class Locked
+{
+public:
+  Locked() = default;
+
+  Locked(const Locked& other)
+  {
+    const auto lock = std::lock_guard(other._mutex);
+    _value = other._value;
+  }
+
+  Locked& operator=(const Locked& other)
+  {
+    if (this == &other) {
+      return *this;
+    }
+
+    const auto lock = std::scoped_lock(_mutex, other._mutex);
+    _value = other._value;
+    return *this;
+  }
+
+  // A copy of the value
+  T load() const
+  {
+    const auto lock = std::lock_guard(_mutex);
+    return _value;
+  }
+
+  void store(T value)
+  {
+    const auto lock = std::lock_guard(_mutex);
+    _value = std::move(value);
+  }
+
+  // Call f with the value, under the lock, and return what it returns
+  template<typename F>
+  auto with(F&& f) const
+  {
+    const auto lock = std::lock_guard(_mutex);
+    return f(_value);
+  }
+
+  template<typename F>
+  auto with(F&& f)
+  {
+    const auto lock = std::lock_guard(_mutex);
+    return f(_value);
+  }
+
+private:
+  mutable std::mutex _mutex;
+  T _value;
+};
+
 // A slightly more elegant way to silence -Werror=unused-variable
 template<typename T>
 void
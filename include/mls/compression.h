@@ -0,0 +1,36 @@
+#pragma once
+
+#include "mls/core_types.h"
+
+namespace mls {
+
+///
+/// Compression of large payloads before they are encrypted, e.g., the
+/// GroupInfo in a Welcome.  Clients that can decompress say so with a
+/// CompressionExtension in their KeyPackages.
+///
+
+bytes
+compress(CompressionAlgorithm algorithm, const bytes& data);
+
+// The limit on a decompressed GroupInfo where the DecodeLimits in force set
+// no max_message_size
+constexpr size_t default_max_decompressed_size = size_t(1) << 27;
+
+// Fails with ProtocolError on malformed input, or if the output would be
+// longer than max_size
+bytes
+decompress(CompressionAlgorithm algorithm,
+           const bytes& data,
+           size_t max_size);
+
+// The algorithm, if any, that every KeyPackage lists, in the order of
+// preference of the first one
+CompressionAlgorithm
+common_compression(const std::vector<KeyPackage>& key_packages);
+
+bool
+supports_compression(const KeyPackage& key_package,
+                     CompressionAlgorithm algorithm);
+
+} // namespace mls
@@ -2,8 +2,13 @@
 
 #include "mls/credential.h"
 #include "mls/crypto.h"
+#include "mls/executor.h"
 #include "mls/tree_math.h"
 
+#include <functional>
+#include <memory>
+#include <optional>
+
 namespace mls {
 
 ///
@@ -24,6 +29,8 @@ struct ExtensionType
   static constexpr uint16_t lifetime = 3;
   static constexpr uint16_t key_id = 4;
   static constexpr uint16_t parent_hash = 5;
+  static constexpr uint16_t external_tree = 6;
+  static constexpr uint16_t compression = 7;
 };
 
 struct Extension
@@ -114,6 +121,38 @@ struct ParentHashExtension
   TLS_TRAITS(tls::vector<1>)
 };
 
+// Sent in a GroupInfo whose tree has been left out, so that the joiner can
+// check a tree obtained some other way
+struct ExternalTreeExtension
+{
+  bytes tree_hash;
+
+  static const uint16_t type;
+  TLS_SERIALIZABLE(tree_hash)
+  TLS_TRAITS(tls::vector<1>)
+};
+
+enum struct CompressionAlgorithm : uint16_t
+{
+  none = 0,
+
+  // LZ77 matching, in the style of the LZ4 block format, against a preset
+  // dictionary of encodings common in MLS messages
+  mls_lz = 1,
+};
+
+// In a KeyPackage, the compression algorithms that the client can decompress,
+// in order of preference.  In a GroupSecrets, the one algorithm applied to the
+// Welcome's GroupInfo.
+struct CompressionExtension
+{
+  std::vector<CompressionAlgorithm> algorithms;
+
+  static const uint16_t type;
+  TLS_SERIALIZABLE(algorithms)
+  TLS_TRAITS(tls::vector<1>)
+};
+
 ///
 /// NodeType, ParentNode, and KeyPackage
 ///
@@ -160,6 +199,17 @@ struct KeyPackage
              const SignaturePrivateKey& sig_priv_in,
              const std::optional<KeyPackageOpts>& opts_in);
 
+  // Key packages that differ only in their init keys, signed and hashed
+  // across the executor.  The extensions and the encodings of the credential
+  // and extensions are computed once and shared by all of them.
+  static std::vector<KeyPackage> generate(
+    CipherSuite suite,
+    const std::vector<HPKEPublicKey>& init_keys,
+    const Credential& credential,
+    const SignaturePrivateKey& sig_priv,
+    const std::optional<KeyPackageOpts>& opts,
+    Executor& executor);
+
   bytes hash() const;
 
   void sign(const SignaturePrivateKey& sig_priv,
@@ -185,6 +235,29 @@ struct KeyPackage
 private:
   bytes to_be_signed() const;
 
+  // The results of hash() and verify(), with a fingerprint of the fields they
+  // were computed from.  They are used only while the fields still have the
+  // same fingerprint, so a KeyPackage that has been changed computes them
+  // afresh.  The credential, which is interned, is compared by identity, and
+  // the rest of the fields by a digest, so that a multi-kilobyte certificate
+  // chain is neither copied nor rehashed.  Copies share the memo.
+  struct Memo
+  {
+    Credential credential;
+    bytes fields_digest;
+
+    std::optional<bytes> hash;
+    std::optional<bool> verified;
+  };
+  mutable Locked<std::shared_ptr<const Memo>> _memo;
+
+  // A digest over the fields other than the credential
+  bytes fields_digest() const;
+
+  // The memo for the current field values, if any, and its replacement
+  std::shared_ptr<const Memo> find_memo() const;
+  void update_memo(const std::function<void(Memo&)>& update) const;
+
   friend bool operator==(const KeyPackage& lhs, const KeyPackage& rhs);
 };
 
@@ -225,7 +298,8 @@ struct UpdatePath
             const std::optional<KeyPackageOpts>& maybe_opts);
 
   TLS_SERIALIZABLE(leaf_key_package, nodes)
-  TLS_TRAITS(tls::pass, tls::vector<2>)
+  TLS_TRAITS(tls::pass,
+             tls::bounded_vector<2, DecodeLimit<&DecodeLimits::max_tree_nodes>>)
 };
 
 } // namespace mls
@@ -53,10 +53,17 @@ struct X509Credential
   };
 
   X509Credential() = default;
+
+  // Parses and verifies the chain.  The outcome of a successful verification
+  // is cached for a while, keyed by the hashes of the certificates, so
+  // constructing a credential for a chain seen recently skips the X.509 work.
   explicit X509Credential(std::vector<CertData> der_chain_in);
 
   SignaturePublicKey public_key() const;
 
+  // The number of verified chains currently held in the cache
+  static size_t cached_chain_count();
+
   // TODO(rlb) This should be const or exposed via a method
   std::vector<CertData> der_chain;
 
@@ -73,6 +80,9 @@ operator<<(tls::ostream& str, const X509Credential& obj);
 tls::istream&
 operator>>(tls::istream& str, X509Credential& obj);
 
+size_t
+encoded_size(const X509Credential& obj);
+
 bool
 operator==(const X509Credential& lhs, const X509Credential& rhs);
 
@@ -86,9 +96,17 @@ operator==(const X509Credential& lhs, const X509Credential& rhs);
 //             opaque cert_data<1..2^24-1>;
 //     };
 // } Credential;
+//
+// Credentials are immutable and interned across the process: Credentials with
+// the same encoding that are alive at the same time, whether decoded from a
+// message or built with basic() or x509(), share one copy, including its
+// parsed signature key.  A credential is freed once the last tree, message,
+// or state referring to it goes away.
 class Credential
 {
 public:
+  Credential();
+
   CredentialType::selector type() const;
   SignaturePublicKey public_key() const;
   bool valid_for(const SignaturePrivateKey& priv) const;
@@ -96,7 +114,7 @@ public:
   template<typename T>
   const T& get() const
   {
-    return std::get<T>(_cred);
+    return std::get<T>(*_cred);
   }
 
   static Credential basic(const bytes& identity,
@@ -105,11 +123,39 @@ public:
   static Credential x509(
     const std::vector<X509Credential::CertData>& der_chain);
 
-  TLS_SERIALIZABLE(_cred)
-  TLS_TRAITS(tls::variant<CredentialType>)
+  // The number of distinct credentials currently shared through the store
+  static size_t interned_count();
+
+  friend tls::ostream& operator<<(tls::ostream& str, const Credential& obj);
+  friend tls::istream& operator>>(tls::istream& str, Credential& obj);
+  friend size_t encoded_size(const Credential& obj);
+  friend bool operator==(const Credential& lhs, const Credential& rhs);
+  friend bool operator!=(const Credential& lhs, const Credential& rhs);
 
 private:
-  std::variant<BasicCredential, X509Credential> _cred;
+  using Value = std::variant<BasicCredential, X509Credential>;
+  std::shared_ptr<const Value> _cred;
+
+  struct Store;
+  static std::shared_ptr<const Value> intern(const uint8_t* encoded,
+                                             size_t size,
+                                             Value&& value);
+  static std::shared_ptr<const Value> intern(Value&& value);
 };
 
+tls::ostream&
+operator<<(tls::ostream& str, const Credential& obj);
+
+tls::istream&
+operator>>(tls::istream& str, Credential& obj);
+
+size_t
+encoded_size(const Credential& obj);
+
+bool
+operator==(const Credential& lhs, const Credential& rhs);
+
+bool
+operator!=(const Credential& lhs, const Credential& rhs);
+
 } // namespace mls
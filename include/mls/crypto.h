@@ -5,8 +5,10 @@
 #include <hpke/random.h>
 #include <hpke/signature.h>
 #include <mls/common.h>
+#include <mls/executor.h>
 #include <tls/tls_syntax.h>
 
+#include <memory>
 #include <vector>
 
 namespace mls {
@@ -56,21 +58,224 @@ struct CipherSuite
                           size_t length) const;
   bytes derive_secret(const bytes& secret, const std::string& label) const;
 
+  // The KDF info used by expand_with_label, for use with a KDF::Expander
+  static bytes hkdf_label(const std::string& label,
+                          const bytes& context,
+                          size_t length);
+
+  // Calls f with the SuiteTraits of this suite, so that code on a hot path
+  // can be written once against constexpr parameters and instantiated for
+  // each suite, at the cost of one switch per call
+  template<typename F>
+  decltype(auto) dispatch(F&& f) const;
+
+  // Fixed parameters of the suite, without virtual calls into the primitives
+  size_t secret_size() const;
+  size_t key_size() const;
+  size_t nonce_size() const;
+  size_t tag_size() const;
+
   TLS_SERIALIZABLE(id)
 
 private:
+  // Built on first use, so that any hpke::Provider installed at startup is
+  // taken into account
   template<CipherSuite::ID>
-  static const Ciphers ciphers;
+  static const Ciphers& ciphers();
 };
 
 extern const std::array<CipherSuite::ID, 6> all_supported_suites;
 
+// The largest hash, and so the largest secret, of any supported suite, so
+// that hashes and secrets can be held in inline_bytes
+constexpr size_t max_hash_size = 64;
+
+// Compile-time parameters of each cipher suite.  These must agree with the
+// primitives in CipherSuite::get(), which the crypto tests verify.
+template<CipherSuite::ID suite_id>
+struct SuiteTraits;
+
+template<CipherSuite::ID suite_id, size_t hash_size_in, size_t key_size_in>
+struct SuiteParameters
+{
+  static constexpr CipherSuite::ID id = suite_id;
+  static constexpr size_t hash_size = hash_size_in;
+  static constexpr size_t key_size = key_size_in;
+  static constexpr size_t nonce_size = 12;
+  static constexpr size_t tag_size = 16;
+};
+
+template<>
+struct SuiteTraits<CipherSuite::ID::X25519_AES128GCM_SHA256_Ed25519>
+  : SuiteParameters<CipherSuite::ID::X25519_AES128GCM_SHA256_Ed25519, 32, 16>
+{};
+
+template<>
+struct SuiteTraits<CipherSuite::ID::P256_AES128GCM_SHA256_P256>
+  : SuiteParameters<CipherSuite::ID::P256_AES128GCM_SHA256_P256, 32, 16>
+{};
+
+template<>
+struct SuiteTraits<CipherSuite::ID::X25519_CHACHA20POLY1305_SHA256_Ed25519>
+  : SuiteParameters<CipherSuite::ID::X25519_CHACHA20POLY1305_SHA256_Ed25519,
+                    32,
+                    32>
+{};
+
+template<>
+struct SuiteTraits<CipherSuite::ID::X448_AES256GCM_SHA512_Ed448>
+  : SuiteParameters<CipherSuite::ID::X448_AES256GCM_SHA512_Ed448, 64, 32>
+{};
+
+template<>
+struct SuiteTraits<CipherSuite::ID::P521_AES256GCM_SHA512_P521>
+  : SuiteParameters<CipherSuite::ID::P521_AES256GCM_SHA512_P521, 64, 32>
+{};
+
+template<>
+struct SuiteTraits<CipherSuite::ID::X448_CHACHA20POLY1305_SHA512_Ed448>
+  : SuiteParameters<CipherSuite::ID::X448_CHACHA20POLY1305_SHA512_Ed448,
+                    64,
+                    32>
+{};
+
+template<typename F>
+decltype(auto)
+CipherSuite::dispatch(F&& f) const
+{
+  switch (id) {
+    case ID::X25519_AES128GCM_SHA256_Ed25519:
+      return f(SuiteTraits<ID::X25519_AES128GCM_SHA256_Ed25519>{});
+
+    case ID::P256_AES128GCM_SHA256_P256:
+      return f(SuiteTraits<ID::P256_AES128GCM_SHA256_P256>{});
+
+    case ID::X25519_CHACHA20POLY1305_SHA256_Ed25519:
+      return f(SuiteTraits<ID::X25519_CHACHA20POLY1305_SHA256_Ed25519>{});
+
+    case ID::X448_AES256GCM_SHA512_Ed448:
+      return f(SuiteTraits<ID::X448_AES256GCM_SHA512_Ed448>{});
+
+    case ID::P521_AES256GCM_SHA512_P521:
+      return f(SuiteTraits<ID::P521_AES256GCM_SHA512_P521>{});
+
+    case ID::X448_CHACHA20POLY1305_SHA512_Ed448:
+      return f(SuiteTraits<ID::X448_CHACHA20POLY1305_SHA512_Ed448>{});
+
+    default:
+      throw InvalidParameterError("Unsupported ciphersuite");
+  }
+}
+
 // Utilities
 using hpke::random_bytes;
 
 bool
 constant_time_eq(const bytes& lhs, const bytes& rhs);
 
+// Caching of parsed keys (see ParsedKeyCache) is off by default.  Enabling it
+// saves a parse per operation on long-lived keys, at the cost of keeping the
+// OpenSSL form of each key used alive for as long as any copy of the key.
+void
+enable_parsed_key_cache(bool enabled);
+
+bool
+parsed_key_cache_enabled();
+
+// A lazily-populated cache of the OpenSSL form of a serialized key.  Copies
+// of a key made after it has been used share one cache slot, so a key parsed
+// through any of them is reused by all of them.  The slot is only allocated
+// once the cache is enabled and the key is used.
+//
+// An entry records a digest of the data it was parsed from, not the data
+// itself, so no copy of a private key is retained beyond the parsed key.  A
+// cached key is only used if the suite and digest match the key asking for
+// it, so changing a key's data simply causes a re-parse.
+template<typename T>
+struct ParsedKeyCache
+{
+  ParsedKeyCache() = default;
+
+  ParsedKeyCache(const ParsedKeyCache& other)
+    : _slot(std::atomic_load(&other._slot))
+  {
+  }
+
+  ParsedKeyCache& operator=(const ParsedKeyCache& other)
+  {
+    if (this != &other) {
+      std::atomic_store(&_slot, std::atomic_load(&other._slot));
+    }
+    return *this;
+  }
+
+  ~ParsedKeyCache() = default;
+
+  void set(CipherSuite suite, const bytes& data, std::unique_ptr<T> key) const
+  {
+    if (!parsed_key_cache_enabled()) {
+      return;
+    }
+
+    store(suite, suite.get().digest.hash(data), std::move(key));
+  }
+
+  template<typename F>
+  std::shared_ptr<const T> get(CipherSuite suite,
+                               const bytes& data,
+                               F&& parse) const
+  {
+    if (!parsed_key_cache_enabled()) {
+      return std::shared_ptr<const T>(parse());
+    }
+
+    auto digest = suite.get().digest.hash(data);
+    if (auto slot = std::atomic_load(&_slot)) {
+      auto entry = std::atomic_load(&slot->entry);
+      if (entry && entry->suite == suite.id &&
+          constant_time_eq(entry->digest, digest)) {
+        return entry->key;
+      }
+    }
+
+    auto key = std::shared_ptr<const T>(parse());
+    store(suite, std::move(digest), key);
+    return key;
+  }
+
+private:
+  struct Entry
+  {
+    CipherSuite::ID suite;
+    bytes digest;
+    std::shared_ptr<const T> key;
+  };
+
+  struct Slot
+  {
+    std::shared_ptr<const Entry> entry;
+  };
+
+  mutable std::shared_ptr<Slot> _slot;
+
+  void store(CipherSuite suite,
+             bytes digest,
+             std::shared_ptr<const T> key) const
+  {
+    auto slot = std::atomic_load(&_slot);
+    if (!slot) {
+      auto fresh = std::make_shared<Slot>();
+      if (std::atomic_compare_exchange_strong(&_slot, &slot, fresh)) {
+        slot = std::move(fresh);
+      }
+    }
+
+    auto entry = std::make_shared<const Entry>(
+      Entry{ suite.id, std::move(digest), std::move(key) });
+    std::atomic_store(&slot->entry, std::move(entry));
+  }
+};
+
 // HPKE Keys
 struct HPKECiphertext
 {
@@ -83,6 +288,9 @@ struct HPKECiphertext
 
 struct HPKEPublicKey
 {
+  HPKEPublicKey() = default;
+  HPKEPublicKey(bytes data_in);
+
   bytes data;
 
   HPKECiphertext encrypt(CipherSuite suite,
@@ -91,6 +299,10 @@ struct HPKEPublicKey
 
   TLS_SERIALIZABLE(data)
   TLS_TRAITS(tls::vector<2>)
+
+private:
+  ParsedKeyCache<hpke::KEM::PublicKey> _parsed;
+  friend struct HPKEPrivateKey;
 };
 
 struct HPKEPrivateKey
@@ -112,20 +324,48 @@ struct HPKEPrivateKey
   TLS_TRAITS(tls::vector<2>, tls::pass)
 
 private:
+  ParsedKeyCache<hpke::KEM::PrivateKey> _parsed;
+
   HPKEPrivateKey(bytes priv_data, bytes pub_data);
 };
 
 // Signature Keys
 struct SignaturePublicKey
 {
+  SignaturePublicKey() = default;
+  SignaturePublicKey(bytes data_in);
+
   bytes data;
 
   bool verify(const CipherSuite& suite,
               const bytes& message,
               const bytes& signature) const;
 
+  // Verify several signatures in one pass; results are in the same order as
+  // the items.  With an Executor, the items are verified as tasks on it.
+  struct VerifyItem
+  {
+    const SignaturePublicKey& pub;
+    const bytes& message;
+    const bytes& signature;
+  };
+
+  static std::vector<bool> verify_batch(const CipherSuite& suite,
+                                        const std::vector<VerifyItem>& items);
+  static std::vector<bool> verify_batch(const CipherSuite& suite,
+                                        const std::vector<VerifyItem>& items,
+                                        Executor& executor);
+
   TLS_SERIALIZABLE(data)
   TLS_TRAITS(tls::vector<2>)
+
+private:
+  ParsedKeyCache<hpke::Signature::PublicKey> _parsed;
+
+  std::shared_ptr<const hpke::Signature::PublicKey> parsed(
+    const CipherSuite& suite) const;
+
+  friend struct SignaturePrivateKey;
 };
 
 struct SignaturePrivateKey
@@ -143,6 +383,8 @@ struct SignaturePrivateKey
   TLS_TRAITS(tls::vector<2>, tls::pass)
 
 private:
+  ParsedKeyCache<hpke::Signature::PrivateKey> _parsed;
+
   SignaturePrivateKey(bytes priv_data, bytes pub_data);
 };
 
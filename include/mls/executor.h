@@ -0,0 +1,93 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace mls {
+
+///
+/// An Executor runs batches of independent tasks.  Operations that accept an
+/// Executor produce the same output regardless of how the tasks are
+/// scheduled; each task writes only to its own slot of the result.
+///
+
+struct Executor
+{
+  using Task = std::function<void(size_t)>;
+
+  virtual ~Executor() = default;
+
+  // Run task(0), ..., task(count - 1), returning once all have finished.  If
+  // a task throws, run() rethrows the exception once no task is running;
+  // tasks that had not yet started may be skipped.
+  virtual void run(size_t count, const Task& task) = 0;
+};
+
+// Runs every task on the calling thread, in order
+struct SerialExecutor : public Executor
+{
+  void run(size_t count, const Task& task) override;
+};
+
+// Runs tasks on a fixed set of worker threads that live as long as the pool.
+// A ThreadPool may be shared by several threads, but a task must not call
+// run() on the pool that is running it.
+class ThreadPool : public Executor
+{
+public:
+  explicit ThreadPool(size_t threads = std::thread::hardware_concurrency());
+  ~ThreadPool() override;
+
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+
+  size_t size() const { return workers.size(); }
+
+  void run(size_t count, const Task& task) override;
+
+  // Queue a job for a worker without waiting for it.  The job must not
+  // throw.  Jobs still queued when the pool is destroyed are run first.
+  void post(std::function<void()> job);
+
+private:
+  std::mutex mutex;
+  std::condition_variable ready;
+  std::deque<std::function<void()>> queue;
+  std::vector<std::thread> workers;
+  bool stopping = false;
+
+  void work();
+};
+
+// Runs jobs one at a time, in the order they were posted, on the workers of
+// a ThreadPool, so that work for one object is kept in order without a
+// thread of its own.  Strands sharing a pool run concurrently.  Like the
+// pool's own jobs, a strand's jobs must not throw, nor call run() on the
+// pool.  Destroying a Strand waits for the jobs posted to it.
+class Strand
+{
+public:
+  explicit Strand(ThreadPool& pool);
+  ~Strand();
+
+  Strand(const Strand&) = delete;
+  Strand& operator=(const Strand&) = delete;
+
+  void post(std::function<void()> job);
+
+private:
+  ThreadPool& pool;
+  std::mutex mutex;
+  std::condition_variable idle;
+  std::deque<std::function<void()>> jobs;
+  bool running = false;
+
+  void drain();
+};
+
+} // namespace mls
@@ -2,8 +2,16 @@
 
 #include "mls/common.h"
 #include "mls/crypto.h"
+#include "mls/executor.h"
 #include "mls/tree_math.h"
+#include <array>
 #include <map>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
+#include <string>
+#include <tuple>
+#include <vector>
 
 namespace mls {
 
@@ -16,13 +24,71 @@ struct KeyAndNonce
   bytes nonce;
 };
 
+// Limits on the keys a HashRatchet retains for out-of-order messages
+struct RatchetPolicy
+{
+  // Keys are kept for this many of the most recent generations.  Older keys
+  // are overwritten, so messages more than this many generations behind the
+  // newest one cannot be decrypted.
+  uint32_t window = 128;
+
+  // A request for a generation more than this far past the next one to be
+  // derived is rejected, rather than deriving every key in between
+  uint32_t max_forward = 1024;
+
+  // The number of keys that precompute() keeps ready beyond the newest
+  // generation used.  Precomputed keys occupy the window, so this must be
+  // smaller than the window size.
+  uint32_t precompute = 0;
+};
+
+// Which senders' ratchets are derived ahead of their first message in a new
+// epoch: none, this member and the senders active in the previous epoch, or
+// every leaf, e.g., for a member that archives all of the group's traffic
+enum struct KeyPrewarm : uint8_t
+{
+  none,
+  active,
+  all,
+};
+
+// Counters for the keys held by a set of ratchets
+struct RatchetStats
+{
+  // Keys derived only to reach a later generation
+  uint64_t keys_skipped = 0;
+
+  // Keys currently retained, whether used, skipped, or precomputed
+  size_t keys_cached = 0;
+};
+
 struct HashRatchet
 {
+  // A slot in the key window.  Slots are reused in place once the window is
+  // full.  The keys and nonces of all the slots are stored together in
+  // slot_keys, so that the window is one allocation from locked secret
+  // memory, and is wiped in one pass when the ratchet is destroyed.
+  struct CachedKey
+  {
+    uint32_t generation = 0;
+    bool present = false;
+  };
+
   CipherSuite suite;
   NodeIndex node;
-  bytes next_secret;
+  inline_bytes<max_hash_size> next_secret;
   uint32_t next_generation;
-  std::map<uint32_t, KeyAndNonce> cache;
+
+  // One past the newest generation handed out by next() or get().  Keys from
+  // here up to next_generation have been precomputed.
+  uint32_t next_unused = 0;
+
+  // Ring buffer indexed by generation modulo the window size, with the key
+  // and nonce for each slot at the slot's offset in slot_keys
+  std::vector<CachedKey> cache;
+  secret_buffer slot_keys;
+  RatchetPolicy policy;
+  uint64_t keys_skipped = 0;
 
   size_t key_size;
   size_t nonce_size;
@@ -32,11 +98,30 @@ struct HashRatchet
   HashRatchet() = default;
   HashRatchet(const HashRatchet& other) = default;
 
-  HashRatchet(CipherSuite suite_in, NodeIndex node_in, bytes base_secret_in);
+  HashRatchet(CipherSuite suite_in,
+              NodeIndex node_in,
+              bytes base_secret_in,
+              const RatchetPolicy& policy_in = {});
 
   std::tuple<uint32_t, KeyAndNonce> next();
   KeyAndNonce get(uint32_t generation);
   void erase(uint32_t generation);
+
+  // Derive keys ahead of use, up to the policy's precompute count
+  void precompute();
+
+  // Approximate heap memory held by this ratchet
+  size_t retained_bytes() const;
+  RatchetStats stats() const;
+
+  // The key and nonce stored in a slot of the window
+  size_t slot_size() const { return key_size + nonce_size; }
+  KeyAndNonce slot_key(size_t slot) const;
+  void set_slot_key(size_t slot, const bytes& key, const bytes& nonce);
+
+private:
+  size_t derive();
+  std::optional<size_t> find(uint32_t generation);
 };
 
 struct SecretTree
@@ -48,14 +133,35 @@ struct SecretTree
 
   bytes get(LeafIndex sender);
 
+  size_t retained_bytes() const;
+
 private:
   CipherSuite suite;
   NodeIndex root;
   NodeCount width;
-  std::vector<bytes> secrets;
+
+  // Split the frontier until it has at least the given number of nodes, or
+  // only leaves, then move each frontier node out into a tree of its own,
+  // leaving this one empty.  The trees are in node order, and are disjoint,
+  // so their leaves can be derived in parallel.
+  std::vector<SecretTree> split(size_t parts);
+
+  // The leaves below the frontier, i.e., those not yet consumed, in order
+  std::vector<LeafIndex> leaves() const;
+
+  // Only the populated frontier of the tree is stored.  Secrets are derived
+  // on demand from their nearest populated ancestor, and consumed secrets are
+  // zeroized and removed.
+  std::map<NodeIndex, bytes> secrets;
   size_t secret_size;
+
+  friend struct GroupKeySource;
 };
 
+// The keys for each sender's messages in an epoch.  next(), get(), erase(),
+// take() and precompute() may be called from several threads at once, and
+// calls for different senders proceed in parallel.  Setting the policy,
+// copying, and assignment must not overlap with any other use.
 struct GroupKeySource
 {
   enum struct RatchetType
@@ -73,14 +179,79 @@ struct GroupKeySource
   KeyAndNonce get(RatchetType type, LeafIndex sender, uint32_t generation);
   void erase(RatchetType type, LeafIndex sender, uint32_t generation);
 
+  // As get() followed by erase(), but atomic with respect to other threads, so
+  // that each key is handed out once
+  KeyAndNonce take(RatchetType type, LeafIndex sender, uint32_t generation);
+
+  // Applies to ratchets created after the call
+  const RatchetPolicy& policy() const { return _policy; }
+  void policy(const RatchetPolicy& policy);
+
+  // Precompute keys for every sender that has been used in this epoch.  Each
+  // ratchet is advanced as a separate task on the executor.
+  void precompute(Executor& executor);
+
+  // Create the ratchets of the given senders, or of every leaf, before they
+  // are first used, with the derivations for different senders run as
+  // separate tasks on the executor.  Other uses of the key source wait until
+  // this is done.
+  void prewarm(const std::vector<LeafIndex>& senders, Executor& executor);
+  void prewarm_all(Executor& executor);
+
+  // The senders whose ratchets have handed out keys, in order.  Ratchets
+  // that were created ahead of use, but not used, are left out.
+  std::vector<LeafIndex> active_senders() const;
+
+  size_t retained_bytes() const;
+  RatchetStats stats() const;
+
+  // Encodes the unconsumed secrets and the ratchets of each sender, so that
+  // the key source can be stored and later restored exactly as it was.  The
+  // encoding holds secret keys.
+  bytes snapshot() const;
+  static GroupKeySource restore(CipherSuite suite, const bytes& snapshot);
+
 private:
   CipherSuite suite;
   SecretTree secret_tree;
+  RatchetPolicy _policy;
 
-  using Key = std::tuple<RatchetType, LeafIndex>;
-  std::map<Key, HashRatchet> chains;
+  // The ratchets of each sender that has been used, sorted by sender
+  struct Chains
+  {
+    LeafIndex sender;
+    HashRatchet handshake;
+    HashRatchet application;
+  };
+  std::vector<Chains> chains;
+
+  // Each sender's ratchets are guarded by one of a fixed set of locks, chosen
+  // by sender.  The table of chains is held shared while a ratchet is used,
+  // and exclusively to add a sender or to read all of them.  Copies get
+  // fresh locks.
+  struct Locks
+  {
+    static constexpr size_t stripes = 16;
 
-  HashRatchet& chain(RatchetType type, LeafIndex sender);
+    std::shared_mutex table;
+    std::array<std::mutex, stripes> senders;
+
+    Locks() = default;
+    Locks(const Locks& /* other */) {}
+    Locks& operator=(const Locks& /* other */) { return *this; }
+
+    std::mutex& sender(LeafIndex index);
+  };
+  mutable Locks _locks;
+
+  std::vector<Chains>::iterator lower_bound(LeafIndex sender);
+  Chains* find_chains(LeafIndex sender);
+  Chains& add_chains(LeafIndex sender);
+  Chains make_chains(LeafIndex sender, bytes leaf_secret) const;
+
+  // Apply f to the sender's ratchet of the given type, holding its lock
+  template<typename F>
+  auto with_chain(RatchetType type, LeafIndex sender, const F& f);
 
   static const std::array<RatchetType, 2> all_ratchet_types;
 };
@@ -97,19 +268,37 @@ struct KeyScheduleEpoch
 
   bytes sender_data_secret;
   bytes encryption_secret;
-  bytes exporter_secret;
-  bytes authentication_secret;
-  bytes external_secret;
   bytes confirmation_key;
   bytes membership_key;
-  bytes resumption_secret;
   bytes init_secret;
 
-  HPKEPrivateKey external_priv;
-
   GroupKeySource keys;
 
+  // Secrets that most epochs never use are derived from the epoch secret on
+  // first access, and zeroized when the epoch is destroyed
+  const bytes& exporter_secret() const;
+  const bytes& authentication_secret() const;
+  const bytes& external_secret() const;
+  const bytes& resumption_secret() const;
+  const HPKEPrivateKey& external_priv() const;
+
+  // Secrets exported from the exporter secret.  Each label, context and size
+  // is derived once per epoch, up to a limit on the number cached, and the
+  // same value is returned to later callers on any thread.
+  bytes do_export(const std::string& label,
+                  const bytes& context,
+                  size_t size) const;
+  std::vector<bytes> do_export(const std::vector<std::string>& labels,
+                               const bytes& context,
+                               size_t size) const;
+
+  // The secrets above are wiped when the epoch is destroyed
   KeyScheduleEpoch() = default;
+  KeyScheduleEpoch(const KeyScheduleEpoch& other) = default;
+  KeyScheduleEpoch(KeyScheduleEpoch&& other) = default;
+  KeyScheduleEpoch& operator=(const KeyScheduleEpoch& other) = default;
+  KeyScheduleEpoch& operator=(KeyScheduleEpoch&& other) = default;
+  ~KeyScheduleEpoch();
 
   // Generate an initial random epoch
   KeyScheduleEpoch(CipherSuite suite);
@@ -128,9 +317,47 @@ struct KeyScheduleEpoch
                         LeafCount size) const;
 
   KeyAndNonce sender_data(const bytes& ciphertext) const;
+  KeyAndNonce sender_data(const uint8_t* ciphertext, size_t size) const;
+
+  size_t retained_bytes() const;
 
 private:
+  // Derivation is serialized by a lock, so that the accessors above can be
+  // used concurrently.  Copies carry over whatever has been derived.
+  struct LazySecrets
+  {
+    mutable std::mutex mutex;
+    std::optional<bytes> exporter_secret;
+    std::optional<bytes> authentication_secret;
+    std::optional<bytes> external_secret;
+    std::optional<bytes> resumption_secret;
+    std::optional<HPKEPrivateKey> external_priv;
+
+    LazySecrets() = default;
+    LazySecrets(const LazySecrets& other);
+    LazySecrets& operator=(const LazySecrets& other);
+    ~LazySecrets();
+  };
+  mutable LazySecrets _lazy;
+
+  // Kept apart from the lazy secrets, since filling it uses the exporter
+  // secret
+  struct ExportCache
+  {
+    static constexpr size_t max_entries = 64;
+
+    std::map<std::tuple<std::string, bytes, size_t>, bytes> entries;
+
+    ExportCache() = default;
+    ExportCache(const ExportCache& other) = default;
+    ExportCache& operator=(const ExportCache& other);
+    ~ExportCache();
+  };
+  mutable Locked<ExportCache> _exports;
+
   void init_secrets(LeafCount size);
+  const bytes& lazy_secret(std::optional<bytes>& slot,
+                           const std::string& label) const;
 };
 
 bool
@@ -4,9 +4,11 @@
 #include "mls/core_types.h"
 #include "mls/credential.h"
 #include "mls/crypto.h"
+#include "mls/executor.h"
 #include "mls/treekem.h"
 #include <optional>
 #include <tls/tls_syntax.h>
+#include <unordered_map>
 #include <variant>
 
 namespace mls {
@@ -53,6 +55,13 @@ public:
   void sign(LeafIndex index, const SignaturePrivateKey& priv);
   bool verify() const;
 
+  // As above, but with the signer's key taken from the given tree, e.g., for
+  // a GroupInfo whose tree is delivered separately
+  void sign(const TreeKEMPublicKey& signer_tree,
+            LeafIndex index,
+            const SignaturePrivateKey& priv);
+  bool verify(const TreeKEMPublicKey& signer_tree) const;
+
   TLS_SERIALIZABLE(group_id,
                    epoch,
                    tree,
@@ -88,11 +97,24 @@ struct GroupSecrets
     TLS_TRAITS(tls::vector<1>)
   };
 
+  // An ExtensionList that is encoded only if it is not empty, so that
+  // GroupSecrets without extensions keep their original encoding
+  struct TrailingExtensions
+  {
+    static tls::ostream& encode(tls::ostream& str, const ExtensionList& val);
+    static tls::istream& decode(tls::istream& str, ExtensionList& val);
+    static size_t size(const ExtensionList& val);
+  };
+
   bytes joiner_secret;
   std::optional<PathSecret> path_secret;
 
-  TLS_SERIALIZABLE(joiner_secret, path_secret)
-  TLS_TRAITS(tls::vector<1>, tls::pass)
+  // Carries a CompressionExtension naming the compression applied to the
+  // GroupInfo, if any
+  ExtensionList extensions;
+
+  TLS_SERIALIZABLE(joiner_secret, path_secret, extensions)
+  TLS_TRAITS(tls::vector<1>, tls::pass, TrailingExtensions)
 };
 
 // struct {
@@ -122,20 +144,53 @@ struct Welcome
   bytes encrypted_group_info;
 
   Welcome();
+  // The GroupInfo is compressed with the given algorithm before it is
+  // encrypted, and the algorithm is named in each joiner's GroupSecrets.  It
+  // should be one that every joiner's KeyPackage lists.
   Welcome(CipherSuite suite,
           const bytes& joiner_secret,
           const bytes& psk_secret,
-          const GroupInfo& group_info);
+          const GroupInfo& group_info,
+          CompressionAlgorithm compression = CompressionAlgorithm::none);
 
   void encrypt(const KeyPackage& kp, const std::optional<bytes>& path_secret);
+
+  // Encrypt GroupSecrets to several joiners at once.  The result is the same
+  // as calling encrypt() for each joiner in order.
+  void encrypt(const std::vector<KeyPackage>& kps,
+               const std::vector<std::optional<bytes>>& path_secrets,
+               Executor& executor);
+
   std::optional<int> find(const KeyPackage& kp) const;
-  GroupInfo decrypt(const bytes& joiner_secret, const bytes& psk_secret) const;
+
+  // The compression is the one named in the joiner's GroupSecrets
+  GroupInfo decrypt(
+    const bytes& joiner_secret,
+    const bytes& psk_secret,
+    CompressionAlgorithm compression = CompressionAlgorithm::none) const&;
+
+  // As above, but decrypts the GroupInfo in place in encrypted_group_info,
+  // and releases that buffer once the GroupInfo has been decoded from it, so
+  // that a large tree is not held in a separate plaintext copy
+  GroupInfo decrypt(
+    const bytes& joiner_secret,
+    const bytes& psk_secret,
+    CompressionAlgorithm compression = CompressionAlgorithm::none) &&;
 
   TLS_SERIALIZABLE(version, cipher_suite, secrets, encrypted_group_info)
-  TLS_TRAITS(tls::pass, tls::pass, tls::vector<4>, tls::vector<4>)
+  TLS_TRAITS(tls::pass,
+             tls::pass,
+             tls::bounded_vector<4, DecodeLimit<&DecodeLimits::max_joiners>>,
+             tls::vector<4>)
 
 private:
   bytes _joiner_secret;
+  CompressionAlgorithm _compression = CompressionAlgorithm::none;
+
+  GroupSecrets group_secrets(const std::optional<bytes>& path_secret) const;
+  GroupInfo decode_group_info(const bytes& data,
+                              CompressionAlgorithm compression) const;
+
   static std::tuple<bytes, bytes> group_info_key_nonce(
     CipherSuite suite,
     const bytes& joiner_secret,
@@ -224,7 +279,8 @@ struct Commit
   std::optional<UpdatePath> path;
 
   TLS_SERIALIZABLE(proposals, path)
-  TLS_TRAITS(tls::vector<4>, tls::pass)
+  TLS_TRAITS(tls::bounded_vector<4, DecodeLimit<&DecodeLimits::max_proposals>>,
+             tls::pass)
 };
 
 // struct {
@@ -292,13 +348,20 @@ struct MLSPlaintext
   // Constructor for unmarshaling directly
   MLSPlaintext();
 
-  // Constructor for decrypting
+  // Constructors for decrypting
   MLSPlaintext(bytes group_id,
                epoch_t epoch,
                Sender sender,
                ContentType::selector content_type,
                bytes authenticated_data,
                const bytes& content);
+  MLSPlaintext(bytes group_id,
+               epoch_t epoch,
+               Sender sender,
+               ContentType::selector content_type,
+               bytes authenticated_data,
+               const uint8_t* content,
+               size_t content_size);
 
   // Constructors for encrypting
   MLSPlaintext(bytes group_id,
@@ -311,6 +374,7 @@ struct MLSPlaintext
   ContentType::selector content_type() const;
 
   bytes to_be_signed(const GroupContext& context) const;
+  void write_to_be_signed(tls::ostream& w, const GroupContext& context) const;
   void sign(const CipherSuite& suite,
             const GroupContext& context,
             const SignaturePrivateKey& priv);
@@ -319,6 +383,8 @@ struct MLSPlaintext
               const SignaturePublicKey& pub) const;
 
   bytes membership_tag_input(const GroupContext& context) const;
+  void write_membership_tag_input(tls::ostream& w,
+                                  const GroupContext& context) const;
   void set_membership_tag(const CipherSuite& suite,
                           const GroupContext& context,
                           const bytes& mac_key);
@@ -326,7 +392,27 @@ struct MLSPlaintext
                              const GroupContext& context,
                              const bytes& mac_key) const;
 
+  // As above, but with a GroupContext that has already been encoded, so that
+  // it need not be encoded again for each message in an epoch
+  void write_to_be_signed(tls::ostream& w, const bytes& encoded_context) const;
+  void sign(const CipherSuite& suite,
+            const bytes& encoded_context,
+            const SignaturePrivateKey& priv);
+  bool verify(const CipherSuite& suite,
+              const bytes& encoded_context,
+              const SignaturePublicKey& pub) const;
+  void write_membership_tag_input(tls::ostream& w,
+                                  const bytes& encoded_context) const;
+  void set_membership_tag(const CipherSuite& suite,
+                          const bytes& encoded_context,
+                          const bytes& mac_key);
+  bool verify_membership_tag(const CipherSuite& suite,
+                             const bytes& encoded_context,
+                             const bytes& mac_key) const;
+
   bytes marshal_content(size_t padding_size) const;
+  void write_content(tls::ostream& w, size_t padding_size) const;
+  size_t content_size(size_t padding_size) const;
 
   bytes commit_content() const;
   bytes commit_auth_data() const;
@@ -352,8 +438,71 @@ private:
   // Not part of the struct, an indicator of whether this MLSPlaintext was
   // constructed from an MLSCiphertext
   bool decrypted;
+
+  // The signed content that follows the GroupContext
+  void write_signed_content(tls::ostream& w) const;
+};
+
+// A Proposal cached until a Commit covers it, as State and PublicGroupState
+// keep them, so that both change the tree in the same way.  Entries are
+// marked consumed and then dropped together.
+struct CachedProposal
+{
+  ProposalID id;
+  MLSPlaintext pt;
+  bool consumed = false;
+};
+
+// Hashes a ProposalID for an index of cached proposals.  Proposal IDs are
+// digests, so their leading bytes are already uniform.
+struct ProposalIDHash
+{
+  size_t operator()(const bytes& id) const;
+};
+
+// Marks the cached proposals that the proposals of a Commit supersede as
+// consumed: Updates from members that the Commit updates or removes, and
+// Removes of members that it removes
+void
+supersede_proposals(std::vector<CachedProposal>& cache,
+                    const std::vector<MLSPlaintext>& committed);
+
+// The Proposals cached until a Commit covers them, in the order received and
+// indexed by ProposalID.  Each ID is computed once, when the proposal arrives.
+struct ProposalCache
+{
+  std::vector<CachedProposal> entries;
+  std::unordered_map<bytes, size_t, ProposalIDHash> index;
+
+  // Add a proposal, unless it is already there
+  void add(ProposalID id, MLSPlaintext pt);
+
+  // The proposals that a Commit covers, in its order.  They are dropped from
+  // the cache, along with the cached proposals that they supersede.  Throws
+  // ProtocolError if the Commit covers a proposal that is not cached, or
+  // covers one twice.
+  std::vector<MLSPlaintext> take(const Commit& commit);
+};
+
+// The leaves of a tree that the proposals of a Commit changed
+struct AppliedProposals
+{
+  // The senders of Updates, and the members removed and added, in the order
+  // applied
+  std::vector<LeafIndex> updated;
+  std::vector<LeafIndex> removed;
+  std::vector<LeafIndex> added;
 };
 
+// Apply the proposals of a Commit to a public tree: Updates, then Removes,
+// then Adds, after which the tree is truncated and rehashed.  The key
+// packages of the Adds are verified across the executor before any is
+// inserted, and ProtocolError is thrown if one is invalid.
+AppliedProposals
+apply_proposals(TreeKEMPublicKey& tree,
+                const std::vector<MLSPlaintext>& pts,
+                Executor& executor);
+
 // struct {
 //     opaque group_id<0..255>;
 //     uint32 epoch;
@@ -384,4 +533,28 @@ struct MLSCiphertext
              tls::vector<4>)
 };
 
+// The leading fields of an encoded MLSPlaintext or MLSCiphertext, read
+// without decoding the rest of the message
+struct MessageHeader
+{
+  bytes group_id;
+  epoch_t epoch;
+  ContentType::selector content_type;
+
+  TLS_SERIALIZABLE(group_id, epoch, content_type)
+  TLS_TRAITS(tls::vector<1>, tls::pass, tls::pass)
+};
+
+// Both messages start with the group ID, so this applies to either
+bytes
+peek_group_id(const bytes& message);
+
+MessageHeader
+peek_header(const bytes& ciphertext);
+
+// An MLSPlaintext has the sender and authenticated data before the content,
+// which are skipped
+MessageHeader
+peek_plaintext_header(const bytes& plaintext);
+
 } // namespace mls
@@ -0,0 +1,151 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+
+namespace mls {
+
+///
+/// Optional instrumentation of the costly steps inside State operations.
+/// Measurements are only taken when the library is built with MLS_METRICS
+/// defined (the METRICS CMake option); otherwise the probes below compile to
+/// nothing and no sink is ever called.
+///
+
+struct Metrics
+{
+  // The State operation that a measurement is attributed to
+  enum struct Operation : uint8_t
+  {
+    other = 0,
+    commit,
+    handle,
+    protect,
+    unprotect,
+  };
+  static constexpr size_t operation_count = 5;
+
+  // The step being measured
+  enum struct Event : uint8_t
+  {
+    hpke_encap = 0,
+    hpke_decap,
+    sign,
+    verify,
+    aead_seal,
+    aead_open,
+    hkdf_expand,
+    tree_hash,
+    state_copy,
+  };
+  static constexpr size_t event_count = 9;
+
+  // Receives each measurement.  Sinks are called on the thread that did the
+  // work, so they must be safe for concurrent use.
+  struct Sink
+  {
+    virtual ~Sink() = default;
+    virtual void record(Operation operation,
+                        Event event,
+                        size_t count,
+                        std::chrono::nanoseconds elapsed) = 0;
+  };
+
+  // Install a sink, or remove it with nullptr.  The caller keeps ownership,
+  // and must keep the sink alive until it has been removed.
+  static void set_sink(Sink* sink);
+
+  // Whether measurements are compiled into this build
+  static bool enabled();
+
+  // A sink that sums the counts and times for each operation and event
+  class Counters : public Sink
+  {
+  public:
+    struct Entry
+    {
+      uint64_t count = 0;
+      std::chrono::nanoseconds elapsed{ 0 };
+    };
+
+    void record(Operation operation,
+                Event event,
+                size_t count,
+                std::chrono::nanoseconds elapsed) override;
+
+    Entry get(Operation operation, Event event) const;
+    void reset();
+
+  private:
+    mutable std::mutex _mutex;
+    std::array<std::array<Entry, event_count>, operation_count> _entries;
+  };
+
+#if defined(MLS_METRICS)
+  // Attributes the measurements taken on this thread during its lifetime to
+  // an operation.  Nested scopes keep the outermost operation.
+  class Scope
+  {
+  public:
+    explicit Scope(Operation operation);
+    ~Scope();
+
+    Scope(const Scope&) = delete;
+    Scope& operator=(const Scope&) = delete;
+
+  private:
+    Operation _previous;
+  };
+
+  // Measures the time from construction to destruction as one event, or as
+  // `count` events performed together
+  class Timer
+  {
+  public:
+    explicit Timer(Event event, size_t count = 1);
+    ~Timer();
+
+    Timer(const Timer&) = delete;
+    Timer& operator=(const Timer&) = delete;
+
+  private:
+    Event _event;
+    size_t _count;
+    std::chrono::steady_clock::time_point _start;
+  };
+
+  // A member whose copies are recorded, to count copies of its owner
+  struct CopyProbe
+  {
+    CopyProbe() = default;
+    CopyProbe(const CopyProbe& other);
+    CopyProbe& operator=(const CopyProbe& other);
+  };
+#else
+  // Measurements are compiled out, so these do nothing
+  class [[maybe_unused]] Scope
+  {
+  public:
+    explicit Scope(Operation /* operation */) {}
+  };
+
+  class [[maybe_unused]] Timer
+  {
+  public:
+    explicit Timer(Event /* event */, size_t /* count */ = 1) {}
+  };
+#endif
+
+  // Call `f`, timing it as one event
+  template<typename F>
+  static auto timed(Event event, F&& f)
+  {
+    const auto timer = Timer(event);
+    return f();
+  }
+};
+
+} // namespace mls
@@ -0,0 +1,72 @@
+#pragma once
+
+#include "mls/common.h"
+#include "mls/executor.h"
+#include "mls/messages.h"
+#include "mls/state.h"
+#include "mls/treekem.h"
+#include <optional>
+#include <vector>
+
+namespace mls {
+
+// The public view of a group, for a party that is not a member of it, such
+// as a delivery service that checks handshake messages before fanning them
+// out.  It follows the group's Proposals and Commits, checking their
+// signatures, the parent hashes of the tree and the key packages of new
+// members, and keeps the tree, roster and transcript hashes current.
+//
+// It holds no secrets, so it does not decrypt UpdatePaths or run the key
+// schedule, and it cannot check membership tags or confirmation MACs.  Its
+// cost per epoch is that of the tree changes and the signatures.
+class PublicGroupState
+{
+public:
+  // Follow a group from the current epoch of one of its members
+  explicit PublicGroupState(const State& state);
+
+  // Follow a group from a GroupInfo, e.g., one provided by its creator.  The
+  // signature on the GroupInfo and the parent hashes of its tree are checked.
+  PublicGroupState(CipherSuite suite, GroupInfo group_info);
+
+  // Handle a Proposal or Commit, returning true if a Commit moved the group
+  // to a new epoch.  Throws ProtocolError if the message is invalid, or
+  // InvalidParameterError if it is not for this group and epoch.
+  bool handle(const MLSPlaintext& pt);
+
+  /// As above, but with the key packages of joiners verified across an
+  /// executor
+  bool handle(const MLSPlaintext& pt, Executor& executor);
+
+  ///
+  /// Accessors
+  ///
+  CipherSuite cipher_suite() const { return _suite; }
+  const bytes& group_id() const { return _group_id; }
+  epoch_t epoch() const { return _epoch; }
+  const TreeKEMPublicKey& tree() const { return _tree; }
+  GroupContext group_context() const;
+
+  // Ordered list of credentials from non-blank leaves
+  std::vector<KeyPackage> roster() const;
+
+private:
+  CipherSuite _suite;
+  bytes _group_id;
+  epoch_t _epoch = 0;
+  TreeKEMPublicKey _tree;
+  bytes _confirmed_transcript_hash;
+  bytes _interim_transcript_hash;
+  ExtensionList _extensions;
+
+  // Cached Proposals, kept as State keeps them, so that Commits change the
+  // tree in the same way
+  ProposalCache _proposals;
+
+  // Check that a handshake message is for this epoch and validly signed
+  void verify(const MLSPlaintext& pt) const;
+
+  void apply(const Commit& commit, Executor& executor);
+};
+
+} // namespace mls
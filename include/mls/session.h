@@ -4,12 +4,103 @@
 #include <mls/core_types.h>
 #include <mls/credential.h>
 #include <mls/crypto.h>
+#include <mls/executor.h>
+#include <mls/key_schedule.h>
+
+#include <functional>
 
 namespace mls {
 
 class PendingJoin;
 class Session;
 
+// A recording of the messages a Session consumed, for reproducing
+// performance problems offline, e.g., with cmd/replay.  It starts from a
+// snapshot of the Session, or of the PendingJoin it was created from,
+// encrypted under a capture secret, and goes on with each Welcome,
+// handshake message, and application ciphertext in the order they were
+// given, with how long each took.  Plaintexts are never recorded, so
+// without the secret a capture reveals no more than the messages on the
+// wire.
+struct SessionCapture
+{
+  enum struct Origin : uint8_t
+  {
+    session = 1,
+    join = 2,
+  };
+
+  enum struct Input : uint8_t
+  {
+    welcome = 1,
+    handshake = 2,
+    catch_up = 3,
+    application = 4,
+    application_batch = 5,
+  };
+
+  // The messages of one call.  Only the batch inputs have more than one.
+  struct Entry
+  {
+    Input input = Input::handshake;
+    uint8_t failed = 0;
+    uint64_t elapsed_ns = 0;
+    std::vector<tls::opaque<4>> messages;
+
+    TLS_SERIALIZABLE(input, failed, elapsed_ns, messages)
+    TLS_TRAITS(tls::pass, tls::pass, tls::pass, tls::vector<4>)
+  };
+
+  static constexpr uint32_t capture_magic = 0x4d4c5343; // "MLSC"
+  static constexpr uint16_t capture_version = 1;
+
+  uint32_t magic = capture_magic;
+  uint16_t version = capture_version;
+  Origin origin = Origin::session;
+  bytes snapshot;
+  std::vector<Entry> entries;
+
+  TLS_SERIALIZABLE(magic, version, origin, snapshot, entries)
+  TLS_TRAITS(tls::pass,
+             tls::pass,
+             tls::pass,
+             tls::vector<4>,
+             tls::vector<4>)
+
+  // Decode a capture, checking its magic and version
+  static SessionCapture decode(const bytes& data);
+};
+
+// Limits on the past epochs a Session keeps in order to decrypt application
+// messages that arrive after an epoch change.  The current epoch is always
+// kept.
+struct HistoryPolicy
+{
+  // Maximum number of past epochs to retain
+  size_t max_past_epochs = 16;
+
+  // If set, past epochs are dropped this many seconds after they were
+  // superseded
+  std::optional<uint64_t> max_age;
+
+  // Keep only what is needed to decrypt application messages for past
+  // epochs, rather than a full copy of the group state
+  bool decrypt_only = true;
+};
+
+// When a Session commits the proposals it has gathered, so that a busy group
+// changes epoch once per batch of proposals rather than once per proposal.
+// A batch is due once either limit is reached.
+struct CommitSchedule
+{
+  // Commit once this many proposals are pending
+  size_t max_proposals = 16;
+
+  // If set, commit once the oldest pending proposal has waited this many
+  // seconds, with a stand-in committer after each further max_delay
+  std::optional<uint64_t> max_delay;
+};
+
 class Client
 {
 public:
@@ -22,6 +113,13 @@ public:
 
   PendingJoin start_join() const;
 
+  // Several PendingJoins at once, e.g., to upload their key packages to a
+  // directory ahead of time.  The init keys are generated and the key
+  // packages signed across the executor.
+  std::vector<PendingJoin> generate_key_packages(size_t count) const;
+  std::vector<PendingJoin> generate_key_packages(size_t count,
+                                                 Executor& executor) const;
+
 private:
   const CipherSuite suite;
   const SignaturePrivateKey sig_priv;
@@ -38,6 +136,32 @@ public:
   bytes key_package() const;
   Session complete(const bytes& welcome) const;
 
+  // Keeping a PendingJoin until its Welcome arrives.  As with
+  // Session::serialize(), the private keys are encrypted under the given
+  // secret.
+  bytes serialize(const bytes& transfer_secret) const;
+  static PendingJoin restore(const bytes& data, const bytes& transfer_secret);
+
+  // As above, with the snapshot decoded under the given limits, which the
+  // restored PendingJoin keeps, as by decode_limits()
+  static PendingJoin restore(const bytes& data,
+                             const bytes& transfer_secret,
+                             const DecodeLimits& limits);
+
+  // Limits on the Welcome that complete() decodes, including the GroupInfo
+  // and tree within it.  A Welcome beyond them is rejected with
+  // tls::ReadError.  The Session created by complete() keeps them, as by
+  // Session::decode_limits().  They are not carried over by serialize().
+  void decode_limits(const DecodeLimits& limits);
+
+  // Capture the Session created by complete(), starting from this
+  // PendingJoin and its Welcome.  See Session::capture().
+  void capture(const bytes& capture_secret);
+
+  // As above, but with the tree in the Welcome hashed and checked across the
+  // executor
+  Session complete(const bytes& welcome, Executor& executor) const;
+
 private:
   struct Inner;
   std::unique_ptr<Inner> inner;
@@ -46,6 +170,12 @@ private:
   friend class Client;
 };
 
+// A Session may be shared between threads.  protect(), unprotect(), and the
+// accessors below may be called concurrently with each other; decryption of
+// messages from different senders proceeds in parallel, and each sender's
+// keys are handed out once.  Settings, message producers, and handle() wait
+// for calls in progress to finish and run alone.  Moving, destroying, and
+// comparing Sessions must not overlap with any other use.
 class Session
 {
 public:
@@ -55,6 +185,26 @@ public:
 
   // Settings
   void encrypt_handshake(bool enabled);
+  void history_policy(const HistoryPolicy& policy);
+
+  // Limits on the handshake messages and key packages that the Session
+  // decodes.  A message beyond them is rejected with tls::ReadError.  They
+  // are not carried over by serialize().
+  void decode_limits(const DecodeLimits& limits);
+
+  // Where the parallel parts of commit() and handle() run: the encryptions
+  // to the group and to new joiners, and the checks of joiners' key
+  // packages.  By default they run on the calling thread.  The executor must
+  // outlive the Session, is not carried over by serialize(), and must not be
+  // a ThreadPool that is running the Session's own calls.
+  void crypto_executor(Executor& executor);
+
+  // Create the ratchets of the senders chosen by the mode, for the current
+  // epoch and each later one, as a job on the worker right after the epoch
+  // starts.  See State::key_prewarm().  The derivations within the job run
+  // on the crypto executor.  The worker must outlive the Session, and must
+  // not be the crypto executor.
+  void key_prewarm(KeyPrewarm mode, ThreadPool& worker);
 
   // Message producers
   bytes add(const bytes& key_package_data);
@@ -64,22 +214,150 @@ public:
   std::tuple<bytes, bytes> commit(const std::vector<bytes>& proposals);
   std::tuple<bytes, bytes> commit();
 
+  // Derive the direct path for the next commit() ahead of time, e.g., on a
+  // background thread, so that the commit only has to do the encryptions.
+  // Messages can be protected and unprotected while this runs.  The prepared
+  // path is used by at most one commit, and is dropped if the epoch changes
+  // first.
+  void prepare_commit();
+
+  // Batched commits.  Once a schedule is set, the proposals that the Session
+  // handles, its own included, are left pending, and commit_scheduled()
+  // commits them when the schedule says a batch is due.  Only the member
+  // first in State::scheduled_committers() commits, so members that all call
+  // commit_scheduled(), e.g., from a timer and after each handle(), send one
+  // Commit per batch between them.  If a max_delay is set and the batch is
+  // still pending after it, the next member in the order stands in after each
+  // further max_delay, so that one absent member does not stall the group.
+  // It returns nullopt if no Commit is due from this member, or while a
+  // Commit it sent is waiting to be handled.  commit() can still be called
+  // at any time.  The schedule is not carried over by serialize().
+  void commit_schedule(const CommitSchedule& schedule);
+  std::optional<std::tuple<bytes, bytes>> commit_scheduled();
+
+  // Durable storage.  Once journal() is called, the Session appends a record
+  // to a StateJournal each time its state changes, i.e., for a new epoch, a
+  // handled proposal, or an update() of its own.  Records hold only what
+  // changed, so the I/O per epoch grows with the log of the group size.
+  // journal_records() hands over the records written since it was last
+  // called, to be appended to storage in order.  If the flag is set, they
+  // begin with a full snapshot, and what was stored before can be dropped.
+  void journal(const bytes& storage_secret, size_t compact_interval = 32);
+  std::tuple<bool, bytes> journal_records();
+
+  // Recreate a Session in the last state recorded in a journal.  Settings
+  // and past epochs are not journaled.  Message keys used after the last
+  // record are not either, so the Session should commit before protecting
+  // messages of its own.
+  static Session resume(const bytes& journal, const bytes& storage_secret);
+
+  // Moving a live Session to another process or host.  serialize() encodes
+  // what is needed to carry on: the retained epochs with their message
+  // ratchets and cached proposals, a Commit sent but not yet handled, and
+  // the settings.  Each epoch is encrypted as by State::save(), under a
+  // secret shared with the receiving side.  A journal and a prepared commit
+  // are not carried over.  The serialized Session must not be used again,
+  // since it would share message keys with the restored one.
+  bytes serialize(const bytes& transfer_secret) const;
+  static Session restore(const bytes& data, const bytes& transfer_secret);
+
+  // As above, with the snapshot decoded under the given limits, which the
+  // restored Session keeps, as by decode_limits()
+  static Session restore(const bytes& data,
+                         const bytes& transfer_secret,
+                         const DecodeLimits& limits);
+
+  // Recording a SessionCapture.  Once capture() is called, the Session holds
+  // a snapshot of itself, as by serialize(), and appends each message given
+  // to handle(), catch_up(), and the unprotect methods, until end_capture()
+  // hands over the encoded capture.  The messages are held in memory until
+  // then.  Replaying a capture restores the snapshot, so as with serialize(),
+  // the secret should be one that is not used for anything else.
+  void capture(const bytes& capture_secret);
+  bytes end_capture();
+
   // Message consumers
   bool handle(const bytes& handshake_data);
 
+  // Handle a backlog of handshake messages, in order, e.g., on coming back
+  // online.  Without handshake encryption, the signatures on each epoch's
+  // messages are checked on the crypto executor while the epoch before is
+  // being applied.  Returns true if any of them moved the group to a new
+  // epoch.
+  bool catch_up(const std::vector<bytes>& handshake_data);
+
   // Information about the current state
+  bytes group_id() const;
   epoch_t current_epoch() const;
   uint32_t index() const;
   bytes do_export(const std::string& label,
                   const bytes& context,
                   size_t size) const;
+  std::vector<bytes> do_export(const std::vector<std::string>& labels,
+                               const bytes& context,
+                               size_t size) const;
   std::vector<KeyPackage> roster() const;
   bytes authentication_secret() const;
 
+  // The number of epochs retained, including the current one, and the
+  // approximate memory they hold, in bytes
+  size_t retained_epochs() const;
+  size_t retained_bytes() const;
+
+  // The memory held by the current epoch, by component, with all past epochs
+  // and any cached outbound state counted as history
+  MemoryUsage memory_usage() const;
+
   // Application message protection
   bytes protect(const bytes& plaintext);
+
+  // As protect(), but writes the encoded ciphertext into out, reusing its
+  // capacity across calls
+  void protect_into(const bytes& plaintext, bytes& out);
   bytes unprotect(const bytes& ciphertext);
 
+  // As unprotect(), but decrypts in the message buffer, leaving just the
+  // application data in it
+  void unprotect_in_place(bytes& message);
+
+  // Batch forms of protect() and unprotect(), taking the Session's lock once
+  // for the whole batch.  In unprotect_batch(), a message that cannot be
+  // unprotected gives std::nullopt, without affecting the rest of the batch.
+  std::vector<bytes> protect_batch(const std::vector<bytes>& plaintexts);
+  std::vector<std::optional<bytes>> unprotect_batch(
+    const std::vector<bytes>& ciphertexts);
+
+  // Streaming protection of large payloads, e.g., file transfers.  The
+  // payload is read from the source a chunk at a time, and each chunk is
+  // protected as an application message of its own, with its own key
+  // generation, and handed to the sink.  The source writes up to the given
+  // number of bytes and returns how many it wrote, which is less than asked
+  // for only at the end of the payload.  A payload that fills its last chunk
+  // is followed by an empty one.  Memory use is bounded by the chunk size.
+  using StreamSource = std::function<size_t(uint8_t* data, size_t size)>;
+  using StreamSink = std::function<void(const bytes& message)>;
+  void protect_stream(const StreamSource& source,
+                      const StreamSink& sink,
+                      size_t chunk_size);
+
+  // Unprotect a message from protect_stream() in place, as by
+  // unprotect_in_place(), leaving the chunk's data in the buffer.  Chunks are
+  // numbered from zero, and the payload is complete after the last one.  Each
+  // stream has a random ID, which is authenticated with every chunk, so that
+  // chunks of different streams cannot be mixed.  Reassembling the chunks of
+  // a stream in order is left to the caller.
+  struct StreamChunk
+  {
+    bytes stream_id;
+    uint32_t index = 0;
+    bool last = false;
+  };
+  StreamChunk unprotect_chunk(bytes& message);
+
+  // As above, but a chunk from any stream but the given one, e.g., the stream
+  // of the first chunk received, is rejected with ProtocolError
+  StreamChunk unprotect_chunk(bytes& message, const bytes& stream_id);
+
 protected:
   struct Inner;
   std::unique_ptr<Inner> inner;
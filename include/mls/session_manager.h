@@ -0,0 +1,108 @@
+#pragma once
+
+#include <mls/session.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace mls {
+
+///
+/// A SessionManager owns the Sessions for many groups and routes encoded
+/// messages to them by the group ID at the start of each message.
+///
+/// Groups are pinned to shards by a hash of their group ID, and the shard's
+/// worker thread processes the messages submitted for its groups in order.
+/// An idle worker steals application messages from busy shards, since a
+/// Session can decrypt them concurrently.  Submitting to a busy shard wakes
+/// an idle worker to steal; idle workers also look for work on their own, at
+/// an interval that grows while there is none.  Handshake messages always run on
+/// the owning shard, and a group's application messages are not stolen while
+/// a handshake message for it is pending, so they never overtake an epoch
+/// change submitted before them.
+///
+
+class SessionManager
+{
+public:
+  struct Result
+  {
+    bytes group_id;
+
+    // For application messages, the plaintext
+    bytes data;
+
+    // For handshake messages, whether the group moved to a new epoch
+    bool epoch_changed = false;
+
+    // Set if processing the message threw
+    std::exception_ptr error;
+  };
+
+  // Called on a worker thread once a message has been processed.  Callbacks
+  // must not throw, and must not call drain().
+  using Callback = std::function<void(Result)>;
+
+  explicit SessionManager(
+    size_t shards = std::thread::hardware_concurrency());
+  ~SessionManager();
+
+  SessionManager(const SessionManager&) = delete;
+  SessionManager& operator=(const SessionManager&) = delete;
+
+  // Registry.  Sessions are keyed by their group ID; adding a second Session
+  // for a group throws InvalidParameterError.  A removed Session is destroyed
+  // once any of its messages in flight have been processed.
+  void add(Session session);
+  bool remove(const bytes& group_id);
+  bool contains(const bytes& group_id) const;
+  size_t size() const;
+
+  size_t shard_count() const { return shards.size(); }
+  size_t shard_of(const bytes& group_id) const;
+
+  // Process a message on the calling thread.  These must not be mixed with
+  // submitted handshake messages for the same group, which could then be
+  // applied out of order.
+  bool handle(const bytes& handshake_data);
+  bytes protect(const bytes& group_id, const bytes& plaintext);
+  bytes unprotect(const bytes& ciphertext);
+
+  // Queue a message for the shard that owns its group.  If the group is not
+  // known, done is called right away on the calling thread, with a
+  // MissingStateError.
+  void submit_handshake(bytes handshake_data, Callback done);
+  void submit_application(bytes ciphertext, Callback done);
+
+  // Wait until every message submitted so far has been processed
+  void drain();
+
+private:
+  struct Group;
+  struct Task;
+  struct Shard;
+
+  std::vector<std::unique_ptr<Shard>> shards;
+  std::atomic<bool> stopping{ false };
+
+  std::mutex outstanding_mutex;
+  std::condition_variable all_done;
+  size_t outstanding = 0;
+
+  Shard& shard_for(const bytes& group_id) const;
+  std::shared_ptr<Group> find(const bytes& group_id) const;
+  void submit(bool handshake, bytes message, Callback done);
+  void work(size_t index);
+  bool steal(size_t thief, Task& task);
+  void wake_thief(size_t owner);
+  void run(Task& task);
+};
+
+} // namespace mls
@@ -3,10 +3,13 @@
 #include "mls/crypto.h"
 #include "mls/key_schedule.h"
 #include "mls/messages.h"
+#include "mls/metrics.h"
 #include "mls/treekem.h"
-#include <list>
+#include <map>
+#include <memory>
 #include <optional>
 #include <set>
+#include <unordered_map>
 #include <vector>
 
 namespace mls {
@@ -38,12 +41,78 @@ struct GroupContext
              tls::pass)
 };
 
+// The encodings that every message in an epoch is signed, MACed, or
+// encrypted with: the GroupContext, and the group ID and epoch that begin the
+// AADs of an MLSCiphertext
+struct EpochEncodings
+{
+  GroupContext context;
+  bytes encoded_context;
+  bytes aad_prefix;
+
+  EpochEncodings() = default;
+  explicit EpochEncodings(GroupContext context_in);
+  EpochEncodings(GroupContext context_in, bytes encoded_context_in);
+};
+
 // Index into the session roster
 struct RosterIndex : public UInt32
 {
   using UInt32::UInt32;
 };
 
+// A saved State, e.g., in a memory-mapped file.  Only the plaintext header,
+// which identifies the group and epoch, is read on construction, so stored
+// states can be indexed without decrypting them.  The view does not copy
+// the data, which must outlive it.
+class StateSnapshot
+{
+public:
+  StateSnapshot(const uint8_t* data, size_t size);
+  explicit StateSnapshot(const bytes& data);
+  explicit StateSnapshot(bytes&& data) = delete;
+
+  CipherSuite cipher_suite() const { return _suite; }
+  const bytes& group_id() const { return _group_id; }
+  epoch_t epoch() const { return _epoch; }
+
+  // Whether this holds only the changes from an earlier state, as written by
+  // State::save_delta()
+  bool delta() const { return _type == Type::delta; }
+
+  // Whether this holds a past epoch saved by DecryptOnlyEpoch::save()
+  bool decrypt_only() const { return _type == Type::decrypt_only; }
+
+private:
+  enum struct Type : uint8_t
+  {
+    full = 0,
+    delta = 1,
+    decrypt_only = 2,
+  };
+
+  CipherSuite _suite;
+  bytes _group_id;
+  epoch_t _epoch;
+  Type _type;
+  bytes _salt;
+
+  const uint8_t* _data;
+  size_t _header_size;
+  size_t _size;
+
+  static bytes seal(Type type,
+                    CipherSuite suite,
+                    epoch_t epoch,
+                    const bytes& group_id,
+                    const bytes& body,
+                    const bytes& storage_secret);
+  bytes open(const bytes& storage_secret) const;
+
+  friend class State;
+  friend class DecryptOnlyEpoch;
+};
+
 class State
 {
 public:
@@ -64,11 +133,51 @@ public:
         const KeyPackage& kp,
         const Welcome& welcome);
 
+  // As above, but the GroupInfo is decrypted and decoded in the Welcome's own
+  // buffer, and the tree moves into the State, so that joining a large group
+  // holds about one encoded and one decoded copy of the tree at a time
+  State(const HPKEPrivateKey& init_priv,
+        SignaturePrivateKey sig_priv,
+        const KeyPackage& kp,
+        Welcome&& welcome);
+
+  // As above, but the incoming tree is hashed and its parent hashes checked
+  // across the executor
+  State(const HPKEPrivateKey& init_priv,
+        SignaturePrivateKey sig_priv,
+        const KeyPackage& kp,
+        Welcome&& welcome,
+        Executor& executor);
+
+  // Initialize a group from a Welcome that was sent without the tree (see
+  // external_tree() below), with the tree obtained separately, e.g., from
+  // the delivery service.  The tree is checked against the tree hash in the
+  // Welcome before anything else is done with it.
+  State(const HPKEPrivateKey& init_priv,
+        SignaturePrivateKey sig_priv,
+        const KeyPackage& kp,
+        Welcome&& welcome,
+        TreeKEMPublicKey tree);
+  State(const HPKEPrivateKey& init_priv,
+        SignaturePrivateKey sig_priv,
+        const KeyPackage& kp,
+        Welcome&& welcome,
+        TreeKEMPublicKey tree,
+        Executor& executor);
+
   ///
   /// Message factories
   ///
 
   MLSPlaintext add(const KeyPackage& key_package) const;
+
+  // Add proposals for several joiners, in order.  The key packages are
+  // verified, and the proposals signed, across the executor.
+  std::vector<MLSPlaintext> add_batch(
+    const std::vector<KeyPackage>& key_packages) const;
+  std::vector<MLSPlaintext> add_batch(
+    const std::vector<KeyPackage>& key_packages,
+    Executor& executor) const;
   MLSPlaintext update(const bytes& leaf_secret);
   MLSPlaintext remove(RosterIndex index) const;
   MLSPlaintext remove(LeafIndex removed) const;
@@ -76,38 +185,198 @@ public:
   std::tuple<MLSPlaintext, Welcome, State> commit(
     const bytes& leaf_secret) const;
 
+  // As above, but with the HPKE encryptions to the group and to new joiners
+  // spread across an executor
+  std::tuple<MLSPlaintext, Welcome, State> commit(const bytes& leaf_secret,
+                                                  Executor& executor) const;
+
+  // The expensive part of a Commit that does not depend on the other
+  // members, i.e., deriving the key pairs along the direct path and signing
+  // the new leaf, can be done ahead of time, e.g., on a background thread.
+  // A commit() from a prepared commit only has to do the encryptions.  If the
+  // cached proposals have since changed the shape of the tree, the path is
+  // derived again from the same leaf secret.  Like a leaf secret, a prepared
+  // commit must be used for at most one Commit.
+  struct PreparedCommit
+  {
+    epoch_t epoch;
+    bytes leaf_secret;
+    PreparedPath path;
+  };
+
+  PreparedCommit prepare_commit(const bytes& leaf_secret) const;
+
+  std::tuple<MLSPlaintext, Welcome, State> commit(
+    const PreparedCommit& prepared) const;
+  std::tuple<MLSPlaintext, Welcome, State> commit(
+    const PreparedCommit& prepared,
+    Executor& executor) const;
+
+  // The cached proposals that the next commit() will leave out because later
+  // proposals make them redundant: an Update followed by another Update from
+  // the same member, an Update from a member that is being removed, and a
+  // repeated Remove of the same member.  Applying a Commit discards the
+  // cached proposals it supersedes.
+  std::vector<ProposalID> superseded_proposals() const;
+
+  // The number of cached proposals that the next commit() will include
+  size_t pending_proposals() const;
+
+  // The members that should commit the cached proposals, in order, when
+  // members commit on a schedule rather than each committing its own
+  // proposals.  The first is the scheduled committer and the rest stand in,
+  // one after another, if it does not commit.  Every member with the same
+  // cached proposals computes the same order, so they do not send
+  // conflicting Commits.  The order rotates with the epoch among the members
+  // that the cached proposals do not remove.
+  //
+  // Members whose cached proposals differ, e.g., while a proposal is still
+  // in flight, can disagree on the order, and so may both commit.  The
+  // Delivery Service then orders their Commits, and the ones that lose are
+  // rejected by every member, as for any two Commits in one epoch.
+  std::vector<LeafIndex> scheduled_committers() const;
+
   ///
   /// Generic handshake message handler
   ///
   std::optional<State> handle(const MLSPlaintext& pt);
 
+  /// As above, but with the key packages of joiners added by a Commit
+  /// verified across an executor.  Joiners are still placed in the tree one
+  /// after another, in the order of the Commit.
+  std::optional<State> handle(const MLSPlaintext& pt, Executor& executor);
+
+  /// As above, for a message the caller no longer needs.  A Proposal is
+  /// moved into the cache rather than copied.
+  std::optional<State> handle(MLSPlaintext&& pt);
+  std::optional<State> handle(MLSPlaintext&& pt, Executor& executor);
+
+  /// Handle a sequence of handshake messages in order.  All of the
+  /// signatures for an epoch are verified together before any message in
+  /// that epoch is applied.  Returns the state after the last Commit, or
+  /// nullopt if the batch contained only Proposals.
+  std::optional<State> handle_batch(const std::vector<MLSPlaintext>& pts);
+  std::optional<State> handle_batch(const std::vector<MLSPlaintext>& pts,
+                                    Executor& executor);
+
+  /// Handle a backlog of handshake messages in order, as a pipeline of two
+  /// tasks on the executor.  The first follows the group's public state,
+  /// which is all that a message's signature depends on, and checks the
+  /// signatures; the second applies each message once it has been checked.
+  /// So the signatures for a Commit are checked while the one before it is
+  /// being decrypted and applied.  Returns the state after each Commit, in
+  /// order.  As with handle(), Proposals before the first Commit are cached
+  /// in this state.
+  std::vector<State> catch_up(const std::vector<MLSPlaintext>& pts,
+                              Executor& executor);
+
   ///
   /// Accessors
   ///
+  const bytes& group_id() const { return _group_id; }
   epoch_t epoch() const { return _epoch; }
   LeafIndex index() const { return _index; }
   CipherSuite cipher_suite() const { return _suite; }
+  const TreeKEMPublicKey& tree() const { return _tree; }
   bytes do_export(const std::string& label,
                   const bytes& context,
                   size_t size) const;
 
+  // Export several secrets with the same context and size.  Exports are
+  // cached for the epoch, so repeated requests are not derived again.
+  std::vector<bytes> do_export(const std::vector<std::string>& labels,
+                               const bytes& context,
+                               size_t size) const;
+
   // Ordered list of credentials from non-blank leaves
   std::vector<KeyPackage> roster() const;
 
   bytes authentication_secret() const;
 
+  // Approximate memory held by this state, in bytes
+  MemoryUsage memory_usage() const;
+  size_t retained_bytes() const;
+
   ///
   /// General encryption and decryption
   ///
   MLSCiphertext encrypt(const MLSPlaintext& pt);
   MLSPlaintext decrypt(const MLSCiphertext& ct);
 
+  // Writes the encoded MLSCiphertext to out, replacing its contents but
+  // reusing its capacity.  Both AEAD encryptions run in place in out.
+  void encrypt_into(const MLSPlaintext& pt, bytes& out);
+
+  // As encrypt_into() for each message in turn, but with the AEAD encryptions
+  // for the whole batch handed to the AEAD together
+  std::vector<bytes> encrypt_batch(const std::vector<MLSPlaintext>& pts);
+
+  // Where new members are placed in the tree.  Every member of the group has
+  // to use the same placement policy.  The policy is carried over to the
+  // states for later epochs.
+  void leaf_placement(std::shared_ptr<const LeafPlacement> placement);
+
+  // Limits on message keys retained for out-of-order decryption.  The policy
+  // is carried over to the states for later epochs.
+  void ratchet_policy(const RatchetPolicy& policy);
+
+  // Whether the Welcomes from commit() leave out the tree and carry only its
+  // hash, for groups whose members can get the tree from elsewhere.  This
+  // keeps the size of a Welcome independent of the size of the group.  The
+  // setting is carried over to the states for later epochs.
+  void external_tree(bool enabled);
+
+  // Which senders' message keys prewarm_keys() derives: this member and the
+  // senders active in the previous epoch, or every leaf.  The setting is
+  // carried over to the states for later epochs.
+  void key_prewarm(KeyPrewarm mode);
+
+  ///
+  /// Persistence
+  ///
+
+  // Encrypts the state for storage, with keys derived from a secret that
+  // only this member holds.  Everything needed to continue in the epoch is
+  // saved, including message keys retained for late messages and cached
+  // proposals.  The leaf placement policy and the external tree setting are
+  // not saved, and have to be set again on the loaded state.
+  bytes save(const bytes& storage_secret) const;
+  static State load(const StateSnapshot& snapshot,
+                    const bytes& storage_secret);
+
+  // As save(), but with only the tree nodes that changed since an earlier
+  // state of the same group, typically the previous epoch, i.e., O(log n)
+  // nodes after a Commit.  The rest of the member's state is small and is
+  // saved in full.  load_delta() is called on a copy of the earlier state.
+  bytes save_delta(const State& base, const bytes& storage_secret) const;
+  State load_delta(const StateSnapshot& delta,
+                   const bytes& storage_secret) const;
+
+  // Precompute message keys for the members that have sent in this epoch
+  void precompute_keys(Executor& executor);
+
+  // Create the ratchets chosen by key_prewarm() ahead of their first use,
+  // e.g., on a background thread right after the epoch starts, so that the
+  // first message from each sender does not pay for deriving them.  Messages
+  // can be protected and unprotected while this runs.
+  void prewarm_keys(Executor& executor);
+  RatchetStats ratchet_stats() const;
+
   ///
   /// Application encryption and decryption
   ///
   MLSCiphertext protect(const bytes& pt);
+  void protect_into(const bytes& pt, bytes& out);
   bytes unprotect(const MLSCiphertext& ct);
 
+  // As protect() for each plaintext, returning the encoded MLSCiphertexts
+  std::vector<bytes> protect_batch(const std::vector<bytes>& pts);
+
+  // Decrypts an encoded MLSCiphertext in its own buffer.  On success, message
+  // is left holding just the application data; on failure, its contents are
+  // unspecified.
+  void unprotect_in_place(bytes& message);
+
 protected:
   // Shared confirmed state
   // XXX(rlb@ipv.sx): Can these be made const?
@@ -127,36 +396,90 @@ protected:
   LeafIndex _index;
   SignaturePrivateKey _identity_priv;
 
-  // Cache of Proposals and update secrets
-  std::list<MLSPlaintext> _pending_proposals;
+  // Whether Welcomes are sent without the tree
+  bool _external_tree = false;
+
+  // Which ratchets to create ahead of use, and the senders whose ratchets
+  // were used in the previous epoch
+  KeyPrewarm _key_prewarm = KeyPrewarm::none;
+  std::vector<LeafIndex> _prior_senders;
+
+  // Cache of Proposals and of update secrets
+  ProposalCache _proposals;
   std::map<bytes, bytes> _update_secrets;
 
+#if defined(MLS_METRICS)
+  // Records each copy of the State
+  Metrics::CopyProbe _copy_probe;
+#endif
+
+  // The encodings for the current GroupContext, computed on first use.  They
+  // are dropped wherever the fields of the GroupContext change, i.e., when a
+  // Commit is applied to the tree and when the epoch advances.  Copies share
+  // them.
+  mutable Locked<std::shared_ptr<const EpochEncodings>> _epoch_cache;
+
   // Assemble a group context for this state
   GroupContext group_context() const;
+  std::shared_ptr<const EpochEncodings> epoch_encodings() const;
+
+  // A Commit covering all cached proposals, and the state that results from
+  // applying them, before any UpdatePath
+  struct CommitPlan;
+  CommitPlan plan_commit(Executor& executor) const;
+
+  // The encrypted body of a saved state, apart from the tree
+  struct Snapshot;
+  State(const StateSnapshot& header, TreeKEMPublicKey&& tree, Snapshot&& body);
+  bytes seal_snapshot(bool delta,
+                      const bytes& tree,
+                      const bytes& storage_secret) const;
+
+  std::tuple<MLSPlaintext, Welcome, State> commit(
+    const bytes& leaf_secret,
+    const PreparedPath* prepared,
+    Executor& executor) const;
+
+  // An MLSCiphertext laid out in its output buffer, with the sender data and
+  // content in their final places waiting to be encrypted
+  struct PendingCiphertext;
+  PendingCiphertext lay_out_ciphertext(const MLSPlaintext& pt,
+                                       const EpochEncodings& encodings,
+                                       bytes& content_aad,
+                                       bytes& out);
 
   // Ratchet the key schedule forward and sign the commit that caused the
   // transition
   MLSPlaintext ratchet_and_sign(const Commit& op,
                                 const bytes& update_secret,
-                                const GroupContext& prev_ctx);
+                                const EpochEncodings& prev_epoch);
+
+  // Ingest a Welcome; shared by the joining constructors
+  void join(const HPKEPrivateKey& init_priv,
+            const KeyPackage& kp,
+            Welcome&& welcome,
+            std::optional<TreeKEMPublicKey> external_tree,
+            Executor& executor);
 
   // Create an MLSPlaintext with a signature over some content
   MLSPlaintext sign(const Proposal& proposal) const;
 
-  // Apply the changes requested by various messages
-  LeafIndex apply(const Add& add);
-  void apply(LeafIndex target, const Update& update);
-  void apply(LeafIndex target, const Update& update, const bytes& leaf_secret);
-  void apply(const Remove& remove);
-  std::vector<LeafIndex> apply(const std::vector<MLSPlaintext>& pts,
-                               ProposalType::selector required_type);
-  std::tuple<bool, bool, std::vector<LeafIndex>> apply(const Commit& commit);
+  // Check that a key package may be added to the group, throwing if not
+  void check_key_package(const KeyPackage& key_package, uint64_t now) const;
+
+  // Apply the proposals covered by a Commit, returning whether it included
+  // an Update from this member and any Removes, and where joiners were added
+  std::tuple<bool, bool, std::vector<LeafIndex>> apply(const Commit& commit,
+                                                       Executor& executor);
 
   // Compute a proposal ID
   ProposalID proposal_id(const MLSPlaintext& pt) const;
 
-  // Extract a proposal from the cache
-  std::optional<MLSPlaintext> find_proposal(const ProposalID& id);
+  // Add a proposal to the cache, unless it is already there
+  void cache_proposal(MLSPlaintext pt);
+
+  // Flags the cached proposals that superseded_proposals() reports
+  std::vector<bool> find_superseded_proposals() const;
 
   // Compare the **shared** attributes of the states
   friend bool operator==(const State& lhs, const State& rhs);
@@ -167,12 +490,86 @@ protected:
 
   // Signature verification over a handshake message
   bool verify(const MLSPlaintext& pt) const;
+  std::vector<bool> verify(const std::vector<const MLSPlaintext*>& pts,
+                           Executor& executor) const;
+
+  // Check that a handshake message is addressed to this group and epoch
+  void check_epoch(const MLSPlaintext& pt) const;
+
+  // Apply a handshake message whose signature has been verified
+  std::optional<State> handle_verified(const MLSPlaintext& pt,
+                                       Executor& executor);
 
   // Verification of the confirmation MAC
   bool verify_confirmation(const bytes& confirmation) const;
 
   // Convert a Roster entry into LeafIndex
   LeafIndex leaf_for_roster_entry(RosterIndex index) const;
+
+  friend class DecryptOnlyEpoch;
+  friend class PublicGroupState;
+};
+
+// The parts of a State needed to decrypt and authenticate application
+// messages from its epoch: the group context, the sender data secret and
+// message ratchets, and the members' signature keys.  The tree, transcript
+// hashes, proposals and other epoch secrets are dropped.
+class DecryptOnlyEpoch
+{
+public:
+  explicit DecryptOnlyEpoch(const State& state);
+
+  epoch_t epoch() const { return _epoch.context.epoch; }
+  bytes unprotect(const MLSCiphertext& ct);
+  void unprotect_in_place(bytes& message);
+
+  // Approximate memory held by this record, in bytes
+  MemoryUsage memory_usage() const;
+  size_t retained_bytes() const;
+
+  // Encrypts the record for storage, as State::save() does
+  bytes save(const bytes& storage_secret) const;
+  static DecryptOnlyEpoch load(const StateSnapshot& snapshot,
+                               const bytes& storage_secret);
+
+private:
+  DecryptOnlyEpoch() = default;
+
+  EpochEncodings _epoch;
+  KeyScheduleEpoch _keys;
+
+  // Late messages may come from any member of the epoch, so every member's
+  // key is kept, but the blank leaves of the tree are not
+  std::map<uint32_t, SignaturePublicKey> _signers;
+
+  const SignaturePublicKey& signer(uint32_t sender) const;
+};
+
+// An append-only log of a member's states, for keeping a group durable
+// without writing out the whole tree on every change.  Each record is a
+// State::save_delta() from the one before, except that every
+// compact_interval records the whole state is saved instead, after which
+// the records before it are no longer needed.
+class StateJournal
+{
+public:
+  StateJournal(bytes storage_secret, size_t compact_interval);
+
+  // Encodes a record for the state, framed to be appended to the journal.
+  // The first record is always a full snapshot.  The flag reports whether
+  // this record is one, i.e., whether the journal can be cut back to it.
+  std::tuple<bool, bytes> record(const State& state);
+
+  // The last state recorded in a journal, i.e., in a sequence of records.
+  // Records before the last full snapshot are skipped without being
+  // decrypted.
+  static State replay(const bytes& journal, const bytes& storage_secret);
+
+private:
+  bytes _storage_secret;
+  size_t _compact_interval;
+  size_t _deltas = 0;
+  std::optional<State> _base;
 };
 
 } // namespace mls
@@ -1,6 +1,8 @@
 #pragma once
 
+#include <array>
 #include <cstdint>
+#include <stdexcept>
 #include <tls/tls_syntax.h>
 #include <vector>
 
@@ -36,11 +38,11 @@ struct UInt32
 {
   uint32_t val;
 
-  UInt32()
+  constexpr UInt32()
     : val(0)
   {}
 
-  explicit UInt32(uint32_t val_in)
+  constexpr explicit UInt32(uint32_t val_in)
     : val(val_in)
   {}
 
@@ -58,59 +60,241 @@ struct LeafCount : public UInt32
 struct NodeCount : public UInt32
 {
   using UInt32::UInt32;
-  explicit NodeCount(const LeafCount n);
+  constexpr explicit NodeCount(const LeafCount n)
+    : UInt32(2 * (n.val - 1) + 1)
+  {}
 };
 
 struct LeafIndex : public UInt32
 {
   using UInt32::UInt32;
-  bool operator<(const LeafIndex other) const { return val < other.val; }
-  bool operator<(const LeafCount other) const { return val < other.val; }
+  constexpr bool operator<(const LeafIndex other) const
+  {
+    return val < other.val;
+  }
+  constexpr bool operator<(const LeafCount other) const
+  {
+    return val < other.val;
+  }
 };
 
 struct NodeIndex : public UInt32
 {
   using UInt32::UInt32;
-  explicit NodeIndex(const LeafIndex x)
+  constexpr explicit NodeIndex(const LeafIndex x)
     : UInt32(2 * x.val)
   {}
 
-  bool operator<(const NodeIndex other) const { return val < other.val; }
+  constexpr bool operator<(const NodeIndex other) const
+  {
+    return val < other.val;
+  }
+};
+
+// A direct path or copath, held inline.  A tree with 32-bit node indices is
+// at most 32 levels deep, so no path is longer than max_size and computing a
+// path never allocates.
+class NodePath
+{
+public:
+  static constexpr size_t max_size = 32;
+
+  using value_type = NodeIndex;
+  using const_iterator = const NodeIndex*;
+  using iterator = const_iterator;
+
+  constexpr void push_back(NodeIndex x)
+  {
+    if (_size == max_size) {
+      throw std::length_error("Node path too long");
+    }
+
+    _nodes[_size] = x;
+    _size += 1;
+  }
+
+  constexpr size_t size() const { return _size; }
+  constexpr bool empty() const { return _size == 0; }
+  constexpr NodeIndex operator[](size_t i) const { return _nodes[i]; }
+  constexpr NodeIndex back() const { return _nodes[_size - 1]; }
+
+  constexpr const_iterator begin() const { return _nodes.data(); }
+  constexpr const_iterator end() const { return _nodes.data() + _size; }
+
+  operator std::vector<NodeIndex>() const { return { begin(), end() }; }
+
+private:
+  std::array<NodeIndex, max_size> _nodes{};
+  size_t _size = 0;
 };
 
+bool
+operator==(const NodePath& lhs, const std::vector<NodeIndex>& rhs);
+
 // Internal namespace to keep these generic names clean
 namespace tree_math {
 
-uint32_t
-level(NodeIndex x);
+constexpr uint32_t
+log2(uint32_t x)
+{
+  if (x == 0) {
+    return 0;
+  }
+
+  uint32_t k = 0;
+  while (k < 32 && (x >> k) > 0) {
+    k += 1;
+  }
+  return k - 1;
+}
+
+// The number of trailing one bits
+constexpr uint32_t
+level(NodeIndex x)
+{
+  uint32_t k = 0;
+  while (k < 32 && ((x.val >> k) & 1U) == 1) {
+    k += 1;
+  }
+  return k;
+}
 
 // Node relationships
-NodeIndex
-root(NodeCount w);
+constexpr NodeIndex
+root(NodeCount w)
+{
+  return NodeIndex{ (1U << log2(w.val)) - 1 };
+}
 
-NodeIndex
-left(NodeIndex x);
+constexpr NodeIndex
+left(NodeIndex x)
+{
+  const auto k = level(x);
+  if (k == 0) {
+    return x;
+  }
 
-NodeIndex
-right(NodeIndex x, NodeCount w);
+  return NodeIndex{ x.val ^ (1U << (k - 1)) };
+}
 
-NodeIndex
-parent(NodeIndex x, NodeCount w);
+constexpr NodeIndex
+right(NodeIndex x, NodeCount w)
+{
+  const auto k = level(x);
+  if (k == 0) {
+    return x;
+  }
 
-NodeIndex
-sibling(NodeIndex x, NodeCount w);
+  auto r = NodeIndex{ x.val ^ (3U << (k - 1)) };
+  while (r.val >= w.val) {
+    r = left(r);
+  }
+  return r;
+}
 
-std::vector<NodeIndex>
-dirpath(NodeIndex x, NodeCount w);
+constexpr NodeIndex
+parent_step(NodeIndex x)
+{
+  const auto k = level(x);
+  return NodeIndex{ (x.val | (1U << k)) & ~(1U << (k + 1)) };
+}
 
-std::vector<NodeIndex>
-copath(NodeIndex x, NodeCount w);
+constexpr NodeIndex
+parent(NodeIndex x, NodeCount w)
+{
+  if (x.val == root(w).val) {
+    return x;
+  }
 
-bool
-in_path(NodeIndex x, NodeIndex y);
+  auto p = parent_step(x);
+  while (p.val >= w.val) {
+    p = parent_step(p);
+  }
+  return p;
+}
+
+constexpr NodeIndex
+sibling(NodeIndex x, NodeCount w)
+{
+  const auto p = parent(x, w);
+  if (x.val < p.val) {
+    return right(p, w);
+  }
+
+  if (x.val > p.val) {
+    return left(p);
+  }
+
+  // root's sibling is itself
+  return p;
+}
+
+// The ancestors of x, from its parent up to the root
+constexpr NodePath
+dirpath(NodeIndex x, NodeCount w)
+{
+  auto d = NodePath{};
+  const auto r = root(w);
+  if (x.val == r.val) {
+    return d;
+  }
+
+  auto p = parent(x, w);
+  while (p.val != r.val) {
+    d.push_back(p);
+    p = parent(p, w);
+  }
+
+  d.push_back(r);
+  return d;
+}
+
+// The siblings of x and of each of its ancestors below the root
+constexpr NodePath
+copath(NodeIndex x, NodeCount w)
+{
+  auto c = NodePath{};
+  const auto d = dirpath(x, w);
+  if (d.empty()) {
+    return c;
+  }
+
+  c.push_back(sibling(x, w));
+  for (size_t i = 0; i + 1 < d.size(); i++) {
+    c.push_back(sibling(d[i], w));
+  }
+  return c;
+}
+
+constexpr bool
+in_path(NodeIndex x, NodeIndex y)
+{
+  const auto lx = level(x);
+  const auto ly = level(y);
+  return lx <= ly && (x.val >> (ly + 1) == y.val >> (ly + 1));
+}
+
+// Common ancestor of two leaves
+constexpr NodeIndex
+ancestor(LeafIndex l, LeafIndex r)
+{
+  auto ln = NodeIndex(l);
+  auto rn = NodeIndex(r);
+  if (ln.val == rn.val) {
+    return ln;
+  }
+
+  uint32_t k = 0;
+  while (ln.val != rn.val) {
+    ln.val = ln.val >> 1U;
+    rn.val = rn.val >> 1U;
+    k += 1;
+  }
 
-NodeIndex
-ancestor(LeafIndex l, LeafIndex r);
+  const uint32_t prefix = ln.val << k;
+  const uint32_t stop = (1U << (k - 1));
+  return NodeIndex(prefix + (stop - 1));
+}
 
 } // namespace tree_math
 } // namespace mls
@@ -3,7 +3,13 @@
 #include "mls/common.h"
 #include "mls/core_types.h"
 #include "mls/crypto.h"
+#include "mls/executor.h"
 #include "mls/tree_math.h"
+#include <array>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <optional>
 #include <tls/tls_syntax.h>
 
 namespace mls {
@@ -34,7 +40,12 @@ struct Node
 struct OptionalNode
 {
   std::optional<Node> node;
-  bytes hash;
+  inline_bytes<max_hash_size> hash;
+
+  // The TLS encoding of the node, set when the node is hashed and spliced
+  // into the hash input and into encodings of the tree.  Empty until then,
+  // and cleared when the node is changed through the tree.
+  bytes encoding = {};
 
   bool blank() const { return !node.has_value(); }
 
@@ -53,21 +64,181 @@ struct OptionalNode
   void set_leaf_hash(CipherSuite suite, NodeIndex index);
   void set_parent_hash(CipherSuite suite,
                        NodeIndex index,
-                       const bytes& left,
-                       const bytes& right);
+                       const inline_bytes<max_hash_size>& left,
+                       const inline_bytes<max_hash_size>& right);
 
   TLS_SERIALIZABLE(node)
+
+private:
+  // Writes the node as an optional<T>, i.e., the encoding without the node
+  // type.  Throws std::bad_variant_access if the node is not a T.
+  template<typename T>
+  void write_content(tls::ostream& w);
 };
 
 struct TreeKEMPublicKey;
 
+// Values for nodes on one member's direct path, including its leaf, held
+// inline with one slot per level.  The nodes on a path are at distinct
+// levels, so a node is found from its level in constant time, and copying
+// the map does not allocate for the map itself.  Iteration is in order of
+// level, i.e., from the leaf up.
+template<typename T>
+class DirectPathMap
+{
+public:
+  using value_type = std::pair<NodeIndex, T>;
+
+  // A leaf and the at most NodePath::max_size nodes above it
+  static constexpr size_t max_levels = NodePath::max_size + 1;
+
+private:
+  using Slots = std::array<std::optional<value_type>, max_levels>;
+
+  // Visits the occupied slots in order
+  template<typename S, typename V>
+  class basic_iterator
+  {
+  public:
+    using iterator_category = std::forward_iterator_tag;
+    using value_type = V;
+    using difference_type = std::ptrdiff_t;
+    using pointer = V*;
+    using reference = V&;
+
+    basic_iterator(S* slots, size_t i)
+      : _slots(slots)
+      , _i(i)
+    {
+      skip();
+    }
+
+    reference operator*() const { return *(*_slots)[_i]; }
+    pointer operator->() const { return &*(*_slots)[_i]; }
+
+    basic_iterator& operator++()
+    {
+      _i += 1;
+      skip();
+      return *this;
+    }
+
+    bool operator==(const basic_iterator& other) const
+    {
+      return _i == other._i;
+    }
+    bool operator!=(const basic_iterator& other) const
+    {
+      return _i != other._i;
+    }
+
+  private:
+    S* _slots;
+    size_t _i;
+
+    void skip()
+    {
+      while (_i < max_levels && !(*_slots)[_i].has_value()) {
+        _i += 1;
+      }
+    }
+  };
+
+public:
+  using iterator = basic_iterator<Slots, value_type>;
+  using const_iterator = basic_iterator<const Slots, const value_type>;
+
+  iterator begin() { return { &_slots, 0 }; }
+  iterator end() { return { &_slots, max_levels }; }
+  const_iterator begin() const { return { &_slots, 0 }; }
+  const_iterator end() const { return { &_slots, max_levels }; }
+
+  bool empty() const { return begin() == end(); }
+  size_t size() const { return std::distance(begin(), end()); }
+
+  iterator find(NodeIndex n)
+  {
+    const auto i = tree_math::level(n);
+    return holds(i, n) ? iterator{ &_slots, i } : end();
+  }
+
+  const_iterator find(NodeIndex n) const
+  {
+    const auto i = tree_math::level(n);
+    return holds(i, n) ? const_iterator{ &_slots, i } : end();
+  }
+
+  size_t count(NodeIndex n) const { return holds(tree_math::level(n), n); }
+
+  const T& at(NodeIndex n) const
+  {
+    auto it = find(n);
+    if (it == end()) {
+      throw std::out_of_range("Node not in direct path map");
+    }
+    return it->second;
+  }
+
+  // As for std::map, a node that is already present keeps its value.  A
+  // different node at the same level, which cannot be on the same path, is
+  // replaced.
+  std::pair<iterator, bool> emplace(NodeIndex n, T value)
+  {
+    const auto i = tree_math::level(n);
+    if (holds(i, n)) {
+      return { iterator{ &_slots, i }, false };
+    }
+
+    _slots.at(i).emplace(n, std::move(value));
+    return { iterator{ &_slots, i }, true };
+  }
+
+  std::pair<iterator, bool> insert(value_type entry)
+  {
+    return emplace(entry.first, std::move(entry.second));
+  }
+
+  T& operator[](NodeIndex n) { return emplace(n, T{}).first->second; }
+
+  size_t erase(NodeIndex n)
+  {
+    const auto i = tree_math::level(n);
+    if (!holds(i, n)) {
+      return 0;
+    }
+
+    _slots.at(i).reset();
+    return 1;
+  }
+
+  void clear() { _slots = {}; }
+
+  friend bool operator==(const DirectPathMap& lhs, const DirectPathMap& rhs)
+  {
+    return lhs._slots == rhs._slots;
+  }
+
+  friend bool operator!=(const DirectPathMap& lhs, const DirectPathMap& rhs)
+  {
+    return !(lhs == rhs);
+  }
+
+private:
+  Slots _slots;
+
+  bool holds(size_t i, NodeIndex n) const
+  {
+    return _slots.at(i).has_value() && _slots.at(i)->first == n;
+  }
+};
+
 struct TreeKEMPrivateKey
 {
   CipherSuite suite;
   LeafIndex index;
   bytes update_secret;
-  std::map<NodeIndex, bytes> path_secrets;
-  std::map<NodeIndex, HPKEPrivateKey> private_key_cache;
+  DirectPathMap<bytes> path_secrets;
+  DirectPathMap<HPKEPrivateKey> private_key_cache;
 
   static TreeKEMPrivateKey solo(CipherSuite suite,
                                 LeafIndex index,
@@ -105,10 +276,101 @@ private:
   bytes path_step(const bytes& path_secret) const;
 };
 
+// The sender's side of an UpdatePath, which does not depend on the group
+// context or on the other members' keys: the path secrets and key pairs, and
+// the re-signed leaf KeyPackage.  The path nodes carry no encrypted path
+// secrets yet.  A prepared path can only be used with a tree of the same size
+// and with the same key package at the sender's leaf.
+struct PreparedPath
+{
+  LeafIndex from;
+  LeafCount size;
+  bytes leaf_key_package;
+  TreeKEMPrivateKey priv;
+  UpdatePath path;
+
+  bool valid_for(const TreeKEMPublicKey& pub) const;
+};
+
+// Chooses the leaf where add_leaf() places a new member.  A policy returns a
+// blank leaf, or the leaf just past the end of the tree to extend it.  The
+// placement is part of the tree that the group agrees on, so every member of
+// a group has to use the same policy; only LeftmostPlacement is what the MLS
+// specification prescribes.
+struct LeafPlacement
+{
+  virtual ~LeafPlacement() = default;
+  virtual LeafIndex place(const TreeKEMPublicKey& tree) const = 0;
+};
+
+// The leftmost blank leaf
+struct LeftmostPlacement : public LeafPlacement
+{
+  LeafIndex place(const TreeKEMPublicKey& tree) const override;
+};
+
+// A new member enlarges the resolution of each of its ancestors until a
+// Commit from a member below that ancestor puts a key there.  This picks the
+// blank leaf whose nearest non-blank ancestor is lowest, so that the next
+// Commit from any member sharing that ancestor absorbs the new member.  Ties
+// go to the leftmost leaf.
+struct MinResolutionPlacement : public LeafPlacement
+{
+  LeafIndex place(const TreeKEMPublicKey& tree) const override;
+};
+
+// Picks a blank leaf in the largest subtree that has no members, so that
+// members added together share their direct paths and the first of them to
+// commit fills in keys for the others.  Ties go to the leftmost leaf.
+struct ClusteredPlacement : public LeafPlacement
+{
+  LeafIndex place(const TreeKEMPublicKey& tree) const override;
+};
+
+// The changes that turn one tree into another, e.g., the tree of the next
+// epoch, so that a party mirroring the public tree can follow a group with
+// O(log n) nodes per Commit instead of the whole tree.  The hashes identify
+// the tree the diff applies to and the tree it produces.
+//
+// struct {
+//   uint32 index;
+//   optional<Node> node;
+// } NodeChange;
+//
+// struct {
+//   opaque prev_tree_hash<0..255>;
+//   opaque tree_hash<0..255>;
+//   uint32 width;
+//   NodeChange nodes<0..2^32-1>;
+// } TreeDiff;
+struct TreeDiff
+{
+  struct NodeChange
+  {
+    NodeIndex index;
+    OptionalNode node;
+
+    TLS_SERIALIZABLE(index, node)
+  };
+
+  bytes prev_tree_hash;
+  bytes tree_hash;
+  NodeCount width;
+  std::vector<NodeChange> nodes;
+
+  TLS_SERIALIZABLE(prev_tree_hash, tree_hash, width, nodes)
+  TLS_TRAITS(tls::vector<1>,
+             tls::vector<1>,
+             tls::pass,
+             tls::bounded_vector<4, DecodeLimit<&DecodeLimits::max_tree_nodes>>)
+};
+
+// Copies of a TreeKEMPublicKey share their nodes.  A node is only copied when
+// one of the trees holding it modifies it, so deriving a new tree from an old
+// one costs one pointer per node plus the nodes along the modified paths.
 struct TreeKEMPublicKey
 {
   CipherSuite suite;
-  std::vector<OptionalNode> nodes;
 
   explicit TreeKEMPublicKey(CipherSuite suite);
 
@@ -119,19 +381,58 @@ struct TreeKEMPublicKey
   TreeKEMPublicKey& operator=(TreeKEMPublicKey&& other) = default;
 
   LeafIndex add_leaf(const KeyPackage& kp);
+
+  // The placement policy is carried over to copies of the tree, but is not
+  // part of its encoding.  A null policy means LeftmostPlacement.
+  void leaf_placement(std::shared_ptr<const LeafPlacement> placement);
+
   void update_leaf(LeafIndex index, const KeyPackage& kp);
   void blank_path(LeafIndex index);
 
   void merge(LeafIndex from, const UpdatePath& path);
   void set_hash_all();
-  bytes root_hash() const;
+
+  // As above, but the subtrees below the top few levels of the tree are
+  // hashed as independent tasks
+  void set_hash_all(Executor& executor);
+  const inline_bytes<max_hash_size>& root_hash() const;
+
+  // The number of node hashes computed over the lifetime of this object,
+  // including those inherited by copying.  Only nodes whose subtrees changed
+  // since the last set_hash_all() are rehashed.
+  size_t hashes_computed() const;
+
   LeafCount size() const;
+
+  // Check that each non-blank parent node is covered by the parent hash of
+  // one of its children.  Nodes that pass are marked as verified, and the
+  // mark stays until the node or one of its children changes, so a later
+  // check, on this tree or a copy of it, only examines the nodes changed in
+  // between.
   bool parent_hash_valid() const;
 
+  // As above, but only for the parent nodes on the direct path of a leaf,
+  // e.g., the path just replaced by a merge()
+  bool parent_hash_valid(LeafIndex from) const;
+
+  // As parent_hash_valid(), but the unverified nodes are checked as
+  // independent tasks.  The marks are only set once all checks have run.
+  bool parent_hash_valid(Executor& executor) const;
+
+  // Leaf lookups are answered from an index that is brought up to date with
+  // any leaves changed since the previous lookup, so they do not scan the tree
   std::optional<LeafIndex> find(const KeyPackage& kp) const;
+
+  // The lowest leaf holding a basic credential with the given identity
+  std::optional<LeafIndex> find_identity(const bytes& identity) const;
+
   std::optional<KeyPackage> key_package(LeafIndex index) const;
   std::vector<NodeIndex> resolve(NodeIndex index) const;
 
+  // Whether a node is blank, answered from a bitmap kept beside the nodes so
+  // that tree walks do not have to visit the nodes themselves
+  bool blank(NodeIndex index) const { return _blank.at(index.val); }
+
   std::tuple<TreeKEMPrivateKey, UpdatePath> encap(
     LeafIndex from,
     const bytes& context,
@@ -139,25 +440,170 @@ struct TreeKEMPublicKey
     const SignaturePrivateKey& sig_priv,
     const std::optional<KeyPackageOpts>& opts);
 
+  // As above, but with the HPKE encryptions to the copath resolutions run on
+  // the given executor.  The order of node_secrets is the same as for the
+  // serial version.
+  std::tuple<TreeKEMPrivateKey, UpdatePath> encap(
+    LeafIndex from,
+    const bytes& context,
+    const bytes& leaf_secret,
+    const SignaturePrivateKey& sig_priv,
+    const std::optional<KeyPackageOpts>& opts,
+    Executor& executor);
+
+  // Derive the sender's side of an UpdatePath ahead of an encap().  The
+  // result of encap() is the same as if it had been given these inputs.
+  PreparedPath prepare_path(LeafIndex from,
+                            const bytes& leaf_secret,
+                            const SignaturePrivateKey& sig_priv,
+                            const std::optional<KeyPackageOpts>& opts) const;
+
+  // Encrypt a prepared path to the group, leaving only the HPKE encryptions
+  // to be done.  Throws InvalidParameterError if the path does not fit this
+  // tree.
+  std::tuple<TreeKEMPrivateKey, UpdatePath> encap(const PreparedPath& prepared,
+                                                  const bytes& context,
+                                                  Executor& executor);
+
   void truncate();
 
-  OptionalNode& node_at(NodeIndex n) { return nodes.at(n.val); }
-  const OptionalNode& node_at(NodeIndex n) const { return nodes.at(n.val); }
-  OptionalNode& node_at(LeafIndex n) { return nodes.at(NodeIndex(n).val); }
+  // The nodes of this tree that differ from those of another, along with any
+  // past the end of the other tree.  Nodes the trees share are not compared,
+  // so for a tree derived from the other, only the nodes written since the
+  // copy are examined.  Applying these to a copy of the other tree with
+  // resize() and set_node() reproduces this tree.
+  std::vector<NodeIndex> changed_nodes(const TreeKEMPublicKey& other) const;
+
+  // The diff that turns prev into this tree.  Both trees must be hashed.
+  TreeDiff diff(const TreeKEMPublicKey& prev) const;
+
+  // Apply a diff made against this tree, leaving the tree hashed.  Throws
+  // InvalidParameterError if the diff was made against a different tree, and
+  // ProtocolError if it is malformed or does not produce the tree it names;
+  // in either case the tree is left as it was.
+  void apply_diff(const TreeDiff& diff);
+
+  // Sets the number of nodes, adding blank nodes or dropping nodes at the end
+  void resize(NodeCount width);
+
+  // Replaces a node, clearing the hashes of the node and its ancestors
+  void set_node(NodeIndex index, OptionalNode node);
+
+  // The non-const accessors detach the node from any other tree sharing it
+  OptionalNode& node_at(NodeIndex n);
+
+  // As node_at(), but without marking the leaf index stale, for changes that
+  // do not affect how a leaf is indexed, such as setting its hash
+  OptionalNode& detach(NodeIndex n);
+  const OptionalNode& node_at(NodeIndex n) const { return *nodes.at(n.val); }
+  OptionalNode& node_at(LeafIndex n) { return node_at(NodeIndex(n)); }
   const OptionalNode& node_at(LeafIndex n) const
   {
-    return nodes.at(NodeIndex(n).val);
+    return node_at(NodeIndex(n));
   }
 
-  TLS_SERIALIZABLE(nodes)
-  TLS_TRAITS(tls::vector<4>)
+  friend tls::ostream& operator<<(tls::ostream& str,
+                                  const TreeKEMPublicKey& obj);
+  friend tls::istream& operator>>(tls::istream& str, TreeKEMPublicKey& obj);
+  friend size_t encoded_size(const TreeKEMPublicKey& obj);
+  friend bool operator==(const TreeKEMPublicKey& lhs,
+                         const TreeKEMPublicKey& rhs);
 
 private:
+  std::vector<std::shared_ptr<OptionalNode>> nodes;
+  size_t hash_count = 0;
+  std::shared_ptr<const LeafPlacement> _placement;
+
+  // One bit per node, set for blank nodes.  Bits are brought up to date
+  // wherever node hashes are cleared, i.e., along every path that changes.
+  std::vector<bool> _blank;
+
+  // The leaf index maps init keys and credential identities to leaves.  It is
+  // shared between copies like the nodes are.  Each tree records the leaves it
+  // has changed since its last lookup, and the index is copied only when a
+  // lookup needs to apply those changes to a shared index.  Copies of the tree
+  // take the lock on the source.
+  struct LeafIndexTable;
+  struct LeafIndexCache
+  {
+    mutable std::mutex mutex;
+    std::shared_ptr<LeafIndexTable> table;
+    std::vector<LeafIndex> stale;
+    bool rebuild = true;
+
+    LeafIndexCache() = default;
+    LeafIndexCache(const LeafIndexCache& other);
+    LeafIndexCache& operator=(const LeafIndexCache& other);
+  };
+  mutable LeafIndexCache _leaf_index;
+
+  void mark_stale(LeafIndex index);
+
+  // Apply the recorded leaf changes; the caller holds the cache lock
+  const LeafIndexTable& refresh_leaf_index() const;
+
+  // Resolutions are memoized per node and cleared along with the node
+  // hashes, so repeated resolutions during a commit reuse earlier work.
+  // Cached resolutions are shared between copies of the tree, and copies take
+  // the lock on the source.
+  struct ResolutionCache
+  {
+    mutable std::mutex mutex;
+    std::vector<std::shared_ptr<const std::vector<NodeIndex>>> entries;
+
+    ResolutionCache() = default;
+    ResolutionCache(const ResolutionCache& other);
+    ResolutionCache& operator=(const ResolutionCache& other);
+  };
+  mutable ResolutionCache _resolutions;
+
+  // The caller holds the resolution cache lock
+  const std::vector<NodeIndex>& resolve_cached(NodeIndex index) const;
+
+  // One bit per node, set for parent nodes whose parent hash has been
+  // verified.  Bits are cleared along with the node hashes.  Copies of the
+  // tree take the lock on the source.
+  struct ParentHashWatermark
+  {
+    mutable std::mutex mutex;
+    std::vector<bool> verified;
+
+    ParentHashWatermark() = default;
+    ParentHashWatermark(const ParentHashWatermark& other);
+    ParentHashWatermark& operator=(const ParentHashWatermark& other);
+  };
+  mutable ParentHashWatermark _parent_hashes;
+
+  // The caller holds the watermark lock
+  bool parent_hash_valid_at(NodeIndex index) const;
+
+  // Whether a child of a parent node is covered by its parent hash, without
+  // consulting or setting the marks
+  bool parent_hash_matches(NodeIndex index) const;
+
   void clear_hash_all();
   void clear_hash_path(LeafIndex index);
-  bytes get_hash(NodeIndex index);
+  void clear_hash(NodeIndex index);
+  // Hashes computed are added to count, so that disjoint subtrees can be
+  // hashed concurrently without sharing a counter
+  const inline_bytes<max_hash_size>& get_hash(NodeIndex index, size_t& count);
 
   friend struct TreeKEMPrivateKey;
 };
 
+tls::ostream&
+operator<<(tls::ostream& str, const TreeKEMPublicKey& obj);
+
+tls::istream&
+operator>>(tls::istream& str, TreeKEMPublicKey& obj);
+
+size_t
+encoded_size(const TreeKEMPublicKey& obj);
+
+bool
+operator==(const TreeKEMPublicKey& lhs, const TreeKEMPublicKey& rhs);
+
+bool
+operator!=(const TreeKEMPublicKey& lhs, const TreeKEMPublicKey& rhs);
+
 } // namespace mls
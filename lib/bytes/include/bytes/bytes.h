@@ -1,6 +1,11 @@
 #pragma once
 
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
 #include <iosfwd>
+#include <stdexcept>
 #include <string>
 #include <vector>
 
@@ -26,7 +31,220 @@ operator+(const bytes& lhs, const bytes& rhs);
 bytes
 operator^(const bytes& lhs, const bytes& rhs);
 
+// Concatenates its arguments with a single allocation, where a chain of
+// operator+ would allocate for each intermediate result
+template<typename... T>
+bytes
+concat(const T&... parts)
+{
+  bytes out;
+  out.reserve((size_t(0) + ... + parts.size()));
+  (out.insert(out.end(), parts.begin(), parts.end()), ...);
+  return out;
+}
+
 std::ostream&
 operator<<(std::ostream& out, const bytes& data);
 
+// Overwrites memory with zeros, in a way that the compiler cannot drop as a
+// dead store
+void
+secure_wipe(void* data, size_t size);
+
+// Overwrites data with zeros, including any capacity beyond its size left by
+// earlier shrinking, then empties it
+void
+zeroize(bytes& data);
+
+// A buffer for the temporaries of one message operation, drawn from a pool
+// kept per thread.  Its storage goes back to the pool on destruction instead
+// of being freed, so that steady-state operations on a thread do not contend
+// on the global allocator.  Since temporaries may hold secrets, the whole
+// capacity is zeroized before reuse.
+class scratch_buffer
+{
+public:
+  scratch_buffer();
+  ~scratch_buffer();
+
+  scratch_buffer(const scratch_buffer&) = delete;
+  scratch_buffer(scratch_buffer&&) = delete;
+  scratch_buffer& operator=(const scratch_buffer&) = delete;
+  scratch_buffer& operator=(scratch_buffer&&) = delete;
+
+  // Storage may be moved out and back, e.g., through a tls::ostream
+  bytes& data() { return _data; }
+  const bytes& data() const { return _data; }
+
+private:
+  bytes _data;
+};
+
+// A buffer for secrets that are kept and wiped together, e.g., the keys in a
+// ratchet's window.  Storage comes from a process-wide pool of pages that
+// are locked in memory where the platform allows it, so that secrets are not
+// written to swap.  If the limit on locked memory has been reached, the pool
+// goes on with unlocked pages.  Buffers are carved from the pages in
+// power-of-two size classes, so allocation does not go to the global
+// allocator, and the whole buffer is wiped in one pass when it is resized,
+// wiped, or destroyed, before its storage goes back to the pool.
+class secret_buffer
+{
+public:
+  secret_buffer() = default;
+  explicit secret_buffer(size_t size);
+  secret_buffer(const secret_buffer& other);
+  secret_buffer(secret_buffer&& other) noexcept;
+  secret_buffer& operator=(const secret_buffer& other);
+  secret_buffer& operator=(secret_buffer&& other) noexcept;
+  ~secret_buffer();
+
+  uint8_t* data() { return _data; }
+  const uint8_t* data() const { return _data; }
+  size_t size() const { return _size; }
+  size_t capacity() const { return _capacity; }
+
+  // Change the size, keeping the contents up to the new size.  Bytes past
+  // the old size are zero.
+  void resize(size_t size);
+
+  // Overwrite the contents with zeros, keeping the size
+  void wipe();
+
+  // The memory the pool has taken from the system, and how much of it is
+  // locked
+  struct PoolStats
+  {
+    size_t reserved = 0;
+    size_t locked = 0;
+  };
+  static PoolStats pool_stats();
+
+private:
+  uint8_t* _data = nullptr;
+  size_t _size = 0;
+  size_t _capacity = 0;
+
+  void release();
+};
+
+// At most N bytes, e.g., a hash or a secret, stored inline rather than on the
+// heap, so that structures holding many of them are copied without
+// allocating.  Converts to and from bytes.  Since the contents may be secret,
+// they are wiped when overwritten, shrunk, or destroyed.
+template<size_t N>
+class inline_bytes
+{
+  static_assert(N <= 0xff, "inline_bytes size must fit in a byte");
+
+public:
+  inline_bytes() = default;
+
+  // NOLINTNEXTLINE(google-explicit-constructor,hicpp-explicit-conversions)
+  inline_bytes(const bytes& data) { assign(data.data(), data.size()); }
+  inline_bytes(const uint8_t* data, size_t size) { assign(data, size); }
+
+  inline_bytes(const inline_bytes& other)
+  {
+    assign(other.data(), other.size());
+  }
+  inline_bytes& operator=(const inline_bytes& other)
+  {
+    if (this != &other) {
+      assign(other.data(), other.size());
+    }
+    return *this;
+  }
+
+  ~inline_bytes() { secure_wipe(_data.data(), _size); }
+
+  // NOLINTNEXTLINE(google-explicit-constructor,hicpp-explicit-conversions)
+  operator bytes() const { return bytes(begin(), end()); }
+
+  static constexpr size_t capacity() { return N; }
+  size_t size() const { return _size; }
+  bool empty() const { return _size == 0; }
+
+  uint8_t* data() { return _data.data(); }
+  const uint8_t* data() const { return _data.data(); }
+  uint8_t* begin() { return _data.data(); }
+  const uint8_t* begin() const { return _data.data(); }
+  uint8_t* end() { return _data.data() + _size; }
+  const uint8_t* end() const { return _data.data() + _size; }
+
+  // Change the size, up to N.  Bytes past the old size are zero.
+  void resize(size_t size)
+  {
+    check_size(size);
+    if (size < _size) {
+      secure_wipe(_data.data() + size, _size - size);
+    }
+    _size = static_cast<uint8_t>(size);
+  }
+
+  void clear() { resize(0); }
+
+private:
+  // Bytes past the size are always zero
+  std::array<uint8_t, N> _data = {};
+  uint8_t _size = 0;
+
+  static void check_size(size_t size)
+  {
+    if (size > N) {
+      throw std::length_error("Data too large for inline_bytes");
+    }
+  }
+
+  void assign(const uint8_t* data, size_t size)
+  {
+    check_size(size);
+    secure_wipe(_data.data(), _size);
+    std::copy(data, data + size, _data.data());
+    _size = static_cast<uint8_t>(size);
+  }
+};
+
+template<size_t N>
+bool
+operator==(const inline_bytes<N>& lhs, const inline_bytes<N>& rhs)
+{
+  return std::equal(lhs.begin(), lhs.end(), rhs.begin(), rhs.end());
+}
+
+template<size_t N>
+bool
+operator==(const inline_bytes<N>& lhs, const bytes& rhs)
+{
+  return std::equal(lhs.begin(), lhs.end(), rhs.begin(), rhs.end());
+}
+
+template<size_t N>
+bool
+operator==(const bytes& lhs, const inline_bytes<N>& rhs)
+{
+  return rhs == lhs;
+}
+
+template<size_t N>
+bool
+operator!=(const inline_bytes<N>& lhs, const inline_bytes<N>& rhs)
+{
+  return !(lhs == rhs);
+}
+
+template<size_t N>
+bool
+operator!=(const inline_bytes<N>& lhs, const bytes& rhs)
+{
+  return !(lhs == rhs);
+}
+
+template<size_t N>
+bool
+operator!=(const bytes& lhs, const inline_bytes<N>& rhs)
+{
+  return !(lhs == rhs);
+}
+
 } // namespace bytes_ns
@@ -1,9 +1,20 @@
 #include "bytes/bytes.h"
 
+#include <algorithm>
+#include <array>
+#include <cstring>
 #include <iomanip>
 #include <iostream>
+#include <mutex>
+#include <new>
 #include <sstream>
 #include <stdexcept>
+#include <tuple>
+#include <utility>
+
+#if !defined(_WIN32)
+#include <sys/mman.h>
+#endif
 
 namespace bytes_ns {
 
@@ -72,6 +83,311 @@ operator^(const bytes& lhs, const bytes& rhs)
   return out;
 }
 
+// Called through a volatile pointer, so that the call cannot be elided even
+// when the memory is about to be freed
+static void* (*const volatile wipe_memset)(void*, int, size_t) = std::memset;
+
+void
+secure_wipe(void* data, size_t size)
+{
+  if (size > 0) {
+    wipe_memset(data, 0, size);
+  }
+}
+
+void
+zeroize(bytes& data)
+{
+  // Growing within the capacity does not reallocate
+  data.resize(data.capacity());
+  secure_wipe(data.data(), data.size());
+  data.resize(0);
+}
+
+///
+/// scratch_buffer
+///
+
+// Bounds on what each thread keeps, so that one large message does not pin
+// its buffer for the life of the thread
+static constexpr size_t scratch_pool_buffers = 8;
+static constexpr size_t scratch_pool_max_capacity = 64 * 1024;
+
+static std::vector<bytes>&
+scratch_pool()
+{
+  static thread_local auto pool = std::vector<bytes>{};
+  return pool;
+}
+
+scratch_buffer::scratch_buffer()
+{
+  auto& pool = scratch_pool();
+  if (!pool.empty()) {
+    _data = std::move(pool.back());
+    pool.pop_back();
+  }
+}
+
+scratch_buffer::~scratch_buffer()
+{
+  // This covers the whole capacity, since the buffer may have shrunk in use
+  zeroize(_data);
+
+  auto& pool = scratch_pool();
+  if (pool.size() < scratch_pool_buffers &&
+      _data.capacity() <= scratch_pool_max_capacity) {
+    pool.push_back(std::move(_data));
+  }
+}
+
+///
+/// secret_buffer
+///
+
+// Pages are taken from the system in chunks, and buffers up to the chunk
+// size are carved from them in power-of-two classes.  Larger buffers get
+// chunks of their own.  Freed buffers are kept on a list for their class,
+// already wiped.  Chunks are not returned to the system, except the large
+// ones.
+static constexpr size_t secret_chunk_size = 64 * 1024;
+static constexpr size_t secret_min_class = 64;
+static constexpr size_t secret_class_count = 11; // 64 B to 64 KiB
+
+static size_t
+secret_class(size_t size)
+{
+  auto index = size_t(0);
+  auto capacity = secret_min_class;
+  while (capacity < size) {
+    capacity *= 2;
+    index += 1;
+  }
+  return index;
+}
+
+static size_t
+secret_class_size(size_t index)
+{
+  return secret_min_class << index;
+}
+
+struct SecretPool
+{
+  std::mutex mutex;
+  std::array<std::vector<uint8_t*>, secret_class_count> free;
+
+  // The chunk being carved into new buffers
+  uint8_t* chunk = nullptr;
+  size_t chunk_used = secret_chunk_size;
+
+  secret_buffer::PoolStats stats;
+
+  static SecretPool& get()
+  {
+    // Never destroyed, since buffers may outlive static destruction
+    static auto* pool = new SecretPool();
+    return *pool;
+  }
+
+  // Map pages and try to lock them.  Locking fails once the process reaches
+  // its limit, e.g., RLIMIT_MEMLOCK, in which case the pages are used as
+  // they are.
+  uint8_t* map(size_t size)
+  {
+#if !defined(_WIN32)
+    auto* data = ::mmap(nullptr,
+                        size,
+                        PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS,
+                        -1,
+                        0);
+    if (data == MAP_FAILED) {
+      throw std::bad_alloc();
+    }
+
+#if defined(MADV_DONTDUMP)
+    ::madvise(data, size, MADV_DONTDUMP);
+#endif
+
+    stats.reserved += size;
+    if (::mlock(data, size) == 0) {
+      stats.locked += size;
+    }
+    return static_cast<uint8_t*>(data);
+#else
+    auto* data = new uint8_t[size]();
+    stats.reserved += size;
+    return data;
+#endif
+  }
+
+  void unmap(uint8_t* data, size_t size)
+  {
+#if !defined(_WIN32)
+    stats.reserved -= size;
+    if (::munlock(data, size) == 0) {
+      stats.locked -= std::min(stats.locked, size);
+    }
+    ::munmap(data, size);
+#else
+    stats.reserved -= size;
+    delete[] data;
+#endif
+  }
+
+  std::tuple<uint8_t*, size_t> allocate(size_t size)
+  {
+    const auto lock = std::lock_guard(mutex);
+    if (size > secret_chunk_size) {
+      return { map(size), size };
+    }
+
+    const auto index = secret_class(size);
+    const auto capacity = secret_class_size(index);
+    auto& list = free.at(index);
+    if (!list.empty()) {
+      auto* data = list.back();
+      list.pop_back();
+      return { data, capacity };
+    }
+
+    // Blocks of a class are aligned to their size within the chunk, which
+    // the tail of the current chunk may not fit
+    const auto offset = (chunk_used + capacity - 1) / capacity * capacity;
+    if (offset + capacity > secret_chunk_size) {
+      chunk = map(secret_chunk_size);
+      chunk_used = 0;
+    } else {
+      chunk_used = offset;
+    }
+
+    auto* data = chunk + chunk_used;
+    chunk_used += capacity;
+    return { data, capacity };
+  }
+
+  // The buffer must already be wiped
+  void release(uint8_t* data, size_t capacity)
+  {
+    const auto lock = std::lock_guard(mutex);
+    if (capacity > secret_chunk_size) {
+      unmap(data, capacity);
+      return;
+    }
+
+    free.at(secret_class(capacity)).push_back(data);
+  }
+};
+
+secret_buffer::secret_buffer(size_t size)
+{
+  resize(size);
+}
+
+secret_buffer::secret_buffer(const secret_buffer& other)
+{
+  *this = other;
+}
+
+secret_buffer::secret_buffer(secret_buffer&& other) noexcept
+  : _data(std::exchange(other._data, nullptr))
+  , _size(std::exchange(other._size, 0))
+  , _capacity(std::exchange(other._capacity, 0))
+{}
+
+secret_buffer&
+secret_buffer::operator=(const secret_buffer& other)
+{
+  if (this == &other) {
+    return *this;
+  }
+
+  if (_capacity < other._size) {
+    release();
+    std::tie(_data, _capacity) = SecretPool::get().allocate(other._size);
+  } else if (_size > other._size) {
+    secure_wipe(_data + other._size, _size - other._size);
+  }
+
+  if (other._size > 0) {
+    std::memcpy(_data, other._data, other._size);
+  }
+  _size = other._size;
+  return *this;
+}
+
+secret_buffer&
+secret_buffer::operator=(secret_buffer&& other) noexcept
+{
+  if (this != &other) {
+    release();
+    _data = std::exchange(other._data, nullptr);
+    _size = std::exchange(other._size, 0);
+    _capacity = std::exchange(other._capacity, 0);
+  }
+  return *this;
+}
+
+secret_buffer::~secret_buffer()
+{
+  release();
+}
+
+void
+secret_buffer::resize(size_t size)
+{
+  if (size <= _capacity) {
+    if (size < _size) {
+      secure_wipe(_data + size, _size - size);
+    }
+    _size = size;
+    return;
+  }
+
+  // Grow into the next size class, or at least double, so that a buffer
+  // grown a step at a time is copied a logarithmic number of times
+  auto [data, capacity] =
+    SecretPool::get().allocate(std::max(size, 2 * _capacity));
+  if (_size > 0) {
+    std::memcpy(data, _data, _size);
+  }
+  release();
+
+  _data = data;
+  _capacity = capacity;
+  _size = size;
+}
+
+void
+secret_buffer::wipe()
+{
+  secure_wipe(_data, _size);
+}
+
+void
+secret_buffer::release()
+{
+  if (_data == nullptr) {
+    return;
+  }
+
+  // The whole capacity is wiped, since pooled blocks come back zeroed
+  secure_wipe(_data, _capacity);
+  SecretPool::get().release(_data, _capacity);
+  _data = nullptr;
+  _size = 0;
+  _capacity = 0;
+}
+
+secret_buffer::PoolStats
+secret_buffer::pool_stats()
+{
+  auto& pool = SecretPool::get();
+  const auto lock = std::lock_guard(pool.mutex);
+  return pool.stats;
+}
+
 std::ostream&
 operator<<(std::ostream& out, const bytes& data)
 {
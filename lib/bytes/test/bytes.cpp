@@ -0,0 +1,180 @@
+#include <bytes/bytes.h>
+#include <doctest/doctest.h>
+
+#include <algorithm>
+#include <cstring>
+
+using namespace bytes_ns;
+
+static void
+fill(secret_buffer& buffer, uint8_t value)
+{
+  std::memset(buffer.data(), value, buffer.size());
+}
+
+static bool
+all_equal(const uint8_t* data, size_t size, uint8_t value)
+{
+  return std::all_of(
+    data, data + size, [value](uint8_t byte) { return byte == value; });
+}
+
+static bool
+all_equal(const secret_buffer& buffer, uint8_t value)
+{
+  return all_equal(buffer.data(), buffer.size(), value);
+}
+
+TEST_CASE("Secret Buffer Resize")
+{
+  auto buffer = secret_buffer(10);
+  REQUIRE(buffer.size() == 10);
+  REQUIRE(buffer.capacity() == 64);
+  REQUIRE(all_equal(buffer, 0));
+  fill(buffer, 0xa5);
+
+  // Within the size class, the storage stays where it is, and bytes that
+  // come back into view after a shrink are zero
+  const auto* data = buffer.data();
+  buffer.resize(4);
+  REQUIRE(buffer.data() == data);
+  REQUIRE(all_equal(buffer, 0xa5));
+
+  buffer.resize(64);
+  REQUIRE(buffer.data() == data);
+  REQUIRE(buffer.capacity() == 64);
+  REQUIRE(all_equal(buffer.data(), 4, 0xa5));
+  REQUIRE(all_equal(buffer.data() + 4, 60, 0));
+
+  // Across size classes, the contents move to a larger block and the rest of
+  // it is zero
+  buffer.resize(100);
+  REQUIRE(buffer.size() == 100);
+  REQUIRE(buffer.capacity() == 128);
+  REQUIRE(all_equal(buffer.data(), 4, 0xa5));
+  REQUIRE(all_equal(buffer.data() + 4, 96, 0));
+
+  // Growing a step at a time at least doubles the capacity
+  buffer.resize(129);
+  REQUIRE(buffer.capacity() == 256);
+
+  // Wiping keeps the size
+  fill(buffer, 0x5a);
+  buffer.wipe();
+  REQUIRE(buffer.size() == 129);
+  REQUIRE(all_equal(buffer, 0));
+
+  buffer.resize(0);
+  REQUIRE(buffer.size() == 0);
+  REQUIRE(buffer.capacity() == 256);
+}
+
+TEST_CASE("Secret Buffer Reuse")
+{
+  // A released block goes back to its size class, wiped
+  const uint8_t* data = nullptr;
+  {
+    auto buffer = secret_buffer(32);
+    fill(buffer, 0xff);
+    data = buffer.data();
+  }
+
+  auto buffer = secret_buffer(64);
+  REQUIRE(buffer.data() == data);
+  REQUIRE(all_equal(buffer, 0));
+}
+
+TEST_CASE("Secret Buffer Copy and Move")
+{
+  auto original = secret_buffer(40);
+  fill(original, 0x11);
+
+  // A copy has its own storage
+  auto copy = original;
+  REQUIRE(copy.size() == original.size());
+  REQUIRE(copy.data() != original.data());
+  REQUIRE(all_equal(copy, 0x11));
+
+  // Assigning a shorter buffer keeps the storage, and wipes what is left of
+  // the longer contents
+  auto target = secret_buffer(60);
+  fill(target, 0x22);
+  const auto* target_data = target.data();
+  target = original;
+  REQUIRE(target.data() == target_data);
+  REQUIRE(target.size() == 40);
+  REQUIRE(all_equal(target, 0x11));
+  target.resize(60);
+  REQUIRE(all_equal(target.data() + 40, 20, 0));
+
+  // Assigning a longer buffer than the capacity allows moves to a new block
+  auto small = secret_buffer(8);
+  auto large = secret_buffer(200);
+  fill(large, 0x33);
+  small = large;
+  REQUIRE(small.size() == 200);
+  REQUIRE(small.capacity() >= 200);
+  REQUIRE(all_equal(small, 0x33));
+
+  // Self-assignment leaves the contents alone
+  const auto& alias = small;
+  small = alias;
+  REQUIRE(small.size() == 200);
+  REQUIRE(all_equal(small, 0x33));
+
+  // Moving takes the storage and leaves the source empty
+  const auto* original_data = original.data();
+  auto moved = std::move(original);
+  REQUIRE(moved.data() == original_data);
+  REQUIRE(moved.size() == 40);
+  REQUIRE(all_equal(moved, 0x11));
+
+  // NOLINTBEGIN(bugprone-use-after-move,hicpp-invalid-access-moved)
+  REQUIRE(original.data() == nullptr);
+  REQUIRE(original.size() == 0);
+  REQUIRE(original.capacity() == 0);
+  // NOLINTEND(bugprone-use-after-move,hicpp-invalid-access-moved)
+
+  copy = std::move(moved);
+  REQUIRE(copy.data() == original_data);
+  REQUIRE(all_equal(copy, 0x11));
+}
+
+TEST_CASE("Secret Buffer Larger than a Chunk")
+{
+  const auto chunk_size = size_t(64 * 1024);
+  const auto before = secret_buffer::pool_stats();
+
+  {
+    // A buffer beyond the largest class gets pages of its own, of exactly
+    // the size asked for
+    auto buffer = secret_buffer(chunk_size + 1);
+    REQUIRE(buffer.capacity() == chunk_size + 1);
+    REQUIRE(all_equal(buffer, 0));
+    fill(buffer, 0x44);
+
+    auto during = secret_buffer::pool_stats();
+    REQUIRE(during.reserved == before.reserved + chunk_size + 1);
+
+    // Growing it copies the contents into a new mapping
+    buffer.resize(3 * chunk_size);
+    REQUIRE(buffer.capacity() == 3 * chunk_size);
+    REQUIRE(all_equal(buffer.data(), chunk_size + 1, 0x44));
+    REQUIRE(all_equal(buffer.data() + chunk_size + 1, 2 * chunk_size - 1, 0));
+
+    during = secret_buffer::pool_stats();
+    REQUIRE(during.reserved == before.reserved + 3 * chunk_size);
+  }
+
+  // ... and its pages go back to the system when it is released
+  const auto after = secret_buffer::pool_stats();
+  REQUIRE(after.reserved == before.reserved);
+}
+
+TEST_CASE("Secret Buffer Pool Stats")
+{
+  auto buffer = secret_buffer(16);
+  const auto stats = secret_buffer::pool_stats();
+  REQUIRE(stats.reserved >= 64 * 1024);
+  REQUIRE(stats.locked <= stats.reserved);
+}
@@ -24,6 +24,24 @@ struct Digest
   bytes hash(const bytes& data) const;
   bytes hmac(const bytes& key, const bytes& data) const;
 
+  // An incremental hash or HMAC computation.  finalize() returns the output
+  // and resets the context to its starting state, still keyed in the HMAC
+  // case, so that one keyed context can be used for many computations.
+  // copy() clones the current state, e.g., to fork a common prefix.  A
+  // Context is not safe for concurrent use.
+  struct Context
+  {
+    virtual ~Context() = default;
+    virtual void update(const uint8_t* data, size_t size) = 0;
+    virtual bytes finalize() = 0;
+    virtual std::unique_ptr<Context> copy() const = 0;
+
+    void update(const bytes& data) { update(data.data(), data.size()); }
+  };
+
+  std::unique_ptr<Context> hash_context() const;
+  std::unique_ptr<Context> hmac_context(const bytes& key) const;
+
   size_t hash_size() const;
 
 private:
@@ -1,7 +1,9 @@
 #pragma once
 
+#include <initializer_list>
 #include <memory>
 #include <optional>
+#include <vector>
 
 #include <bytes/bytes.h>
 using namespace bytes_ns;
@@ -59,6 +61,16 @@ struct KEM
                            const PublicKey& pkS,
                            const PrivateKey& skR) const;
 
+  // Ephemeral key pairs for encap() can be generated ahead of time, e.g., on
+  // an idle or background thread, so that encap() only pays for the DH and
+  // the KDF.  Each pooled key pair is removed from the pool by the encap that
+  // uses it, so none is used twice; when the pool is empty, encap generates a
+  // fresh key pair as usual.  Filling is safe concurrently with encap.  KEMs
+  // without a pool ignore these calls.
+  virtual void fill_ephemeral_pool(size_t size) const;
+  virtual size_t ephemeral_pool_size() const;
+  virtual void clear_ephemeral_pool() const;
+
   virtual size_t secret_size() const = 0;
   virtual size_t enc_size() const = 0;
   virtual size_t pk_size() const = 0;
@@ -91,6 +103,31 @@ struct KDF
 
   virtual size_t hash_size() const = 0;
 
+  // An Expander holds a PRK that has already been keyed into the PRF, so that
+  // many outputs can be expanded from it with only the info changing.  Output
+  // is written into a caller-provided buffer, filling it to its current size.
+  // An Expander is not safe for concurrent use.
+  struct Expander
+  {
+    virtual ~Expander() = default;
+    virtual void expand(const bytes& info, uint8_t* out, size_t size) = 0;
+
+    void expand(const bytes& info, bytes& out)
+    {
+      expand(info, out.data(), out.size());
+    }
+  };
+
+  virtual std::unique_ptr<Expander> expander(const bytes& prk) const = 0;
+
+  // As extract() and expand(), but with the input given in pieces that are
+  // fed to the PRF in order, instead of being concatenated first
+  using Pieces = std::initializer_list<const bytes*>;
+  virtual bytes extract_pieces(const bytes& salt, Pieces ikm) const = 0;
+  virtual bytes expand_pieces(const bytes& prk,
+                              Pieces info,
+                              size_t size) const = 0;
+
   bytes labeled_extract(const bytes& suite_id,
                         const bytes& salt,
                         const bytes& label,
@@ -101,6 +138,20 @@ struct KDF
                        const bytes& info,
                        size_t size) const;
 
+  // The labeled functions above start every input with "HPKE-05 " ||
+  // suite_id.  Holders of a fixed suite_id can compute that prefix once and
+  // use the variants below, which take it directly.
+  static bytes label_prefix(const bytes& suite_id);
+  bytes prefixed_extract(const bytes& prefix,
+                         const bytes& salt,
+                         const bytes& label,
+                         const bytes& ikm) const;
+  bytes prefixed_expand(const bytes& prefix,
+                        const bytes& prk,
+                        const bytes& label,
+                        const bytes& info,
+                        size_t size) const;
+
 protected:
   KDF(ID id_in);
 };
@@ -121,6 +172,39 @@ struct AEAD
 
   const ID id;
 
+  // A Context holds a key that has already been scheduled, so that many
+  // messages can be protected under the same key with only the nonce changing.
+  // A Context is not safe for concurrent use.
+  struct Context
+  {
+    virtual ~Context() = default;
+    virtual bytes seal(const bytes& nonce,
+                       const bytes& aad,
+                       const bytes& pt) = 0;
+    virtual std::optional<bytes> open(const bytes& nonce,
+                                      const bytes& aad,
+                                      const bytes& ct) = 0;
+
+    // Writes pt_size bytes of ciphertext followed by the tag to ct.  The
+    // output may be the same buffer as the input, to seal in place.
+    virtual void seal_into(const bytes& nonce,
+                           const bytes& aad,
+                           const uint8_t* pt,
+                           size_t pt_size,
+                           uint8_t* ct) = 0;
+
+    // Writes the ct_size - tag_size() bytes of plaintext to pt, returning
+    // false if authentication fails.  The output may be the same buffer as
+    // the input, to open in place.
+    virtual bool open_into(const bytes& nonce,
+                           const bytes& aad,
+                           const uint8_t* ct,
+                           size_t ct_size,
+                           uint8_t* pt) = 0;
+  };
+
+  virtual std::unique_ptr<Context> context(const bytes& key) const = 0;
+
   virtual bytes seal(const bytes& key,
                      const bytes& nonce,
                      const bytes& aad,
@@ -130,8 +214,46 @@ struct AEAD
                                     const bytes& aad,
                                     const bytes& ct) const = 0;
 
+  // One-shot version of Context::seal_into()
+  void seal_into(const bytes& key,
+                 const bytes& nonce,
+                 const bytes& aad,
+                 const uint8_t* pt,
+                 size_t pt_size,
+                 uint8_t* ct) const;
+
+  // One-shot version of Context::open_into()
+  bool open_into(const bytes& key,
+                 const bytes& nonce,
+                 const bytes& aad,
+                 const uint8_t* ct,
+                 size_t ct_size,
+                 uint8_t* pt) const;
+
+  // One message of a batch.  The input and output are as for seal_into() or
+  // open_into(), and may be the same buffer.
+  struct BatchItem
+  {
+    const bytes& key;
+    const bytes& nonce;
+    const bytes& aad;
+    const uint8_t* input;
+    size_t input_size;
+    uint8_t* output;
+  };
+
+  // Seal or open many independent messages in one call.  The default
+  // implementations process the items in order, scheduling each key once for
+  // a run of items that share it.  Implementations with multi-buffer kernels
+  // can override these to interleave the items.  open_batch() reports for
+  // each item whether it authenticated.
+  virtual void seal_batch(const std::vector<BatchItem>& items) const;
+  virtual std::vector<bool> open_batch(
+    const std::vector<BatchItem>& items) const;
+
   virtual size_t key_size() const = 0;
   virtual size_t nonce_size() const = 0;
+  virtual size_t tag_size() const = 0;
 
 protected:
   AEAD(ID id_in);
@@ -139,6 +261,9 @@ protected:
 
 struct Context
 {
+  Context(const Context& other);
+  Context(Context&& other) = default;
+
   bytes do_export(const bytes& exporter_context, size_t size) const;
 
 protected:
@@ -148,6 +273,7 @@ protected:
   bytes exporter_secret;
   const KDF& kdf;
   const AEAD& aead;
+  std::unique_ptr<AEAD::Context> aead_ctx;
 
   bytes current_nonce() const;
   void increment_seq();
@@ -233,6 +359,8 @@ struct HPKE
   const AEAD& aead;
 
 private:
+  bytes label_prefix;
+
   static bool verify_psk_inputs(Mode mode,
                                 const bytes& psk,
                                 const bytes& psk_id);
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <memory>
+
+#include <hpke/hpke.h>
+#include <hpke/signature.h>
+
+namespace hpke {
+
+// A Provider supplies alternative implementations of some primitives, e.g.,
+// ones tuned for particular CPU features or backed by a hardware device.
+// Each get() for a primitive asks the installed providers in turn, most
+// recently installed first, and falls back to the built-in OpenSSL
+// implementation if none of them supplies it.
+//
+// Providers should be installed at startup, before the primitives they
+// replace are first used.  Objects that already hold a primitive, such as an
+// HPKE instance, keep the implementation they were constructed with.
+struct Provider
+{
+  virtual ~Provider() = default;
+
+  // Whether the provider can run on this machine, e.g., whether the CPU has
+  // the instructions it relies on.  This is checked once, by install().
+  virtual bool available() const;
+
+  // Each of these returns nullptr if the provider does not implement the
+  // requested primitive.  A returned primitive must have the requested ID.
+  virtual const KEM* kem(KEM::ID id) const;
+  virtual const KDF* kdf(KDF::ID id) const;
+  virtual const AEAD* aead(AEAD::ID id) const;
+  virtual const Signature* signature(Signature::ID id) const;
+
+  // Installs a provider ahead of those already installed.  If the provider
+  // is not available, nothing is installed and false is returned.
+  static bool install(std::shared_ptr<const Provider> provider);
+
+  // Stops consulting installed providers, so that get() returns the built-in
+  // implementations again.  Providers are kept alive for the life of the
+  // process, so primitives already handed out remain valid.
+  static void reset();
+};
+
+} // namespace hpke
@@ -8,4 +8,8 @@ namespace hpke {
 bytes
 random_bytes(size_t size);
 
+// Fills size bytes at out with random data, without allocating
+void
+random_bytes(uint8_t* out, size_t size);
+
 } // namespace hpke
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <memory>
+#include <vector>
 
 #include <bytes/bytes.h>
 using namespace bytes_ns;
@@ -52,6 +53,19 @@ struct Signature
                       const bytes& sig,
                       const PublicKey& pk) const = 0;
 
+  // Verify many signatures at once, returning one result per item in the
+  // same order.  The default implementation verifies each item in turn; a
+  // Provider with a true batch verification can override it.
+  struct VerifyItem
+  {
+    const bytes& data;
+    const bytes& sig;
+    const PublicKey& pk;
+  };
+
+  virtual std::vector<bool> verify_batch(
+    const std::vector<VerifyItem>& items) const;
+
 protected:
   Signature(ID id_in);
 };
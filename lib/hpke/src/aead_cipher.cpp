@@ -1,6 +1,7 @@
 #include "aead_cipher.h"
 #include "openssl_common.h"
 
+#include <openssl/crypto.h>
 #include <openssl/evp.h>
 
 namespace hpke {
@@ -110,103 +111,183 @@ AEADCipher::AEADCipher(AEAD::ID id_in)
   : AEAD(id_in)
   , nk(cipher_key_size(id))
   , nn(cipher_nonce_size(id))
-  , tag_size(cipher_tag_size(id))
+  , nt(cipher_tag_size(id))
 {}
 
-bytes
-AEADCipher::seal(const bytes& key,
-                 const bytes& nonce,
-                 const bytes& aad,
-                 const bytes& pt) const
+struct AEADCipher::CipherContext : public AEAD::Context
 {
-  auto ctx = make_typed_unique(EVP_CIPHER_CTX_new());
-  if (ctx == nullptr) {
-    throw openssl_error();
+  CipherContext(AEAD::ID id, const bytes& key_in, size_t tag_size_in)
+    : tag_size(tag_size_in)
+    , cipher(openssl_cipher(id))
+    , key(key_in)
+    , enc_ctx(nullptr, typed_delete<EVP_CIPHER_CTX>)
+    , dec_ctx(nullptr, typed_delete<EVP_CIPHER_CTX>)
+  {
   }
 
-  const auto* cipher = openssl_cipher(id);
-  if (1 != EVP_EncryptInit(ctx.get(), cipher, key.data(), nonce.data())) {
-    throw openssl_error();
+  CipherContext(const CipherContext&) = delete;
+  CipherContext& operator=(const CipherContext&) = delete;
+
+  ~CipherContext() override { OPENSSL_cleanse(key.data(), key.size()); }
+
+  bytes seal(const bytes& nonce, const bytes& aad, const bytes& pt) override
+  {
+    bytes ct(pt.size() + tag_size);
+    seal_into(nonce, aad, pt.data(), pt.size(), ct.data());
+    return ct;
   }
 
-  int outlen = 0;
-  if (!aad.empty()) {
-    if (1 != EVP_EncryptUpdate(
-               ctx.get(), nullptr, &outlen, aad.data(), aad.size())) {
+  void seal_into(const bytes& nonce,
+                 const bytes& aad,
+                 const uint8_t* pt,
+                 size_t pt_size,
+                 uint8_t* ct) override
+  {
+    auto* ctx = direction(enc_ctx, 1);
+    if (1 != EVP_EncryptInit_ex(ctx, nullptr, nullptr, nullptr, nonce.data())) {
       throw openssl_error();
     }
-  }
 
-  bytes ct(pt.size());
-  if (1 !=
-      EVP_EncryptUpdate(ctx.get(), ct.data(), &outlen, pt.data(), pt.size())) {
-    throw openssl_error();
-  }
+    int outlen = 0;
+    if (!aad.empty()) {
+      if (1 != EVP_EncryptUpdate(ctx, nullptr, &outlen, aad.data(), aad.size())) {
+        throw openssl_error();
+      }
+    }
 
-  // Providing nullptr as an argument is safe here because this
-  // function never writes with GCM; it only computes the tag
-  if (1 != EVP_EncryptFinal(ctx.get(), nullptr, &outlen)) {
-    throw openssl_error();
-  }
+    // OpenSSL supports exactly overlapping input and output
+    if (1 != EVP_EncryptUpdate(ctx, ct, &outlen, pt, pt_size)) {
+      throw openssl_error();
+    }
 
-  bytes tag(tag_size);
-  if (1 != EVP_CIPHER_CTX_ctrl(
-             ctx.get(), EVP_CTRL_GCM_GET_TAG, tag_size, tag.data())) {
-    throw openssl_error();
+    // Providing nullptr as an argument is safe here because this
+    // function never writes with GCM; it only computes the tag
+    if (1 != EVP_EncryptFinal_ex(ctx, nullptr, &outlen)) {
+      throw openssl_error();
+    }
+
+    auto* tag = ct + pt_size;
+    if (1 != EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, tag_size, tag)) {
+      throw openssl_error();
+    }
   }
 
-  ct.insert(ct.end(), tag.begin(), tag.end());
-  return ct;
-}
+  std::optional<bytes> open(const bytes& nonce,
+                            const bytes& aad,
+                            const bytes& ct) override
+  {
+    if (ct.size() < tag_size) {
+      throw std::runtime_error("AEAD ciphertext smaller than tag size");
+    }
 
-std::optional<bytes>
-AEADCipher::open(const bytes& key,
-                 const bytes& nonce,
-                 const bytes& aad,
-                 const bytes& ct) const
-{
-  if (ct.size() < tag_size) {
-    throw std::runtime_error("AEAD ciphertext smaller than tag size");
-  }
+    bytes pt(ct.size() - tag_size);
+    if (!open_into(nonce, aad, ct.data(), ct.size(), pt.data())) {
+      throw std::runtime_error("AEAD authentication failure");
+    }
 
-  auto ctx = make_typed_unique(EVP_CIPHER_CTX_new());
-  if (ctx == nullptr) {
-    throw openssl_error();
+    return pt;
   }
 
-  const auto* cipher = openssl_cipher(id);
-  if (1 != EVP_DecryptInit(ctx.get(), cipher, key.data(), nonce.data())) {
-    throw openssl_error();
-  }
+  bool open_into(const bytes& nonce,
+                 const bytes& aad,
+                 const uint8_t* ct,
+                 size_t ct_size,
+                 uint8_t* pt) override
+  {
+    if (ct_size < tag_size) {
+      throw std::runtime_error("AEAD ciphertext smaller than tag size");
+    }
 
-  auto inner_ct_size = ct.size() - tag_size;
-  auto tag = bytes(ct.begin() + inner_ct_size, ct.end());
-  if (1 != EVP_CIPHER_CTX_ctrl(
-             ctx.get(), EVP_CTRL_GCM_SET_TAG, tag_size, tag.data())) {
-    throw openssl_error();
-  }
+    auto* ctx = direction(dec_ctx, 0);
+    if (1 != EVP_DecryptInit_ex(ctx, nullptr, nullptr, nullptr, nonce.data())) {
+      throw openssl_error();
+    }
 
-  int out_size = 0;
-  if (!aad.empty()) {
-    if (1 != EVP_DecryptUpdate(
-               ctx.get(), nullptr, &out_size, aad.data(), aad.size())) {
+    // The tag is copied out first, since decrypting in place may overwrite
+    // the buffer it came from
+    auto inner_ct_size = ct_size - tag_size;
+    auto tag = bytes(ct + inner_ct_size, ct + ct_size);
+    if (1 !=
+        EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, tag_size, tag.data())) {
       throw openssl_error();
     }
+
+    int out_size = 0;
+    if (!aad.empty()) {
+      if (1 !=
+          EVP_DecryptUpdate(ctx, nullptr, &out_size, aad.data(), aad.size())) {
+        throw openssl_error();
+      }
+    }
+
+    // OpenSSL supports exactly overlapping input and output
+    if (1 != EVP_DecryptUpdate(ctx, pt, &out_size, ct, inner_ct_size)) {
+      throw openssl_error();
+    }
+
+    // Providing nullptr as an argument is safe here because this
+    // function never writes with GCM; it only verifies the tag
+    return 1 == EVP_DecryptFinal_ex(ctx, nullptr, &out_size);
   }
 
-  bytes pt(inner_ct_size);
-  if (1 != EVP_DecryptUpdate(
-             ctx.get(), pt.data(), &out_size, ct.data(), inner_ct_size)) {
-    throw openssl_error();
+private:
+  const size_t tag_size;
+  const EVP_CIPHER* cipher;
+  bytes key;
+  typed_unique_ptr<EVP_CIPHER_CTX> enc_ctx;
+  typed_unique_ptr<EVP_CIPHER_CTX> dec_ctx;
+
+  // The key schedule for each direction is run the first time that
+  // direction is used, since most contexts, including those behind the
+  // one-shot seal() and open(), are only used in one.  Each message then only
+  // re-initializes the nonce.
+  EVP_CIPHER_CTX* direction(typed_unique_ptr<EVP_CIPHER_CTX>& ctx, int enc)
+  {
+    if (ctx != nullptr) {
+      return ctx.get();
+    }
+
+    auto fresh = make_typed_unique(EVP_CIPHER_CTX_new());
+    if (fresh == nullptr) {
+      throw openssl_error();
+    }
+
+    if (1 != EVP_CipherInit_ex(
+               fresh.get(), cipher, nullptr, key.data(), nullptr, enc)) {
+      throw openssl_error();
+    }
+
+    ctx = std::move(fresh);
+    return ctx.get();
   }
+};
 
-  // Providing nullptr as an argument is safe here because this
-  // function never writes with GCM; it only verifies the tag
-  if (1 != EVP_DecryptFinal(ctx.get(), nullptr, &out_size)) {
-    throw std::runtime_error("AEAD authentication failure");
+std::unique_ptr<AEAD::Context>
+AEADCipher::context(const bytes& key) const
+{
+  if (key.size() != nk) {
+    throw std::runtime_error("Incorrect AEAD key size");
   }
 
-  return pt;
+  return std::make_unique<CipherContext>(id, key, nt);
+}
+
+bytes
+AEADCipher::seal(const bytes& key,
+                 const bytes& nonce,
+                 const bytes& aad,
+                 const bytes& pt) const
+{
+  return context(key)->seal(nonce, aad, pt);
+}
+
+std::optional<bytes>
+AEADCipher::open(const bytes& key,
+                 const bytes& nonce,
+                 const bytes& aad,
+                 const bytes& ct) const
+{
+  return context(key)->open(nonce, aad, ct);
 }
 
 size_t
@@ -221,4 +302,10 @@ AEADCipher::nonce_size() const
   return nn;
 }
 
+size_t
+AEADCipher::tag_size() const
+{
+  return nt;
+}
+
 } // namespace hpke
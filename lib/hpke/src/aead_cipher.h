@@ -11,6 +11,8 @@ struct AEADCipher : public AEAD
 
   ~AEADCipher() override = default;
 
+  std::unique_ptr<Context> context(const bytes& key) const override;
+
   bytes seal(const bytes& key,
              const bytes& nonce,
              const bytes& aad,
@@ -22,11 +24,14 @@ struct AEADCipher : public AEAD
 
   size_t key_size() const override;
   size_t nonce_size() const override;
+  size_t tag_size() const override;
 
 private:
+  struct CipherContext;
+
   const size_t nk;
   const size_t nn;
-  const size_t tag_size;
+  const size_t nt;
 
   AEADCipher(AEAD::ID id_in);
   friend AEADCipher make_aead(AEAD::ID cipher_in);
@@ -2,9 +2,24 @@
 
 #include <hpke/hpke.h>
 
+#include <functional>
+
 namespace hpke {
 
 bytes
 i2osp(uint64_t val, size_t size);
 
+// The number of forks that led to this process.  State that a parent and
+// child must not share, such as pooled random values or keys, is stamped
+// with it and discarded when it changes.
+uint64_t
+fork_generation();
+
+// The implementation of a primitive that get() hands out: the one from the
+// first installed Provider that supplies it, or else the built-in one.
+// Instantiated for KEM, KDF, AEAD, and Signature.
+template<typename T>
+const T&
+select_primitive(typename T::ID id, const T& builtin);
+
 } // namespace hpke
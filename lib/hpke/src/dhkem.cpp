@@ -89,9 +89,11 @@ DHKEM::DHKEM(KEM::ID kem_id_in, const Group& group_in, const KDF& kdf_in)
   : KEM(kem_id_in)
   , group(group_in)
   , kdf(kdf_in)
+  , pool(std::make_unique<EphemeralPool>())
 {
   static const auto label_kem = to_bytes("KEM");
   suite_id = label_kem + i2osp(uint16_t(kem_id_in), 2);
+  label_prefix = KDF::label_prefix(suite_id);
 }
 
 std::unique_ptr<KEM::PrivateKey>
@@ -139,14 +141,14 @@ DHKEM::encap(const KEM::PublicKey& pkR) const
 {
   const auto& gpkR = dynamic_cast<const Group::PublicKey&>(pkR);
 
-  auto skE = group.generate_key_pair();
+  auto skE = ephemeral_key_pair();
   auto pkE = skE->public_key();
 
   auto zz = group.dh(*skE, gpkR);
   auto enc = group.serialize(*pkE);
 
   auto pkRm = group.serialize(gpkR);
-  auto kem_context = enc + pkRm;
+  auto kem_context = concat(enc, pkRm);
 
   auto shared_secret = extract_and_expand(zz, kem_context);
   return std::make_pair(shared_secret, enc);
@@ -161,7 +163,7 @@ DHKEM::decap(const bytes& enc, const KEM::PrivateKey& skR) const
   auto zz = group.dh(*gskR.group_priv, *pkE);
 
   auto pkRm = group.serialize(*pkR);
-  auto kem_context = enc + pkRm;
+  auto kem_context = concat(enc, pkRm);
   return extract_and_expand(zz, kem_context);
 }
 
@@ -171,18 +173,18 @@ DHKEM::auth_encap(const KEM::PublicKey& pkR, const KEM::PrivateKey& skS) const
   const auto& gpkR = dynamic_cast<const Group::PublicKey&>(pkR);
   const auto& gskS = dynamic_cast<const PrivateKey&>(skS);
 
-  auto skE = group.generate_key_pair();
+  auto skE = ephemeral_key_pair();
   auto pkE = skE->public_key();
   auto pkS = gskS.group_priv->public_key();
 
   auto zzER = group.dh(*skE, gpkR);
   auto zzSR = group.dh(*gskS.group_priv, gpkR);
-  auto zz = zzER + zzSR;
+  auto zz = concat(zzER, zzSR);
   auto enc = group.serialize(*pkE);
 
   auto pkRm = group.serialize(gpkR);
   auto pkSm = group.serialize(*pkS);
-  auto kem_context = enc + pkRm + pkSm;
+  auto kem_context = concat(enc, pkRm, pkSm);
 
   auto shared_secret = extract_and_expand(zz, kem_context);
   return std::make_pair(shared_secret, enc);
@@ -201,11 +203,11 @@ DHKEM::auth_decap(const bytes& enc,
 
   auto zzER = group.dh(*gskR.group_priv, *pkE);
   auto zzSR = group.dh(*gskR.group_priv, gpkS);
-  auto zz = zzER + zzSR;
+  auto zz = concat(zzER, zzSR);
 
   auto pkRm = group.serialize(*pkR);
   auto pkSm = group.serialize(gpkS);
-  auto kem_context = enc + pkRm + pkSm;
+  auto kem_context = concat(enc, pkRm, pkSm);
 
   return extract_and_expand(zz, kem_context);
 }
@@ -234,15 +236,91 @@ DHKEM::sk_size() const
   return group.sk_size();
 }
 
+void
+DHKEM::EphemeralPool::discard_if_forked(uint64_t current)
+{
+  if (generation != current) {
+    keys.clear();
+    generation = current;
+  }
+}
+
+void
+DHKEM::fill_ephemeral_pool(size_t size) const
+{
+  const auto generation = fork_generation();
+  auto missing = size_t(0);
+  {
+    const auto lock = std::lock_guard(pool->mutex);
+    pool->discard_if_forked(generation);
+    if (pool->keys.size() >= size) {
+      return;
+    }
+    missing = size - pool->keys.size();
+  }
+
+  // Key generation is the expensive part, so it is done without the lock
+  auto fresh = std::vector<std::unique_ptr<Group::PrivateKey>>{};
+  fresh.reserve(missing);
+  for (size_t i = 0; i < missing; i++) {
+    fresh.push_back(group.generate_key_pair());
+  }
+
+  // Concurrent fills may have topped up the pool in the meantime
+  const auto lock = std::lock_guard(pool->mutex);
+  pool->discard_if_forked(fork_generation());
+  if (pool->generation != generation) {
+    return;
+  }
+
+  for (auto& key : fresh) {
+    if (pool->keys.size() >= size) {
+      break;
+    }
+    pool->keys.push_back(std::move(key));
+  }
+}
+
+size_t
+DHKEM::ephemeral_pool_size() const
+{
+  const auto lock = std::lock_guard(pool->mutex);
+  pool->discard_if_forked(fork_generation());
+  return pool->keys.size();
+}
+
+void
+DHKEM::clear_ephemeral_pool() const
+{
+  const auto lock = std::lock_guard(pool->mutex);
+  pool->keys.clear();
+}
+
+std::unique_ptr<Group::PrivateKey>
+DHKEM::ephemeral_key_pair() const
+{
+  {
+    const auto lock = std::lock_guard(pool->mutex);
+    pool->discard_if_forked(fork_generation());
+    if (!pool->keys.empty()) {
+      auto key = std::move(pool->keys.back());
+      pool->keys.pop_back();
+      return key;
+    }
+  }
+
+  return group.generate_key_pair();
+}
+
 bytes
 DHKEM::extract_and_expand(const bytes& dh, const bytes& kem_context) const
 {
   static const auto label_eae_prk = to_bytes("eae_prk");
   static const auto label_shared_secret = to_bytes("shared_secret");
 
-  auto eae_prk = kdf.labeled_extract(suite_id, {}, label_eae_prk, dh);
-  return kdf.labeled_expand(
-    suite_id, eae_prk, label_shared_secret, kem_context, secret_size());
+  auto eae_prk = kdf.prefixed_extract(label_prefix, {}, label_eae_prk, dh);
+  return kdf.prefixed_expand(
+    label_prefix, eae_prk, label_shared_secret, kem_context, secret_size());
 }
 
 } // namespace hpke
@@ -4,6 +4,9 @@
 
 #include "group.h"
 
+#include <mutex>
+#include <vector>
+
 namespace hpke {
 
 struct DHKEM : public KEM
@@ -46,10 +49,32 @@ struct DHKEM : public KEM
   size_t pk_size() const override;
   size_t sk_size() const override;
 
+  void fill_ephemeral_pool(size_t size) const override;
+  size_t ephemeral_pool_size() const override;
+  void clear_ephemeral_pool() const override;
+
 private:
   const Group& group;
   const KDF& kdf;
   bytes suite_id;
+  bytes label_prefix;
+
+  // The keys are stamped with the fork generation they were generated in,
+  // and a child process discards the ones it inherited, so that it never
+  // uses an ephemeral key that its parent also uses
+  struct EphemeralPool
+  {
+    std::mutex mutex;
+    std::vector<std::unique_ptr<Group::PrivateKey>> keys;
+    uint64_t generation = 0;
+
+    // Called with the lock held
+    void discard_if_forked(uint64_t current);
+  };
+  std::unique_ptr<EphemeralPool> pool;
+
+  // Take a pooled ephemeral key pair, or generate one if there is none
+  std::unique_ptr<Group::PrivateKey> ephemeral_key_pair() const;
 
   bytes extract_and_expand(const bytes& dh, const bytes& kem_context) const;
 
@@ -7,7 +7,7 @@
 
 namespace hpke {
 
-static const EVP_MD*
+const EVP_MD*
 openssl_digest_type(Digest::ID digest)
 {
   switch (digest) {
@@ -87,6 +87,129 @@ Digest::hmac(const bytes& key, const bytes& data) const
   return md;
 }
 
+struct HashContext : public Digest::Context
+{
+  HashContext(const EVP_MD* type_in, size_t output_size_in)
+    : type(type_in)
+    , output_size(output_size_in)
+    , ctx(make_typed_unique(EVP_MD_CTX_new()))
+  {
+    if (ctx == nullptr || 1 != EVP_DigestInit_ex(ctx.get(), type, nullptr)) {
+      throw openssl_error();
+    }
+  }
+
+  void update(const uint8_t* data, size_t size) override
+  {
+    if (1 != EVP_DigestUpdate(ctx.get(), data, size)) {
+      throw openssl_error();
+    }
+  }
+
+  bytes finalize() override
+  {
+    auto md = bytes(output_size);
+    unsigned int size = 0;
+    if (1 != EVP_DigestFinal_ex(ctx.get(), md.data(), &size) ||
+        1 != EVP_DigestInit_ex(ctx.get(), type, nullptr)) {
+      throw openssl_error();
+    }
+
+    return md;
+  }
+
+  std::unique_ptr<Digest::Context> copy() const override
+  {
+    auto out = std::make_unique<HashContext>(type, output_size);
+    if (1 != EVP_MD_CTX_copy_ex(out->ctx.get(), ctx.get())) {
+      throw openssl_error();
+    }
+
+    return out;
+  }
+
+private:
+  const EVP_MD* type;
+  size_t output_size;
+  typed_unique_ptr<EVP_MD_CTX> ctx;
+};
+
+struct HMACContext : public Digest::Context
+{
+  HMACContext(const EVP_MD* type, size_t output_size_in, const bytes& key)
+    : output_size(output_size_in)
+    , ctx(make_typed_unique(HMAC_CTX_new()))
+  {
+    if (ctx == nullptr) {
+      throw openssl_error();
+    }
+
+    // OpenSSL reads a null key as "keep the current key", so an empty key is
+    // passed through a non-null pointer
+    static const uint8_t empty = 0;
+    const auto* key_data = key.empty() ? &empty : key.data();
+    if (1 != HMAC_Init_ex(ctx.get(), key_data, key.size(), type, nullptr)) {
+      throw openssl_error();
+    }
+  }
+
+  void update(const uint8_t* data, size_t size) override
+  {
+    if (1 != HMAC_Update(ctx.get(), data, size)) {
+      throw openssl_error();
+    }
+  }
+
+  bytes finalize() override
+  {
+    auto md = bytes(output_size);
+    unsigned int size = 0;
+    if (1 != HMAC_Final(ctx.get(), md.data(), &size) ||
+        1 != HMAC_Init_ex(ctx.get(), nullptr, 0, nullptr, nullptr)) {
+      throw openssl_error();
+    }
+
+    return md;
+  }
+
+  std::unique_ptr<Digest::Context> copy() const override
+  {
+    auto out = std::unique_ptr<HMACContext>(new HMACContext(output_size));
+    if (1 != HMAC_CTX_copy(out->ctx.get(), ctx.get())) {
+      throw openssl_error();
+    }
+
+    return out;
+  }
+
+private:
+  size_t output_size;
+  typed_unique_ptr<HMAC_CTX> ctx;
+
+  // An unkeyed context, to be filled by copying
+  explicit HMACContext(size_t output_size_in)
+    : output_size(output_size_in)
+    , ctx(make_typed_unique(HMAC_CTX_new()))
+  {
+    if (ctx == nullptr) {
+      throw openssl_error();
+    }
+  }
+};
+
+std::unique_ptr<Digest::Context>
+Digest::hash_context() const
+{
+  return std::make_unique<HashContext>(openssl_digest_type(id), output_size);
+}
+
+std::unique_ptr<Digest::Context>
+Digest::hmac_context(const bytes& key) const
+{
+  return std::make_unique<HMACContext>(
+    openssl_digest_type(id), output_size, key);
+}
+
 size_t
 Digest::hash_size() const
 {
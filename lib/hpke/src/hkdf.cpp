@@ -1,9 +1,6 @@
 #include "hkdf.h"
-#include "openssl_common.h"
 
-#include <openssl/err.h>
-#include <openssl/evp.h>
-#include <openssl/hmac.h>
+#include <algorithm>
 #include <stdexcept>
 
 namespace hpke {
@@ -59,23 +56,92 @@ HKDF::extract(const bytes& salt, const bytes& ikm) const
 }
 
 bytes
-HKDF::expand(const bytes& prk, const bytes& info, size_t size) const
+HKDF::extract_pieces(const bytes& salt, Pieces ikm) const
 {
-  auto okm = bytes{};
-  auto i = uint8_t(0x00);
-  auto Ti = bytes{};
-  while (okm.size() < size) {
-    i += 1;
-    auto block = Ti + info + bytes{ i };
-
-    Ti = digest.hmac(prk, block);
-    okm += Ti;
+  auto ctx = digest.hmac_context(salt);
+  for (const auto* piece : ikm) {
+    ctx->update(*piece);
+  }
+  return ctx->finalize();
+}
+
+struct HMACExpander : public KDF::Expander
+{
+  HMACExpander(const Digest& digest, const bytes& prk)
+    : ctx(digest.hmac_context(prk))
+    , hash_size(digest.hash_size())
+  {}
+
+  using KDF::Expander::expand;
+
+  void expand(const bytes& info, uint8_t* out, size_t size) override
+  {
+    expand_pieces({ &info }, out, size);
+  }
+
+  void expand_pieces(KDF::Pieces info, bytes& out)
+  {
+    expand_pieces(info, out.data(), out.size());
+  }
+
+  // T(i) = HMAC(PRK, T(i-1) | info | i), with the keyed HMAC context reused,
+  // since finalizing it resets it to the keyed state
+  void expand_pieces(KDF::Pieces info, uint8_t* out, size_t size)
+  {
+    if (size > 255 * hash_size) {
+      throw std::runtime_error("HKDF output too long");
+    }
+
+    auto block = bytes{};
+    auto i = uint8_t(0x00);
+    auto written = size_t(0);
+    while (written < size) {
+      ctx->update(block);
+      for (const auto* piece : info) {
+        ctx->update(*piece);
+      }
+
+      i += 1;
+      ctx->update(&i, 1);
+
+      zeroize(block);
+      block = ctx->finalize();
+
+      auto chunk = std::min(size - written, block.size());
+      std::copy(block.begin(), block.begin() + chunk, out + written);
+      written += chunk;
+    }
+
+    zeroize(block);
   }
 
-  okm.resize(size);
+private:
+  std::unique_ptr<Digest::Context> ctx;
+  size_t hash_size;
+};
+
+bytes
+HKDF::expand(const bytes& prk, const bytes& info, size_t size) const
+{
+  auto okm = bytes(size);
+  HMACExpander(digest, prk).expand(info, okm);
+  return okm;
+}
+
+bytes
+HKDF::expand_pieces(const bytes& prk, Pieces info, size_t size) const
+{
+  auto okm = bytes(size);
+  HMACExpander(digest, prk).expand_pieces(info, okm);
   return okm;
 }
 
+std::unique_ptr<KDF::Expander>
+HKDF::expander(const bytes& prk) const
+{
+  return std::make_unique<HMACExpander>(digest, prk);
+}
+
 size_t
 HKDF::hash_size() const
 {
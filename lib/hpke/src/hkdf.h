@@ -14,6 +14,11 @@ struct HKDF : public KDF
 
   bytes extract(const bytes& salt, const bytes& ikm) const override;
   bytes expand(const bytes& prk, const bytes& info, size_t size) const override;
+  bytes extract_pieces(const bytes& salt, Pieces ikm) const override;
+  bytes expand_pieces(const bytes& prk,
+                      Pieces info,
+                      size_t size) const override;
+  std::unique_ptr<Expander> expander(const bytes& prk) const override;
   size_t hash_size() const override;
 
 private:
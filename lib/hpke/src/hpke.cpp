@@ -98,35 +98,40 @@ template<>
 const KEM&
 KEM::get<KEM::ID::DHKEM_P256_SHA256>()
 {
-  return DHKEM::get<KEM::ID::DHKEM_P256_SHA256>();
+  const auto& builtin = DHKEM::get<KEM::ID::DHKEM_P256_SHA256>();
+  return select_primitive<KEM>(KEM::ID::DHKEM_P256_SHA256, builtin);
 }
 
 template<>
 const KEM&
 KEM::get<KEM::ID::DHKEM_P384_SHA384>()
 {
-  return DHKEM::get<KEM::ID::DHKEM_P384_SHA384>();
+  const auto& builtin = DHKEM::get<KEM::ID::DHKEM_P384_SHA384>();
+  return select_primitive<KEM>(KEM::ID::DHKEM_P384_SHA384, builtin);
 }
 
 template<>
 const KEM&
 KEM::get<KEM::ID::DHKEM_P521_SHA512>()
 {
-  return DHKEM::get<KEM::ID::DHKEM_P521_SHA512>();
+  const auto& builtin = DHKEM::get<KEM::ID::DHKEM_P521_SHA512>();
+  return select_primitive<KEM>(KEM::ID::DHKEM_P521_SHA512, builtin);
 }
 
 template<>
 const KEM&
 KEM::get<KEM::ID::DHKEM_X25519_SHA256>()
 {
-  return DHKEM::get<KEM::ID::DHKEM_X25519_SHA256>();
+  const auto& builtin = DHKEM::get<KEM::ID::DHKEM_X25519_SHA256>();
+  return select_primitive<KEM>(KEM::ID::DHKEM_X25519_SHA256, builtin);
 }
 
 template<>
 const KEM&
 KEM::get<KEM::ID::DHKEM_X448_SHA512>()
 {
-  return DHKEM::get<KEM::ID::DHKEM_X448_SHA512>();
+  const auto& builtin = DHKEM::get<KEM::ID::DHKEM_X448_SHA512>();
+  return select_primitive<KEM>(KEM::ID::DHKEM_X448_SHA512, builtin);
 }
 
 bytes
@@ -148,6 +153,20 @@ KEM::auth_encap(const PublicKey& /* unused */,
   throw std::runtime_error("Not implemented");
 }
 
+void
+KEM::fill_ephemeral_pool(size_t /* unused */) const
+{}
+
+size_t
+KEM::ephemeral_pool_size() const
+{
+  return 0;
+}
+
+void
+KEM::clear_ephemeral_pool() const
+{}
+
 bytes
 KEM::auth_decap(const bytes& /* unused */,
                 const PublicKey& /* unused */,
@@ -160,21 +179,24 @@ template<>
 const KDF&
 KDF::get<KDF::ID::HKDF_SHA256>()
 {
-  return HKDF::get<Digest::ID::SHA256>();
+  const auto& builtin = HKDF::get<Digest::ID::SHA256>();
+  return select_primitive<KDF>(KDF::ID::HKDF_SHA256, builtin);
 }
 
 template<>
 const KDF&
 KDF::get<KDF::ID::HKDF_SHA384>()
 {
-  return HKDF::get<Digest::ID::SHA384>();
+  const auto& builtin = HKDF::get<Digest::ID::SHA384>();
+  return select_primitive<KDF>(KDF::ID::HKDF_SHA384, builtin);
 }
 
 template<>
 const KDF&
 KDF::get<KDF::ID::HKDF_SHA512>()
 {
-  return HKDF::get<Digest::ID::SHA512>();
+  const auto& builtin = HKDF::get<Digest::ID::SHA512>();
+  return select_primitive<KDF>(KDF::ID::HKDF_SHA512, builtin);
 }
 
 KDF::KDF(KDF::ID id_in)
@@ -187,8 +209,7 @@ KDF::labeled_extract(const bytes& suite_id,
                      const bytes& label,
                      const bytes& ikm) const
 {
-  auto labeled_ikm = label_hpke_05() + suite_id + label + ikm;
-  return extract(salt, labeled_ikm);
+  return prefixed_extract(label_prefix(suite_id), salt, label, ikm);
 }
 
 bytes
@@ -198,36 +219,126 @@ KDF::labeled_expand(const bytes& suite_id,
                     const bytes& info,
                     size_t size) const
 {
-  auto labeled_info =
-    i2osp(size, 2) + label_hpke_05() + suite_id + label + info;
-  return expand(prk, labeled_info, size);
+  return prefixed_expand(label_prefix(suite_id), prk, label, info, size);
+}
+
+bytes
+KDF::label_prefix(const bytes& suite_id)
+{
+  return concat(label_hpke_05(), suite_id);
+}
+
+bytes
+KDF::prefixed_extract(const bytes& prefix,
+                      const bytes& salt,
+                      const bytes& label,
+                      const bytes& ikm) const
+{
+  return extract_pieces(salt, { &prefix, &label, &ikm });
+}
+
+bytes
+KDF::prefixed_expand(const bytes& prefix,
+                     const bytes& prk,
+                     const bytes& label,
+                     const bytes& info,
+                     size_t size) const
+{
+  auto length = i2osp(size, 2);
+  return expand_pieces(prk, { &length, &prefix, &label, &info }, size);
 }
 
 template<>
 const AEAD&
 AEAD::get<AEAD::ID::AES_128_GCM>()
 {
-  return AEADCipher::get<AEAD::ID::AES_128_GCM>();
+  const auto& builtin = AEADCipher::get<AEAD::ID::AES_128_GCM>();
+  return select_primitive<AEAD>(AEAD::ID::AES_128_GCM, builtin);
 }
 
 template<>
 const AEAD&
 AEAD::get<AEAD::ID::AES_256_GCM>()
 {
-  return AEADCipher::get<AEAD::ID::AES_256_GCM>();
+  const auto& builtin = AEADCipher::get<AEAD::ID::AES_256_GCM>();
+  return select_primitive<AEAD>(AEAD::ID::AES_256_GCM, builtin);
 }
 
 template<>
 const AEAD&
 AEAD::get<AEAD::ID::CHACHA20_POLY1305>()
 {
-  return AEADCipher::get<AEAD::ID::CHACHA20_POLY1305>();
+  const auto& builtin = AEADCipher::get<AEAD::ID::CHACHA20_POLY1305>();
+  return select_primitive<AEAD>(AEAD::ID::CHACHA20_POLY1305, builtin);
 }
 
 AEAD::AEAD(AEAD::ID id_in)
   : id(id_in)
 {}
 
+void
+AEAD::seal_into(const bytes& key,
+                const bytes& nonce,
+                const bytes& aad,
+                const uint8_t* pt,
+                size_t pt_size,
+                uint8_t* ct) const
+{
+  context(key)->seal_into(nonce, aad, pt, pt_size, ct);
+}
+
+bool
+AEAD::open_into(const bytes& key,
+                const bytes& nonce,
+                const bytes& aad,
+                const uint8_t* ct,
+                size_t ct_size,
+                uint8_t* pt) const
+{
+  return context(key)->open_into(nonce, aad, ct, ct_size, pt);
+}
+
+// Keeps ctx keyed for the given key, rescheduling only when it changes
+static AEAD::Context&
+batch_context(const AEAD& aead,
+              std::unique_ptr<AEAD::Context>& ctx,
+              const bytes*& ctx_key,
+              const bytes& key)
+{
+  if (!ctx || (&key != ctx_key && key != *ctx_key)) {
+    ctx = aead.context(key);
+    ctx_key = &key;
+  }
+  return *ctx;
+}
+
+void
+AEAD::seal_batch(const std::vector<BatchItem>& items) const
+{
+  auto ctx = std::unique_ptr<Context>{};
+  const bytes* ctx_key = nullptr;
+  for (const auto& item : items) {
+    batch_context(*this, ctx, ctx_key, item.key)
+      .seal_into(
+        item.nonce, item.aad, item.input, item.input_size, item.output);
+  }
+}
+
+std::vector<bool>
+AEAD::open_batch(const std::vector<BatchItem>& items) const
+{
+  auto ctx = std::unique_ptr<Context>{};
+  const bytes* ctx_key = nullptr;
+  auto ok = std::vector<bool>(items.size());
+  for (size_t i = 0; i < items.size(); i++) {
+    const auto& item = items[i];
+    ok[i] = batch_context(*this, ctx, ctx_key, item.key)
+              .open_into(
+                item.nonce, item.aad, item.input, item.input_size, item.output);
+  }
+  return ok;
+}
+
 ///
 /// Encryption Contexts
 ///
@@ -268,9 +379,21 @@ Context::Context(bytes suite_in,
   , exporter_secret(std::move(exporter_secret_in))
   , kdf(kdf_in)
   , aead(aead_in)
+  , aead_ctx(aead.context(key))
   , seq(0)
 {}
 
+Context::Context(const Context& other)
+  : suite(other.suite)
+  , key(other.key)
+  , nonce(other.nonce)
+  , exporter_secret(other.exporter_secret)
+  , kdf(other.kdf)
+  , aead(other.aead)
+  , aead_ctx(aead.context(key))
+  , seq(other.seq)
+{}
+
 bool
 operator==(const Context& lhs, const Context& rhs)
 {
@@ -290,7 +413,7 @@ SenderContext::SenderContext(Context&& c)
 bytes
 SenderContext::seal(const bytes& aad, const bytes& pt)
 {
-  auto ct = aead.seal(key, current_nonce(), aad, pt);
+  auto ct = aead_ctx->seal(current_nonce(), aad, pt);
   increment_seq();
   return ct;
 }
@@ -302,7 +425,7 @@ ReceiverContext::ReceiverContext(Context&& c)
 std::optional<bytes>
 ReceiverContext::open(const bytes& aad, const bytes& ct)
 {
-  auto maybe_pt = aead.open(key, current_nonce(), aad, ct);
+  auto maybe_pt = aead_ctx->open(current_nonce(), aad, ct);
   increment_seq();
   return maybe_pt;
 }
@@ -317,9 +440,10 @@ static const bytes default_psk_id = {};
 static bytes
 suite_id(KEM::ID kem_id, KDF::ID kdf_id, AEAD::ID aead_id)
 {
-  return label_hpke() + i2osp(static_cast<uint64_t>(kem_id), 2) +
-         i2osp(static_cast<uint64_t>(kdf_id), 2) +
-         i2osp(static_cast<uint64_t>(aead_id), 2);
+  return concat(label_hpke(),
+                i2osp(static_cast<uint64_t>(kem_id), 2),
+                i2osp(static_cast<uint64_t>(kdf_id), 2),
+                i2osp(static_cast<uint64_t>(aead_id), 2));
 }
 
 static const KEM&
@@ -376,6 +500,7 @@ HPKE::HPKE(KEM::ID kem_id, KDF::ID kdf_id, AEAD::ID aead_id)
   , kem(select_kem(kem_id))
   , kdf(select_kdf(kdf_id))
   , aead(select_aead(aead_id))
+  , label_prefix(KDF::label_prefix(suite))
 {}
 
 HPKE::SenderInfo
@@ -493,22 +618,23 @@ HPKE::key_schedule(Mode mode,
     throw std::runtime_error("Invalid PSK inputs");
   }
 
+  const auto& prefix = label_prefix;
   auto psk_id_hash =
-    kdf.labeled_extract(suite, {}, label_psk_id_hash(), psk_id);
-  auto info_hash = kdf.labeled_extract(suite, {}, label_info_hash(), info);
+    kdf.prefixed_extract(prefix, {}, label_psk_id_hash(), psk_id);
+  auto info_hash = kdf.prefixed_extract(prefix, {}, label_info_hash(), info);
   auto mode_bytes = bytes{ uint8_t(mode) };
-  auto key_schedule_context = mode_bytes + psk_id_hash + info_hash;
+  auto key_schedule_context = concat(mode_bytes, psk_id_hash, info_hash);
 
-  auto psk_hash = kdf.labeled_extract(suite, {}, label_psk_hash(), psk);
+  auto psk_hash = kdf.prefixed_extract(prefix, {}, label_psk_hash(), psk);
   auto secret =
-    kdf.labeled_extract(suite, psk_hash, label_secret(), shared_secret);
-
-  auto key = kdf.labeled_expand(
-    suite, secret, label_key(), key_schedule_context, aead.key_size());
-  auto nonce = kdf.labeled_expand(
-    suite, secret, label_nonce(), key_schedule_context, aead.nonce_size());
-  auto exporter_secret = kdf.labeled_expand(
-    suite, secret, label_exp(), key_schedule_context, kdf.hash_size());
+    kdf.prefixed_extract(prefix, psk_hash, label_secret(), shared_secret);
+
+  auto key = kdf.prefixed_expand(
+    prefix, secret, label_key(), key_schedule_context, aead.key_size());
+  auto nonce = kdf.prefixed_expand(
+    prefix, secret, label_nonce(), key_schedule_context, aead.nonce_size());
+  auto exporter_secret = kdf.prefixed_expand(
+    prefix, secret, label_exp(), key_schedule_context, kdf.hash_size());
 
   return Context(suite, key, nonce, exporter_secret, kdf, aead);
 }
@@ -1,7 +1,9 @@
 #pragma once
 
+#include <hpke/digest.h>
 #include <hpke/hpke.h>
 #include <memory>
+#include <openssl/evp.h>
 #include <stdexcept>
 
 namespace hpke {
@@ -23,4 +25,7 @@ make_typed_unique(T* ptr)
 std::runtime_error
 openssl_error();
 
+const EVP_MD*
+openssl_digest_type(Digest::ID digest);
+
 } // namespace hpke
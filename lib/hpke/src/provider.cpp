@@ -0,0 +1,150 @@
+#include <hpke/provider.h>
+
+#include "common.h"
+
+#include <atomic>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
+
+namespace hpke {
+
+struct ProviderRegistry
+{
+  std::mutex mutex;
+
+  // Every provider ever installed, so that primitives handed out by a
+  // provider outlive its removal by reset()
+  std::vector<std::shared_ptr<const Provider>> retained;
+
+  // The providers to consult, most recent first.  This is replaced as a
+  // whole on every change, so that readers need no lock.
+  std::shared_ptr<const std::vector<const Provider*>> active;
+};
+
+static ProviderRegistry&
+registry()
+{
+  static auto instance = ProviderRegistry{};
+  return instance;
+}
+
+bool
+Provider::available() const
+{
+  return true;
+}
+
+const KEM*
+Provider::kem(KEM::ID /* unused */) const
+{
+  return nullptr;
+}
+
+const KDF*
+Provider::kdf(KDF::ID /* unused */) const
+{
+  return nullptr;
+}
+
+const AEAD*
+Provider::aead(AEAD::ID /* unused */) const
+{
+  return nullptr;
+}
+
+const Signature*
+Provider::signature(Signature::ID /* unused */) const
+{
+  return nullptr;
+}
+
+bool
+Provider::install(std::shared_ptr<const Provider> provider)
+{
+  if (!provider || !provider->available()) {
+    return false;
+  }
+
+  auto& reg = registry();
+  const auto lock = std::lock_guard(reg.mutex);
+
+  auto active = std::vector<const Provider*>{ provider.get() };
+  if (auto current = std::atomic_load(&reg.active)) {
+    active.insert(active.end(), current->begin(), current->end());
+  }
+
+  reg.retained.push_back(std::move(provider));
+  std::atomic_store(&reg.active,
+                    std::make_shared<const std::vector<const Provider*>>(
+                      std::move(active)));
+  return true;
+}
+
+void
+Provider::reset()
+{
+  auto& reg = registry();
+  const auto lock = std::lock_guard(reg.mutex);
+  std::atomic_store(&reg.active, {});
+}
+
+static const KEM*
+provided(const Provider& provider, KEM::ID id)
+{
+  return provider.kem(id);
+}
+
+static const KDF*
+provided(const Provider& provider, KDF::ID id)
+{
+  return provider.kdf(id);
+}
+
+static const AEAD*
+provided(const Provider& provider, AEAD::ID id)
+{
+  return provider.aead(id);
+}
+
+static const Signature*
+provided(const Provider& provider, Signature::ID id)
+{
+  return provider.signature(id);
+}
+
+template<typename T>
+const T&
+select_primitive(typename T::ID id, const T& builtin)
+{
+  const auto active = std::atomic_load(&registry().active);
+  if (!active) {
+    return builtin;
+  }
+
+  for (const auto* provider : *active) {
+    const auto* primitive = provided(*provider, id);
+    if (primitive == nullptr) {
+      continue;
+    }
+
+    if (primitive->id != id) {
+      throw std::runtime_error("Provider returned the wrong primitive");
+    }
+
+    return *primitive;
+  }
+
+  return builtin;
+}
+
+template const KEM&
+select_primitive<KEM>(KEM::ID id, const KEM& builtin);
+template const KDF&
+select_primitive<KDF>(KDF::ID id, const KDF& builtin);
+template const AEAD&
+select_primitive<AEAD>(AEAD::ID id, const AEAD& builtin);
+template const Signature&
+select_primitive<Signature>(Signature::ID id, const Signature& builtin);
+
+} // namespace hpke
@@ -1,18 +1,112 @@
 #include <hpke/random.h>
 
+#include "common.h"
 #include "openssl_common.h"
 
+#include <openssl/crypto.h>
 #include <openssl/rand.h>
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <limits>
+
+#if !defined(_WIN32)
+#include <pthread.h>
+#endif
+
 namespace hpke {
 
+static void
+openssl_random(uint8_t* out, size_t size)
+{
+  while (size > 0) {
+    const auto chunk = std::min<size_t>(size, std::numeric_limits<int>::max());
+    if (1 != RAND_bytes(out, static_cast<int>(chunk))) {
+      throw openssl_error();
+    }
+
+    out += chunk;
+    size -= chunk;
+  }
+}
+
+// Small requests, such as reuse guards and fresh secrets, are served from a
+// per-thread pool of DRBG output, so that the message path does not take the
+// DRBG's lock for every few bytes.  Bytes are erased from the pool as they are
+// handed out, and the pool is refilled from the DRBG, which reseeds itself,
+// once it runs low; what is left over is erased first.  The pool is kept to a
+// few requests' worth, so that little future output sits in memory.  A fork
+// discards every pool, so that a parent and child never hand out the same
+// bytes.
+static constexpr size_t random_pool_size = 256;
+static constexpr size_t max_pooled_request = 32;
+
+static std::atomic<uint64_t> fork_count = 0;
+
+#if !defined(_WIN32)
+static void
+count_fork()
+{
+  fork_count.fetch_add(1);
+}
+#endif
+
+uint64_t
+fork_generation()
+{
+#if !defined(_WIN32)
+  static const auto registered = pthread_atfork(nullptr, nullptr, count_fork);
+  if (registered != 0) {
+    throw std::runtime_error("Unable to register fork handler");
+  }
+#endif
+
+  return fork_count.load();
+}
+
+struct RandomPool
+{
+  std::array<uint8_t, random_pool_size> data;
+  size_t used = random_pool_size;
+  uint64_t generation = fork_generation();
+
+  ~RandomPool() { OPENSSL_cleanse(data.data(), data.size()); }
+
+  void take(uint8_t* out, size_t size)
+  {
+    const auto current = fork_generation();
+    if (used + size > data.size() || generation != current) {
+      OPENSSL_cleanse(data.data() + used, data.size() - used);
+      openssl_random(data.data(), data.size());
+      used = 0;
+      generation = current;
+    }
+
+    auto* start = data.data() + used;
+    std::copy(start, start + size, out);
+    OPENSSL_cleanse(start, size);
+    used += size;
+  }
+};
+
+void
+random_bytes(uint8_t* out, size_t size)
+{
+  if (size > max_pooled_request) {
+    openssl_random(out, size);
+    return;
+  }
+
+  thread_local auto pool = RandomPool{};
+  pool.take(out, size);
+}
+
 bytes
 random_bytes(size_t size)
 {
   auto rand = bytes(size);
-  if (1 != RAND_bytes(rand.data(), size)) {
-    throw openssl_error();
-  }
+  random_bytes(rand.data(), rand.size());
   return rand;
 }
 
@@ -129,35 +129,40 @@ template<>
 const Signature&
 Signature::get<Signature::ID::P256_SHA256>()
 {
-  return ConcreteSignature::instance<Signature::ID::P256_SHA256>;
+  const auto& builtin = ConcreteSignature::instance<Signature::ID::P256_SHA256>;
+  return select_primitive<Signature>(Signature::ID::P256_SHA256, builtin);
 }
 
 template<>
 const Signature&
 Signature::get<Signature::ID::P384_SHA384>()
 {
-  return ConcreteSignature::instance<Signature::ID::P384_SHA384>;
+  const auto& builtin = ConcreteSignature::instance<Signature::ID::P384_SHA384>;
+  return select_primitive<Signature>(Signature::ID::P384_SHA384, builtin);
 }
 
 template<>
 const Signature&
 Signature::get<Signature::ID::P521_SHA512>()
 {
-  return ConcreteSignature::instance<Signature::ID::P521_SHA512>;
+  const auto& builtin = ConcreteSignature::instance<Signature::ID::P521_SHA512>;
+  return select_primitive<Signature>(Signature::ID::P521_SHA512, builtin);
 }
 
 template<>
 const Signature&
 Signature::get<Signature::ID::Ed25519>()
 {
-  return ConcreteSignature::instance<Signature::ID::Ed25519>;
+  const auto& builtin = ConcreteSignature::instance<Signature::ID::Ed25519>;
+  return select_primitive<Signature>(Signature::ID::Ed25519, builtin);
 }
 
 template<>
 const Signature&
 Signature::get<Signature::ID::Ed448>()
 {
-  return ConcreteSignature::instance<Signature::ID::Ed448>;
+  const auto& builtin = ConcreteSignature::instance<Signature::ID::Ed448>;
+  return select_primitive<Signature>(Signature::ID::Ed448, builtin);
 }
 
 Signature::Signature(Signature::ID id_in)
@@ -176,4 +181,18 @@ Signature::deserialize_private(const bytes& /* unused */) const
   throw std::runtime_error("Not implemented");
 }
 
+std::vector<bool>
+Signature::verify_batch(const std::vector<VerifyItem>& items) const
+{
+  // OpenSSL has no batch verification API, even for EdDSA, so by default
+  // the items are simply verified in turn
+  auto valid = std::vector<bool>(items.size(), false);
+  for (size_t i = 0; i < items.size(); i++) {
+    const auto& item = items.at(i);
+    valid.at(i) = verify(item.data, item.sig, item.pk);
+  }
+
+  return valid;
+}
+
 } // namespace hpke
@@ -109,3 +109,135 @@ TEST_CASE("AEAD Round-Trip")
     CHECK(decrypted == plaintext);
   }
 }
+
+TEST_CASE("AEAD Keyed Context")
+{
+  const std::vector<AEAD::ID> ids{ AEAD::ID::AES_128_GCM,
+                                   AEAD::ID::AES_256_GCM,
+                                   AEAD::ID::CHACHA20_POLY1305 };
+
+  const auto aad = from_hex("04050607");
+
+  for (const auto& id : ids) {
+    const auto& aead = select_aead(id);
+    auto key = bytes(aead.key_size(), 0xA0);
+    auto ctx = aead.context(key);
+
+    // Sealing several messages under one context must match the one-shot
+    // interface, and a modified ciphertext must not corrupt the context
+    for (uint8_t i = 0; i < 4; i++) {
+      auto nonce = bytes(aead.nonce_size(), i);
+      auto plaintext = bytes(i * 17, i);
+
+      auto encrypted = ctx->seal(nonce, aad, plaintext);
+      CHECK(encrypted == aead.seal(key, nonce, aad, plaintext));
+
+      auto tampered = encrypted;
+      tampered.back() ^= 0xff;
+      REQUIRE_THROWS(ctx->open(nonce, aad, tampered));
+
+      auto decrypted = ctx->open(nonce, aad, encrypted);
+      CHECK(decrypted == plaintext);
+    }
+  }
+}
+
+TEST_CASE("AEAD In-Place")
+{
+  const std::vector<AEAD::ID> ids{ AEAD::ID::AES_128_GCM,
+                                   AEAD::ID::AES_256_GCM,
+                                   AEAD::ID::CHACHA20_POLY1305 };
+
+  const auto plaintext = from_hex("000102030405060708090a0b0c0d0e0f10");
+  const auto aad = from_hex("04050607");
+
+  for (const auto& id : ids) {
+    const auto& aead = select_aead(id);
+    auto key = bytes(aead.key_size(), 0xA0);
+    auto nonce = bytes(aead.nonce_size(), 0xA1);
+    auto encrypted = aead.seal(key, nonce, aad, plaintext);
+
+    // Sealing in place leaves the same ciphertext as the copying interface
+    auto buffer = plaintext;
+    buffer.resize(plaintext.size() + aead.tag_size());
+    aead.seal_into(
+      key, nonce, aad, buffer.data(), plaintext.size(), buffer.data());
+    CHECK(buffer == encrypted);
+
+    auto tampered = buffer;
+    tampered.front() ^= 0xff;
+    CHECK_FALSE(aead.open_into(
+      key, nonce, aad, tampered.data(), tampered.size(), tampered.data()));
+
+    REQUIRE(aead.open_into(
+      key, nonce, aad, buffer.data(), buffer.size(), buffer.data()));
+    buffer.resize(plaintext.size());
+    CHECK(buffer == plaintext);
+  }
+}
+
+TEST_CASE("AEAD Batch")
+{
+  const std::vector<AEAD::ID> ids{ AEAD::ID::AES_128_GCM,
+                                   AEAD::ID::AES_256_GCM,
+                                   AEAD::ID::CHACHA20_POLY1305 };
+
+  const auto aad = from_hex("04050607");
+  const auto batch_size = size_t(5);
+
+  for (const auto& id : ids) {
+    const auto& aead = select_aead(id);
+
+    // Alternate between two keys, with a run sharing one in the middle
+    const auto keys = std::vector<bytes>{ bytes(aead.key_size(), 0xA0),
+                                          bytes(aead.key_size(), 0xB0) };
+    auto nonces = std::vector<bytes>{};
+    auto plaintexts = std::vector<bytes>{};
+    auto buffers = std::vector<bytes>{};
+    for (size_t i = 0; i < batch_size; i++) {
+      nonces.emplace_back(aead.nonce_size(), static_cast<uint8_t>(i));
+      plaintexts.emplace_back(i + 1, static_cast<uint8_t>(0xC0 + i));
+      buffers.push_back(plaintexts.back());
+      buffers.back().resize(plaintexts.back().size() + aead.tag_size());
+    }
+
+    const auto key_for = [&](size_t i) -> const bytes& {
+      return keys.at((i == 2) ? 0 : i % 2);
+    };
+
+    auto items = std::vector<AEAD::BatchItem>{};
+    for (size_t i = 0; i < batch_size; i++) {
+      auto* buffer = buffers[i].data();
+      items.push_back(
+        { key_for(i), nonces[i], aad, buffer, plaintexts[i].size(), buffer });
+    }
+
+    // Sealing a batch gives the same output as sealing each message
+    aead.seal_batch(items);
+    for (size_t i = 0; i < batch_size; i++) {
+      CHECK(buffers[i] == aead.seal(key_for(i), nonces[i], aad, plaintexts[i]));
+    }
+
+    // Opening a batch reports each message separately
+    buffers[3].front() ^= 0xff;
+    items.clear();
+    for (size_t i = 0; i < batch_size; i++) {
+      auto* buffer = buffers[i].data();
+      items.push_back(
+        { key_for(i), nonces[i], aad, buffer, buffers[i].size(), buffer });
+    }
+
+    const auto ok = aead.open_batch(items);
+    REQUIRE(ok.size() == batch_size);
+    for (size_t i = 0; i < batch_size; i++) {
+      if (i == 3) {
+        CHECK_FALSE(ok[i]);
+        continue;
+      }
+
+      REQUIRE(ok[i]);
+      buffers[i].resize(plaintexts[i].size());
+      CHECK(buffers[i] == plaintexts[i]);
+    }
+  }
+}
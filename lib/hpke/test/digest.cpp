@@ -0,0 +1,64 @@
+#include <doctest/doctest.h>
+#include <hpke/digest.h>
+
+#include "common.h"
+
+TEST_CASE("Digest Incremental Contexts")
+{
+  const auto ids = std::vector<Digest::ID>{
+    Digest::ID::SHA256,
+    Digest::ID::SHA384,
+    Digest::ID::SHA512,
+  };
+
+  const auto key = from_hex("000102030405060708090a0b0c0d0e0f");
+  const auto head = from_hex("00010203");
+  const auto tail = from_hex("0405060708090a0b0c0d0e0f");
+  const auto data = head + tail;
+
+  for (const auto id : ids) {
+    const auto& digest = [&]() -> const Digest& {
+      switch (id) {
+        case Digest::ID::SHA256:
+          return Digest::get<Digest::ID::SHA256>();
+        case Digest::ID::SHA384:
+          return Digest::get<Digest::ID::SHA384>();
+        default:
+          return Digest::get<Digest::ID::SHA512>();
+      }
+    }();
+
+    // Data fed in pieces hashes as if concatenated, and each finalize()
+    // leaves the context ready for the next computation
+    auto hash = digest.hash_context();
+    for (int i = 0; i < 2; i++) {
+      hash->update(head);
+      hash->update(tail);
+      REQUIRE(hash->finalize() == digest.hash(data));
+    }
+
+    auto hmac = digest.hmac_context(key);
+    for (int i = 0; i < 2; i++) {
+      hmac->update(head);
+      hmac->update(tail);
+      REQUIRE(hmac->finalize() == digest.hmac(key, data));
+    }
+
+    auto unkeyed = digest.hmac_context({});
+    unkeyed->update(data);
+    REQUIRE(unkeyed->finalize() == digest.hmac({}, data));
+
+    // A copy continues from the state it was copied in, independently
+    hash->update(head);
+    hmac->update(head);
+    auto hash_copy = hash->copy();
+    auto hmac_copy = hmac->copy();
+
+    hash_copy->update(tail);
+    hmac_copy->update(tail);
+    REQUIRE(hash_copy->finalize() == digest.hash(data));
+    REQUIRE(hmac_copy->finalize() == digest.hmac(key, data));
+    REQUIRE(hash->finalize() == digest.hash(head));
+    REQUIRE(hmac->finalize() == digest.hmac(key, head));
+  }
+}
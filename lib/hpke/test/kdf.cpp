@@ -74,11 +74,42 @@ TEST_CASE("KDF Known-Answer")
     auto expanded = kdf.expand(extracted, info, expand_size);
     CHECK(expanded == tc.expanded);
 
+    // A keyed expander gives the same output, repeatably, into the caller's
+    // buffer
+    auto expander = kdf.expander(extracted);
+    for (int i = 0; i < 2; i++) {
+      auto out = bytes(expand_size);
+      expander->expand(info, out);
+      CHECK(out == tc.expanded);
+    }
+
+    auto short_out = bytes(expand_size / 2);
+    expander->expand(info, short_out);
+    CHECK(short_out == bytes(tc.expanded.begin(),
+                             tc.expanded.begin() + short_out.size()));
+
     auto labeled_extracted = kdf.labeled_extract(tc.suite_id, salt, label, ikm);
     CHECK(labeled_extracted == tc.labeled_extracted);
 
     auto labeled_expanded = kdf.labeled_expand(
       tc.suite_id, labeled_extracted, label, info, expand_size);
     CHECK(labeled_expanded == tc.labeled_expanded);
+
+    // Input given in pieces is processed as if concatenated, including the
+    // pieces of a precomputed label prefix
+    const auto ikm_head = bytes(ikm.begin(), ikm.begin() + 5);
+    const auto ikm_tail = bytes(ikm.begin() + 5, ikm.end());
+    const auto empty = bytes{};
+    CHECK(kdf.extract_pieces(salt, { &ikm_head, &empty, &ikm_tail }) ==
+          tc.extracted);
+    CHECK(kdf.expand_pieces(extracted, { &info }, expand_size) ==
+          tc.expanded);
+
+    const auto prefix = KDF::label_prefix(tc.suite_id);
+    CHECK(kdf.prefixed_extract(prefix, salt, label, ikm) ==
+          tc.labeled_extracted);
+    CHECK(kdf.prefixed_expand(
+            prefix, labeled_extracted, label, info, expand_size) ==
+          tc.labeled_expanded);
   }
 }
@@ -3,6 +3,14 @@
 
 #include "common.h"
 
+#include <algorithm>
+#include <array>
+
+#if !defined(_WIN32)
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
 // TODO(RLB): Add known-answer tests
 
 TEST_CASE("KEM round-trip")
@@ -50,3 +58,75 @@ TEST_CASE("KEM round-trip")
     }
   }
 }
+
+TEST_CASE("KEM Ephemeral Key Pool")
+{
+  const auto& kem = select_kem(KEM::ID::DHKEM_P256_SHA256);
+  const auto skR = kem.derive_key_pair(from_hex("B0B0B0B0"));
+  const auto pkR = skR->public_key();
+
+  const auto pool_size = size_t(4);
+  kem.clear_ephemeral_pool();
+  kem.fill_ephemeral_pool(pool_size);
+  REQUIRE(kem.ephemeral_pool_size() == pool_size);
+
+  // Filling is idempotent up to the requested size
+  kem.fill_ephemeral_pool(pool_size / 2);
+  REQUIRE(kem.ephemeral_pool_size() == pool_size);
+
+  // Each pooled key pair is used once, and encap still works once the pool
+  // has run dry
+  auto encs = std::vector<bytes>{};
+  for (size_t i = 0; i < pool_size + 2; i++) {
+    auto [secretS, enc] = kem.encap(*pkR);
+    REQUIRE(kem.decap(enc, *skR) == secretS);
+    REQUIRE(std::find(encs.begin(), encs.end(), enc) == encs.end());
+    encs.push_back(enc);
+
+    auto expected = (i < pool_size) ? pool_size - i - 1 : 0;
+    REQUIRE(kem.ephemeral_pool_size() == expected);
+  }
+
+  kem.fill_ephemeral_pool(pool_size);
+  kem.clear_ephemeral_pool();
+  REQUIRE(kem.ephemeral_pool_size() == 0);
+}
+
+#if !defined(_WIN32)
+TEST_CASE("KEM Ephemeral Key Pool after fork")
+{
+  const auto& kem = select_kem(KEM::ID::DHKEM_P256_SHA256);
+  const auto skR = kem.derive_key_pair(from_hex("B0B0B0B0"));
+  const auto pkR = skR->public_key();
+
+  kem.clear_ephemeral_pool();
+  kem.fill_ephemeral_pool(1);
+
+  auto fds = std::array<int, 2>{};
+  REQUIRE(pipe(fds.data()) == 0);
+
+  const auto enc_size = kem.enc_size();
+  const auto pid = fork();
+  REQUIRE(pid >= 0);
+  if (pid == 0) {
+    // The child must not use the key pooled by the parent
+    auto ok = kem.ephemeral_pool_size() == 0;
+    auto [secret, enc] = kem.encap(*pkR);
+    auto written = write(fds[1], enc.data(), enc.size());
+    _exit(ok && written == static_cast<ssize_t>(enc_size) ? 0 : 1);
+  }
+
+  auto [secret, parent_enc] = kem.encap(*pkR);
+  auto child_enc = bytes(enc_size);
+  auto read_size = read(fds[0], child_enc.data(), child_enc.size());
+  close(fds[0]);
+  close(fds[1]);
+
+  auto status = 0;
+  REQUIRE(waitpid(pid, &status, 0) == pid);
+  REQUIRE(WIFEXITED(status));
+  REQUIRE(WEXITSTATUS(status) == 0);
+  REQUIRE(read_size == static_cast<ssize_t>(enc_size));
+  REQUIRE(parent_enc != child_enc);
+}
+#endif
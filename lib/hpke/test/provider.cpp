@@ -0,0 +1,111 @@
+#include <doctest/doctest.h>
+#include <hpke/provider.h>
+
+#include "common.h"
+
+#include <atomic>
+
+// A KDF that counts its calls and otherwise defers to another KDF
+struct CountingKDF : public KDF
+{
+  CountingKDF(const KDF& inner_in)
+    : KDF(inner_in.id)
+    , inner(inner_in)
+  {}
+
+  bytes extract(const bytes& salt, const bytes& ikm) const override
+  {
+    calls += 1;
+    return inner.extract(salt, ikm);
+  }
+
+  bytes expand(const bytes& prk, const bytes& info, size_t size) const override
+  {
+    calls += 1;
+    return inner.expand(prk, info, size);
+  }
+
+  size_t hash_size() const override { return inner.hash_size(); }
+
+  std::unique_ptr<Expander> expander(const bytes& prk) const override
+  {
+    calls += 1;
+    return inner.expander(prk);
+  }
+
+  bytes extract_pieces(const bytes& salt, Pieces ikm) const override
+  {
+    calls += 1;
+    return inner.extract_pieces(salt, ikm);
+  }
+
+  bytes expand_pieces(const bytes& prk,
+                      Pieces info,
+                      size_t size) const override
+  {
+    calls += 1;
+    return inner.expand_pieces(prk, info, size);
+  }
+
+  const KDF& inner;
+  mutable std::atomic<size_t> calls = 0;
+};
+
+struct TestProvider : public Provider
+{
+  TestProvider(bool available_in, const KDF& inner)
+    : is_available(available_in)
+    , kdf_sha256(inner)
+  {}
+
+  bool available() const override { return is_available; }
+
+  const KDF* kdf(KDF::ID id) const override
+  {
+    if (id != KDF::ID::HKDF_SHA256) {
+      return nullptr;
+    }
+    return &kdf_sha256;
+  }
+
+  const bool is_available;
+  const CountingKDF kdf_sha256;
+};
+
+TEST_CASE("Crypto Provider")
+{
+  const auto& builtin = KDF::get<KDF::ID::HKDF_SHA256>();
+  const auto& other = KDF::get<KDF::ID::HKDF_SHA512>();
+
+  // An unavailable provider is not installed
+  auto unavailable = std::make_shared<TestProvider>(false, builtin);
+  REQUIRE_FALSE(Provider::install(unavailable));
+  REQUIRE(&KDF::get<KDF::ID::HKDF_SHA256>() == &builtin);
+
+  // An installed provider replaces the primitives it supplies, and only those
+  auto provider = std::make_shared<TestProvider>(true, builtin);
+  REQUIRE(Provider::install(provider));
+  REQUIRE(&KDF::get<KDF::ID::HKDF_SHA256>() == &provider->kdf_sha256);
+  REQUIRE(&KDF::get<KDF::ID::HKDF_SHA512>() == &other);
+
+  // Objects built afterward use the provided primitive
+  const auto hpke = HPKE(KEM::ID::DHKEM_X25519_SHA256,
+                         KDF::ID::HKDF_SHA256,
+                         AEAD::ID::AES_128_GCM);
+  REQUIRE(&hpke.kdf == &provider->kdf_sha256);
+
+  const auto info = from_hex("00010203");
+  const auto aad = from_hex("04050607");
+  const auto pt = from_hex("08090a0b");
+  auto skR = hpke.kem.generate_key_pair();
+  auto pkR = skR->public_key();
+  auto [enc, ctxS] = hpke.setup_base_s(*pkR, info);
+  auto ctxR = hpke.setup_base_r(enc, *skR, info);
+  auto ct = ctxS.seal(aad, pt);
+  REQUIRE(ctxR.open(aad, ct) == pt);
+  REQUIRE(provider->kdf_sha256.calls > 0);
+
+  // Resetting restores the built-in primitives
+  Provider::reset();
+  REQUIRE(&KDF::get<KDF::ID::HKDF_SHA256>() == &builtin);
+}
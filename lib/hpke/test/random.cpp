@@ -1,9 +1,66 @@
 #include <doctest/doctest.h>
 #include <hpke/random.h>
 
+#include <array>
+
+#if !defined(_WIN32)
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
 TEST_CASE("Random bytes")
 {
   auto size = size_t(128);
   auto test_val = hpke::random_bytes(size);
   CHECK(test_val.size() == size);
 }
+
+TEST_CASE("Random bytes into a buffer")
+{
+  // Small requests are served from a pool; draw enough of them to refill it
+  auto previous = bytes(4);
+  hpke::random_bytes(previous.data(), previous.size());
+  for (int i = 0; i < 1000; i++) {
+    auto value = bytes(4);
+    hpke::random_bytes(value.data(), value.size());
+    REQUIRE(value != previous);
+    previous = value;
+  }
+
+  // Large requests bypass the pool
+  auto large = bytes(4096, 0);
+  hpke::random_bytes(large.data(), large.size());
+  CHECK(large != bytes(4096, 0));
+}
+
+#if !defined(_WIN32)
+TEST_CASE("Random bytes after fork")
+{
+  // Make sure this thread has a partly used pool before forking
+  auto warm = hpke::random_bytes(16);
+  CHECK(warm.size() == 16);
+
+  auto fds = std::array<int, 2>{};
+  REQUIRE(pipe(fds.data()) == 0);
+
+  const auto size = size_t(32);
+  const auto pid = fork();
+  REQUIRE(pid >= 0);
+  if (pid == 0) {
+    auto child_value = hpke::random_bytes(size);
+    auto written = write(fds[1], child_value.data(), child_value.size());
+    _exit(written == static_cast<ssize_t>(size) ? 0 : 1);
+  }
+
+  auto parent_value = hpke::random_bytes(size);
+  auto child_value = bytes(size);
+  auto read_size = read(fds[0], child_value.data(), child_value.size());
+  close(fds[0]);
+  close(fds[1]);
+
+  auto status = 0;
+  REQUIRE(waitpid(pid, &status, 0) == pid);
+  REQUIRE(read_size == static_cast<ssize_t>(size));
+  REQUIRE(parent_value != child_value);
+}
+#endif
@@ -100,3 +100,44 @@ TEST_CASE("Signature Round-Trip")
     CHECK(sig.verify(data, signature, *pub));
   }
 }
+
+TEST_CASE("Signature Batch Verification")
+{
+  const std::vector<Signature::ID> ids{
+    Signature::ID::P256_SHA256, Signature::ID::P384_SHA384,
+    Signature::ID::P521_SHA512, Signature::ID::Ed25519,
+    Signature::ID::Ed448,
+  };
+
+  const auto batch_size = size_t(16);
+
+  for (const auto& id : ids) {
+    const auto& sig = select_signature(id);
+
+    auto priv = sig.generate_key_pair();
+    auto pub = priv->public_key();
+
+    auto messages = std::vector<bytes>{};
+    auto signatures = std::vector<bytes>{};
+    for (size_t i = 0; i < batch_size; i++) {
+      messages.push_back(bytes(i + 1, static_cast<uint8_t>(i)));
+      signatures.push_back(sig.sign(messages.back(), *priv));
+    }
+
+    // Corrupt every third signature
+    for (size_t i = 0; i < batch_size; i += 3) {
+      signatures.at(i).at(0) ^= 0xff;
+    }
+
+    auto items = std::vector<Signature::VerifyItem>{};
+    for (size_t i = 0; i < batch_size; i++) {
+      items.push_back({ messages.at(i), signatures.at(i), *pub });
+    }
+
+    auto valid = sig.verify_batch(items);
+    REQUIRE(valid.size() == batch_size);
+    for (size_t i = 0; i < batch_size; i++) {
+      CHECK(valid.at(i) == (i % 3 != 0));
+    }
+  }
+}
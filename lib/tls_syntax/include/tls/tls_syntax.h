@@ -4,7 +4,9 @@
 #include <array>
 #include <map>
 #include <optional>
+#include <functional>
 #include <stdexcept>
+#include <utility>
 #include <variant>
 #include <vector>
 
@@ -39,15 +41,32 @@ class ostream
 public:
   static const size_t none = -1;
 
+  ostream() = default;
+
+  // Appends to an existing buffer, so that its capacity can be reused
+  explicit ostream(std::vector<uint8_t>&& buffer)
+    : _buffer(std::move(buffer))
+  {}
+
   void write_raw(const std::vector<uint8_t>& bytes);
+  void write_raw(const uint8_t* data, size_t size);
+
+  // Reserves space to be filled in after encoding, e.g., by an AEAD tag
+  void write_zeros(size_t count) { _buffer.resize(_buffer.size() + count); }
 
-  std::vector<uint8_t> bytes() const { return _buffer; }
+  std::vector<uint8_t> bytes() const& { return _buffer; }
+  std::vector<uint8_t> bytes() && { return std::move(_buffer); }
   size_t size() const { return _buffer.size(); }
   bool empty() const { return _buffer.empty(); }
+  void reserve(size_t size) { _buffer.reserve(_buffer.size() + size); }
+
+  // Moves the encoded data out, leaving the stream empty
+  std::vector<uint8_t> take() { return std::exchange(_buffer, {}); }
 
 private:
   std::vector<uint8_t> _buffer;
   ostream& write_uint(uint64_t value, int length);
+  void write_uint_at(size_t offset, uint64_t value, int length);
 
   friend ostream& operator<<(ostream& out, bool data);
   friend ostream& operator<<(ostream& out, uint8_t data);
@@ -87,6 +106,14 @@ operator<<(tls::ostream& out, const std::optional<T>& opt)
   return out << uint8_t(1) << opt.value();
 }
 
+// Reference writer, for encoding values that are stored elsewhere
+template<typename T>
+tls::ostream&
+operator<<(tls::ostream& out, const std::reference_wrapper<T>& ref)
+{
+  return out << ref.get();
+}
+
 // Enum writer
 template<typename T, std::enable_if_t<std::is_enum<T>::value, int> = 0>
 tls::ostream&
@@ -100,30 +127,45 @@ operator<<(tls::ostream& str, const T& val)
 /// istream
 ///
 
+// An istream reads in place from a buffer that it does not own, so the buffer
+// must outlive the istream.
 class istream
 {
 public:
   istream(const std::vector<uint8_t>& data)
-    : _buffer(data)
-  {
-    // So that we can use the constant-time pop_back
-    std::reverse(_buffer.begin(), _buffer.end());
-  }
+    : istream(data.data(), data.size())
+  {}
 
-  size_t size() const { return _buffer.size(); }
-  bool empty() const { return _buffer.empty(); }
+  // Reading from a temporary would leave the istream dangling
+  istream(const std::vector<uint8_t>&& data) = delete;
+
+  istream(const uint8_t* data, size_t size)
+    : _data(data)
+    , _end(size)
+  {}
+
+  size_t size() const { return _end - _pos; }
+  bool empty() const { return _pos == _end; }
+
+  // Skips the next `length` bytes without copying them, returning a pointer
+  // into the underlying buffer
+  const uint8_t* read_raw(size_t length) { return take(length); }
 
 private:
-  istream() {}
-  std::vector<uint8_t> _buffer;
-  uint8_t next();
+  const uint8_t* _data = nullptr;
+  size_t _end = 0;
+  size_t _pos = 0;
+
+  // Advances past the next `length` bytes, returning a pointer to them
+  const uint8_t* take(size_t length);
 
   template<typename T>
   istream& read_uint(T& data, int length)
   {
+    const auto* ptr = take(length);
     uint64_t value = 0;
     for (int i = 0; i < length; i += 1) {
-      value = (value << unsigned(8)) + next();
+      value = (value << unsigned(8)) + ptr[i];
     }
     data = value;
     return *this;
@@ -191,33 +233,6 @@ operator>>(tls::istream& str, T& val)
   return str;
 }
 
-// Abbreviations
-template<typename T>
-std::vector<uint8_t>
-marshal(const T& value)
-{
-  ostream w;
-  w << value;
-  return w.bytes();
-}
-
-template<typename T>
-void
-unmarshal(const std::vector<uint8_t>& data, T& value)
-{
-  istream r(data);
-  r >> value;
-}
-
-template<typename T, typename... Tp>
-T
-get(const std::vector<uint8_t>& data, Tp... args)
-{
-  T value(args...);
-  tls::unmarshal(data, value);
-  return value;
-}
-
 // Use this macro to define struct serialization with minimal boilerplate
 #define TLS_SERIALIZABLE(...)                                                  \
   static const bool _tls_serializable = true;                                  \
@@ -254,10 +269,69 @@ struct has_traits
   static const bool value = decltype(test<T>(true))::value;
 };
 
-// Traits must have static encode and decode methods, of the following form:
+///
+/// Encoded size
+///
+/// encoded_size(val) computes the length of the encoding of val without
+/// encoding it.  Types with their own operator<< provide an overload.
+///
+
+inline size_t
+encoded_size(bool /* unused */)
+{
+  return 1;
+}
+
+inline size_t
+encoded_size(uint8_t /* unused */)
+{
+  return 1;
+}
+
+inline size_t
+encoded_size(uint16_t /* unused */)
+{
+  return 2;
+}
+
+inline size_t
+encoded_size(uint32_t /* unused */)
+{
+  return 4;
+}
+
+inline size_t
+encoded_size(uint64_t /* unused */)
+{
+  return 8;
+}
+
+template<typename T, size_t N>
+size_t
+encoded_size(const std::array<T, N>& data);
+
+template<typename T>
+size_t
+encoded_size(const std::optional<T>& opt);
+
+template<typename T>
+size_t
+encoded_size(const std::reference_wrapper<T>& ref);
+
+template<typename T>
+std::enable_if_t<std::is_enum<T>::value, size_t>
+encoded_size(const T& val);
+
+template<typename T>
+std::enable_if_t<is_serializable<T>::value, size_t>
+encoded_size(const T& obj);
+
+// Traits must have static encode, decode, and size methods, of the following
+// form:
 //
 //     static ostream& encode(ostream& str, const T& val);
 //     static istream& decode(istream& str, T& val);
+//     static size_t size(const T& val);
 //
 // Trait types will never be constructed; only these static methods are used.
 // The value arguments to encode and decode can be as strict or as loose as
@@ -283,8 +357,27 @@ struct pass
   {
     return str >> val;
   }
+  template<typename T>
+  static size_t size(const T& val)
+  {
+    return encoded_size(val);
+  }
 };
 
+// The length of every encoding of a T, or zero if encodings vary in length
+template<typename T>
+constexpr size_t
+fixed_encoded_size()
+{
+  if constexpr (std::is_enum<T>::value) {
+    return sizeof(std::underlying_type_t<T>);
+  } else if constexpr (std::is_integral<T>::value) {
+    return sizeof(T);
+  } else {
+    return 0;
+  }
+}
+
 // Vector encoding
 template<size_t head, size_t min = none, size_t max = none>
 struct vector
@@ -318,31 +411,44 @@ struct vector
         throw WriteError("Invalid header size");
     }
 
-    // Pre-encode contents
-    ostream temp;
+    // Leave room for the length, encode the contents in place after it, then
+    // fill in the length
+    auto start = str._buffer.size();
+    str._buffer.resize(start + head);
     for (const auto& item : data) {
-      temp << item;
+      str << item;
     }
 
     // Check that the encoded length is OK
-    uint64_t size = temp._buffer.size();
+    uint64_t size = str._buffer.size() - start - head;
+    auto error = static_cast<const char*>(nullptr);
     if (size > head_max) {
-      throw WriteError("Data too large for header size");
+      error = "Data too large for header size";
     } else if ((max != none) && (size > max)) {
-      throw WriteError("Data too large for declared max");
+      error = "Data too large for declared max";
     } else if ((min != none) && (size < min)) {
-      throw WriteError("Data too small for declared min");
+      error = "Data too small for declared min";
     }
 
-    // Write the encoded length, then the pre-encoded data
-    str.write_uint(size, head);
-    str.write_raw(temp.bytes());
+    if (error != nullptr) {
+      str._buffer.resize(start);
+      throw WriteError(error);
+    }
 
+    str.write_uint_at(start, size, head);
     return str;
   }
 
   template<typename T>
   static istream& decode(istream& str, std::vector<T>& data)
+  {
+    return decode(str, data, none);
+  }
+
+  // As above, but rejecting a vector of more than `max_items` items before
+  // the items beyond that are allocated
+  template<typename T>
+  static istream& decode(istream& str, std::vector<T>& data, size_t max_items)
   {
     switch (head) {
       case 0: // fallthrough
@@ -357,13 +463,13 @@ struct vector
 
     // Read the size of the vector, if provided; otherwise consume all remaining
     // data in the buffer
-    uint64_t size = str._buffer.size();
+    uint64_t size = str.size();
     if (head > 0) {
       str.read_uint(size, head);
     }
 
     // Check the size against the declared constraints
-    if (size > str._buffer.size()) {
+    if (size > str.size()) {
       throw ReadError("Declared size exceeds available data size");
     } else if ((max != none) && (size > max)) {
       throw ReadError("Data too large for declared max");
@@ -371,26 +477,72 @@ struct vector
       throw ReadError("Data too small for declared min");
     }
 
-    // Truncate the data buffer
-    data.clear();
+    const auto* content = str.take(size);
 
-    // Truncate the buffer to the declared length and wrap it in a
-    // new reader, then read items from it
-    // NB: Remember that we store the vector in reverse order
+    // Items of a fixed size are counted, and their storage reserved, up front
+    constexpr auto item_size = fixed_encoded_size<T>();
+    if constexpr (item_size > 0) {
+      if (size % item_size != 0) {
+        throw ReadError("Data is not a whole number of items");
+      }
+
+      if (size / item_size > max_items) {
+        throw ReadError("Too many items");
+      }
+    }
+
+    // Opaque data is copied out in one step
+    if constexpr (std::is_same<T, uint8_t>::value) {
+      data.assign(content, content + size);
+      return str;
+    }
+
+    // Otherwise, read items from a reader over just the declared range
     // NB: This requires that T be default-constructible
-    std::vector<uint8_t> trunc(str._buffer.end() - size, str._buffer.end());
-    istream r;
-    r._buffer = trunc;
-    while (r._buffer.size() > 0) {
+    data.clear();
+    if constexpr (item_size > 0) {
+      data.reserve(size / item_size);
+    }
+
+    istream r(content, size);
+    while (!r.empty()) {
+      if (data.size() == max_items) {
+        throw ReadError("Too many items");
+      }
+
       data.emplace_back();
       r >> data.back();
     }
 
-    // Truncate the primary buffer
-    str._buffer.erase(str._buffer.end() - size, str._buffer.end());
-
     return str;
   }
+
+  template<typename T>
+  static size_t size(const std::vector<T>& data)
+  {
+    if constexpr (std::is_same<T, uint8_t>::value) {
+      return head + data.size();
+    }
+
+    auto size = size_t(head);
+    for (const auto& item : data) {
+      size += encoded_size(item);
+    }
+    return size;
+  }
+};
+
+// Vector encoding with a cap on the number of items that is read when
+// decoding, from Limit::max_items(), so that it can be set at run time.  A
+// vector with too many items is rejected before the excess is allocated.
+template<size_t head, typename Limit>
+struct bounded_vector : vector<head>
+{
+  template<typename T>
+  static istream& decode(istream& str, std::vector<T>& data)
+  {
+    return vector<head>::decode(str, data, Limit::max_items());
+  }
 };
 
 // Variant encoding
@@ -455,6 +607,13 @@ struct variant
     read_variant(str, target_type, data);
     return str;
   }
+  template<typename... Tp>
+  static size_t size(const std::variant<Tp...>& data)
+  {
+    auto type_size = encoded_size(typename Ts::selector{});
+    auto value_size = [](const auto& val) { return encoded_size(val); };
+    return type_size + std::visit(value_size, data);
+  }
 };
 
 // Struct writer without traits (enabled by macro)
@@ -557,6 +716,111 @@ inline
   return str;
 }
 
+///
+/// Encoded size definitions
+///
+
+template<typename T, size_t N>
+size_t
+encoded_size(const std::array<T, N>& data)
+{
+  auto size = size_t(0);
+  for (const auto& item : data) {
+    size += encoded_size(item);
+  }
+  return size;
+}
+
+template<typename T>
+size_t
+encoded_size(const std::optional<T>& opt)
+{
+  if (!opt.has_value()) {
+    return 1;
+  }
+
+  return 1 + encoded_size(opt.value());
+}
+
+template<typename T>
+size_t
+encoded_size(const std::reference_wrapper<T>& ref)
+{
+  return encoded_size(ref.get());
+}
+
+template<typename T>
+std::enable_if_t<std::is_enum<T>::value, size_t>
+encoded_size(const T& val)
+{
+  return encoded_size(static_cast<std::underlying_type_t<T>>(val));
+}
+
+template<typename Tr, size_t I = 0, typename... Tp>
+inline size_t
+tuple_size_traits(const std::tuple<Tp...>& t)
+{
+  if constexpr (I == sizeof...(Tp)) {
+    return 0;
+  } else if constexpr (std::is_same<Tr, void>::value) {
+    return encoded_size(std::get<I>(t)) + tuple_size_traits<Tr, I + 1>(t);
+  } else {
+    return std::tuple_element_t<I, Tr>::size(std::get<I>(t)) +
+           tuple_size_traits<Tr, I + 1>(t);
+  }
+}
+
+template<typename T>
+std::enable_if_t<is_serializable<T>::value, size_t>
+encoded_size(const T& obj)
+{
+  if constexpr (has_traits<T>::value) {
+    return tuple_size_traits<typename T::_tls_traits>(obj._tls_fields_w());
+  } else {
+    return tuple_size_traits<void>(obj._tls_fields_w());
+  }
+}
+
+// Abbreviations
+template<typename T>
+std::vector<uint8_t>
+marshal(const T& value)
+{
+  ostream w;
+  w.reserve(encoded_size(value));
+  w << value;
+  return w.take();
+}
+
+// Encodes value into out, replacing its contents but reusing its capacity
+template<typename T>
+void
+marshal_into(const T& value, std::vector<uint8_t>& out)
+{
+  out.clear();
+  ostream w(std::move(out));
+  w.reserve(encoded_size(value));
+  w << value;
+  out = w.take();
+}
+
+template<typename T>
+void
+unmarshal(const std::vector<uint8_t>& data, T& value)
+{
+  istream r(data);
+  r >> value;
+}
+
+template<typename T, typename... Tp>
+T
+get(const std::vector<uint8_t>& data, Tp... args)
+{
+  T value(args...);
+  tls::unmarshal(data, value);
+  return value;
+}
+
 ///
 /// Abbreviation for opaque<N>
 ///
@@ -11,6 +11,12 @@ ostream::write_raw(const std::vector<uint8_t>& bytes)
   _buffer.insert(_buffer.end(), bytes.begin(), bytes.end());
 }
 
+void
+ostream::write_raw(const uint8_t* data, size_t size)
+{
+  _buffer.insert(_buffer.end(), data, data + size);
+}
+
 // Primitive type writers
 ostream&
 ostream::write_uint(uint64_t value, int length)
@@ -21,6 +27,14 @@ ostream::write_uint(uint64_t value, int length)
   return *this;
 }
 
+void
+ostream::write_uint_at(size_t offset, uint64_t value, int length)
+{
+  for (int i = 0; i < length; i += 1) {
+    _buffer.at(offset + i) = value >> unsigned(8 * (length - 1 - i));
+  }
+}
+
 ostream&
 operator<<(ostream& out, bool data)
 {
@@ -55,17 +69,16 @@ operator<<(ostream& out, uint64_t data)
   return out.write_uint(data, 8);
 }
 
-// Because pop_back() on an empty vector is undefined
-uint8_t
-istream::next()
+const uint8_t*
+istream::take(size_t length)
 {
-  if (_buffer.empty()) {
-    throw ReadError("Attempt to read from empty buffer");
+  if (length > size()) {
+    throw ReadError("Attempt to read past the end of the buffer");
   }
 
-  uint8_t value = _buffer.back();
-  _buffer.pop_back();
-  return value;
+  const auto* ptr = _data + _pos;
+  _pos += length;
+  return ptr;
 }
 
 // Primitive type readers
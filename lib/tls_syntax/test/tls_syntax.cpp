@@ -101,6 +101,7 @@ ostream_test(T val, const std::vector<uint8_t>& enc)
   w << val;
   REQUIRE(w.bytes() == enc);
   REQUIRE(w.size() == enc.size());
+  REQUIRE(tls::encoded_size(val) == enc.size());
 }
 
 TEST_CASE_FIXTURE(TLSSyntaxTest, "TLS ostream")
@@ -169,6 +170,99 @@ TEST_CASE_FIXTURE(TLSSyntaxTest, "TLS istream")
   istream_test(val_opaque, data_opaque, enc_opaque);
 }
 
+TEST_CASE_FIXTURE(TLSSyntaxTest, "TLS istream in place")
+{
+  // Read two structs in sequence from the middle of a larger buffer
+  auto enc = from_hex("ffff") + enc_struct + enc_struct + from_hex("ffff");
+  tls::istream r(enc.data() + 2, enc.size() - 4);
+
+  ExampleStruct first;
+  ExampleStruct second;
+  r >> first >> second;
+  REQUIRE(first == val_struct);
+  REQUIRE(second == val_struct);
+  REQUIRE(second.d == val_struct.d);
+  REQUIRE(r.empty());
+
+  // Reads past the end of the range fail, even with data beyond it
+  uint8_t extra = 0;
+  REQUIRE_THROWS_AS(r >> extra, tls::ReadError);
+
+  // A vector whose declared length overruns the input is rejected
+  auto truncated = from_hex("0004aabb");
+  auto data = std::vector<uint8_t>{};
+  tls::istream r_trunc(truncated);
+  REQUIRE_THROWS_AS(tls::vector<2>::decode(r_trunc, data), tls::ReadError);
+}
+
+struct TwoItems
+{
+  static size_t max_items() { return 2; }
+};
+
+TEST_CASE_FIXTURE(TLSSyntaxTest, "TLS vector limits")
+{
+  using limited = tls::bounded_vector<1, TwoItems>;
+
+  // Fixed-size items are counted before any are read
+  auto ints = std::vector<uint16_t>{};
+  auto two_ints = from_hex("0400010002");
+  tls::istream r_two(two_ints);
+  limited::decode(r_two, ints);
+  REQUIRE(ints == std::vector<uint16_t>{ 1, 2 });
+  REQUIRE(r_two.empty());
+
+  auto three_ints = from_hex("06000100020003");
+  tls::istream r_three(three_ints);
+  REQUIRE_THROWS_AS(limited::decode(r_three, ints), tls::ReadError);
+
+  auto partial_int = from_hex("03000100");
+  tls::istream r_partial(partial_int);
+  REQUIRE_THROWS_AS(tls::vector<1>::decode(r_partial, ints), tls::ReadError);
+
+  // Other items are counted as they are read
+  auto structs = std::vector<ExampleStruct>{};
+  auto w_two = tls::ostream{};
+  auto w_three = tls::ostream{};
+  tls::vector<1>::encode(w_two, std::vector{ val_struct, val_struct });
+  tls::vector<1>::encode(w_three,
+                         std::vector{ val_struct, val_struct, val_struct });
+  auto enc_two = w_two.bytes();
+  auto enc_three = w_three.bytes();
+
+  tls::istream r_two_structs(enc_two);
+  limited::decode(r_two_structs, structs);
+  REQUIRE(structs.size() == 2);
+
+  tls::istream r_three_structs(enc_three);
+  REQUIRE_THROWS_AS(limited::decode(r_three_structs, structs),
+                    tls::ReadError);
+
+  // Encoding is unchanged
+  tls::ostream w;
+  limited::encode(w, ints);
+  REQUIRE(w.bytes() == two_ints);
+  REQUIRE(limited::size(ints) == two_ints.size());
+}
+
+TEST_CASE_FIXTURE(TLSSyntaxTest, "TLS ostream in place")
+{
+  tls::ostream w;
+  w << val_struct;
+  REQUIRE(w.bytes() == enc_struct);
+
+  // A vector that violates its constraints leaves the stream as it was
+  auto too_short = std::vector<uint8_t>{ 0x01 };
+  using short_vector = tls::vector<1, 2>;
+  REQUIRE_THROWS_AS(short_vector::encode(w, too_short), tls::WriteError);
+  REQUIRE(w.bytes() == enc_struct);
+
+  // Taking the buffer leaves the stream empty
+  auto taken = w.take();
+  REQUIRE(taken == enc_struct);
+  REQUIRE(w.empty());
+}
+
 TEST_CASE_FIXTURE(TLSSyntaxTest, "TLS abbreviations")
 {
   ExampleStruct val_in = val_struct;
@@ -0,0 +1,85 @@
+#include <mls/async_session.h>
+
+namespace mls {
+
+AsyncSession::AsyncSession(Session session_in, ThreadPool& pool)
+  : session(std::move(session_in))
+  , strand(pool)
+{}
+
+std::future<Session>
+AsyncSession::join(PendingJoin pending,
+                   bytes welcome,
+                   ThreadPool& pool,
+                   Executor& crypto)
+{
+  // A posted job has to be copyable, so the move-only inputs are shared
+  auto join = std::make_shared<PendingJoin>(std::move(pending));
+  auto task = std::make_shared<std::packaged_task<Session()>>(
+    [join, welcome = std::move(welcome), &crypto]() {
+      return join->complete(welcome, crypto);
+    });
+  auto result = task->get_future();
+  pool.post([task]() { (*task)(); });
+  return result;
+}
+
+std::future<bytes>
+AsyncSession::add(bytes key_package_data)
+{
+  return call([data = std::move(key_package_data)](Session& s) {
+    return s.add(data);
+  });
+}
+
+std::future<bytes>
+AsyncSession::update()
+{
+  return call([](Session& s) { return s.update(); });
+}
+
+std::future<bytes>
+AsyncSession::remove(uint32_t index)
+{
+  return call([index](Session& s) { return s.remove(index); });
+}
+
+std::future<std::tuple<bytes, bytes>>
+AsyncSession::commit(std::vector<bytes> proposals)
+{
+  return call([proposals = std::move(proposals)](Session& s) {
+    return s.commit(proposals);
+  });
+}
+
+std::future<std::tuple<bytes, bytes>>
+AsyncSession::commit()
+{
+  return call([](Session& s) { return s.commit(); });
+}
+
+std::future<bool>
+AsyncSession::handle(bytes handshake_data)
+{
+  return call([data = std::move(handshake_data)](Session& s) {
+    return s.handle(data);
+  });
+}
+
+std::future<bytes>
+AsyncSession::protect(bytes plaintext)
+{
+  return call([pt = std::move(plaintext)](Session& s) {
+    return s.protect(pt);
+  });
+}
+
+std::future<bytes>
+AsyncSession::unprotect(bytes ciphertext)
+{
+  return call([ct = std::move(ciphertext)](Session& s) {
+    return s.unprotect(ct);
+  });
+}
+
+} // namespace mls
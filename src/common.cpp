@@ -1,5 +1,7 @@
 #include "mls/common.h"
 
+#include <hpke/random.h>
+
 namespace mls {
 
 uint64_t
@@ -10,4 +12,126 @@ seconds_since_epoch()
   return std::time(nullptr);
 }
 
+static uint64_t
+load_le64(const uint8_t* data, size_t size)
+{
+  auto out = uint64_t(0);
+  for (size_t i = 0; i < size; i++) {
+    out |= uint64_t(data[i]) << (8 * i);
+  }
+  return out;
+}
+
+static uint64_t
+rotl64(uint64_t x, unsigned int bits)
+{
+  return (x << bits) | (x >> (64 - bits));
+}
+
+struct SipState
+{
+  std::array<uint64_t, 4> v;
+
+  void round()
+  {
+    v[0] += v[1];
+    v[1] = rotl64(v[1], 13);
+    v[1] ^= v[0];
+    v[0] = rotl64(v[0], 32);
+    v[2] += v[3];
+    v[3] = rotl64(v[3], 16);
+    v[3] ^= v[2];
+    v[0] += v[3];
+    v[3] = rotl64(v[3], 21);
+    v[3] ^= v[0];
+    v[2] += v[1];
+    v[1] = rotl64(v[1], 17);
+    v[1] ^= v[2];
+    v[2] = rotl64(v[2], 32);
+  }
+
+  void absorb(uint64_t m)
+  {
+    v[3] ^= m;
+    round();
+    round();
+    v[0] ^= m;
+  }
+};
+
+size_t
+BytesHash::operator()(const bytes& data) const
+{
+  static const auto key = [] {
+    const auto seed = hpke::random_bytes(16);
+    return std::array<uint64_t, 2>{ load_le64(seed.data(), 8),
+                                    load_le64(seed.data() + 8, 8) };
+  }();
+
+  auto state = SipState{ {
+    key[0] ^ uint64_t(0x736f6d6570736575),
+    key[1] ^ uint64_t(0x646f72616e646f6d),
+    key[0] ^ uint64_t(0x6c7967656e657261),
+    key[1] ^ uint64_t(0x7465646279746573),
+  } };
+
+  const auto* ptr = data.data();
+  const auto blocks = data.size() / 8;
+  for (size_t i = 0; i < blocks; i++) {
+    state.absorb(load_le64(ptr + 8 * i, 8));
+  }
+
+  const auto tail = load_le64(ptr + 8 * blocks, data.size() % 8);
+  state.absorb(tail | (uint64_t(data.size() & 0xff) << 56));
+
+  state.v[2] ^= 0xff;
+  for (auto i = 0; i < 4; i++) {
+    state.round();
+  }
+
+  return static_cast<size_t>(state.v[0] ^ state.v[1] ^ state.v[2] ^
+                             state.v[3]);
+}
+
+static const auto no_decode_limits = DecodeLimits{};
+static thread_local const DecodeLimits* decode_limits = &no_decode_limits;
+
+const DecodeLimits&
+DecodeLimits::current()
+{
+  return *decode_limits;
+}
+
+DecodeLimits::Scope::Scope(const DecodeLimits& limits)
+  : _prior(decode_limits)
+{
+  decode_limits = &limits;
+}
+
+DecodeLimits::Scope::~Scope()
+{
+  decode_limits = _prior;
+}
+
+size_t
+MemoryUsage::total() const
+{
+  return tree + private_key_cache + path_secrets + key_schedule + ratchets +
+         pending_proposals + history + other;
+}
+
+MemoryUsage&
+MemoryUsage::operator+=(const MemoryUsage& rhs)
+{
+  tree += rhs.tree;
+  private_key_cache += rhs.private_key_cache;
+  path_secrets += rhs.path_secrets;
+  key_schedule += rhs.key_schedule;
+  ratchets += rhs.ratchets;
+  pending_proposals += rhs.pending_proposals;
+  history += rhs.history;
+  other += rhs.other;
+  return *this;
+}
+
 } // namespace mls
@@ -0,0 +1,348 @@
+#include "mls/compression.h"
+
+#include <algorithm>
+#include <limits>
+
+namespace mls {
+
+///
+/// mls_lz
+///
+/// The compressed form is the uncompressed size as a uint32, followed by a
+/// series of sequences, as in the LZ4 block format:
+///
+///   token               literal length << 4 | (match length - 4)
+///   literal length      255-continued bytes, if the nibble is 15
+///   literals
+///   offset              uint16, back from the end of the output so far
+///   match length        255-continued bytes, if the nibble is 15
+///
+/// The last sequence has only literals, and ends the input.  Matches may
+/// reach back into a preset dictionary, which is treated as output that
+/// precedes the first byte.
+///
+
+// The extensions that KeyPackage adds by default, and a CompressionExtension
+// listing mls_lz, which appear once for each member in the tree of a Welcome.
+// Changing this changes the format, so it is fixed here rather than computed
+// from the current defaults.
+static const auto lz_dictionary = from_hex("ff0001"
+                                           "002b"
+                                           "0001000201ff"
+                                           "0002000d0c000100020003000400050006"
+                                           "00030010"
+                                           "0000000000000000"
+                                           "ffffffffffffffff"
+                                           "0007000302"
+                                           "0001");
+
+static constexpr size_t lz_min_match = 4;
+static constexpr size_t lz_max_offset = 0xffff;
+static constexpr size_t lz_hash_bits = 14;
+
+// No input byte produces more than 255 bytes of output, so a claimed size
+// beyond that is malformed, whatever the limit
+static constexpr size_t lz_max_expansion = 255;
+
+static uint32_t
+lz_hash(const uint8_t* data)
+{
+  const auto word = (uint32_t(data[0]) << 24) | (uint32_t(data[1]) << 16) |
+                    (uint32_t(data[2]) << 8) | uint32_t(data[3]);
+  return (word * 2654435761U) >> (32 - lz_hash_bits);
+}
+
+static void
+lz_write_length(bytes& out, size_t length)
+{
+  for (; length >= 255; length -= 255) {
+    out.push_back(255);
+  }
+  out.push_back(static_cast<uint8_t>(length));
+}
+
+static void
+lz_write_sequence(bytes& out,
+                  const uint8_t* literals,
+                  size_t literal_size,
+                  size_t offset,
+                  size_t match_size)
+{
+  const auto literal_nibble = std::min<size_t>(literal_size, 15);
+  const auto match_nibble =
+    (match_size == 0) ? 0 : std::min<size_t>(match_size - lz_min_match, 15);
+  out.push_back(static_cast<uint8_t>((literal_nibble << 4) | match_nibble));
+  if (literal_nibble == 15) {
+    lz_write_length(out, literal_size - 15);
+  }
+
+  out.insert(out.end(), literals, literals + literal_size);
+  if (match_size == 0) {
+    return;
+  }
+
+  out.push_back(static_cast<uint8_t>(offset >> 8));
+  out.push_back(static_cast<uint8_t>(offset));
+  if (match_nibble == 15) {
+    lz_write_length(out, match_size - lz_min_match - 15);
+  }
+}
+
+static bytes
+lz_compress(const bytes& data)
+{
+  if (data.size() > std::numeric_limits<uint32_t>::max()) {
+    throw InvalidParameterError("Data too large to compress");
+  }
+
+  // Matching runs over the dictionary and the data as one buffer, with the
+  // dictionary already entered in the hash table
+  auto window = lz_dictionary;
+  window.insert(window.end(), data.begin(), data.end());
+  const auto* base = window.data();
+  const auto end = window.size();
+
+  static constexpr size_t no_position = std::numeric_limits<size_t>::max();
+  auto table = std::vector<size_t>(size_t(1) << lz_hash_bits, no_position);
+  auto pos = lz_dictionary.size();
+  for (size_t i = 0; i + lz_min_match <= pos; i++) {
+    table[lz_hash(base + i)] = i;
+  }
+
+  auto out = bytes{};
+  out.reserve(4 + data.size() + data.size() / 255 + 16);
+  const auto size = static_cast<uint32_t>(data.size());
+  for (int shift = 24; shift >= 0; shift -= 8) {
+    out.push_back(static_cast<uint8_t>(size >> shift));
+  }
+
+  auto literal_start = pos;
+  while (pos + lz_min_match <= end) {
+    const auto hash = lz_hash(base + pos);
+    const auto candidate = table[hash];
+    table[hash] = pos;
+
+    if (candidate == no_position || pos - candidate > lz_max_offset ||
+        !std::equal(base + pos, base + pos + lz_min_match, base + candidate)) {
+      pos += 1;
+      continue;
+    }
+
+    auto match_size = lz_min_match;
+    while (pos + match_size < end &&
+           base[candidate + match_size] == base[pos + match_size]) {
+      match_size += 1;
+    }
+
+    lz_write_sequence(out,
+                      base + literal_start,
+                      pos - literal_start,
+                      pos - candidate,
+                      match_size);
+
+    // Enter the positions covered by the match, so that later repeats of it
+    // can be found
+    const auto match_end = pos + match_size;
+    for (pos += 1; pos < match_end && pos + lz_min_match <= end; pos++) {
+      table[lz_hash(base + pos)] = pos;
+    }
+    pos = match_end;
+    literal_start = pos;
+  }
+
+  lz_write_sequence(out, base + literal_start, end - literal_start, 0, 0);
+  return out;
+}
+
+static size_t
+lz_read_length(const bytes& data, size_t& pos, size_t length)
+{
+  for (;;) {
+    if (pos >= data.size()) {
+      throw ProtocolError("Truncated compressed data");
+    }
+
+    const auto next = data[pos++];
+    length += next;
+    if (next != 255) {
+      return length;
+    }
+  }
+}
+
+static bytes
+lz_decompress(const bytes& data, size_t max_size)
+{
+  if (data.size() < 4) {
+    throw ProtocolError("Truncated compressed data");
+  }
+
+  auto size = size_t(0);
+  for (size_t i = 0; i < 4; i++) {
+    size = (size << 8) | data[i];
+  }
+  if (size > max_size) {
+    throw ProtocolError("Decompressed data too large");
+  }
+
+  if (size > (data.size() - 4) * lz_max_expansion) {
+    throw ProtocolError("Malformed compressed data");
+  }
+
+  // The claimed size is only trusted as a bound, so the output grows with
+  // what the input actually produces
+  const auto start = lz_dictionary.size();
+  const auto end = start + size;
+  auto out = lz_dictionary;
+  out.reserve(start + std::min(size, 4 * data.size()));
+
+  auto pos = size_t(4);
+  for (;;) {
+    if (pos >= data.size()) {
+      throw ProtocolError("Truncated compressed data");
+    }
+
+    const auto token = data[pos++];
+    auto literal_size = size_t(token >> 4);
+    if (literal_size == 15) {
+      literal_size = lz_read_length(data, pos, literal_size);
+    }
+
+    if (literal_size > data.size() - pos || literal_size > end - out.size()) {
+      throw ProtocolError("Malformed compressed data");
+    }
+
+    const auto literals = data.begin() + static_cast<ptrdiff_t>(pos);
+    out.insert(out.end(), literals, literals + literal_size);
+    pos += literal_size;
+
+    if (pos == data.size()) {
+      break;
+    }
+
+    if (data.size() - pos < 2) {
+      throw ProtocolError("Truncated compressed data");
+    }
+
+    const auto offset = (size_t(data[pos]) << 8) | data[pos + 1];
+    pos += 2;
+
+    auto match_size = size_t(token & 0x0f);
+    if (match_size == 15) {
+      match_size = lz_read_length(data, pos, match_size);
+    }
+    match_size += lz_min_match;
+
+    if (offset == 0 || offset > out.size() ||
+        match_size > end - out.size()) {
+      throw ProtocolError("Malformed compressed data");
+    }
+
+    // Byte by byte, since the match may overlap the bytes it produces
+    auto from = out.size() - offset;
+    for (size_t i = 0; i < match_size; i++) {
+      out.push_back(out[from + i]);
+    }
+  }
+
+  if (out.size() != end) {
+    throw ProtocolError("Compressed data does not match its size");
+  }
+
+  out.erase(out.begin(), out.begin() + static_cast<ptrdiff_t>(start));
+  return out;
+}
+
+///
+/// Dispatch
+///
+
+bytes
+compress(CompressionAlgorithm algorithm, const bytes& data)
+{
+  switch (algorithm) {
+    case CompressionAlgorithm::none:
+      return data;
+
+    case CompressionAlgorithm::mls_lz:
+      return lz_compress(data);
+
+    default:
+      throw InvalidParameterError("Unsupported compression algorithm");
+  }
+}
+
+bytes
+decompress(CompressionAlgorithm algorithm,
+           const bytes& data,
+           size_t max_size)
+{
+  switch (algorithm) {
+    case CompressionAlgorithm::none:
+      if (data.size() > max_size) {
+        throw ProtocolError("Decompressed data too large");
+      }
+      return data;
+
+    case CompressionAlgorithm::mls_lz:
+      return lz_decompress(data, max_size);
+
+    default:
+      throw ProtocolError("Unsupported compression algorithm");
+  }
+}
+
+static bool
+is_implemented(CompressionAlgorithm algorithm)
+{
+  return algorithm == CompressionAlgorithm::mls_lz;
+}
+
+bool
+supports_compression(const KeyPackage& key_package,
+                     CompressionAlgorithm algorithm)
+{
+  if (algorithm == CompressionAlgorithm::none) {
+    return true;
+  }
+
+  const auto ext = key_package.extensions.find<CompressionExtension>();
+  if (!ext.has_value()) {
+    return false;
+  }
+
+  const auto& algorithms = ext.value().algorithms;
+  return std::find(algorithms.begin(), algorithms.end(), algorithm) !=
+         algorithms.end();
+}
+
+CompressionAlgorithm
+common_compression(const std::vector<KeyPackage>& key_packages)
+{
+  if (key_packages.empty()) {
+    return CompressionAlgorithm::none;
+  }
+
+  const auto ext = key_packages.front().extensions.find<CompressionExtension>();
+  if (!ext.has_value()) {
+    return CompressionAlgorithm::none;
+  }
+
+  for (const auto algorithm : ext.value().algorithms) {
+    if (!is_implemented(algorithm)) {
+      continue;
+    }
+
+    const auto all = std::all_of(
+      key_packages.begin(), key_packages.end(), [&](const auto& kp) {
+        return supports_compression(kp, algorithm);
+      });
+    if (all) {
+      return algorithm;
+    }
+  }
+
+  return CompressionAlgorithm::none;
+}
+
+} // namespace mls
@@ -16,6 +16,8 @@ const uint16_t SupportedCipherSuitesExtension::type =
 const uint16_t LifetimeExtension::type = ExtensionType::lifetime;
 const uint16_t KeyIDExtension::type = ExtensionType::key_id;
 const uint16_t ParentHashExtension::type = ExtensionType::parent_hash;
+const uint16_t ExternalTreeExtension::type = ExtensionType::external_tree;
+const uint16_t CompressionExtension::type = ExtensionType::compression;
 
 void
 ExtensionList::add(uint16_t type, bytes data)
@@ -59,6 +61,18 @@ KeyPackage::KeyPackage()
 static const uint64_t default_not_before = 0x0000000000000000;
 static const uint64_t default_not_after = 0xffffffffffffffff;
 
+static void
+add_default_extensions(ExtensionList& extensions)
+{
+  extensions.add(SupportedVersionsExtension{
+    { all_supported_versions.begin(), all_supported_versions.end() } });
+  extensions.add(SupportedCipherSuitesExtension{
+    { all_supported_suites.begin(), all_supported_suites.end() } });
+
+  // TODO(RLB) Set non-eternal lifetimes
+  extensions.add(LifetimeExtension{ default_not_before, default_not_after });
+}
+
 KeyPackage::KeyPackage(CipherSuite suite_in,
                        HPKEPublicKey init_key_in,
                        Credential credential_in,
@@ -69,21 +83,67 @@ KeyPackage::KeyPackage(CipherSuite suite_in,
   , init_key(std::move(init_key_in))
   , credential(std::move(credential_in))
 {
-  extensions.add(SupportedVersionsExtension{
-    { all_supported_versions.begin(), all_supported_versions.end() } });
-  extensions.add(SupportedCipherSuitesExtension{
-    { all_supported_suites.begin(), all_supported_suites.end() } });
+  add_default_extensions(extensions);
+  sign(sig_priv_in, opts_in);
+}
 
-  // TODO(RLB) Set non-eternal lifetimes
-  extensions.add(LifetimeExtension{ default_not_before, default_not_after });
+std::vector<KeyPackage>
+KeyPackage::generate(CipherSuite suite,
+                     const std::vector<HPKEPublicKey>& init_keys,
+                     const Credential& credential,
+                     const SignaturePrivateKey& sig_priv,
+                     const std::optional<KeyPackageOpts>& opts,
+                     Executor& executor)
+{
+  // Everything but the init key and signature is the same in each
+  auto proto = KeyPackage{};
+  proto.cipher_suite = suite;
+  proto.credential = credential;
+  add_default_extensions(proto.extensions);
+  if (opts.has_value()) {
+    for (const auto& ext : opts.value().extensions.extensions) {
+      proto.extensions.add(ext.type, ext.data);
+    }
+  }
 
-  sign(sig_priv_in, opts_in);
+  auto prefix = tls::ostream{};
+  prefix << proto.version << proto.cipher_suite;
+  const auto prefix_data = prefix.take();
+  const auto credential_data = tls::marshal(proto.credential);
+  const auto extensions_data = tls::marshal(proto.extensions);
+
+  auto key_packages = std::vector<KeyPackage>(init_keys.size(), proto);
+  executor.run(init_keys.size(), [&](size_t i) {
+    auto& kp = key_packages.at(i);
+    kp.init_key = init_keys.at(i);
+
+    // The same as to_be_signed() and tls::marshal(kp), from the shared parts
+    const auto init_key_data = tls::marshal(kp.init_key);
+    auto tbs = concat(prefix_data, init_key_data, credential_data);
+    kp.signature = sig_priv.sign(suite, tbs);
+
+    auto digest = suite.get().digest.hash_context();
+    digest->update(tbs);
+    digest->update(extensions_data);
+    digest->update(tls::marshal(tls::opaque<2>{ kp.signature }));
+    auto hash = digest->finalize();
+    kp.update_memo([&](Memo& next) { next.hash = std::move(hash); });
+  });
+
+  return key_packages;
 }
 
 bytes
 KeyPackage::hash() const
 {
-  return cipher_suite.get().digest.hash(tls::marshal(*this));
+  const auto memo = find_memo();
+  if (memo && memo->hash.has_value()) {
+    return memo->hash.value();
+  }
+
+  auto digest = cipher_suite.get().digest.hash(tls::marshal(*this));
+  update_memo([&](Memo& next) { next.hash = digest; });
+  return digest;
 }
 
 void
@@ -125,6 +185,11 @@ KeyPackage::verify_extension_support(const ExtensionList& ext_list) const
 bool
 KeyPackage::verify() const
 {
+  const auto memo = find_memo();
+  if (memo && memo->verified.has_value()) {
+    return memo->verified.value();
+  }
+
   auto tbs = to_be_signed();
   auto identity_key = credential.public_key();
 
@@ -136,7 +201,9 @@ KeyPackage::verify() const
     }
   }
 
-  return identity_key.verify(cipher_suite, tbs, signature);
+  const auto valid = identity_key.verify(cipher_suite, tbs, signature);
+  update_memo([&](Memo& next) { next.verified = valid; });
+  return valid;
 }
 
 bytes
@@ -144,7 +211,47 @@ KeyPackage::to_be_signed() const
 {
   tls::ostream out;
   out << version << cipher_suite << init_key << credential;
-  return out.bytes();
+  return out.take();
+}
+
+bytes
+KeyPackage::fields_digest() const
+{
+  static const auto& sha256 = hpke::Digest::get<hpke::Digest::ID::SHA256>();
+
+  auto w = tls::ostream{};
+  w << version << cipher_suite << init_key << extensions;
+  tls::vector<2>::encode(w, signature);
+  return sha256.hash(w.bytes());
+}
+
+std::shared_ptr<const KeyPackage::Memo>
+KeyPackage::find_memo() const
+{
+  auto memo = _memo.load();
+  if (!memo || memo->credential != credential ||
+      memo->fields_digest != fields_digest()) {
+    return nullptr;
+  }
+
+  return memo;
+}
+
+void
+KeyPackage::update_memo(const std::function<void(Memo&)>& update) const
+{
+  // A memo for other field values is replaced rather than extended
+  auto next = std::make_shared<Memo>(
+    Memo{ credential, fields_digest(), std::nullopt, std::nullopt });
+  _memo.with([&](std::shared_ptr<const Memo>& memo) {
+    if (memo && memo->credential == next->credential &&
+        memo->fields_digest == next->fields_digest) {
+      *next = *memo;
+    }
+
+    update(*next);
+    memo = std::move(next);
+  });
 }
 
 bool
@@ -1,7 +1,15 @@
 #include "mls/credential.h"
 #include "hpke/certificate.h"
+#include "hpke/digest.h"
 #include <tls/tls_syntax.h>
 
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <unordered_map>
+
 namespace mls {
 
 ///
@@ -41,6 +49,104 @@ find_signature(Signature::ID id)
   throw InvalidParameterError("Unsupported algorithm");
 }
 
+// Chains that have passed verification, keyed by the concatenated SHA-256
+// digests of their certificates, leaf first, so that a key names both a
+// certificate and the issuers it was verified against.  Entries expire after a
+// fixed time, so that a chain is re-verified periodically, and the cache is
+// bounded; when it is full, the entry closest to expiry is dropped.
+struct VerifiedChainCache
+{
+  using Clock = std::chrono::steady_clock;
+
+  static constexpr size_t capacity = 1024;
+  static constexpr auto lifetime = std::chrono::minutes(60);
+
+  struct Entry
+  {
+    Clock::time_point expiry;
+    SignatureScheme signature_scheme;
+    SignaturePublicKey public_key;
+  };
+
+  static VerifiedChainCache& get()
+  {
+    static auto cache = VerifiedChainCache{};
+    return cache;
+  }
+
+  static bytes key(const std::vector<X509Credential::CertData>& der_chain)
+  {
+    static const auto& sha256 = hpke::Digest::get<hpke::Digest::ID::SHA256>();
+    auto out = bytes{};
+    for (const auto& cert : der_chain) {
+      out += sha256.hash(cert.data);
+    }
+    return out;
+  }
+
+  std::optional<Entry> find(const bytes& key)
+  {
+    const auto lock = std::lock_guard(mutex);
+    auto it = entries.find(key);
+    if (it == entries.end()) {
+      return std::nullopt;
+    }
+
+    if (it->second.expiry <= Clock::now()) {
+      entries.erase(it);
+      return std::nullopt;
+    }
+
+    return it->second;
+  }
+
+  void insert(bytes key, SignatureScheme scheme, SignaturePublicKey pub)
+  {
+    const auto lock = std::lock_guard(mutex);
+    const auto now = Clock::now();
+    if (entries.size() >= capacity && entries.count(key) == 0) {
+      evict(now);
+    }
+
+    entries.insert_or_assign(
+      std::move(key), Entry{ now + lifetime, scheme, std::move(pub) });
+  }
+
+  size_t size()
+  {
+    const auto lock = std::lock_guard(mutex);
+    return static_cast<size_t>(
+      std::count_if(entries.begin(), entries.end(), [&](const auto& entry) {
+        return entry.second.expiry > Clock::now();
+      }));
+  }
+
+private:
+  std::mutex mutex;
+  std::map<bytes, Entry> entries;
+
+  void evict(Clock::time_point now)
+  {
+    for (auto it = entries.begin(); it != entries.end();) {
+      if (it->second.expiry <= now) {
+        it = entries.erase(it);
+      } else {
+        ++it;
+      }
+    }
+
+    if (entries.size() < capacity) {
+      return;
+    }
+
+    const auto oldest =
+      std::min_element(entries.begin(), entries.end(), [](auto& a, auto& b) {
+        return a.second.expiry < b.second.expiry;
+      });
+    entries.erase(oldest);
+  }
+};
+
 X509Credential::X509Credential(
   std::vector<X509Credential::CertData> der_chain_in)
   : der_chain(std::move(der_chain_in))
@@ -49,6 +155,14 @@ X509Credential::X509Credential(
     throw std::invalid_argument("empty certificate chain");
   }
 
+  auto& verified = VerifiedChainCache::get();
+  auto key = VerifiedChainCache::key(der_chain);
+  if (const auto cached = verified.find(key)) {
+    _signature_scheme = cached->signature_scheme;
+    _public_key = cached->public_key;
+    return;
+  }
+
   // Parse the chain
   auto parsed = std::vector<Certificate>();
   for (const auto& cert : der_chain) {
@@ -67,6 +181,14 @@ X509Credential::X509Credential(
       throw std::runtime_error("Certificate Chain validation failure");
     }
   }
+
+  verified.insert(std::move(key), _signature_scheme, _public_key);
+}
+
+size_t
+X509Credential::cached_chain_count()
+{
+  return VerifiedChainCache::get().size();
 }
 
 SignaturePublicKey
@@ -91,6 +213,12 @@ operator>>(tls::istream& str, X509Credential& obj)
   return str;
 }
 
+size_t
+encoded_size(const X509Credential& obj)
+{
+  return tls::vector<4>::size(obj.der_chain);
+}
+
 bool
 operator==(const X509Credential& lhs, const X509Credential& rhs)
 {
@@ -101,10 +229,121 @@ operator==(const X509Credential& lhs, const X509Credential& rhs)
 /// Credential
 ///
 
+// The store is keyed by a SHA-256 digest of each credential's encoding, so
+// that it does not hold a second copy of large certificate chains.  The digest
+// is computed before any lock is taken, and its last byte picks one of several
+// shards, each with its own lock, so that threads decoding different
+// credentials rarely contend.  Entries are weak, and expired ones are swept
+// whenever a shard has doubled in size since its last sweep.
+struct Credential::Store
+{
+  struct DigestHash
+  {
+    size_t operator()(const bytes& digest) const
+    {
+      auto out = size_t(0);
+      for (size_t i = 0; i < sizeof(out) && i < digest.size(); i++) {
+        out = (out << 8) | digest.at(i);
+      }
+      return out;
+    }
+  };
+
+  static constexpr size_t min_sweep_size = 64;
+  static constexpr size_t shard_count = 16;
+
+  struct Shard
+  {
+    std::mutex mutex;
+    std::unordered_map<bytes, std::weak_ptr<const Value>, DigestHash> entries;
+    size_t sweep_size = min_sweep_size;
+
+    void sweep()
+    {
+      if (entries.size() < sweep_size) {
+        return;
+      }
+
+      for (auto it = entries.begin(); it != entries.end();) {
+        if (it->second.expired()) {
+          it = entries.erase(it);
+        } else {
+          ++it;
+        }
+      }
+
+      sweep_size = std::max(min_sweep_size, 2 * entries.size());
+    }
+  };
+
+  std::array<Shard, shard_count> shards;
+
+  static Store& get()
+  {
+    static auto store = Store{};
+    return store;
+  }
+
+  Shard& shard(const bytes& digest)
+  {
+    return shards.at(digest.back() % shard_count);
+  }
+};
+
+std::shared_ptr<const Credential::Value>
+Credential::intern(const uint8_t* encoded, size_t size, Value&& value)
+{
+  static const auto& sha256 = hpke::Digest::get<hpke::Digest::ID::SHA256>();
+  auto ctx = sha256.hash_context();
+  ctx->update(encoded, size);
+  auto digest = ctx->finalize();
+
+  auto& shard = Store::get().shard(digest);
+  const auto lock = std::lock_guard(shard.mutex);
+  auto& entry = shard.entries[std::move(digest)];
+  if (auto existing = entry.lock()) {
+    return existing;
+  }
+
+  auto fresh = std::make_shared<const Value>(std::move(value));
+  entry = fresh;
+  shard.sweep();
+  return fresh;
+}
+
+std::shared_ptr<const Credential::Value>
+Credential::intern(Value&& value)
+{
+  auto w = tls::ostream{};
+  tls::variant<CredentialType>::encode(w, value);
+  const auto& encoded = w.bytes();
+  return intern(encoded.data(), encoded.size(), std::move(value));
+}
+
+size_t
+Credential::interned_count()
+{
+  auto count = size_t(0);
+  for (auto& shard : Store::get().shards) {
+    const auto lock = std::lock_guard(shard.mutex);
+    count += static_cast<size_t>(
+      std::count_if(shard.entries.begin(),
+                    shard.entries.end(),
+                    [](const auto& entry) { return !entry.second.expired(); }));
+  }
+  return count;
+}
+
+Credential::Credential()
+{
+  static const auto empty = std::make_shared<const Value>();
+  _cred = empty;
+}
+
 CredentialType::selector
 Credential::type() const
 {
-  switch (_cred.index()) {
+  switch (_cred->index()) {
     case 0:
       return CredentialType::selector::basic;
     case 1:
@@ -117,11 +356,11 @@ Credential::type() const
 SignaturePublicKey
 Credential::public_key() const
 {
-  switch (_cred.index()) {
+  switch (_cred->index()) {
     case 0:
-      return std::get<BasicCredential>(_cred).public_key;
+      return std::get<BasicCredential>(*_cred).public_key;
     case 1:
-      return std::get<X509Credential>(_cred).public_key();
+      return std::get<X509Credential>(*_cred).public_key();
   }
 
   throw std::bad_variant_access();
@@ -137,7 +376,7 @@ Credential
 Credential::basic(const bytes& identity, const SignaturePublicKey& public_key)
 {
   Credential cred;
-  cred._cred = BasicCredential{ identity, public_key };
+  cred._cred = intern(BasicCredential{ identity, public_key });
   return cred;
 }
 
@@ -145,8 +384,52 @@ Credential
 Credential::x509(const std::vector<X509Credential::CertData>& der_chain)
 {
   Credential cred;
-  cred._cred = X509Credential{ der_chain };
+  cred._cred = intern(X509Credential{ der_chain });
   return cred;
 }
 
+tls::ostream&
+operator<<(tls::ostream& str, const Credential& obj)
+{
+  tls::variant<CredentialType>::encode(str, *obj._cred);
+  return str;
+}
+
+tls::istream&
+operator>>(tls::istream& str, Credential& obj)
+{
+  // The credential is read from a view of at most the maximum size, so that
+  // a longer one fails on its declared lengths, before it is copied out
+  const auto max_size = DecodeLimits::current().max_credential_size;
+  const auto* start = str.read_raw(0);
+  auto r = tls::istream(start, std::min(str.size(), max_size));
+  const auto available = r.size();
+
+  auto value = Credential::Value{};
+  tls::variant<CredentialType>::decode(r, value);
+
+  const auto consumed = available - r.size();
+  str.read_raw(consumed);
+  obj._cred = Credential::intern(start, consumed, std::move(value));
+  return str;
+}
+
+size_t
+encoded_size(const Credential& obj)
+{
+  return tls::variant<CredentialType>::size(*obj._cred);
+}
+
+bool
+operator==(const Credential& lhs, const Credential& rhs)
+{
+  return lhs._cred == rhs._cred || *lhs._cred == *rhs._cred;
+}
+
+bool
+operator!=(const Credential& lhs, const Credential& rhs)
+{
+  return !(lhs == rhs);
+}
+
 } // namespace mls
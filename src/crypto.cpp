@@ -1,5 +1,7 @@
 #include "mls/crypto.h"
+#include "mls/metrics.h"
 
+#include <atomic>
 #include <iostream>
 #include <string>
 
@@ -35,86 +37,110 @@ tls_signature_scheme(Signature::ID id)
 ///
 
 template<>
-const CipherSuite::Ciphers
-  CipherSuite::ciphers<CipherSuite::ID::X25519_AES128GCM_SHA256_Ed25519>{
+const CipherSuite::Ciphers&
+CipherSuite::ciphers<CipherSuite::ID::X25519_AES128GCM_SHA256_Ed25519>()
+{
+  static const auto instance = Ciphers{
     HPKE(KEM::ID::DHKEM_X25519_SHA256,
          KDF::ID::HKDF_SHA256,
          AEAD::ID::AES_128_GCM),
     Digest::get<Digest::ID::SHA256>(),
     Signature::get<Signature::ID::Ed25519>(),
   };
+  return instance;
+}
 
 template<>
-const CipherSuite::Ciphers
-  CipherSuite::ciphers<CipherSuite::ID::P256_AES128GCM_SHA256_P256>{
+const CipherSuite::Ciphers&
+CipherSuite::ciphers<CipherSuite::ID::P256_AES128GCM_SHA256_P256>()
+{
+  static const auto instance = Ciphers{
     HPKE(KEM::ID::DHKEM_P256_SHA256,
          KDF::ID::HKDF_SHA256,
          AEAD::ID::AES_128_GCM),
     Digest::get<Digest::ID::SHA256>(),
     Signature::get<Signature::ID::P256_SHA256>(),
   };
+  return instance;
+}
 
 template<>
-const CipherSuite::Ciphers
-  CipherSuite::ciphers<CipherSuite::ID::X25519_CHACHA20POLY1305_SHA256_Ed25519>{
+const CipherSuite::Ciphers&
+CipherSuite::ciphers<CipherSuite::ID::X25519_CHACHA20POLY1305_SHA256_Ed25519>()
+{
+  static const auto instance = Ciphers{
     HPKE(KEM::ID::DHKEM_P256_SHA256,
          KDF::ID::HKDF_SHA256,
          AEAD::ID::CHACHA20_POLY1305),
     Digest::get<Digest::ID::SHA256>(),
     Signature::get<Signature::ID::Ed25519>(),
   };
+  return instance;
+}
 
 template<>
-const CipherSuite::Ciphers
-  CipherSuite::ciphers<CipherSuite::ID::X448_AES256GCM_SHA512_Ed448>{
+const CipherSuite::Ciphers&
+CipherSuite::ciphers<CipherSuite::ID::X448_AES256GCM_SHA512_Ed448>()
+{
+  static const auto instance = Ciphers{
     HPKE(KEM::ID::DHKEM_X448_SHA512,
          KDF::ID::HKDF_SHA512,
          AEAD::ID::AES_256_GCM),
     Digest::get<Digest::ID::SHA512>(),
     Signature::get<Signature::ID::Ed448>(),
   };
+  return instance;
+}
 
 template<>
-const CipherSuite::Ciphers
-  CipherSuite::ciphers<CipherSuite::ID::P521_AES256GCM_SHA512_P521>{
+const CipherSuite::Ciphers&
+CipherSuite::ciphers<CipherSuite::ID::P521_AES256GCM_SHA512_P521>()
+{
+  static const auto instance = Ciphers{
     HPKE(KEM::ID::DHKEM_P521_SHA512,
          KDF::ID::HKDF_SHA512,
          AEAD::ID::AES_256_GCM),
     Digest::get<Digest::ID::SHA512>(),
     Signature::get<Signature::ID::P521_SHA512>(),
   };
+  return instance;
+}
 
 template<>
-const CipherSuite::Ciphers
-  CipherSuite::ciphers<CipherSuite::ID::X448_CHACHA20POLY1305_SHA512_Ed448>{
+const CipherSuite::Ciphers&
+CipherSuite::ciphers<CipherSuite::ID::X448_CHACHA20POLY1305_SHA512_Ed448>()
+{
+  static const auto instance = Ciphers{
     HPKE(KEM::ID::DHKEM_X448_SHA512,
          KDF::ID::HKDF_SHA512,
          AEAD::ID::CHACHA20_POLY1305),
     Digest::get<Digest::ID::SHA512>(),
     Signature::get<Signature::ID::Ed448>(),
   };
+  return instance;
+}
 
 const CipherSuite::Ciphers&
 CipherSuite::get() const
 {
   switch (id) {
     case ID::X25519_AES128GCM_SHA256_Ed25519:
-      return ciphers<ID::X25519_AES128GCM_SHA256_Ed25519>;
+      return ciphers<ID::X25519_AES128GCM_SHA256_Ed25519>();
 
     case ID::P256_AES128GCM_SHA256_P256:
-      return ciphers<ID::P256_AES128GCM_SHA256_P256>;
+      return ciphers<ID::P256_AES128GCM_SHA256_P256>();
 
     case ID::X25519_CHACHA20POLY1305_SHA256_Ed25519:
-      return ciphers<ID::X25519_CHACHA20POLY1305_SHA256_Ed25519>;
+      return ciphers<ID::X25519_CHACHA20POLY1305_SHA256_Ed25519>();
 
     case ID::X448_AES256GCM_SHA512_Ed448:
-      return ciphers<ID::X448_AES256GCM_SHA512_Ed448>;
+      return ciphers<ID::X448_AES256GCM_SHA512_Ed448>();
 
     case ID::P521_AES256GCM_SHA512_P521:
-      return ciphers<ID::P521_AES256GCM_SHA512_P521>;
+      return ciphers<ID::P521_AES256GCM_SHA512_P521>();
 
     case ID::X448_CHACHA20POLY1305_SHA512_Ed448:
-      return ciphers<ID::X448_CHACHA20POLY1305_SHA512_Ed448>;
+      return ciphers<ID::X448_CHACHA20POLY1305_SHA512_Ed448>();
 
     default:
       throw InvalidParameterError("Unsupported ciphersuite");
@@ -136,18 +162,50 @@ CipherSuite::expand_with_label(const bytes& secret,
                                const std::string& label,
                                const bytes& context,
                                size_t length) const
+{
+  const auto timer = Metrics::Timer(Metrics::Event::hkdf_expand);
+  return get().hpke.kdf.expand(
+    secret, hkdf_label(label, context, length), length);
+}
+
+bytes
+CipherSuite::hkdf_label(const std::string& label,
+                        const bytes& context,
+                        size_t length)
 {
   auto mls_label = to_bytes(std::string("mls10 ") + label);
   auto length16 = static_cast<uint16_t>(length);
-  auto label_bytes = tls::marshal(HKDFLabel{ length16, mls_label, context });
-  return get().hpke.kdf.expand(secret, label_bytes, length);
+  return tls::marshal(HKDFLabel{ length16, mls_label, context });
 }
 
 bytes
 CipherSuite::derive_secret(const bytes& secret, const std::string& label) const
 {
-  auto size = get().digest.hash_size();
-  return expand_with_label(secret, label, {}, size);
+  return expand_with_label(secret, label, {}, secret_size());
+}
+
+size_t
+CipherSuite::secret_size() const
+{
+  return dispatch([](auto traits) { return decltype(traits)::hash_size; });
+}
+
+size_t
+CipherSuite::key_size() const
+{
+  return dispatch([](auto traits) { return decltype(traits)::key_size; });
+}
+
+size_t
+CipherSuite::nonce_size() const
+{
+  return dispatch([](auto traits) { return decltype(traits)::nonce_size; });
+}
+
+size_t
+CipherSuite::tag_size() const
+{
+  return dispatch([](auto traits) { return decltype(traits)::tag_size; });
 }
 
 const std::array<CipherSuite::ID, 6> all_supported_suites = {
@@ -179,15 +237,35 @@ constant_time_eq(const bytes& lhs, const bytes& rhs)
   return (diff == 0);
 }
 
+static std::atomic<bool> parsed_key_cache{ false };
+
+void
+enable_parsed_key_cache(bool enabled)
+{
+  parsed_key_cache.store(enabled);
+}
+
+bool
+parsed_key_cache_enabled()
+{
+  return parsed_key_cache.load(std::memory_order_relaxed);
+}
+
 ///
 /// HPKEPublicKey and HPKEPrivateKey
 ///
+HPKEPublicKey::HPKEPublicKey(bytes data_in)
+  : data(std::move(data_in))
+{}
+
 HPKECiphertext
 HPKEPublicKey::encrypt(CipherSuite suite,
                        const bytes& aad,
                        const bytes& pt) const
 {
-  auto pkR = suite.get().hpke.kem.deserialize(data);
+  const auto timer = Metrics::Timer(Metrics::Event::hpke_encap);
+  auto pkR = _parsed.get(
+    suite, data, [&]() { return suite.get().hpke.kem.deserialize(data); });
   auto [enc, ctx] = suite.get().hpke.setup_base_s(*pkR, {});
   auto ct = ctx.seal(aad, pt);
   return HPKECiphertext{ enc, ct };
@@ -200,7 +278,11 @@ HPKEPrivateKey::generate(CipherSuite suite)
   auto priv_data = suite.get().hpke.kem.serialize_private(*priv);
   auto pub = priv->public_key();
   auto pub_data = suite.get().hpke.kem.serialize(*pub);
-  return HPKEPrivateKey(priv_data, pub_data);
+
+  auto key = HPKEPrivateKey(priv_data, pub_data);
+  key._parsed.set(suite, key.data, std::move(priv));
+  key.public_key._parsed.set(suite, key.public_key.data, std::move(pub));
+  return key;
 }
 
 HPKEPrivateKey
@@ -219,7 +301,11 @@ HPKEPrivateKey::derive(CipherSuite suite, const bytes& secret)
   auto priv_data = suite.get().hpke.kem.serialize_private(*priv);
   auto pub = priv->public_key();
   auto pub_data = suite.get().hpke.kem.serialize(*pub);
-  return HPKEPrivateKey(priv_data, pub_data);
+
+  auto key = HPKEPrivateKey(priv_data, pub_data);
+  key._parsed.set(suite, key.data, std::move(priv));
+  key.public_key._parsed.set(suite, key.public_key.data, std::move(pub));
+  return key;
 }
 
 bytes
@@ -227,7 +313,10 @@ HPKEPrivateKey::decrypt(CipherSuite suite,
                         const bytes& aad,
                         const HPKECiphertext& ct) const
 {
-  auto skR = suite.get().hpke.kem.deserialize_private(data);
+  const auto timer = Metrics::Timer(Metrics::Event::hpke_decap);
+  auto skR = _parsed.get(suite, data, [&]() {
+    return suite.get().hpke.kem.deserialize_private(data);
+  });
   auto ctx = suite.get().hpke.setup_base_r(ct.kem_output, *skR, {});
   auto pt = ctx.open(aad, ct.ciphertext);
   if (!pt.has_value()) {
@@ -245,13 +334,63 @@ HPKEPrivateKey::HPKEPrivateKey(bytes priv_data, bytes pub_data)
 ///
 /// SignaturePublicKey and SignaturePrivateKey
 ///
+SignaturePublicKey::SignaturePublicKey(bytes data_in)
+  : data(std::move(data_in))
+{}
+
 bool
 SignaturePublicKey::verify(const CipherSuite& suite,
                            const bytes& message,
                            const bytes& signature) const
 {
-  auto pub = suite.get().sig.deserialize(data);
-  return suite.get().sig.verify(message, signature, *pub);
+  const auto timer = Metrics::Timer(Metrics::Event::verify);
+  return suite.get().sig.verify(message, signature, *parsed(suite));
+}
+
+std::vector<bool>
+SignaturePublicKey::verify_batch(const CipherSuite& suite,
+                                 const std::vector<VerifyItem>& items)
+{
+  auto pubs = std::vector<std::shared_ptr<const hpke::Signature::PublicKey>>();
+  auto batch = std::vector<hpke::Signature::VerifyItem>();
+  pubs.reserve(items.size());
+  batch.reserve(items.size());
+  for (const auto& item : items) {
+    pubs.push_back(item.pub.parsed(suite));
+    batch.push_back({ item.message, item.signature, *pubs.back() });
+  }
+
+  const auto timer = Metrics::Timer(Metrics::Event::verify, batch.size());
+  return suite.get().sig.verify_batch(batch);
+}
+
+std::vector<bool>
+SignaturePublicKey::verify_batch(const CipherSuite& suite,
+                                 const std::vector<VerifyItem>& items,
+                                 Executor& executor)
+{
+  auto pubs = std::vector<std::shared_ptr<const hpke::Signature::PublicKey>>();
+  pubs.reserve(items.size());
+  for (const auto& item : items) {
+    pubs.push_back(item.pub.parsed(suite));
+  }
+
+  const auto timer = Metrics::Timer(Metrics::Event::verify, items.size());
+  const auto& sig = suite.get().sig;
+  auto valid = std::vector<uint8_t>(items.size(), 0);
+  executor.run(items.size(), [&](size_t i) {
+    const auto& item = items.at(i);
+    valid.at(i) = sig.verify(item.message, item.signature, *pubs.at(i)) ? 1 : 0;
+  });
+
+  return { valid.begin(), valid.end() };
+}
+
+std::shared_ptr<const hpke::Signature::PublicKey>
+SignaturePublicKey::parsed(const CipherSuite& suite) const
+{
+  return _parsed.get(
+    suite, data, [&]() { return suite.get().sig.deserialize(data); });
 }
 
 SignaturePrivateKey
@@ -261,7 +400,11 @@ SignaturePrivateKey::generate(CipherSuite suite)
   auto priv_data = suite.get().sig.serialize_private(*priv);
   auto pub = priv->public_key();
   auto pub_data = suite.get().sig.serialize(*pub);
-  return SignaturePrivateKey(priv_data, pub_data);
+
+  auto key = SignaturePrivateKey(priv_data, pub_data);
+  key._parsed.set(suite, key.data, std::move(priv));
+  key.public_key._parsed.set(suite, key.public_key.data, std::move(pub));
+  return key;
 }
 
 SignaturePrivateKey
@@ -280,13 +423,19 @@ SignaturePrivateKey::derive(CipherSuite suite, const bytes& secret)
   auto priv_data = suite.get().sig.serialize_private(*priv);
   auto pub = priv->public_key();
   auto pub_data = suite.get().sig.serialize(*pub);
-  return SignaturePrivateKey(priv_data, pub_data);
+
+  auto key = SignaturePrivateKey(priv_data, pub_data);
+  key._parsed.set(suite, key.data, std::move(priv));
+  key.public_key._parsed.set(suite, key.public_key.data, std::move(pub));
+  return key;
 }
 
 bytes
 SignaturePrivateKey::sign(const CipherSuite& suite, const bytes& message) const
 {
-  auto priv = suite.get().sig.deserialize_private(data);
+  const auto timer = Metrics::Timer(Metrics::Event::sign);
+  auto priv = _parsed.get(
+    suite, data, [&]() { return suite.get().sig.deserialize_private(data); });
   return suite.get().sig.sign(message, *priv);
 }
 
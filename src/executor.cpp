@@ -0,0 +1,169 @@
+#include "mls/executor.h"
+
+#include <algorithm>
+#include <exception>
+
+namespace mls {
+
+void
+SerialExecutor::run(size_t count, const Task& task)
+{
+  for (size_t i = 0; i < count; i++) {
+    task(i);
+  }
+}
+
+ThreadPool::ThreadPool(size_t threads)
+{
+  threads = std::max<size_t>(threads, 1);
+  workers.reserve(threads);
+  for (size_t i = 0; i < threads; i++) {
+    workers.emplace_back([this]() { work(); });
+  }
+}
+
+ThreadPool::~ThreadPool()
+{
+  {
+    auto lock = std::unique_lock<std::mutex>(mutex);
+    stopping = true;
+  }
+
+  ready.notify_all();
+  for (auto& worker : workers) {
+    worker.join();
+  }
+}
+
+void
+ThreadPool::run(size_t count, const Task& task)
+{
+  if (count == 0) {
+    return;
+  }
+
+  // Each worker takes an interleaved share of the indices.  The calling
+  // thread waits for all shares to finish before returning, so the state
+  // captured by reference below outlives every job.
+  auto shares = std::min(count, workers.size());
+  auto errors = std::vector<std::exception_ptr>(shares);
+  auto done_mutex = std::mutex{};
+  auto done_cv = std::condition_variable{};
+  auto remaining = shares;
+
+  {
+    auto lock = std::unique_lock<std::mutex>(mutex);
+    for (size_t s = 0; s < shares; s++) {
+      queue.emplace_back([&, s]() {
+        try {
+          for (auto i = s; i < count; i += shares) {
+            task(i);
+          }
+        } catch (...) {
+          errors.at(s) = std::current_exception();
+        }
+
+        auto done_lock = std::unique_lock<std::mutex>(done_mutex);
+        remaining -= 1;
+        if (remaining == 0) {
+          done_cv.notify_one();
+        }
+      });
+    }
+  }
+  ready.notify_all();
+
+  {
+    auto lock = std::unique_lock<std::mutex>(done_mutex);
+    done_cv.wait(lock, [&]() { return remaining == 0; });
+  }
+
+  for (const auto& error : errors) {
+    if (error) {
+      std::rethrow_exception(error);
+    }
+  }
+}
+
+void
+ThreadPool::post(std::function<void()> job)
+{
+  {
+    auto lock = std::unique_lock<std::mutex>(mutex);
+    queue.push_back(std::move(job));
+  }
+  ready.notify_one();
+}
+
+void
+ThreadPool::work()
+{
+  while (true) {
+    auto job = std::function<void()>{};
+
+    {
+      auto lock = std::unique_lock<std::mutex>(mutex);
+      ready.wait(lock, [&]() { return stopping || !queue.empty(); });
+      if (stopping && queue.empty()) {
+        return;
+      }
+
+      job = std::move(queue.front());
+      queue.pop_front();
+    }
+
+    job();
+  }
+}
+
+Strand::Strand(ThreadPool& pool_in)
+  : pool(pool_in)
+{}
+
+Strand::~Strand()
+{
+  auto lock = std::unique_lock<std::mutex>(mutex);
+  idle.wait(lock, [&]() { return !running; });
+}
+
+void
+Strand::post(std::function<void()> job)
+{
+  {
+    auto lock = std::unique_lock<std::mutex>(mutex);
+    jobs.push_back(std::move(job));
+    if (running) {
+      return;
+    }
+
+    running = true;
+  }
+
+  pool.post([this]() { drain(); });
+}
+
+void
+Strand::drain()
+{
+  // One pool job runs everything queued on the strand, so at most one of the
+  // strand's jobs runs at a time
+  while (true) {
+    auto job = std::function<void()>{};
+
+    {
+      auto lock = std::unique_lock<std::mutex>(mutex);
+      if (jobs.empty()) {
+        running = false;
+        idle.notify_all();
+        return;
+      }
+
+      job = std::move(jobs.front());
+      jobs.pop_front();
+    }
+
+    job();
+  }
+}
+
+} // namespace mls
@@ -1,16 +1,10 @@
 #include "mls/key_schedule.h"
+#include "mls/metrics.h"
+#include <algorithm>
+#include <iterator>
 
 namespace mls {
 
-static void
-zeroize(bytes& data) // NOLINT(google-runtime-references)
-{
-  for (auto& val : data) {
-    val = 0;
-  }
-  data.resize(0);
-}
-
 ///
 /// Key Derivation Functions
 ///
@@ -39,36 +33,136 @@ derive_tree_secret(CipherSuite suite,
 /// HashRatchet
 ///
 
+static void
+check_policy(const RatchetPolicy& policy)
+{
+  if (policy.window == 0) {
+    throw InvalidParameterError("Ratchet window must be non-empty");
+  }
+
+  if (policy.precompute >= policy.window) {
+    throw InvalidParameterError("Precomputed keys must fit in the window");
+  }
+}
+
 HashRatchet::HashRatchet(CipherSuite suite_in,
                          NodeIndex node_in,
-                         bytes base_secret_in)
+                         bytes base_secret_in,
+                         const RatchetPolicy& policy_in)
   : suite(suite_in)
   , node(node_in)
-  , next_secret(std::move(base_secret_in))
+  , next_secret(base_secret_in)
   , next_generation(0)
+  , policy(policy_in)
   , key_size(suite.get().hpke.aead.key_size())
   , nonce_size(suite.get().hpke.aead.key_size())
   , secret_size(suite.get().hpke.kdf.hash_size())
-{}
+{
+  zeroize(base_secret_in);
+  check_policy(policy);
+}
 
 std::tuple<uint32_t, KeyAndNonce>
 HashRatchet::next()
 {
-  auto key = derive_tree_secret(
-    suite, next_secret, "app-key", node, next_generation, key_size);
-  auto nonce = derive_tree_secret(
-    suite, next_secret, "app-nonce", node, next_generation, nonce_size);
-  auto secret = derive_tree_secret(
-    suite, next_secret, "app-secret", node, next_generation, secret_size);
+  // Hand out a precomputed key if there is one
+  if (next_unused < next_generation) {
+    const auto slot = find(next_unused);
+    if (slot.has_value()) {
+      auto generation = next_unused;
+      next_unused += 1;
+      return { generation, slot_key(slot.value()) };
+    }
+  }
 
+  const auto slot = derive();
+  next_unused = next_generation;
+  return { cache.at(slot).generation, slot_key(slot) };
+}
+
+size_t
+HashRatchet::derive()
+{
   auto generation = next_generation;
 
+  // Generations are produced in order, so until the window is full the slot
+  // for a new generation is always the next one to be appended
+  auto slot = generation % policy.window;
+  if (slot == cache.size()) {
+    cache.emplace_back();
+    slot_keys.resize(cache.size() * slot_size());
+  }
+
+  // The key, nonce, and next secret are all expanded from the current secret,
+  // so it is keyed into the KDF once and the outputs are written in place.
+  // This matches three calls to derive_tree_secret().
+  const auto timer = Metrics::Timer(Metrics::Event::hkdf_expand, 3);
+  auto ctx = tls::marshal(TreeContext{ node, generation });
+  auto prk = bytes(next_secret);
+  auto expander = suite.get().hpke.kdf.expander(prk);
+  zeroize(prk);
+
+  auto* key = slot_keys.data() + slot * slot_size();
+  expander->expand(
+    CipherSuite::hkdf_label("app-key", ctx, key_size), key, key_size);
+  expander->expand(CipherSuite::hkdf_label("app-nonce", ctx, nonce_size),
+                   key + key_size,
+                   nonce_size);
+
+  auto& entry = cache.at(slot);
+  entry.generation = generation;
+  entry.present = true;
+
+  // The expander holds its own copy of the current secret, so the next one
+  // can be written over it
+  next_secret.resize(secret_size);
+  expander->expand(CipherSuite::hkdf_label("app-secret", ctx, secret_size),
+                   next_secret.data(),
+                   secret_size);
+
   next_generation += 1;
-  zeroize(next_secret);
-  next_secret = secret;
 
-  cache[generation] = { key, nonce };
-  return { generation, cache[generation] };
+  return slot;
+}
+
+std::optional<size_t>
+HashRatchet::find(uint32_t generation)
+{
+  auto slot = generation % policy.window;
+  if (slot >= cache.size()) {
+    return std::nullopt;
+  }
+
+  const auto& entry = cache.at(slot);
+  if (!entry.present || entry.generation != generation) {
+    return std::nullopt;
+  }
+
+  return slot;
+}
+
+KeyAndNonce
+HashRatchet::slot_key(size_t slot) const
+{
+  const auto* key = slot_keys.data() + slot * slot_size();
+  return { bytes(key, key + key_size),
+           bytes(key + key_size, key + slot_size()) };
+}
+
+void
+HashRatchet::set_slot_key(size_t slot, const bytes& key, const bytes& nonce)
+{
+  if (key.size() != key_size || nonce.size() != nonce_size) {
+    throw InvalidParameterError("Cached key has the wrong size");
+  }
+
+  if (slot_keys.size() < (slot + 1) * slot_size()) {
+    slot_keys.resize((slot + 1) * slot_size());
+  }
+
+  auto* out = slot_keys.data() + slot * slot_size();
+  std::copy(key.begin(), key.end(), out);
+  std::copy(nonce.begin(), nonce.end(), out + key_size);
 }
 
 // Note: This construction deliberately does not preserve the forward-secrecy
@@ -78,34 +172,63 @@ HashRatchet::next()
 KeyAndNonce
 HashRatchet::get(uint32_t generation)
 {
-  if (cache.count(generation) > 0) {
-    auto out = cache[generation];
-    return out;
+  if (const auto slot = find(generation)) {
+    next_unused = std::max(next_unused, generation + 1);
+    return slot_key(slot.value());
   }
 
   if (next_generation > generation) {
     throw ProtocolError("Request for expired key");
   }
 
+  if (generation - next_generation > policy.max_forward) {
+    throw ProtocolError("Request for key too far in the future");
+  }
+
+  keys_skipped += generation - next_generation;
   while (next_generation < generation) {
-    next();
+    derive();
   }
 
-  auto [gen, key_nonce] = next();
-  silence_unused(gen);
-  return key_nonce;
+  const auto slot = derive();
+  next_unused = next_generation;
+  return slot_key(slot);
+}
+
+void
+HashRatchet::precompute()
+{
+  while (next_generation < next_unused + policy.precompute) {
+    derive();
+  }
 }
 
 void
 HashRatchet::erase(uint32_t generation)
 {
-  if (cache.count(generation) == 0) {
+  const auto slot = find(generation);
+  if (!slot.has_value()) {
     return;
   }
 
-  zeroize(cache[generation].key);
-  zeroize(cache[generation].nonce);
-  cache.erase(generation);
+  // Clear the slot, which stays allocated for the generation that reuses it
+  secure_wipe(slot_keys.data() + slot.value() * slot_size(), slot_size());
+  cache.at(slot.value()).present = false;
+}
+
+size_t
+HashRatchet::retained_bytes() const
+{
+  return next_secret.size() + cache.capacity() * sizeof(CachedKey) +
+         slot_keys.capacity();
+}
+
+RatchetStats
+HashRatchet::stats() const
+{
+  auto present = [](const auto& entry) { return entry.present; };
+  auto cached = std::count_if(cache.begin(), cache.end(), present);
+  return { keys_skipped, static_cast<size_t>(cached) };
 }
 
 ///
@@ -118,27 +241,29 @@ SecretTree::SecretTree(CipherSuite suite_in,
   : suite(suite_in)
   , root(tree_math::root(NodeCount{ group_size }))
   , width(NodeCount{ group_size })
-  , secrets(NodeCount{ group_size }.val)
-  , secret_size(suite_in.get().hpke.kdf.hash_size())
+  , secret_size(suite_in.secret_size())
 {
-  secrets[root.val] = std::move(encryption_secret_in);
+  secrets.emplace(root, std::move(encryption_secret_in));
 }
 
 bytes
 SecretTree::get(LeafIndex sender)
 {
   // Find an ancestor that is populated
-  auto dirpath = tree_math::dirpath(NodeIndex{ sender }, width);
-  dirpath.insert(dirpath.begin(), NodeIndex{ sender });
-  dirpath.push_back(tree_math::root(width));
+  auto dirpath = NodePath{};
+  dirpath.push_back(NodeIndex{ sender });
+  for (auto n : tree_math::dirpath(NodeIndex{ sender }, width)) {
+    dirpath.push_back(n);
+  }
+
   uint32_t curr = 0;
   for (; curr < dirpath.size(); ++curr) {
-    if (!secrets[dirpath[curr].val].empty()) {
+    if (secrets.count(dirpath[curr]) > 0) {
       break;
     }
   }
 
-  if (curr > dirpath.size()) {
+  if (curr >= dirpath.size()) {
     throw InvalidParameterError("No secret found to derive base key");
   }
 
@@ -148,24 +273,94 @@ SecretTree::get(LeafIndex sender)
     auto left = tree_math::left(node);
     auto right = tree_math::right(node, width);
 
-    auto& secret = secrets[node.val];
-    secrets[left.val] =
+    const auto& secret = secrets.at(node);
+    secrets[left] =
       derive_tree_secret(suite, secret, "tree", left, 0, secret_size);
-    secrets[right.val] =
+    secrets[right] =
       derive_tree_secret(suite, secret, "tree", right, 0, secret_size);
   }
 
   // Copy the leaf
-  auto out = secrets[NodeIndex{ sender }.val];
+  auto out = secrets.at(NodeIndex{ sender });
 
-  // Zeroize along the direct path
+  // Zeroize and release along the direct path, leaving only the frontier of
+  // secrets that have not yet been consumed
   for (auto i : dirpath) {
-    zeroize(secrets[i.val]);
+    auto it = secrets.find(i);
+    if (it != secrets.end()) {
+      zeroize(it->second);
+      secrets.erase(it);
+    }
+  }
+
+  return out;
+}
+
+std::vector<SecretTree>
+SecretTree::split(size_t parts)
+{
+  auto by_level = [](const auto& lhs, const auto& rhs) {
+    return tree_math::level(lhs.first) < tree_math::level(rhs.first);
+  };
+
+  while (!secrets.empty() && secrets.size() < parts) {
+    auto it = std::max_element(secrets.begin(), secrets.end(), by_level);
+    auto node = it->first;
+    if (tree_math::level(node) == 0) {
+      break;
+    }
+
+    auto left = tree_math::left(node);
+    auto right = tree_math::right(node, width);
+    secrets[left] =
+      derive_tree_secret(suite, it->second, "tree", left, 0, secret_size);
+    secrets[right] =
+      derive_tree_secret(suite, it->second, "tree", right, 0, secret_size);
+
+    zeroize(it->second);
+    secrets.erase(it);
   }
 
+  auto out = std::vector<SecretTree>{};
+  out.reserve(secrets.size());
+  for (auto& [node, secret] : secrets) {
+    auto& part = out.emplace_back();
+    part.suite = suite;
+    part.root = root;
+    part.width = width;
+    part.secret_size = secret_size;
+    part.secrets.emplace(node, std::move(secret));
+  }
+
+  secrets.clear();
   return out;
 }
 
+std::vector<LeafIndex>
+SecretTree::leaves() const
+{
+  // The subtree below a node at level k spans 2^k - 1 nodes on either side
+  auto out = std::vector<LeafIndex>{};
+  for (const auto& entry : secrets) {
+    const auto node = entry.first.val;
+    const auto span = (uint32_t(1) << tree_math::level(entry.first)) - 1;
+    for (auto n = node - span; n <= node + span && n < width.val; n += 2) {
+      out.push_back(LeafIndex{ n / 2 });
+    }
+  }
+  return out;
+}
+
+size_t
+SecretTree::retained_bytes() const
+{
+  auto size = secrets.size() * sizeof(decltype(secrets)::value_type);
+  for (const auto& entry : secrets) {
+    size += entry.second.size();
+  }
+  return size;
+}
+
 ///
 /// GroupKeySource
 ///
@@ -177,49 +372,442 @@ GroupKeySource::GroupKeySource(CipherSuite suite_in,
   , secret_tree(suite, group_size, std::move(encryption_secret))
 {}
 
-HashRatchet&
-GroupKeySource::chain(RatchetType type, LeafIndex sender)
+void
+GroupKeySource::policy(const RatchetPolicy& policy)
+{
+  check_policy(policy);
+  const auto table = std::unique_lock(_locks.table);
+  _policy = policy;
+}
+
+void
+GroupKeySource::precompute(Executor& executor)
+{
+  const auto table = std::shared_lock(_locks.table);
+  executor.run(2 * chains.size(), [&](size_t i) {
+    auto& entry = chains.at(i / 2);
+    auto& ratchet = (i % 2 == 0) ? entry.handshake : entry.application;
+    const auto lock = std::lock_guard(_locks.sender(entry.sender));
+    ratchet.precompute();
+  });
+}
+
+std::mutex&
+GroupKeySource::Locks::sender(LeafIndex index)
+{
+  return senders.at(index.val % stripes);
+}
+
+std::vector<GroupKeySource::Chains>::iterator
+GroupKeySource::lower_bound(LeafIndex sender)
 {
-  auto key = Key{ type, sender };
-  if (chains.count(key) > 0) {
-    return chains[key];
+  auto by_sender = [](const Chains& entry, LeafIndex index) {
+    return entry.sender < index;
+  };
+  return std::lower_bound(chains.begin(), chains.end(), sender, by_sender);
+}
+
+GroupKeySource::Chains*
+GroupKeySource::find_chains(LeafIndex sender)
+{
+  auto it = lower_bound(sender);
+  if (it == chains.end() || it->sender != sender) {
+    return nullptr;
+  }
+
+  return &*it;
+}
+
+GroupKeySource::Chains&
+GroupKeySource::add_chains(LeafIndex sender)
+{
+  auto it = lower_bound(sender);
+  if (it != chains.end() && it->sender == sender) {
+    return *it;
   }
 
+  it = chains.insert(it, make_chains(sender, secret_tree.get(sender)));
+  return *it;
+}
+
+GroupKeySource::Chains
+GroupKeySource::make_chains(LeafIndex sender, bytes leaf_secret) const
+{
   auto sender_node = NodeIndex{ sender };
-  auto secret_size = suite.get().digest.hash_size();
-  auto leaf_secret = secret_tree.get(sender);
+  auto secret_size = suite.secret_size();
 
   auto handshake_secret = derive_tree_secret(
     suite, leaf_secret, "handshake", sender_node, 0, secret_size);
-  chains.emplace(
-    std::make_pair(Key{ RatchetType::handshake, sender },
-                   HashRatchet{ suite, sender_node, handshake_secret }));
-
   auto application_secret = derive_tree_secret(
     suite, leaf_secret, "application", sender_node, 0, secret_size);
-  chains.emplace(
-    std::make_pair(Key{ RatchetType::application, sender },
-                   HashRatchet{ suite, sender_node, application_secret }));
+  zeroize(leaf_secret);
 
-  return chains[key];
+  return { sender,
+           HashRatchet{ suite, sender_node, handshake_secret, _policy },
+           HashRatchet{ suite, sender_node, application_secret, _policy } };
+}
+
+void
+GroupKeySource::prewarm(const std::vector<LeafIndex>& senders,
+                        Executor& executor)
+{
+  const auto table = std::unique_lock(_locks.table);
+
+  // The leaf secrets share ancestors, so they are taken from the tree one at
+  // a time; the ratchets are then derived in parallel
+  const auto size = LeafCount(secret_tree.width);
+  auto wanted = std::vector<LeafIndex>{};
+  auto leaf_secrets = std::vector<bytes>{};
+  for (const auto sender : senders) {
+    auto known = std::find(wanted.begin(), wanted.end(), sender);
+    if (sender.val >= size.val || known != wanted.end() ||
+        find_chains(sender) != nullptr) {
+      continue;
+    }
+
+    wanted.push_back(sender);
+    leaf_secrets.push_back(secret_tree.get(sender));
+  }
+
+  auto created = std::vector<std::optional<Chains>>(wanted.size());
+  executor.run(wanted.size(), [&](size_t i) {
+    created.at(i) = make_chains(wanted.at(i), std::move(leaf_secrets.at(i)));
+  });
+
+  for (auto& entry : created) {
+    auto it = lower_bound(entry.value().sender);
+    chains.insert(it, std::move(entry.value()));
+  }
+}
+
+void
+GroupKeySource::prewarm_all(Executor& executor)
+{
+  static constexpr size_t max_parts = 64;
+
+  const auto table = std::unique_lock(_locks.table);
+
+  // Every leaf below the frontier gets its ratchets, so the whole tree is
+  // handed out in disjoint parts, one per task
+  auto parts = secret_tree.split(max_parts);
+  auto created = std::vector<std::vector<Chains>>(parts.size());
+  executor.run(parts.size(), [&](size_t i) {
+    auto& part = parts.at(i);
+    for (const auto leaf : part.leaves()) {
+      created.at(i).push_back(make_chains(leaf, part.get(leaf)));
+    }
+  });
+
+  // The new senders are in order, and none of them had ratchets before
+  const auto existing = chains.size();
+  for (auto& part : created) {
+    std::move(part.begin(), part.end(), std::back_inserter(chains));
+  }
+
+  auto by_sender = [](const Chains& lhs, const Chains& rhs) {
+    return lhs.sender < rhs.sender;
+  };
+  std::inplace_merge(chains.begin(),
+                     chains.begin() + static_cast<std::ptrdiff_t>(existing),
+                     chains.end(),
+                     by_sender);
+}
+
+std::vector<LeafIndex>
+GroupKeySource::active_senders() const
+{
+  const auto table = std::unique_lock(_locks.table);
+  auto out = std::vector<LeafIndex>{};
+  for (const auto& entry : chains) {
+    if (entry.handshake.next_unused > 0 || entry.application.next_unused > 0) {
+      out.push_back(entry.sender);
+    }
+  }
+  return out;
+}
+
+template<typename F>
+auto
+GroupKeySource::with_chain(RatchetType type, LeafIndex sender, const F& f)
+{
+  auto select = [&](Chains& entry) -> HashRatchet& {
+    switch (type) {
+      case RatchetType::handshake:
+        return entry.handshake;
+      case RatchetType::application:
+        return entry.application;
+      default:
+        throw InvalidParameterError("Unknown ratchet type");
+    }
+  };
+
+  // The common case is a sender whose ratchets already exist, which only
+  // needs that sender's lock
+  {
+    const auto table = std::shared_lock(_locks.table);
+    if (auto* entry = find_chains(sender)) {
+      const auto lock = std::lock_guard(_locks.sender(sender));
+      return f(select(*entry));
+    }
+  }
+
+  const auto table = std::unique_lock(_locks.table);
+  return f(select(add_chains(sender)));
 }
 
 std::tuple<uint32_t, KeyAndNonce>
 GroupKeySource::next(RatchetType type, LeafIndex sender)
 {
-  return chain(type, sender).next();
+  return with_chain(
+    type, sender, [](HashRatchet& ratchet) { return ratchet.next(); });
 }
 
 KeyAndNonce
 GroupKeySource::get(RatchetType type, LeafIndex sender, uint32_t generation)
 {
-  return chain(type, sender).get(generation);
+  return with_chain(type, sender, [&](HashRatchet& ratchet) {
+    return ratchet.get(generation);
+  });
 }
 
 void
 GroupKeySource::erase(RatchetType type, LeafIndex sender, uint32_t generation)
 {
-  return chain(type, sender).erase(generation);
+  with_chain(type, sender, [&](HashRatchet& ratchet) {
+    ratchet.erase(generation);
+  });
+}
+
+KeyAndNonce
+GroupKeySource::take(RatchetType type, LeafIndex sender, uint32_t generation)
+{
+  return with_chain(type, sender, [&](HashRatchet& ratchet) {
+    auto key_nonce = ratchet.get(generation);
+    ratchet.erase(generation);
+    return key_nonce;
+  });
+}
+
+size_t
+GroupKeySource::retained_bytes() const
+{
+  const auto table = std::unique_lock(_locks.table);
+  auto size = secret_tree.retained_bytes();
+  for (const auto& entry : chains) {
+    size += sizeof(entry) + entry.handshake.retained_bytes() +
+            entry.application.retained_bytes();
+  }
+  return size;
+}
+
+RatchetStats
+GroupKeySource::stats() const
+{
+  const auto table = std::unique_lock(_locks.table);
+  auto out = RatchetStats{};
+  for (const auto& entry : chains) {
+    for (const auto* ratchet : { &entry.handshake, &entry.application }) {
+      auto stats = ratchet->stats();
+      out.keys_skipped += stats.keys_skipped;
+      out.keys_cached += stats.keys_cached;
+    }
+  }
+  return out;
+}
+
+// struct {
+//     uint32 generation;
+//     opaque key<0..255>;
+//     opaque nonce<0..255>;
+// } CachedKeySnapshot;
+struct CachedKeySnapshot
+{
+  uint32_t generation = 0;
+  bytes key;
+  bytes nonce;
+
+  TLS_SERIALIZABLE(generation, key, nonce)
+  TLS_TRAITS(tls::pass, tls::vector<1>, tls::vector<1>)
+};
+
+struct RatchetPolicySnapshot
+{
+  uint32_t window = 0;
+  uint32_t max_forward = 0;
+  uint32_t precompute = 0;
+
+  TLS_SERIALIZABLE(window, max_forward, precompute)
+};
+
+struct HashRatchetSnapshot
+{
+  RatchetPolicySnapshot policy;
+  bytes next_secret;
+  uint32_t next_generation = 0;
+  uint32_t next_unused = 0;
+  uint64_t keys_skipped = 0;
+  std::vector<CachedKeySnapshot> keys;
+
+  TLS_SERIALIZABLE(policy,
+                   next_secret,
+                   next_generation,
+                   next_unused,
+                   keys_skipped,
+                   keys)
+  TLS_TRAITS(tls::pass,
+             tls::vector<1>,
+             tls::pass,
+             tls::pass,
+             tls::pass,
+             tls::vector<4>)
+};
+
+struct SenderChainsSnapshot
+{
+  LeafIndex sender;
+  HashRatchetSnapshot handshake;
+  HashRatchetSnapshot application;
+
+  TLS_SERIALIZABLE(sender, handshake, application)
+};
+
+struct SecretTreeNodeSnapshot
+{
+  NodeIndex node;
+  bytes secret;
+
+  TLS_SERIALIZABLE(node, secret)
+  TLS_TRAITS(tls::pass, tls::vector<1>)
+};
+
+struct GroupKeySourceSnapshot
+{
+  NodeCount width;
+  std::vector<SecretTreeNodeSnapshot> secrets;
+  RatchetPolicySnapshot policy;
+  std::vector<SenderChainsSnapshot> chains;
+
+  TLS_SERIALIZABLE(width, secrets, policy, chains)
+  TLS_TRAITS(tls::pass, tls::vector<4>, tls::pass, tls::vector<4>)
+};
+
+static RatchetPolicySnapshot
+snapshot_policy(const RatchetPolicy& policy)
+{
+  return { policy.window, policy.max_forward, policy.precompute };
+}
+
+static RatchetPolicy
+restore_policy(const RatchetPolicySnapshot& snapshot)
+{
+  auto policy = RatchetPolicy{};
+  policy.window = snapshot.window;
+  policy.max_forward = snapshot.max_forward;
+  policy.precompute = snapshot.precompute;
+  check_policy(policy);
+  return policy;
+}
+
+static HashRatchetSnapshot
+snapshot_ratchet(const HashRatchet& ratchet)
+{
+  auto out = HashRatchetSnapshot{ snapshot_policy(ratchet.policy),
+                                  ratchet.next_secret,
+                                  ratchet.next_generation,
+                                  ratchet.next_unused,
+                                  ratchet.keys_skipped,
+                                  {} };
+  for (size_t slot = 0; slot < ratchet.cache.size(); slot++) {
+    const auto& entry = ratchet.cache.at(slot);
+    if (entry.present) {
+      auto [key, nonce] = ratchet.slot_key(slot);
+      out.keys.push_back({ entry.generation, std::move(key), std::move(nonce) });
+    }
+  }
+  return out;
+}
+
+static HashRatchet
+restore_ratchet(CipherSuite suite,
+                LeafIndex sender,
+                const HashRatchetSnapshot& snapshot)
+{
+  auto ratchet = HashRatchet{ suite,
+                              NodeIndex{ sender },
+                              snapshot.next_secret,
+                              restore_policy(snapshot.policy) };
+  ratchet.next_generation = snapshot.next_generation;
+  ratchet.next_unused = snapshot.next_unused;
+  ratchet.keys_skipped = snapshot.keys_skipped;
+
+  // Slots are appended one generation at a time until the window fills, so
+  // the ring buffer holds a slot for every generation derived so far
+  auto window = ratchet.policy.window;
+  ratchet.cache.resize(std::min(ratchet.next_generation, window));
+  ratchet.slot_keys.resize(ratchet.cache.size() * ratchet.slot_size());
+  for (const auto& key : snapshot.keys) {
+    if (key.generation >= ratchet.next_generation) {
+      throw InvalidParameterError("Cached key beyond ratchet generation");
+    }
+
+    const auto slot = key.generation % window;
+    auto& entry = ratchet.cache.at(slot);
+    entry.generation = key.generation;
+    entry.present = true;
+    ratchet.set_slot_key(slot, key.key, key.nonce);
+  }
+
+  return ratchet;
+}
+
+bytes
+GroupKeySource::snapshot() const
+{
+  const auto table = std::unique_lock(_locks.table);
+  auto out = GroupKeySourceSnapshot{};
+  out.width = secret_tree.width;
+  for (const auto& [node, secret] : secret_tree.secrets) {
+    out.secrets.push_back({ node, secret });
+  }
+
+  out.policy = snapshot_policy(_policy);
+  for (const auto& entry : chains) {
+    out.chains.push_back({ entry.sender,
+                           snapshot_ratchet(entry.handshake),
+                           snapshot_ratchet(entry.application) });
+  }
+
+  return tls::marshal(out);
+}
+
+GroupKeySource
+GroupKeySource::restore(CipherSuite suite, const bytes& snapshot)
+{
+  const auto data = tls::get<GroupKeySourceSnapshot>(snapshot);
+
+  auto out = GroupKeySource{};
+  out.suite = suite;
+  out.secret_tree.suite = suite;
+  out.secret_tree.width = data.width;
+  out.secret_tree.root = tree_math::root(data.width);
+  out.secret_tree.secret_size = suite.secret_size();
+  for (const auto& entry : data.secrets) {
+    out.secret_tree.secrets.emplace(entry.node, entry.secret);
+  }
+
+  out._policy = restore_policy(data.policy);
+  for (const auto& entry : data.chains) {
+    if (!out.chains.empty() && !(out.chains.back().sender < entry.sender)) {
+      throw InvalidParameterError("Key source senders out of order");
+    }
+
+    out.chains.push_back(
+      { entry.sender,
+        restore_ratchet(suite, entry.sender, entry.handshake),
+        restore_ratchet(suite, entry.sender, entry.application) });
+  }
+
+  return out;
 }
 
 ///
@@ -229,7 +817,7 @@ GroupKeySource::erase(RatchetType type, LeafIndex sender, uint32_t generation)
 KeyScheduleEpoch::KeyScheduleEpoch(CipherSuite suite_in)
   : suite(suite_in)
 {
-  auto secret_size = suite.get().digest.hash_size();
+  auto secret_size = suite.secret_size();
   epoch_secret = random_bytes(secret_size);
   init_secrets(LeafCount{ 1 });
 }
@@ -246,7 +834,7 @@ KeyScheduleEpoch::KeyScheduleEpoch(CipherSuite suite_in,
 
   member_secret = suite.get().hpke.kdf.extract(joiner_expand, psk_secret);
 
-  auto secret_size = suite.get().digest.hash_size();
+  auto secret_size = suite.secret_size();
   epoch_secret =
     suite.expand_with_label(member_secret, "epoch", context, secret_size);
   init_secrets(size);
@@ -257,18 +845,194 @@ KeyScheduleEpoch::init_secrets(LeafCount size)
 {
   sender_data_secret = suite.derive_secret(epoch_secret, "sender data");
   encryption_secret = suite.derive_secret(epoch_secret, "encryption");
-  exporter_secret = suite.derive_secret(epoch_secret, "exporter");
-  authentication_secret = suite.derive_secret(epoch_secret, "authentication");
-  external_secret = suite.derive_secret(epoch_secret, "external");
   confirmation_key = suite.derive_secret(epoch_secret, "confirm");
   membership_key = suite.derive_secret(epoch_secret, "membership");
-  resumption_secret = suite.derive_secret(epoch_secret, "resumption");
   init_secret = suite.derive_secret(epoch_secret, "init");
 
-  external_priv = HPKEPrivateKey::derive(suite, external_secret);
   keys = GroupKeySource(suite, size, encryption_secret);
 }
 
+KeyScheduleEpoch::~KeyScheduleEpoch()
+{
+  for (auto* secret : { &joiner_secret,
+                        &member_secret,
+                        &epoch_secret,
+                        &sender_data_secret,
+                        &encryption_secret,
+                        &confirmation_key,
+                        &membership_key,
+                        &init_secret }) {
+    zeroize(*secret);
+  }
+}
+
+KeyScheduleEpoch::LazySecrets::LazySecrets(const LazySecrets& other)
+{
+  const auto lock = std::lock_guard(other.mutex);
+  exporter_secret = other.exporter_secret;
+  authentication_secret = other.authentication_secret;
+  external_secret = other.external_secret;
+  resumption_secret = other.resumption_secret;
+  external_priv = other.external_priv;
+}
+
+KeyScheduleEpoch::LazySecrets&
+KeyScheduleEpoch::LazySecrets::operator=(const LazySecrets& other)
+{
+  if (this == &other) {
+    return *this;
+  }
+
+  const auto lock = std::scoped_lock(mutex, other.mutex);
+  exporter_secret = other.exporter_secret;
+  authentication_secret = other.authentication_secret;
+  external_secret = other.external_secret;
+  resumption_secret = other.resumption_secret;
+  external_priv = other.external_priv;
+  return *this;
+}
+
+KeyScheduleEpoch::LazySecrets::~LazySecrets()
+{
+  for (auto* secret : { &exporter_secret,
+                        &authentication_secret,
+                        &external_secret,
+                        &resumption_secret }) {
+    if (secret->has_value()) {
+      zeroize(secret->value());
+    }
+  }
+
+  if (external_priv.has_value()) {
+    zeroize(external_priv.value().data);
+  }
+}
+
+KeyScheduleEpoch::ExportCache&
+KeyScheduleEpoch::ExportCache::operator=(const ExportCache& other)
+{
+  if (this == &other) {
+    return *this;
+  }
+
+  for (auto& [key, secret] : entries) {
+    zeroize(secret);
+  }
+  entries = other.entries;
+  return *this;
+}
+
+KeyScheduleEpoch::ExportCache::~ExportCache()
+{
+  for (auto& [key, secret] : entries) {
+    zeroize(secret);
+  }
+}
+
+const bytes&
+KeyScheduleEpoch::lazy_secret(std::optional<bytes>& slot,
+                              const std::string& label) const
+{
+  // Once set, a slot is not changed again, so the reference stays valid
+  const auto lock = std::lock_guard(_lazy.mutex);
+  if (!slot.has_value()) {
+    slot = suite.derive_secret(epoch_secret, label);
+  }
+  return slot.value();
+}
+
+const bytes&
+KeyScheduleEpoch::exporter_secret() const
+{
+  return lazy_secret(_lazy.exporter_secret, "exporter");
+}
+
+bytes
+KeyScheduleEpoch::do_export(const std::string& label,
+                            const bytes& context,
+                            size_t size) const
+{
+  return do_export(std::vector<std::string>{ label }, context, size).front();
+}
+
+std::vector<bytes>
+KeyScheduleEpoch::do_export(const std::vector<std::string>& labels,
+                            const bytes& context,
+                            size_t size) const
+{
+  auto out = std::vector<bytes>(labels.size());
+  auto missing = std::vector<size_t>{};
+  _exports.with([&](const ExportCache& cache) {
+    for (size_t i = 0; i < labels.size(); i++) {
+      auto it = cache.entries.find({ labels.at(i), context, size });
+      if (it == cache.entries.end()) {
+        missing.push_back(i);
+        continue;
+      }
+
+      out.at(i) = it->second;
+    }
+  });
+
+  if (missing.empty()) {
+    return out;
+  }
+
+  // Derivation is done outside the lock.  Threads that miss at the same time
+  // derive the same value, and the first one stored is kept.
+  const auto& secret = exporter_secret();
+  const auto context_hash = suite.get().digest.hash(context);
+  for (const auto i : missing) {
+    auto derived = suite.derive_secret(secret, labels.at(i));
+    out.at(i) =
+      suite.expand_with_label(derived, "exporter", context_hash, size);
+    zeroize(derived);
+  }
+
+  _exports.with([&](ExportCache& cache) {
+    for (const auto i : missing) {
+      if (cache.entries.size() >= ExportCache::max_entries) {
+        break;
+      }
+
+      cache.entries.emplace(std::make_tuple(labels.at(i), context, size),
+                            out.at(i));
+    }
+  });
+
+  return out;
+}
+
+const bytes&
+KeyScheduleEpoch::authentication_secret() const
+{
+  return lazy_secret(_lazy.authentication_secret, "authentication");
+}
+
+const bytes&
+KeyScheduleEpoch::external_secret() const
+{
+  return lazy_secret(_lazy.external_secret, "external");
+}
+
+const bytes&
+KeyScheduleEpoch::resumption_secret() const
+{
+  return lazy_secret(_lazy.resumption_secret, "resumption");
+}
+
+const HPKEPrivateKey&
+KeyScheduleEpoch::external_priv() const
+{
+  const auto& secret = external_secret();
+
+  const auto lock = std::lock_guard(_lazy.mutex);
+  if (!_lazy.external_priv.has_value()) {
+    _lazy.external_priv = HPKEPrivateKey::derive(suite, secret);
+  }
+  return _lazy.external_priv.value();
+}
+
 KeyScheduleEpoch
 KeyScheduleEpoch::next(const bytes& commit_secret,
                        const bytes& psk_secret,
@@ -276,26 +1040,72 @@ KeyScheduleEpoch::next(const bytes& commit_secret,
                        LeafCount size) const
 {
   auto joiner_secret = suite.get().hpke.kdf.extract(init_secret, commit_secret);
-  return KeyScheduleEpoch(suite, joiner_secret, psk_secret, context, size);
+  auto out = KeyScheduleEpoch(suite, joiner_secret, psk_secret, context, size);
+  out.keys.policy(keys.policy());
+  return out;
 }
 
 KeyAndNonce
 KeyScheduleEpoch::sender_data(const bytes& ciphertext) const
 {
-  auto sample_size = suite.get().digest.hash_size();
-  auto sample = bytes(sample_size);
-  if (ciphertext.size() < sample_size) {
-    sample = ciphertext;
-  } else {
-    sample = bytes(ciphertext.begin(), ciphertext.begin() + sample_size);
-  }
+  return sender_data(ciphertext.data(), ciphertext.size());
+}
+
+KeyAndNonce
+KeyScheduleEpoch::sender_data(const uint8_t* ciphertext, size_t size) const
+{
+  return suite.dispatch([&](auto traits) -> KeyAndNonce {
+    using Suite = decltype(traits);
+    auto sample_size = std::min(size, Suite::hash_size);
+    auto sample = bytes(ciphertext, ciphertext + sample_size);
+
+    return {
+      suite.expand_with_label(
+        sender_data_secret, "key", sample, Suite::key_size),
+      suite.expand_with_label(
+        sender_data_secret, "nonce", sample, Suite::nonce_size),
+    };
+  });
+}
 
-  auto key_size = suite.get().hpke.aead.key_size();
-  auto nonce_size = suite.get().hpke.aead.nonce_size();
-  return {
-    suite.expand_with_label(sender_data_secret, "key", sample, key_size),
-    suite.expand_with_label(sender_data_secret, "nonce", sample, nonce_size),
+size_t
+KeyScheduleEpoch::retained_bytes() const
+{
+  const auto secrets = {
+    &joiner_secret,      &member_secret,     &epoch_secret,
+    &sender_data_secret, &encryption_secret, &confirmation_key,
+    &membership_key,     &init_secret,
   };
+
+  auto size = keys.retained_bytes();
+  for (const auto* secret : secrets) {
+    size += secret->size();
+  }
+
+  // Only the lazily derived secrets that have been used are retained
+  const auto lock = std::lock_guard(_lazy.mutex);
+  for (const auto* secret : { &_lazy.exporter_secret,
+                              &_lazy.authentication_secret,
+                              &_lazy.external_secret,
+                              &_lazy.resumption_secret }) {
+    if (secret->has_value()) {
+      size += secret->value().size();
+    }
+  }
+
+  if (_lazy.external_priv.has_value()) {
+    size += _lazy.external_priv.value().data.size();
+    size += _lazy.external_priv.value().public_key.data.size();
+  }
+
+  _exports.with([&](const ExportCache& cache) {
+    for (const auto& [key, secret] : cache.entries) {
+      size +=
+        std::get<0>(key).size() + std::get<1>(key).size() + secret.size();
+    }
+  });
+
+  return size;
 }
 
 bool
@@ -303,16 +1113,17 @@ operator==(const KeyScheduleEpoch& lhs, const KeyScheduleEpoch& rhs)
 {
   // NB: Does not compare the GroupKeySource field, since these are dynamically
   // generated as needed.  Rather, we check the roots from which they started.
+  // The lazily derived secrets follow from the epoch secret, and comparing
+  // them would force their derivation.
   auto suite = (lhs.suite == rhs.suite);
   auto epoch_secret = (lhs.epoch_secret == rhs.epoch_secret);
   auto sender_data_secret = (lhs.sender_data_secret == rhs.sender_data_secret);
   auto encryption_secret = (lhs.encryption_secret == rhs.encryption_secret);
-  auto exporter_secret = (lhs.exporter_secret == rhs.exporter_secret);
   auto confirmation_key = (lhs.confirmation_key == rhs.confirmation_key);
   auto init_secret = (lhs.init_secret == rhs.init_secret);
 
   return suite && epoch_secret && sender_data_secret && encryption_secret &&
-         exporter_secret && confirmation_key && init_secret;
+         confirmation_key && init_secret;
 }
 
 } // namespace mls
@@ -1,8 +1,13 @@
 #include "mls/messages.h"
+#include "mls/compression.h"
 #include "mls/key_schedule.h"
+#include "mls/metrics.h"
 #include "mls/state.h"
 #include "mls/treekem.h"
 
+#include <algorithm>
+#include <set>
+
 namespace mls {
 
 // GroupInfo
@@ -40,13 +45,21 @@ GroupInfo::to_be_signed() const
   tls::vector<1>::encode(w, interim_transcript_hash);
   tls::vector<1>::encode(w, confirmation);
   w << signer_index;
-  return w.bytes();
+  return w.take();
 }
 
 void
 GroupInfo::sign(LeafIndex index, const SignaturePrivateKey& priv)
 {
-  auto maybe_kp = tree.key_package(index);
+  sign(tree, index, priv);
+}
+
+void
+GroupInfo::sign(const TreeKEMPublicKey& signer_tree,
+                LeafIndex index,
+                const SignaturePrivateKey& priv)
+{
+  auto maybe_kp = signer_tree.key_package(index);
   if (!maybe_kp.has_value()) {
     throw InvalidParameterError("Cannot sign from a blank leaf");
   }
@@ -63,7 +76,13 @@ GroupInfo::sign(LeafIndex index, const SignaturePrivateKey& priv)
 bool
 GroupInfo::verify() const
 {
-  auto maybe_kp = tree.key_package(signer_index);
+  return verify(tree);
+}
+
+bool
+GroupInfo::verify(const TreeKEMPublicKey& signer_tree) const
+{
+  auto maybe_kp = signer_tree.key_package(signer_index);
   if (!maybe_kp.has_value()) {
     throw InvalidParameterError("Cannot sign from a blank leaf");
   }
@@ -82,15 +101,18 @@ Welcome::Welcome()
 Welcome::Welcome(CipherSuite suite,
                  const bytes& joiner_secret,
                  const bytes& psk_secret,
-                 const GroupInfo& group_info)
+                 const GroupInfo& group_info,
+                 CompressionAlgorithm compression)
   : version(ProtocolVersion::mls10)
   , cipher_suite(suite)
   , _joiner_secret(joiner_secret)
+  , _compression(compression)
 {
   auto [key, nonce] = group_info_key_nonce(suite, joiner_secret, psk_secret);
-  auto group_info_data = tls::marshal(group_info);
-  encrypted_group_info =
-    cipher_suite.get().hpke.aead.seal(key, nonce, {}, group_info_data);
+  auto group_info_data = compress(compression, tls::marshal(group_info));
+  encrypted_group_info = Metrics::timed(Metrics::Event::aead_seal, [&]() {
+    return cipher_suite.get().hpke.aead.seal(key, nonce, {}, group_info_data);
+  });
 }
 
 std::optional<int>
@@ -99,37 +121,120 @@ Welcome::find(const KeyPackage& kp) const
   auto hash = kp.hash();
   for (size_t i = 0; i < secrets.size(); i++) {
     if (hash == secrets[i].key_package_hash) {
-      return i;
+      return static_cast<int>(i);
     }
   }
   return std::nullopt;
 }
 
-void
-Welcome::encrypt(const KeyPackage& kp, const std::optional<bytes>& path_secret)
+GroupSecrets
+Welcome::group_secrets(const std::optional<bytes>& path_secret) const
 {
-  auto gs = GroupSecrets{ _joiner_secret, std::nullopt };
+  auto gs = GroupSecrets{ _joiner_secret, std::nullopt, {} };
   if (path_secret.has_value()) {
     gs.path_secret = { path_secret.value() };
   }
 
+  if (_compression != CompressionAlgorithm::none) {
+    gs.extensions.add(CompressionExtension{ { _compression } });
+  }
+
+  return gs;
+}
+
+void
+Welcome::encrypt(const KeyPackage& kp, const std::optional<bytes>& path_secret)
+{
+  auto gs = group_secrets(path_secret);
   auto gs_data = tls::marshal(gs);
   auto enc_gs = kp.init_key.encrypt(kp.cipher_suite, {}, gs_data);
   secrets.push_back({ kp.hash(), enc_gs });
 }
 
+void
+Welcome::encrypt(const std::vector<KeyPackage>& kps,
+                 const std::vector<std::optional<bytes>>& path_secrets,
+                 Executor& executor)
+{
+  if (kps.size() != path_secrets.size()) {
+    throw InvalidParameterError("Mismatched joiners and path secrets");
+  }
+
+  auto start = secrets.size();
+  secrets.resize(start + kps.size());
+  executor.run(kps.size(), [&](size_t i) {
+    const auto& kp = kps.at(i);
+    auto gs = group_secrets(path_secrets.at(i));
+    auto gs_data = tls::marshal(gs);
+    auto enc_gs = kp.init_key.encrypt(kp.cipher_suite, {}, gs_data);
+    secrets.at(start + i) = { kp.hash(), enc_gs };
+  });
+}
+
 GroupInfo
-Welcome::decrypt(const bytes& joiner_secret, const bytes& psk_secret) const
+Welcome::decrypt(const bytes& joiner_secret,
+                 const bytes& psk_secret,
+                 CompressionAlgorithm compression) const&
 {
   auto [key, nonce] =
     group_info_key_nonce(cipher_suite, joiner_secret, psk_secret);
-  auto group_info_data =
-    cipher_suite.get().hpke.aead.open(key, nonce, {}, encrypted_group_info);
+  auto group_info_data = Metrics::timed(Metrics::Event::aead_open, [&]() {
+    return cipher_suite.get().hpke.aead.open(
+      key, nonce, {}, encrypted_group_info);
+  });
   if (!group_info_data.has_value()) {
     throw ProtocolError("Welcome decryption failed");
   }
 
-  return tls::get<GroupInfo>(group_info_data.value(), cipher_suite);
+  return decode_group_info(group_info_data.value(), compression);
+}
+
+GroupInfo
+Welcome::decrypt(const bytes& joiner_secret,
+                 const bytes& psk_secret,
+                 CompressionAlgorithm compression) &&
+{
+  auto [key, nonce] =
+    group_info_key_nonce(cipher_suite, joiner_secret, psk_secret);
+  const auto& aead = cipher_suite.get().hpke.aead;
+  auto& data = encrypted_group_info;
+  if (data.size() < aead.tag_size()) {
+    throw ProtocolError("Welcome decryption failed");
+  }
+
+  auto ok = Metrics::timed(Metrics::Event::aead_open, [&]() {
+    return aead.open_into(
+      key, nonce, {}, data.data(), data.size(), data.data());
+  });
+  if (!ok) {
+    throw ProtocolError("Welcome decryption failed");
+  }
+
+  data.resize(data.size() - aead.tag_size());
+  auto group_info = decode_group_info(data, compression);
+  data.clear();
+  data.shrink_to_fit();
+  return group_info;
+}
+
+GroupInfo
+Welcome::decode_group_info(const bytes& data,
+                           CompressionAlgorithm compression) const
+{
+  if (compression == CompressionAlgorithm::none) {
+    return tls::get<GroupInfo>(data, cipher_suite);
+  }
+
+  // The decompressed GroupInfo counts as a message for the size limit, since
+  // the limit on the Welcome applied only to the compressed form.  Without a
+  // limit, a fixed default keeps a malicious committer from making joiners
+  // allocate whatever size the compressed data claims.
+  auto max_size = DecodeLimits::current().max_message_size;
+  if (max_size == DecodeLimits::unlimited) {
+    max_size = default_max_decompressed_size;
+  }
+  const auto group_info_data = decompress(compression, data, max_size);
+  return tls::get<GroupInfo>(group_info_data, cipher_suite);
 }
 
 std::tuple<bytes, bytes>
@@ -150,6 +255,40 @@ Welcome::group_info_key_nonce(CipherSuite suite,
   return std::make_tuple(key, nonce);
 }
 
+// GroupSecrets
+
+tls::ostream&
+GroupSecrets::TrailingExtensions::encode(tls::ostream& str,
+                                         const ExtensionList& val)
+{
+  if (val.extensions.empty()) {
+    return str;
+  }
+
+  return str << val;
+}
+
+tls::istream&
+GroupSecrets::TrailingExtensions::decode(tls::istream& str, ExtensionList& val)
+{
+  if (str.empty()) {
+    val.extensions.clear();
+    return str;
+  }
+
+  return str >> val;
+}
+
+size_t
+GroupSecrets::TrailingExtensions::size(const ExtensionList& val)
+{
+  if (val.extensions.empty()) {
+    return 0;
+  }
+
+  return tls::encoded_size(val);
+}
+
 // MLSPlaintext
 
 template<>
@@ -197,6 +336,22 @@ MLSPlaintext::MLSPlaintext(bytes group_id_in,
                            ContentType::selector content_type_in,
                            bytes authenticated_data_in,
                            const bytes& content_in)
+  : MLSPlaintext(std::move(group_id_in),
+                 epoch_in,
+                 sender_in,
+                 content_type_in,
+                 std::move(authenticated_data_in),
+                 content_in.data(),
+                 content_in.size())
+{}
+
+MLSPlaintext::MLSPlaintext(bytes group_id_in,
+                           epoch_t epoch_in,
+                           Sender sender_in,
+                           ContentType::selector content_type_in,
+                           bytes authenticated_data_in,
+                           const uint8_t* content_in,
+                           size_t content_size_in)
   : group_id(std::move(group_id_in))
   , epoch(epoch_in)
   , sender(sender_in)
@@ -204,7 +359,7 @@ MLSPlaintext::MLSPlaintext(bytes group_id_in,
   , content(ApplicationData())
   , decrypted(true)
 {
-  tls::istream r(content_in);
+  tls::istream r(content_in, content_size_in);
   switch (content_type_in) {
     case ContentType::selector::application: {
       auto& application_data = content.emplace<ApplicationData>();
@@ -284,13 +439,30 @@ bytes
 MLSPlaintext::marshal_content(size_t padding_size) const
 {
   tls::ostream w;
+  w.reserve(content_size(padding_size));
+  write_content(w, padding_size);
+  return w.take();
+}
+
+void
+MLSPlaintext::write_content(tls::ostream& w, size_t padding_size) const
+{
   std::visit([&](auto&& inner_content) { w << inner_content; }, content);
 
   bytes padding(padding_size, 0);
   tls::vector<2>::encode(w, signature);
   w << confirmation_tag;
   tls::vector<2>::encode(w, padding);
-  return w.bytes();
+}
+
+size_t
+MLSPlaintext::content_size(size_t padding_size) const
+{
+  auto inner_size = std::visit(
+    [](auto&& inner_content) { return tls::encoded_size(inner_content); },
+    content);
+  return inner_size + tls::vector<2>::size(signature) +
+         tls::encoded_size(confirmation_tag) + 2 + padding_size;
 }
 
 bytes
@@ -301,7 +473,7 @@ MLSPlaintext::commit_content() const
   w << epoch << sender;
   tls::variant<ContentType>::encode(w, content);
   tls::vector<2>::encode(w, signature);
-  return w.bytes();
+  return w.take();
 }
 
 bytes
@@ -314,12 +486,159 @@ bytes
 MLSPlaintext::to_be_signed(const GroupContext& context) const
 {
   tls::ostream w;
+  write_to_be_signed(w, context);
+  return w.take();
+}
+
+void
+MLSPlaintext::write_to_be_signed(tls::ostream& w,
+                                 const GroupContext& context) const
+{
   w << context;
+  write_signed_content(w);
+}
+
+void
+MLSPlaintext::write_to_be_signed(tls::ostream& w,
+                                 const bytes& encoded_context) const
+{
+  w.write_raw(encoded_context);
+  write_signed_content(w);
+}
+
+void
+MLSPlaintext::write_signed_content(tls::ostream& w) const
+{
   tls::vector<1>::encode(w, group_id);
   w << epoch << sender;
   tls::vector<4>::encode(w, authenticated_data);
   tls::variant<ContentType>::encode(w, content);
-  return w.bytes();
+}
+
+size_t
+ProposalIDHash::operator()(const bytes& id) const
+{
+  auto hash = size_t(0);
+  for (size_t i = 0; i < id.size() && i < sizeof(hash); i++) {
+    hash = (hash << 8U) | id[i];
+  }
+  return hash;
+}
+
+void
+supersede_proposals(std::vector<CachedProposal>& cache,
+                    const std::vector<MLSPlaintext>& committed)
+{
+  auto changed = std::set<LeafIndex>{};
+  auto removed = std::set<LeafIndex>{};
+  for (const auto& pt : committed) {
+    const auto& proposal = std::get<Proposal>(pt.content).content;
+    if (std::holds_alternative<Update>(proposal)) {
+      changed.insert(LeafIndex(pt.sender.sender));
+    } else if (std::holds_alternative<Remove>(proposal)) {
+      changed.insert(std::get<Remove>(proposal).removed);
+      removed.insert(std::get<Remove>(proposal).removed);
+    }
+  }
+
+  for (auto& entry : cache) {
+    const auto& proposal = std::get<Proposal>(entry.pt.content).content;
+    if (std::holds_alternative<Update>(proposal)) {
+      entry.consumed |= changed.count(LeafIndex(entry.pt.sender.sender)) > 0;
+    } else if (std::holds_alternative<Remove>(proposal)) {
+      entry.consumed |= removed.count(std::get<Remove>(proposal).removed) > 0;
+    }
+  }
+}
+
+void
+ProposalCache::add(ProposalID id, MLSPlaintext pt)
+{
+  if (index.count(id.id) > 0) {
+    return;
+  }
+
+  index.emplace(id.id, entries.size());
+  entries.push_back({ std::move(id), std::move(pt) });
+}
+
+std::vector<MLSPlaintext>
+ProposalCache::take(const Commit& commit)
+{
+  auto pts = std::vector<MLSPlaintext>{};
+  pts.reserve(commit.proposals.size());
+  for (const auto& id : commit.proposals) {
+    auto it = index.find(id.id);
+    if (it == index.end() || entries.at(it->second).consumed) {
+      throw ProtocolError("Commit of unknown proposal");
+    }
+
+    auto& entry = entries.at(it->second);
+    entry.consumed = true;
+    pts.push_back(entry.pt);
+  }
+
+  // Cached proposals that this Commit makes redundant are dropped with it
+  supersede_proposals(entries, pts);
+
+  auto consumed = [](const auto& entry) { return entry.consumed; };
+  entries.erase(std::remove_if(entries.begin(), entries.end(), consumed),
+                entries.end());
+
+  index.clear();
+  for (size_t i = 0; i < entries.size(); i++) {
+    index.emplace(entries.at(i).id.id, i);
+  }
+
+  return pts;
+}
+
+AppliedProposals
+apply_proposals(TreeKEMPublicKey& tree,
+                const std::vector<MLSPlaintext>& pts,
+                Executor& executor)
+{
+  auto applied = AppliedProposals{};
+  auto adds = std::vector<const Add*>{};
+  for (const auto& pt : pts) {
+    const auto& proposal = std::get<Proposal>(pt.content).content;
+    if (std::holds_alternative<Update>(proposal)) {
+      const auto sender = LeafIndex(pt.sender.sender);
+      tree.update_leaf(sender, std::get<Update>(proposal).key_package);
+      applied.updated.push_back(sender);
+    } else if (std::holds_alternative<Add>(proposal)) {
+      adds.push_back(&std::get<Add>(proposal));
+    }
+  }
+
+  for (const auto& pt : pts) {
+    const auto& proposal = std::get<Proposal>(pt.content).content;
+    if (std::holds_alternative<Remove>(proposal)) {
+      const auto removed = std::get<Remove>(proposal).removed;
+      tree.blank_path(removed);
+      applied.removed.push_back(removed);
+    }
+  }
+
+  // The joiners' signatures are independent of one another and of the tree,
+  // so they are checked up front; only the insertions need to be in order
+  auto valid = std::vector<uint8_t>(adds.size());
+  executor.run(adds.size(), [&](size_t i) {
+    valid.at(i) = static_cast<uint8_t>(adds.at(i)->key_package.verify());
+  });
+
+  if (std::find(valid.begin(), valid.end(), 0) != valid.end()) {
+    throw ProtocolError("Invalid signature on key package");
+  }
+
+  applied.added.reserve(adds.size());
+  for (const auto* add : adds) {
+    applied.added.push_back(tree.add_leaf(add->key_package));
+  }
+
+  tree.truncate();
+  tree.set_hash_all();
+  return applied;
 }
 
 void
@@ -327,8 +646,7 @@ MLSPlaintext::sign(const CipherSuite& suite,
                    const GroupContext& context,
                    const SignaturePrivateKey& priv)
 {
-  auto tbs = to_be_signed(context);
-  signature = priv.sign(suite, tbs);
+  sign(suite, tls::marshal(context), priv);
 }
 
 bool
@@ -336,17 +654,59 @@ MLSPlaintext::verify(const CipherSuite& suite,
                      const GroupContext& context,
                      const SignaturePublicKey& pub) const
 {
-  auto tbs = to_be_signed(context);
-  return pub.verify(suite, tbs, signature);
+  return verify(suite, tls::marshal(context), pub);
+}
+
+// The signed and MACed inputs are staged in scratch buffers, since they are
+// built for every message and discarded immediately
+void
+MLSPlaintext::sign(const CipherSuite& suite,
+                   const bytes& encoded_context,
+                   const SignaturePrivateKey& priv)
+{
+  auto tbs = scratch_buffer();
+  auto w = tls::ostream(std::move(tbs.data()));
+  write_to_be_signed(w, encoded_context);
+  tbs.data() = w.take();
+  signature = priv.sign(suite, tbs.data());
+}
+
+bool
+MLSPlaintext::verify(const CipherSuite& suite,
+                     const bytes& encoded_context,
+                     const SignaturePublicKey& pub) const
+{
+  auto tbs = scratch_buffer();
+  auto w = tls::ostream(std::move(tbs.data()));
+  write_to_be_signed(w, encoded_context);
+  tbs.data() = w.take();
+  return pub.verify(suite, tbs.data(), signature);
 }
 
 bytes
 MLSPlaintext::membership_tag_input(const GroupContext& context) const
 {
   tls::ostream w;
+  write_membership_tag_input(w, context);
+  return w.take();
+}
+
+void
+MLSPlaintext::write_membership_tag_input(tls::ostream& w,
+                                         const GroupContext& context) const
+{
+  write_to_be_signed(w, context);
+  tls::vector<2>::encode(w, signature);
+  w << confirmation_tag;
+}
+
+void
+MLSPlaintext::write_membership_tag_input(tls::ostream& w,
+                                         const bytes& encoded_context) const
+{
+  write_to_be_signed(w, encoded_context);
   tls::vector<2>::encode(w, signature);
   w << confirmation_tag;
-  return to_be_signed(context) + w.bytes();
 }
 
 void
@@ -354,14 +714,33 @@ MLSPlaintext::set_membership_tag(const CipherSuite& suite,
                                  const GroupContext& context,
                                  const bytes& mac_key)
 {
-  auto tbm = membership_tag_input(context);
-  membership_tag = { suite.get().digest.hmac(mac_key, tbm) };
+  set_membership_tag(suite, tls::marshal(context), mac_key);
 }
 
 bool
 MLSPlaintext::verify_membership_tag(const CipherSuite& suite,
                                     const GroupContext& context,
                                     const bytes& mac_key) const
+{
+  return verify_membership_tag(suite, tls::marshal(context), mac_key);
+}
+
+void
+MLSPlaintext::set_membership_tag(const CipherSuite& suite,
+                                 const bytes& encoded_context,
+                                 const bytes& mac_key)
+{
+  auto tbm = scratch_buffer();
+  auto w = tls::ostream(std::move(tbm.data()));
+  write_membership_tag_input(w, encoded_context);
+  tbm.data() = w.take();
+  membership_tag = { suite.get().digest.hmac(mac_key, tbm.data()) };
+}
+
+bool
+MLSPlaintext::verify_membership_tag(const CipherSuite& suite,
+                                    const bytes& encoded_context,
+                                    const bytes& mac_key) const
 {
   if (decrypted) {
     return true;
@@ -371,9 +750,48 @@ MLSPlaintext::verify_membership_tag(const CipherSuite& suite,
     return false;
   }
 
-  auto tbm = membership_tag_input(context);
-  auto mac_value = suite.get().digest.hmac(mac_key, tbm);
+  auto tbm = scratch_buffer();
+  auto w = tls::ostream(std::move(tbm.data()));
+  write_membership_tag_input(w, encoded_context);
+  tbm.data() = w.take();
+  auto mac_value = suite.get().digest.hmac(mac_key, tbm.data());
   return constant_time_eq(mac_value, membership_tag.value().mac_value);
 }
 
+///
+/// Header peeking
+///
+
+bytes
+peek_group_id(const bytes& message)
+{
+  auto r = tls::istream(message);
+  auto group_id = bytes{};
+  tls::vector<1>::decode(r, group_id);
+  return group_id;
+}
+
+MessageHeader
+peek_header(const bytes& ciphertext)
+{
+  auto r = tls::istream(ciphertext);
+  auto header = MessageHeader{};
+  r >> header;
+  return header;
+}
+
+MessageHeader
+peek_plaintext_header(const bytes& plaintext)
+{
+  auto r = tls::istream(plaintext);
+  auto header = MessageHeader{};
+  auto sender = Sender{};
+  auto authenticated_data_size = uint32_t(0);
+  tls::vector<1>::decode(r, header.group_id);
+  r >> header.epoch >> sender >> authenticated_data_size;
+  r.read_raw(authenticated_data_size);
+  r >> header.content_type;
+  return header;
+}
+
 } // namespace mls
@@ -0,0 +1,125 @@
+#include "mls/metrics.h"
+
+#include <atomic>
+
+namespace mls {
+
+static std::atomic<Metrics::Sink*>&
+metrics_sink()
+{
+  static auto sink = std::atomic<Metrics::Sink*>{ nullptr };
+  return sink;
+}
+
+void
+Metrics::set_sink(Sink* sink)
+{
+  metrics_sink().store(sink);
+}
+
+bool
+Metrics::enabled()
+{
+#if defined(MLS_METRICS)
+  return true;
+#else
+  return false;
+#endif
+}
+
+///
+/// Counters
+///
+
+void
+Metrics::Counters::record(Operation operation,
+                          Event event,
+                          size_t count,
+                          std::chrono::nanoseconds elapsed)
+{
+  const auto lock = std::lock_guard(_mutex);
+  auto& entry =
+    _entries.at(static_cast<size_t>(operation)).at(static_cast<size_t>(event));
+  entry.count += count;
+  entry.elapsed += elapsed;
+}
+
+Metrics::Counters::Entry
+Metrics::Counters::get(Operation operation, Event event) const
+{
+  const auto lock = std::lock_guard(_mutex);
+  return _entries.at(static_cast<size_t>(operation))
+    .at(static_cast<size_t>(event));
+}
+
+void
+Metrics::Counters::reset()
+{
+  const auto lock = std::lock_guard(_mutex);
+  _entries = {};
+}
+
+#if defined(MLS_METRICS)
+
+///
+/// Probes
+///
+
+static Metrics::Operation&
+current_operation()
+{
+  static thread_local auto operation = Metrics::Operation::other;
+  return operation;
+}
+
+static void
+record(Metrics::Event event, size_t count, std::chrono::nanoseconds elapsed)
+{
+  auto* sink = metrics_sink().load();
+  if (sink != nullptr) {
+    sink->record(current_operation(), event, count, elapsed);
+  }
+}
+
+Metrics::Scope::Scope(Operation operation)
+  : _previous(current_operation())
+{
+  if (_previous == Operation::other) {
+    current_operation() = operation;
+  }
+}
+
+Metrics::Scope::~Scope()
+{
+  current_operation() = _previous;
+}
+
+Metrics::Timer::Timer(Event event, size_t count)
+  : _event(event)
+  , _count(count)
+  , _start(std::chrono::steady_clock::now())
+{}
+
+Metrics::Timer::~Timer()
+{
+  auto elapsed = std::chrono::steady_clock::now() - _start;
+  record(_event,
+         _count,
+         std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed));
+}
+
+Metrics::CopyProbe::CopyProbe(const CopyProbe& /* other */)
+{
+  record(Event::state_copy, 1, std::chrono::nanoseconds{ 0 });
+}
+
+Metrics::CopyProbe&
+Metrics::CopyProbe::operator=(const CopyProbe& /* other */)
+{
+  record(Event::state_copy, 1, std::chrono::nanoseconds{ 0 });
+  return *this;
+}
+
+#endif
+
+} // namespace mls
@@ -0,0 +1,161 @@
+#include "mls/public_group.h"
+
+namespace mls {
+
+// Each transcript hash covers the previous one followed by part of the
+// Commit, as in State
+static bytes
+transcript_hash(CipherSuite suite, const bytes& prev, const bytes& content)
+{
+  auto ctx = suite.get().digest.hash_context();
+  ctx->update(prev);
+  ctx->update(content);
+  return ctx->finalize();
+}
+
+PublicGroupState::PublicGroupState(const State& state)
+  : _suite(state._suite)
+  , _group_id(state._group_id)
+  , _epoch(state._epoch)
+  , _tree(state._tree)
+  , _confirmed_transcript_hash(state._confirmed_transcript_hash)
+  , _interim_transcript_hash(state._interim_transcript_hash)
+  , _extensions(state._extensions)
+  , _proposals(state._proposals)
+{}
+
+PublicGroupState::PublicGroupState(CipherSuite suite, GroupInfo group_info)
+  : _suite(suite)
+  , _group_id(group_info.group_id)
+  , _epoch(group_info.epoch)
+  , _tree(suite)
+  , _confirmed_transcript_hash(group_info.confirmed_transcript_hash)
+  , _interim_transcript_hash(group_info.interim_transcript_hash)
+  , _extensions(group_info.extensions)
+{
+  // Only the tree is moved out, once the signature over it has been checked
+  group_info.tree.suite = suite;
+  group_info.tree.set_hash_all();
+
+  if (!group_info.verify()) {
+    throw InvalidParameterError("Invalid GroupInfo");
+  }
+
+  if (!group_info.tree.parent_hash_valid()) {
+    throw InvalidParameterError("Invalid tree");
+  }
+
+  _tree = std::move(group_info.tree);
+}
+
+bool
+PublicGroupState::handle(const MLSPlaintext& pt)
+{
+  auto executor = SerialExecutor{};
+  return handle(pt, executor);
+}
+
+bool
+PublicGroupState::handle(const MLSPlaintext& pt, Executor& executor)
+{
+  verify(pt);
+
+  // Proposals get queued, do not result in a state transition
+  if (std::holds_alternative<Proposal>(pt.content)) {
+    auto id = ProposalID{ _suite.get().digest.hash(pt.commit_content()) };
+    _proposals.add(std::move(id), pt);
+    return false;
+  }
+
+  if (!std::holds_alternative<Commit>(pt.content)) {
+    throw InvalidParameterError("Incorrect content type");
+  }
+
+  if (!pt.confirmation_tag.has_value()) {
+    throw ProtocolError("Missing confirmation on Commit");
+  }
+
+  // Changes are made to a copy, so that a failed Commit leaves this one as it
+  // was; the copy shares the tree's unchanged nodes
+  const auto& commit = std::get<Commit>(pt.content);
+  auto sender = LeafIndex(pt.sender.sender);
+  auto next = *this;
+  next.apply(commit, executor);
+
+  if (commit.path.has_value()) {
+    const auto& path = commit.path.value();
+    if (!path.parent_hash_valid(_suite)) {
+      throw ProtocolError("Commit path has invalid parent hash");
+    }
+
+    next._tree.merge(sender, path);
+    if (!next._tree.parent_hash_valid(sender)) {
+      throw ProtocolError("Merged path has invalid parent hash");
+    }
+  }
+
+  next._confirmed_transcript_hash = transcript_hash(
+    _suite, next._interim_transcript_hash, pt.commit_content());
+  next._interim_transcript_hash = transcript_hash(
+    _suite, next._confirmed_transcript_hash, pt.commit_auth_data());
+  next._epoch += 1;
+
+  *this = std::move(next);
+  return true;
+}
+
+GroupContext
+PublicGroupState::group_context() const
+{
+  return GroupContext{
+    _group_id,   _epoch, _tree.root_hash(), _confirmed_transcript_hash,
+    _extensions,
+  };
+}
+
+std::vector<KeyPackage>
+PublicGroupState::roster() const
+{
+  auto kps = std::vector<KeyPackage>{};
+  for (uint32_t i = 0; i < _tree.size().val; i++) {
+    auto kp = _tree.key_package(LeafIndex{ i });
+    if (kp.has_value()) {
+      kps.push_back(std::move(kp.value()));
+    }
+  }
+  return kps;
+}
+
+void
+PublicGroupState::verify(const MLSPlaintext& pt) const
+{
+  if (pt.group_id != _group_id) {
+    throw InvalidParameterError("GroupID mismatch");
+  }
+
+  if (pt.epoch != _epoch) {
+    throw InvalidParameterError("Epoch mismatch");
+  }
+
+  if (pt.sender.sender_type != SenderType::member) {
+    throw InvalidParameterError("External senders not supported");
+  }
+
+  auto maybe_kp = _tree.key_package(LeafIndex(pt.sender.sender));
+  if (!maybe_kp.has_value()) {
+    throw InvalidParameterError("Signature from blank node");
+  }
+
+  auto pub = maybe_kp.value().credential.public_key();
+  if (!pt.verify(_suite, group_context(), pub)) {
+    throw ProtocolError("Invalid handshake message signature");
+  }
+}
+
+void
+PublicGroupState::apply(const Commit& commit, Executor& executor)
+{
+  apply_proposals(_tree, _proposals.take(commit), executor);
+}
+
+} // namespace mls
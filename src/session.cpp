@@ -3,7 +3,18 @@
 #include <mls/messages.h>
 #include <mls/state.h>
 
+#include <algorithm>
+#include <chrono>
 #include <deque>
+#include <exception>
+#include <future>
+#include <iterator>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <utility>
+#include <variant>
 
 namespace mls {
 
@@ -18,10 +29,19 @@ struct PendingJoin::Inner
   const SignaturePrivateKey sig_priv;
   const KeyPackage key_package;
 
+  // If set, the Session created by complete() is captured from the start
+  std::optional<bytes> capture_secret;
+
+  // Applied to the Welcome, and kept by the Session created from it
+  DecodeLimits limits;
+
   Inner(CipherSuite suite_in,
         SignaturePrivateKey sig_priv_in,
         Credential cred_in,
         const std::optional<KeyPackageOpts>& opts_in);
+  Inner(HPKEPrivateKey init_priv_in,
+        SignaturePrivateKey sig_priv_in,
+        KeyPackage key_package_in);
 
   static PendingJoin create(CipherSuite suite,
                             SignaturePrivateKey sig_priv,
@@ -31,11 +51,87 @@ struct PendingJoin::Inner
 
 struct Session::Inner
 {
-  std::deque<State> history;
+  struct Epoch
+  {
+    std::variant<State, DecryptOnlyEpoch> state;
+    std::optional<uint64_t> retired_at;
+
+    epoch_t epoch() const;
+    bytes unprotect(const MLSCiphertext& ct);
+    void unprotect_in_place(bytes& message);
+    size_t retained_bytes() const;
+  };
+
+  // Most recent epoch first.  Epochs are consecutive, so the entry for an
+  // epoch is found by its distance from the current one.
+  std::deque<Epoch> history;
   std::optional<std::tuple<bytes, State>> outbound_cache;
+  std::optional<State::PreparedCommit> prepared_commit;
   bool encrypt_handshake;
+  HistoryPolicy policy;
+  DecodeLimits limits;
+
+  // When to commit pending proposals, if set, and when the oldest of them
+  // arrived
+  std::optional<CommitSchedule> schedule;
+  std::optional<uint64_t> pending_since;
+  size_t pending_count = 0;
+  std::optional<size_t> committer_rank;
+
+  // Runs the parallel parts of commits and handled Commits, if set
+  Executor* crypto = nullptr;
+
+  // Creates the current epoch's ratchets ahead of use, if set.  Anything
+  // that changes or copies the current state waits for this to finish.
+  ThreadPool* prewarm_worker = nullptr;
+  std::future<void> prewarming;
+
+  // Records not yet handed over by journal_records(), and whether they start
+  // with a full snapshot
+  std::optional<StateJournal> journal;
+  bytes journal_records;
+  bool journal_compacted = false;
+
+  // The capture in progress, if any.  It is started and ended under the
+  // exclusive lock, but entries are appended under their own lock, since the
+  // unprotect methods run under a shared one.
+  std::optional<SessionCapture> capture;
+  std::mutex capture_mutex;
+
+  // Times one input to the Session, and appends it to the capture, if there
+  // is one, when it goes out of scope
+  class CaptureScope
+  {
+  public:
+    CaptureScope(Inner& inner_in,
+                 SessionCapture::Input input,
+                 const std::vector<bytes>& messages);
+    CaptureScope(Inner& inner_in,
+                 SessionCapture::Input input,
+                 const bytes& message);
+    ~CaptureScope();
+
+    CaptureScope(const CaptureScope&) = delete;
+    CaptureScope& operator=(const CaptureScope&) = delete;
+
+  private:
+    Inner& inner;
+    SessionCapture::Entry entry;
+    std::chrono::steady_clock::time_point start;
+    int exceptions;
+  };
+
+  // Held shared by operations that only use the epochs' key sources, which
+  // synchronize internally, and exclusively by everything else
+  mutable std::shared_mutex mutex;
 
   explicit Inner(State state);
+  ~Inner();
+
+  Inner(const Inner&) = delete;
+  Inner& operator=(const Inner&) = delete;
+
+  std::unique_lock<std::shared_mutex> lock_exclusive();
 
   static Session begin(const bytes& group_id,
                        const HPKEPrivateKey& init_priv,
@@ -44,15 +140,39 @@ struct Session::Inner
   static Session join(const HPKEPrivateKey& init_priv,
                       const SignaturePrivateKey& sig_priv,
                       const KeyPackage& key_package,
-                      const bytes& welcome_data);
+                      const bytes& welcome_data,
+                      const DecodeLimits& limits,
+                      Executor& executor);
 
   bytes fresh_secret() const;
   bytes export_message(const MLSPlaintext& plaintext);
   MLSPlaintext import_message(const bytes& encoded);
-  void add_state(epoch_t prior_epoch, const State& group_state);
-  State& for_epoch(epoch_t epoch);
+  State& current() { return std::get<State>(history.front().state); }
+  const State& current() const
+  {
+    return std::get<State>(history.front().state);
+  }
+
+  bytes serialize(const bytes& transfer_secret) const;
+  std::tuple<bytes, bytes> commit();
+  void handle_own_commit(epoch_t epoch, const bytes& handshake_data);
+
+  // Session::handle(), for callers that hold the exclusive lock
+  bool handle(const bytes& handshake_data);
+  void add_state(epoch_t prior_epoch, State&& group_state);
+  void record_state();
+  void track_pending();
+  bool commit_due() const;
+  void start_prewarm();
+  void finish_prewarm();
+  bool expired(const Epoch& epoch, uint64_t now) const;
+  void prune();
+  Epoch& for_epoch(epoch_t epoch);
 };
 
+using SharedLock = std::shared_lock<std::shared_mutex>;
+using ExclusiveLock = std::unique_lock<std::shared_mutex>;
+
 ///
 /// Client
 ///
@@ -81,6 +201,39 @@ Client::start_join() const
   return PendingJoin::Inner::create(suite, sig_priv, cred, opts);
 }
 
+std::vector<PendingJoin>
+Client::generate_key_packages(size_t count) const
+{
+  auto executor = SerialExecutor{};
+  return generate_key_packages(count, executor);
+}
+
+std::vector<PendingJoin>
+Client::generate_key_packages(size_t count, Executor& executor) const
+{
+  auto init_privs = std::vector<std::optional<HPKEPrivateKey>>(count);
+  auto init_keys = std::vector<HPKEPublicKey>(count);
+  executor.run(count, [&](size_t i) {
+    init_privs.at(i) = HPKEPrivateKey::generate(suite);
+    init_keys.at(i) = init_privs.at(i).value().public_key;
+  });
+
+  auto key_packages =
+    KeyPackage::generate(suite, init_keys, cred, sig_priv, opts, executor);
+
+  auto joins = std::vector<PendingJoin>{};
+  joins.reserve(count);
+  for (size_t i = 0; i < count; i++) {
+    auto inner =
+      std::make_unique<PendingJoin::Inner>(std::move(init_privs.at(i).value()),
+                                           sig_priv,
+                                           std::move(key_packages.at(i)));
+    joins.push_back(PendingJoin(inner.release()));
+  }
+
+  return joins;
+}
+
 ///
 /// PendingJoin
 ///
@@ -110,6 +263,15 @@ PendingJoin::Inner::create(CipherSuite suite,
   return PendingJoin(inner.release());
 }
 
+PendingJoin::Inner::Inner(HPKEPrivateKey init_priv_in,
+                          SignaturePrivateKey sig_priv_in,
+                          KeyPackage key_package_in)
+  : suite(key_package_in.cipher_suite)
+  , init_priv(std::move(init_priv_in))
+  , sig_priv(std::move(sig_priv_in))
+  , key_package(std::move(key_package_in))
+{}
+
 PendingJoin::PendingJoin(PendingJoin&& other) noexcept = default;
 
 PendingJoin&
@@ -130,8 +292,193 @@ PendingJoin::key_package() const
 Session
 PendingJoin::complete(const bytes& welcome) const
 {
-  return Session::Inner::join(
-    inner->init_priv, inner->sig_priv, inner->key_package, welcome);
+  auto executor = SerialExecutor{};
+  return complete(welcome, executor);
+}
+
+Session
+PendingJoin::complete(const bytes& welcome, Executor& executor) const
+{
+  if (!inner->capture_secret.has_value()) {
+    return Session::Inner::join(inner->init_priv,
+                                inner->sig_priv,
+                                inner->key_package,
+                                welcome,
+                                inner->limits,
+                                executor);
+  }
+
+  auto capture = SessionCapture{};
+  capture.origin = SessionCapture::Origin::join;
+  capture.snapshot = serialize(inner->capture_secret.value());
+
+  const auto start = std::chrono::steady_clock::now();
+  auto session = Session::Inner::join(inner->init_priv,
+                                      inner->sig_priv,
+                                      inner->key_package,
+                                      welcome,
+                                      inner->limits,
+                                      executor);
+  const auto elapsed = std::chrono::steady_clock::now() - start;
+
+  auto entry = SessionCapture::Entry{ SessionCapture::Input::welcome,
+                                      0,
+                                      static_cast<uint64_t>(
+                                        std::chrono::nanoseconds(elapsed)
+                                          .count()),
+                                      { { welcome } } };
+  capture.entries.push_back(std::move(entry));
+  session.inner->capture = std::move(capture);
+  return session;
+}
+
+// struct {
+//     uint32 magic = 0x4d4c534a; // "MLSJ"
+//     uint16 version = 1;
+//     CipherSuite suite;
+//     opaque salt<0..255>;
+// } PendingJoinSnapshotHeader;
+//
+// The header is followed by the encrypted PendingJoinSnapshotBody, with the
+// header as associated data
+struct PendingJoinSnapshotHeader
+{
+  static constexpr uint32_t snapshot_magic = 0x4d4c534a;
+  static constexpr uint16_t snapshot_version = 1;
+  static constexpr size_t salt_size = 32;
+
+  uint32_t magic = 0;
+  uint16_t version = 0;
+  CipherSuite suite;
+  bytes salt;
+
+  TLS_SERIALIZABLE(magic, version, suite, salt)
+  TLS_TRAITS(tls::pass, tls::pass, tls::pass, tls::vector<1>)
+};
+
+struct PendingJoinSnapshotBody
+{
+  bytes init_priv;
+  bytes sig_priv;
+  KeyPackage key_package;
+
+  TLS_SERIALIZABLE(init_priv, sig_priv, key_package)
+  TLS_TRAITS(tls::vector<2>, tls::vector<2>, tls::pass)
+};
+
+static KeyAndNonce
+pending_join_key_nonce(CipherSuite suite,
+                       const bytes& transfer_secret,
+                       const bytes& salt)
+{
+  const auto& aead = suite.get().hpke.aead;
+  return { suite.expand_with_label(
+             transfer_secret, "pending join key", salt, aead.key_size()),
+           suite.expand_with_label(
+             transfer_secret, "pending join nonce", salt, aead.nonce_size()) };
+}
+
+bytes
+PendingJoin::serialize(const bytes& transfer_secret) const
+{
+  const auto header = PendingJoinSnapshotHeader{
+    PendingJoinSnapshotHeader::snapshot_magic,
+    PendingJoinSnapshotHeader::snapshot_version,
+    inner->suite,
+    random_bytes(PendingJoinSnapshotHeader::salt_size),
+  };
+  auto body = tls::marshal(PendingJoinSnapshotBody{
+    inner->init_priv.data, inner->sig_priv.data, inner->key_package });
+
+  auto [key, nonce] =
+    pending_join_key_nonce(inner->suite, transfer_secret, header.salt);
+  auto out = tls::marshal(header);
+  auto ct = inner->suite.get().hpke.aead.seal(key, nonce, out, body);
+  zeroize(key);
+  zeroize(body);
+
+  out.insert(out.end(), ct.begin(), ct.end());
+  return out;
+}
+
+void
+PendingJoin::decode_limits(const DecodeLimits& limits)
+{
+  inner->limits = limits;
+}
+
+PendingJoin
+PendingJoin::restore(const bytes& data, const bytes& transfer_secret)
+{
+  return restore(data, transfer_secret, DecodeLimits{});
+}
+
+PendingJoin
+PendingJoin::restore(const bytes& data,
+                     const bytes& transfer_secret,
+                     const DecodeLimits& limits)
+{
+  if (data.size() > limits.max_message_size) {
+    throw tls::ReadError("Message too large");
+  }
+
+  const auto scope = DecodeLimits::Scope(limits);
+  auto header = PendingJoinSnapshotHeader{};
+  auto r = tls::istream(data);
+  r >> header;
+
+  if (header.magic != PendingJoinSnapshotHeader::snapshot_magic) {
+    throw InvalidParameterError("Not a serialized PendingJoin");
+  }
+
+  if (header.version != PendingJoinSnapshotHeader::snapshot_version) {
+    throw InvalidParameterError("Unsupported PendingJoin version");
+  }
+
+  const auto& aead = header.suite.get().hpke.aead;
+  const auto header_size = data.size() - r.size();
+  const auto aad = bytes(data.begin(), data.begin() + header_size);
+  const auto* ct = data.data() + header_size;
+  const auto ct_size = data.size() - header_size;
+  if (ct_size < aead.tag_size()) {
+    throw ProtocolError("Truncated PendingJoin");
+  }
+
+  // The AEAD reports an authentication failure rather than throwing, so a
+  // wrong secret surfaces as a ProtocolError
+  auto [key, nonce] =
+    pending_join_key_nonce(header.suite, transfer_secret, header.salt);
+  auto pt = bytes(ct_size - aead.tag_size());
+  auto ok = aead.open_into(key, nonce, aad, ct, ct_size, pt.data());
+  zeroize(key);
+  if (!ok) {
+    zeroize(pt);
+    throw ProtocolError("PendingJoin decryption failed");
+  }
+
+  auto body = tls::get<PendingJoinSnapshotBody>(pt);
+  zeroize(pt);
+
+  auto init_priv = HPKEPrivateKey::parse(header.suite, body.init_priv);
+  auto sig_priv = SignaturePrivateKey::parse(header.suite, body.sig_priv);
+  zeroize(body.init_priv);
+  zeroize(body.sig_priv);
+
+  if (body.key_package.cipher_suite != header.suite ||
+      body.key_package.init_key != init_priv.public_key) {
+    throw ProtocolError("KeyPackage does not match PendingJoin keys");
+  }
+
+  auto restored = std::make_unique<PendingJoin::Inner>(
+    std::move(init_priv), std::move(sig_priv), std::move(body.key_package));
+  restored->limits = limits;
+  return PendingJoin(restored.release());
+}
+
+void
+PendingJoin::capture(const bytes& capture_secret)
+{
+  inner->capture_secret = capture_secret;
 }
 
 ///
@@ -139,10 +486,23 @@ PendingJoin::complete(const bytes& welcome) const
 ///
 
 Session::Inner::Inner(State state)
-  : history{ std::move(state) }
+  : history{ { std::move(state), std::nullopt } }
   , encrypt_handshake(true)
 {}
 
+Session::Inner::~Inner()
+{
+  finish_prewarm();
+}
+
+ExclusiveLock
+Session::Inner::lock_exclusive()
+{
+  auto lock = ExclusiveLock(mutex);
+  finish_prewarm();
+  return lock;
+}
+
 Session
 Session::Inner::begin(const bytes& group_id,
                       const HPKEPrivateKey& init_priv,
@@ -151,7 +511,7 @@ Session::Inner::begin(const bytes& group_id,
 {
   auto state =
     State(group_id, key_package.cipher_suite, init_priv, sig_priv, key_package);
-  auto inner = std::make_unique<Inner>(state);
+  auto inner = std::make_unique<Inner>(std::move(state));
   return Session(inner.release());
 }
 
@@ -159,19 +519,26 @@ Session
 Session::Inner::join(const HPKEPrivateKey& init_priv,
                      const SignaturePrivateKey& sig_priv,
                      const KeyPackage& key_package,
-                     const bytes& welcome_data)
+                     const bytes& welcome_data,
+                     const DecodeLimits& limits,
+                     Executor& executor)
 {
-  auto welcome = tls::get<Welcome>(welcome_data);
+  // The GroupInfo and tree are decoded as the Welcome is processed, so the
+  // limits stay in force until the State is built
+  const auto scope = DecodeLimits::Scope(limits);
+  auto welcome = decode<Welcome>(welcome_data, limits);
 
-  auto state = State(init_priv, sig_priv, key_package, welcome);
-  auto inner = std::make_unique<Inner>(state);
+  auto state =
+    State(init_priv, sig_priv, key_package, std::move(welcome), executor);
+  auto inner = std::make_unique<Inner>(std::move(state));
+  inner->limits = limits;
   return Session(inner.release());
 }
 
 bytes
 Session::Inner::fresh_secret() const
 {
-  const auto suite = history.front().cipher_suite();
+  const auto suite = current().cipher_suite();
   const auto secret_size = suite.get().hpke.kdf.hash_size();
   return random_bytes(secret_size);
 }
@@ -183,7 +550,7 @@ Session::Inner::export_message(const MLSPlaintext& plaintext)
     return tls::marshal(plaintext);
   }
 
-  auto ciphertext = history.front().encrypt(plaintext);
+  auto ciphertext = current().encrypt(plaintext);
   return tls::marshal(ciphertext);
 }
 
@@ -191,35 +558,228 @@ MLSPlaintext
 Session::Inner::import_message(const bytes& encoded)
 {
   if (!encrypt_handshake) {
-    return tls::get<MLSPlaintext>(encoded);
+    return decode<MLSPlaintext>(encoded, limits);
   }
 
-  auto ciphertext = tls::get<MLSCiphertext>(encoded);
-  return history.front().decrypt(ciphertext);
+  auto ciphertext = decode<MLSCiphertext>(encoded, limits);
+  return current().decrypt(ciphertext);
 }
 
 void
-Session::Inner::add_state(epoch_t prior_epoch, const State& state)
+Session::Inner::add_state(epoch_t prior_epoch, State&& state)
 {
-  if (!history.empty() && prior_epoch != history.front().epoch()) {
+  if (!history.empty() && (prior_epoch != current().epoch() ||
+                           state.epoch() != prior_epoch + 1)) {
     throw MissingStateError("Discontinuity in history");
   }
 
-  history.emplace_front(state);
+  if (!history.empty()) {
+    history.front().retired_at = seconds_since_epoch();
+  }
 
-  // TODO(rlb) bound the size of the queue
+  history.push_front({ std::move(state), std::nullopt });
+  prepared_commit.reset();
+  pending_since.reset();
+  prune();
+  record_state();
+  track_pending();
+  start_prewarm();
 }
 
-State&
-Session::Inner::for_epoch(epoch_t epoch)
+void
+Session::Inner::record_state()
+{
+  if (!journal.has_value()) {
+    return;
+  }
+
+  auto [full, record] = journal.value().record(current());
+  if (full) {
+    journal_records.clear();
+    journal_compacted = true;
+  }
+
+  journal_records.insert(journal_records.end(), record.begin(), record.end());
+}
+
+void
+Session::Inner::track_pending()
+{
+  // This member's place in the committer order is worked out here, when the
+  // state changes, so that commit_due() does not scan the tree on each poll
+  const auto& state = current();
+  pending_count = state.pending_proposals();
+  committer_rank.reset();
+  if (pending_count == 0) {
+    pending_since.reset();
+    return;
+  }
+
+  if (!pending_since.has_value()) {
+    pending_since = seconds_since_epoch();
+  }
+
+  if (!schedule.has_value()) {
+    return;
+  }
+
+  const auto order = state.scheduled_committers();
+  const auto it = std::find(order.begin(), order.end(), state.index());
+  if (it != order.end()) {
+    committer_rank = static_cast<size_t>(std::distance(order.begin(), it));
+  }
+}
+
+bool
+Session::Inner::commit_due() const
+{
+  if (!schedule.has_value()) {
+    return false;
+  }
+
+  // A Commit already sent for this epoch covers the pending proposals
+  const auto& state = current();
+  if (outbound_cache.has_value() &&
+      std::get<1>(outbound_cache.value()).epoch() == state.epoch() + 1) {
+    return false;
+  }
+
+  if (pending_count == 0 || !committer_rank.has_value()) {
+    return false;
+  }
+
+  const auto rank = committer_rank.value();
+  if (rank == 0 && pending_count >= schedule.value().max_proposals) {
+    return true;
+  }
+
+  const auto& max_delay = schedule.value().max_delay;
+  if (!max_delay.has_value() || !pending_since.has_value()) {
+    return false;
+  }
+
+  const auto now = seconds_since_epoch();
+  if (now < pending_since.value()) {
+    return false;
+  }
+
+  // The scheduled committer commits after max_delay, and each member after
+  // it in the order stands in after one more max_delay
+  const auto waited = now - pending_since.value();
+  const auto delay = max_delay.value();
+  if (delay == 0) {
+    return rank == 0;
+  }
+
+  return waited / delay > rank;
+}
+
+void
+Session::Inner::start_prewarm()
+{
+  if (prewarm_worker == nullptr) {
+    return;
+  }
+
+  // The state stays where it is in the history until the job is finished,
+  // since everything that could move or destroy it waits for the job first
+  finish_prewarm();
+  auto* state = &current();
+  auto* executor = crypto;
+  auto task = std::make_shared<std::packaged_task<void()>>([state, executor]() {
+    auto serial = SerialExecutor{};
+    state->prewarm_keys((executor != nullptr) ? *executor : serial);
+  });
+  prewarming = task->get_future();
+  prewarm_worker->post([task]() { (*task)(); });
+}
+
+void
+Session::Inner::finish_prewarm()
+{
+  // Creating ratchets early only saves time, so a failure is not reported;
+  // the ratchets are created on first use instead
+  if (prewarming.valid()) {
+    prewarming.wait();
+    prewarming = {};
+  }
+}
+
+epoch_t
+Session::Inner::Epoch::epoch() const
+{
+  return std::visit([](const auto& s) { return s.epoch(); }, state);
+}
+
+bytes
+Session::Inner::Epoch::unprotect(const MLSCiphertext& ct)
+{
+  return std::visit([&](auto& s) { return s.unprotect(ct); }, state);
+}
+
+void
+Session::Inner::Epoch::unprotect_in_place(bytes& message)
+{
+  std::visit([&](auto& s) { s.unprotect_in_place(message); }, state);
+}
+
+size_t
+Session::Inner::Epoch::retained_bytes() const
+{
+  return std::visit([](const auto& s) { return s.retained_bytes(); }, state);
+}
+
+bool
+Session::Inner::expired(const Epoch& epoch, uint64_t now) const
+{
+  if (!epoch.retired_at.has_value()) {
+    return false;
+  }
+
+  const auto retired_at = epoch.retired_at.value();
+  return policy.max_age.has_value() && now > retired_at &&
+         now - retired_at > policy.max_age.value();
+}
+
+void
+Session::Inner::prune()
 {
-  for (auto& state : history) {
-    if (state.epoch() == epoch) {
-      return state;
+  // Past epochs are ordered from most to least recently retired, so expired
+  // entries are always at the back
+  const auto now = seconds_since_epoch();
+  while (history.size() > 1 &&
+         (history.size() - 1 > policy.max_past_epochs ||
+          expired(history.back(), now))) {
+    history.pop_back();
+  }
+
+  if (!policy.decrypt_only) {
+    return;
+  }
+
+  for (auto it = std::next(history.begin()); it != history.end(); it++) {
+    if (const auto* state = std::get_if<State>(&it->state)) {
+      it->state = DecryptOnlyEpoch(*state);
     }
   }
+}
+
+Session::Inner::Epoch&
+Session::Inner::for_epoch(epoch_t epoch)
+{
+  // This is called with the lock held shared, so expired epochs are refused
+  // here but only released by the next operation that prunes
+  const auto current_epoch = history.front().epoch();
+  if (epoch > current_epoch || current_epoch - epoch >= history.size()) {
+    throw MissingStateError("No state for epoch");
+  }
+
+  auto& entry = history.at(current_epoch - epoch);
+  if (expired(entry, seconds_since_epoch())) {
+    throw MissingStateError("No state for epoch");
+  }
 
-  throw MissingStateError("No state for epoch");
+  return entry;
 }
 
 Session::Session(Session&& other) noexcept = default;
@@ -236,29 +796,65 @@ Session::Session(Inner* inner_in)
 void
 Session::encrypt_handshake(bool enabled)
 {
+  const auto lock = inner->lock_exclusive();
   inner->encrypt_handshake = enabled;
 }
 
+void
+Session::crypto_executor(Executor& executor)
+{
+  const auto lock = inner->lock_exclusive();
+  inner->crypto = &executor;
+}
+
+void
+Session::key_prewarm(KeyPrewarm mode, ThreadPool& worker)
+{
+  const auto lock = inner->lock_exclusive();
+  inner->prewarm_worker = &worker;
+  inner->current().key_prewarm(mode);
+  inner->start_prewarm();
+}
+
+void
+Session::decode_limits(const DecodeLimits& limits)
+{
+  const auto lock = inner->lock_exclusive();
+  inner->limits = limits;
+}
+
+void
+Session::history_policy(const HistoryPolicy& policy)
+{
+  const auto lock = inner->lock_exclusive();
+  inner->policy = policy;
+  inner->prune();
+}
+
 bytes
 Session::add(const bytes& key_package_data)
 {
-  auto key_package = tls::get<KeyPackage>(key_package_data);
-  auto proposal = inner->history.front().add(key_package);
+  const auto lock = inner->lock_exclusive();
+  auto key_package = decode<KeyPackage>(key_package_data, inner->limits);
+  auto proposal = inner->current().add(key_package);
   return inner->export_message(proposal);
 }
 
 bytes
 Session::update()
 {
+  const auto lock = inner->lock_exclusive();
   auto leaf_secret = inner->fresh_secret();
-  auto proposal = inner->history.front().update(leaf_secret);
+  auto proposal = inner->current().update(leaf_secret);
+  inner->record_state();
   return inner->export_message(proposal);
 }
 
 bytes
 Session::remove(uint32_t index)
 {
-  auto proposal = inner->history.front().remove(RosterIndex{ index });
+  const auto lock = inner->lock_exclusive();
+  auto proposal = inner->current().remove(RosterIndex{ index });
   return inner->export_message(proposal);
 }
 
@@ -271,79 +867,521 @@ Session::commit(const bytes& proposal)
 std::tuple<bytes, bytes>
 Session::commit(const std::vector<bytes>& proposals)
 {
+  const auto lock = inner->lock_exclusive();
   for (const auto& proposal_data : proposals) {
-    const auto pt = inner->import_message(proposal_data);
-    const auto* const proposal = std::get_if<Proposal>(&pt.content);
-    if (proposal == nullptr) {
+    auto pt = inner->import_message(proposal_data);
+    if (!std::holds_alternative<Proposal>(pt.content)) {
       throw ProtocolError("Only proposals can be committed");
     }
 
-    inner->history.front().handle(pt);
+    inner->current().handle(std::move(pt));
   }
 
-  return commit();
+  return inner->commit();
 }
 
 std::tuple<bytes, bytes>
 Session::commit()
 {
-  auto commit_secret = inner->fresh_secret();
+  const auto lock = inner->lock_exclusive();
+  return inner->commit();
+}
+
+void
+Session::prepare_commit()
+{
+  // Preparation works on a copy of the current state, so that the session is
+  // only locked to take the copy and to store the result
+  auto [state, leaf_secret] = [&]() {
+    const auto lock = inner->lock_exclusive();
+    return std::make_tuple(inner->current(), inner->fresh_secret());
+  }();
+
+  auto prepared = state.prepare_commit(leaf_secret);
+
+  const auto lock = inner->lock_exclusive();
+  if (prepared.epoch == inner->current().epoch()) {
+    inner->prepared_commit = std::move(prepared);
+  }
+}
+
+void
+Session::commit_schedule(const CommitSchedule& schedule)
+{
+  const auto lock = inner->lock_exclusive();
+  inner->schedule = schedule;
+  inner->track_pending();
+}
+
+std::optional<std::tuple<bytes, bytes>>
+Session::commit_scheduled()
+{
+  const auto lock = inner->lock_exclusive();
+  if (!inner->commit_due()) {
+    return std::nullopt;
+  }
+
+  return inner->commit();
+}
+
+void
+Session::journal(const bytes& storage_secret, size_t compact_interval)
+{
+  const auto lock = inner->lock_exclusive();
+  inner->journal.emplace(storage_secret, compact_interval);
+  inner->journal_records.clear();
+  inner->record_state();
+}
+
+std::tuple<bool, bytes>
+Session::journal_records()
+{
+  const auto lock = inner->lock_exclusive();
+  auto compacted = std::exchange(inner->journal_compacted, false);
+  auto records = std::exchange(inner->journal_records, bytes{});
+  return { compacted, std::move(records) };
+}
+
+Session
+Session::resume(const bytes& journal, const bytes& storage_secret)
+{
+  auto state = StateJournal::replay(journal, storage_secret);
+  auto inner = std::make_unique<Inner>(std::move(state));
+  return Session(inner.release());
+}
+
+// struct {
+//     uint32 magic = 0x4d4c5345; // "MLSE"
+//     uint16 version = 1;
+//     uint8 encrypt_handshake;
+//     uint64 max_past_epochs;
+//     optional<uint64> max_age;
+//     uint8 decrypt_only;
+//     SessionEpochSnapshot history<0..2^32-1>;
+//     optional<SessionOutboundSnapshot> outbound;
+// } SessionSnapshot;
+struct SessionEpochSnapshot
+{
+  std::optional<uint64_t> retired_at;
+  bytes state;
+
+  TLS_SERIALIZABLE(retired_at, state)
+  TLS_TRAITS(tls::pass, tls::vector<4>)
+};
+
+struct SessionOutboundSnapshot
+{
+  bytes commit;
+  bytes state;
+
+  TLS_SERIALIZABLE(commit, state)
+  TLS_TRAITS(tls::vector<4>, tls::vector<4>)
+};
+
+struct SessionSnapshot
+{
+  static constexpr uint32_t snapshot_magic = 0x4d4c5345;
+  static constexpr uint16_t snapshot_version = 1;
+
+  uint32_t magic = 0;
+  uint16_t version = 0;
+  uint8_t encrypt_handshake = 0;
+  uint64_t max_past_epochs = 0;
+  std::optional<uint64_t> max_age;
+  uint8_t decrypt_only = 0;
+  std::vector<SessionEpochSnapshot> history;
+  std::optional<SessionOutboundSnapshot> outbound;
+
+  TLS_SERIALIZABLE(magic,
+                   version,
+                   encrypt_handshake,
+                   max_past_epochs,
+                   max_age,
+                   decrypt_only,
+                   history,
+                   outbound)
+  TLS_TRAITS(tls::pass,
+             tls::pass,
+             tls::pass,
+             tls::pass,
+             tls::pass,
+             tls::pass,
+             tls::vector<4>,
+             tls::pass)
+};
+
+bytes
+Session::Inner::serialize(const bytes& transfer_secret) const
+{
+  auto out = SessionSnapshot{ SessionSnapshot::snapshot_magic,
+                              SessionSnapshot::snapshot_version,
+                              static_cast<uint8_t>(encrypt_handshake),
+                              policy.max_past_epochs,
+                              policy.max_age,
+                              static_cast<uint8_t>(policy.decrypt_only),
+                              {},
+                              std::nullopt };
+
+  for (const auto& entry : history) {
+    auto state = std::visit(
+      [&](const auto& s) { return s.save(transfer_secret); }, entry.state);
+    out.history.push_back({ entry.retired_at, std::move(state) });
+  }
+
+  if (outbound_cache.has_value()) {
+    const auto& [commit, state] = outbound_cache.value();
+    out.outbound = SessionOutboundSnapshot{ commit,
+                                            state.save(transfer_secret) };
+  }
+
+  return tls::marshal(out);
+}
+
+bytes
+Session::serialize(const bytes& transfer_secret) const
+{
+  const auto lock = inner->lock_exclusive();
+  return inner->serialize(transfer_secret);
+}
+
+Session
+Session::restore(const bytes& data, const bytes& transfer_secret)
+{
+  return restore(data, transfer_secret, DecodeLimits{});
+}
+
+Session
+Session::restore(const bytes& data,
+                 const bytes& transfer_secret,
+                 const DecodeLimits& limits)
+{
+  // The limits stay in force while the epochs are decoded from the snapshot
+  const auto scope = DecodeLimits::Scope(limits);
+  const auto snapshot = decode<SessionSnapshot>(data, limits);
+  if (snapshot.magic != SessionSnapshot::snapshot_magic) {
+    throw InvalidParameterError("Not a serialized Session");
+  }
+
+  if (snapshot.version != SessionSnapshot::snapshot_version) {
+    throw InvalidParameterError("Unsupported Session version");
+  }
+
+  if (snapshot.history.empty()) {
+    throw ProtocolError("Serialized Session has no epochs");
+  }
+
+  const auto current = StateSnapshot(snapshot.history.front().state);
+  if (current.decrypt_only()) {
+    throw ProtocolError("Current epoch is decrypt-only");
+  }
+
+  auto inner =
+    std::make_unique<Inner>(State::load(current, transfer_secret));
+  for (size_t i = 1; i < snapshot.history.size(); i++) {
+    const auto& entry = snapshot.history.at(i);
+    const auto past = StateSnapshot(entry.state);
+    if (past.epoch() + i != current.epoch()) {
+      throw ProtocolError("Discontinuity in history");
+    }
+
+    if (past.decrypt_only()) {
+      inner->history.push_back(
+        { DecryptOnlyEpoch::load(past, transfer_secret), entry.retired_at });
+    } else {
+      inner->history.push_back(
+        { State::load(past, transfer_secret), entry.retired_at });
+    }
+  }
+
+  inner->encrypt_handshake = snapshot.encrypt_handshake != 0;
+  inner->policy.max_past_epochs = snapshot.max_past_epochs;
+  inner->policy.max_age = snapshot.max_age;
+  inner->policy.decrypt_only = snapshot.decrypt_only != 0;
+  inner->limits = limits;
+
+  if (snapshot.outbound.has_value()) {
+    const auto& outbound = snapshot.outbound.value();
+    auto state = State::load(StateSnapshot(outbound.state), transfer_secret);
+    inner->outbound_cache = std::make_tuple(outbound.commit, std::move(state));
+  }
+
+  return Session(inner.release());
+}
+
+///
+/// Capture
+///
+
+SessionCapture
+SessionCapture::decode(const bytes& data)
+{
+  auto capture = tls::get<SessionCapture>(data);
+  if (capture.magic != capture_magic) {
+    throw InvalidParameterError("Not a Session capture");
+  }
+
+  if (capture.version != capture_version) {
+    throw InvalidParameterError("Unsupported Session capture version");
+  }
+
+  return capture;
+}
+
+Session::Inner::CaptureScope::CaptureScope(Inner& inner_in,
+                                           SessionCapture::Input input,
+                                           const std::vector<bytes>& messages)
+  : inner(inner_in)
+  , start(std::chrono::steady_clock::now())
+  , exceptions(std::uncaught_exceptions())
+{
+  if (!inner.capture.has_value()) {
+    return;
+  }
+
+  entry.input = input;
+  entry.messages.reserve(messages.size());
+  for (const auto& message : messages) {
+    entry.messages.push_back({ message });
+  }
+}
+
+Session::Inner::CaptureScope::CaptureScope(Inner& inner_in,
+                                           SessionCapture::Input input,
+                                           const bytes& message)
+  : inner(inner_in)
+  , start(std::chrono::steady_clock::now())
+  , exceptions(std::uncaught_exceptions())
+{
+  if (!inner.capture.has_value()) {
+    return;
+  }
+
+  entry.input = input;
+  entry.messages.push_back({ message });
+}
+
+Session::Inner::CaptureScope::~CaptureScope()
+{
+  if (!inner.capture.has_value()) {
+    return;
+  }
+
+  const auto elapsed = std::chrono::steady_clock::now() - start;
+  entry.elapsed_ns = static_cast<uint64_t>(
+    std::chrono::nanoseconds(elapsed).count());
+  entry.failed = (std::uncaught_exceptions() > exceptions) ? 1 : 0;
+
+  // A capture that cannot be extended is left as it was, rather than
+  // throwing from a destructor
+  try {
+    const auto lock = std::lock_guard(inner.capture_mutex);
+    inner.capture.value().entries.push_back(std::move(entry));
+  } catch (const std::exception& /* unused */) {
+  }
+}
+
+void
+Session::capture(const bytes& capture_secret)
+{
+  const auto lock = inner->lock_exclusive();
+  auto capture = SessionCapture{};
+  capture.origin = SessionCapture::Origin::session;
+  capture.snapshot = inner->serialize(capture_secret);
+  inner->capture = std::move(capture);
+}
+
+bytes
+Session::end_capture()
+{
+  const auto lock = inner->lock_exclusive();
+  if (!inner->capture.has_value()) {
+    throw InvalidParameterError("Session is not being captured");
+  }
+
+  auto capture = std::exchange(inner->capture, std::nullopt);
+  return tls::marshal(capture.value());
+}
+
+std::tuple<bytes, bytes>
+Session::Inner::commit()
+{
+  // A prepared commit is used at most once, even if this commit fails
+  auto prepared = std::exchange(prepared_commit, std::nullopt);
+  auto use_prepared =
+    prepared.has_value() && prepared.value().epoch == current().epoch();
+  auto serial = SerialExecutor{};
+  auto& executor = (crypto != nullptr) ? *crypto : serial;
   auto [commit, welcome, new_state] =
-    inner->history.front().commit(commit_secret);
+    use_prepared ? current().commit(prepared.value(), executor)
+                 : current().commit(fresh_secret(), executor);
 
-  auto commit_msg = inner->export_message(commit);
+  auto commit_msg = export_message(commit);
   auto welcome_msg = tls::marshal(welcome);
 
-  inner->outbound_cache = std::make_tuple(commit_msg, new_state);
+  outbound_cache = std::make_tuple(commit_msg, std::move(new_state));
   return std::make_tuple(welcome_msg, commit_msg);
 }
 
+void
+Session::Inner::handle_own_commit(epoch_t epoch, const bytes& handshake_data)
+{
+  if (!outbound_cache.has_value()) {
+    throw ProtocolError("Received from self without sending");
+  }
+
+  const auto& cached_msg = std::get<0>(outbound_cache.value());
+  if (cached_msg != handshake_data) {
+    throw ProtocolError("Received message different from cached");
+  }
+
+  // The cached state is moved into the history, and stays cached if it does
+  // not follow on from the current epoch
+  add_state(epoch, std::get<1>(std::move(outbound_cache.value())));
+  outbound_cache = std::nullopt;
+}
+
 bool
 Session::handle(const bytes& handshake_data)
 {
-  auto pt = inner->import_message(handshake_data);
+  const auto lock = inner->lock_exclusive();
+  return inner->handle(handshake_data);
+}
+
+bool
+Session::Inner::handle(const bytes& handshake_data)
+{
+  const auto scope =
+    CaptureScope(*this, SessionCapture::Input::handshake, handshake_data);
+
+  // Messages for another group or epoch are rejected before they are decoded
+  const auto header = encrypt_handshake
+                        ? peek_header(handshake_data)
+                        : peek_plaintext_header(handshake_data);
+  if (header.group_id != current().group_id()) {
+    throw InvalidParameterError("GroupID mismatch");
+  }
+
+  if (header.epoch != current().epoch()) {
+    throw InvalidParameterError("Epoch mismatch");
+  }
+
+  auto pt = import_message(handshake_data);
 
   if (pt.sender.sender_type != SenderType::member) {
     throw ProtocolError("External senders not supported");
   }
 
   const auto is_commit = std::holds_alternative<Commit>(pt.content);
-  if (is_commit &&
-      LeafIndex(pt.sender.sender) == inner->history.front().index()) {
-    if (!inner->outbound_cache.has_value()) {
-      throw ProtocolError("Received from self without sending");
-    }
-
-    const auto& cached_msg = std::get<0>(inner->outbound_cache.value());
-    const auto& next_state = std::get<1>(inner->outbound_cache.value());
-    if (cached_msg != handshake_data) {
-      throw ProtocolError("Received message different from cached");
-    }
-
-    inner->add_state(pt.epoch, next_state);
-    inner->outbound_cache = std::nullopt;
+  if (is_commit && LeafIndex(pt.sender.sender) == current().index()) {
+    handle_own_commit(pt.epoch, handshake_data);
     return true;
   }
 
-  auto maybe_next_state = inner->history.front().handle(pt);
+  auto serial = SerialExecutor{};
+  auto& executor = (crypto != nullptr) ? *crypto : serial;
+  auto maybe_next_state = current().handle(std::move(pt), executor);
   if (!maybe_next_state.has_value()) {
+    record_state();
+    track_pending();
     return false;
   }
 
-  inner->add_state(pt.epoch, maybe_next_state.value());
+  add_state(header.epoch, std::move(maybe_next_state.value()));
   return true;
 }
 
+bool
+Session::catch_up(const std::vector<bytes>& handshake_data)
+{
+  // Each encrypted message is decrypted with the keys of the epoch before
+  // it, so there is nothing to gain from a pipeline.  The messages are
+  // captured one by one, by handle().
+  const auto lock = inner->lock_exclusive();
+  if (inner->encrypt_handshake) {
+    auto advanced = false;
+    for (const auto& data : handshake_data) {
+      advanced = inner->handle(data) || advanced;
+    }
+    return advanced;
+  }
+
+  const auto scope = Inner::CaptureScope(
+    *inner, SessionCapture::Input::catch_up, handshake_data);
+
+  auto serial = SerialExecutor{};
+  auto& executor = (inner->crypto != nullptr) ? *inner->crypto : serial;
+
+  // Messages are handed to the State in runs between this member's own
+  // Commits, which are taken from the outbound cache
+  auto advanced = false;
+  auto run = std::vector<MLSPlaintext>{};
+  auto handle_run = [&]() {
+    if (run.empty()) {
+      return;
+    }
+
+    auto states = inner->current().catch_up(run, executor);
+    run.clear();
+    if (states.empty()) {
+      inner->record_state();
+      inner->track_pending();
+      return;
+    }
+
+    for (auto& state : states) {
+      inner->add_state(inner->current().epoch(), std::move(state));
+    }
+    advanced = true;
+  };
+
+  for (const auto& data : handshake_data) {
+    auto pt = decode<MLSPlaintext>(data, inner->limits);
+    if (pt.sender.sender_type != SenderType::member) {
+      throw ProtocolError("External senders not supported");
+    }
+
+    const auto is_commit = std::holds_alternative<Commit>(pt.content);
+    if (!is_commit || LeafIndex(pt.sender.sender) != inner->current().index()) {
+      run.push_back(std::move(pt));
+      continue;
+    }
+
+    handle_run();
+    if (pt.group_id != inner->current().group_id()) {
+      throw InvalidParameterError("GroupID mismatch");
+    }
+
+    if (pt.epoch != inner->current().epoch()) {
+      throw InvalidParameterError("Epoch mismatch");
+    }
+
+    inner->handle_own_commit(pt.epoch, data);
+    advanced = true;
+  }
+
+  handle_run();
+  return advanced;
+}
+
+bytes
+Session::group_id() const
+{
+  const auto lock = SharedLock(inner->mutex);
+  return inner->current().group_id();
+}
+
 epoch_t
 Session::current_epoch() const
 {
-  return inner->history.front().epoch();
+  const auto lock = SharedLock(inner->mutex);
+  return inner->current().epoch();
 }
 
 uint32_t
 Session::index() const
 {
-  return inner->history.front().index().val;
+  const auto lock = SharedLock(inner->mutex);
+  return inner->current().index().val;
 }
 
 bytes
@@ -351,26 +1389,77 @@ Session::do_export(const std::string& label,
                    const bytes& context,
                    size_t size) const
 {
-  return inner->history.front().do_export(label, context, size);
+  const auto lock = SharedLock(inner->mutex);
+  return inner->current().do_export(label, context, size);
+}
+
+std::vector<bytes>
+Session::do_export(const std::vector<std::string>& labels,
+                   const bytes& context,
+                   size_t size) const
+{
+  const auto lock = SharedLock(inner->mutex);
+  return inner->current().do_export(labels, context, size);
 }
 
 std::vector<KeyPackage>
 Session::roster() const
 {
-  return inner->history.front().roster();
+  const auto lock = SharedLock(inner->mutex);
+  return inner->current().roster();
 }
 
 bytes
 Session::authentication_secret() const
 {
-  return inner->history.front().authentication_secret();
+  const auto lock = SharedLock(inner->mutex);
+  return inner->current().authentication_secret();
+}
+
+size_t
+Session::retained_epochs() const
+{
+  const auto lock = SharedLock(inner->mutex);
+  return inner->history.size();
+}
+
+size_t
+Session::retained_bytes() const
+{
+  return memory_usage().total();
+}
+
+MemoryUsage
+Session::memory_usage() const
+{
+  const auto lock = SharedLock(inner->mutex);
+  auto usage = inner->current().memory_usage();
+  for (auto it = std::next(inner->history.begin()); it != inner->history.end();
+       it++) {
+    usage.history += it->retained_bytes();
+  }
+
+  if (inner->outbound_cache.has_value()) {
+    const auto& [message, state] = inner->outbound_cache.value();
+    usage.history += message.size() + state.retained_bytes();
+  }
+
+  return usage;
 }
 
 bytes
 Session::protect(const bytes& plaintext)
 {
-  auto ciphertext = inner->history.front().protect(plaintext);
-  return tls::marshal(ciphertext);
+  auto out = bytes{};
+  protect_into(plaintext, out);
+  return out;
+}
+
+void
+Session::protect_into(const bytes& plaintext, bytes& out)
+{
+  const auto lock = SharedLock(inner->mutex);
+  inner->current().protect_into(plaintext, out);
 }
 
 // TODO(rlb@ipv.sx): It would be good to expose identity information
@@ -379,21 +1468,179 @@ Session::protect(const bytes& plaintext)
 bytes
 Session::unprotect(const bytes& ciphertext)
 {
+  // The epoch is found before the message is decoded, so that messages for
+  // epochs no longer held are dropped without copying their payloads
+  const auto header = peek_header(ciphertext);
+  const auto lock = SharedLock(inner->mutex);
+  const auto scope = Inner::CaptureScope(
+    *inner, SessionCapture::Input::application, ciphertext);
+  auto& epoch = inner->for_epoch(header.epoch);
   auto ciphertext_obj = tls::get<MLSCiphertext>(ciphertext);
-  auto& state = inner->for_epoch(ciphertext_obj.epoch);
-  return state.unprotect(ciphertext_obj);
+  return epoch.unprotect(ciphertext_obj);
+}
+
+void
+Session::unprotect_in_place(bytes& message)
+{
+  // Only the header is decoded here, to find the epoch
+  const auto header = peek_header(message);
+  const auto lock = SharedLock(inner->mutex);
+  const auto scope = Inner::CaptureScope(
+    *inner, SessionCapture::Input::application, message);
+  inner->for_epoch(header.epoch).unprotect_in_place(message);
+}
+
+// Each chunk of a stream is prefixed with the ID of the stream and its
+// position in it
+//
+// struct {
+//     opaque stream_id[16];
+//     uint32 index;
+//     uint8 last;
+//     opaque data[...];
+// } StreamChunk;
+static constexpr size_t stream_id_size = 16;
+static constexpr size_t stream_header_size = stream_id_size + 5;
+
+static void
+write_stream_header(bytes& chunk,
+                    const bytes& stream_id,
+                    uint32_t index,
+                    bool last)
+{
+  std::copy(stream_id.begin(), stream_id.end(), chunk.begin());
+  for (size_t i = 0; i < 4; i++) {
+    chunk.at(stream_id_size + i) = static_cast<uint8_t>(index >> (8 * (3 - i)));
+  }
+  chunk.at(stream_id_size + 4) = static_cast<uint8_t>(last ? 1 : 0);
+}
+
+void
+Session::protect_stream(const StreamSource& source,
+                        const StreamSink& sink,
+                        size_t chunk_size)
+{
+  if (chunk_size == 0) {
+    throw InvalidParameterError("Stream chunks must not be empty");
+  }
+
+  // The chunk and message buffers are reused, so that they are allocated
+  // once for the whole stream.  The lock is taken for each chunk, not held
+  // while reading, so the epoch may change during the stream.
+  const auto stream_id = random_bytes(stream_id_size);
+  auto chunk = bytes(stream_header_size + chunk_size);
+  auto message = bytes{};
+  for (uint32_t index = 0;; index++) {
+    chunk.resize(stream_header_size + chunk_size);
+    const auto size = source(chunk.data() + stream_header_size, chunk_size);
+    if (size > chunk_size) {
+      throw InvalidParameterError("Stream source overran its buffer");
+    }
+
+    const auto last = size < chunk_size;
+    if (!last && index == std::numeric_limits<uint32_t>::max()) {
+      throw InvalidParameterError("Stream has too many chunks");
+    }
+
+    chunk.resize(stream_header_size + size);
+    write_stream_header(chunk, stream_id, index, last);
+    protect_into(chunk, message);
+    sink(message);
+
+    if (last) {
+      return;
+    }
+  }
+}
+
+Session::StreamChunk
+Session::unprotect_chunk(bytes& message)
+{
+  unprotect_in_place(message);
+  if (message.size() < stream_header_size ||
+      message.at(stream_id_size + 4) > 1) {
+    throw ProtocolError("Malformed stream chunk");
+  }
+
+  const auto id_end = message.begin() + stream_id_size;
+  auto chunk = StreamChunk{};
+  chunk.stream_id = bytes(message.begin(), id_end);
+  for (size_t i = 0; i < 4; i++) {
+    chunk.index = (chunk.index << 8U) | message.at(stream_id_size + i);
+  }
+  chunk.last = message.at(stream_id_size + 4) == 1;
+
+  const auto header_end = message.begin() + stream_header_size;
+  message.erase(message.begin(), header_end);
+  return chunk;
+}
+
+Session::StreamChunk
+Session::unprotect_chunk(bytes& message, const bytes& stream_id)
+{
+  auto chunk = unprotect_chunk(message);
+  if (chunk.stream_id != stream_id) {
+    throw ProtocolError("Chunk from another stream");
+  }
+
+  return chunk;
+}
+
+std::vector<bytes>
+Session::protect_batch(const std::vector<bytes>& plaintexts)
+{
+  const auto lock = SharedLock(inner->mutex);
+  return inner->current().protect_batch(plaintexts);
+}
+
+std::vector<std::optional<bytes>>
+Session::unprotect_batch(const std::vector<bytes>& ciphertexts)
+{
+  auto out = std::vector<std::optional<bytes>>(ciphertexts.size());
+  const auto lock = SharedLock(inner->mutex);
+  const auto scope = Inner::CaptureScope(
+    *inner, SessionCapture::Input::application_batch, ciphertexts);
+  for (size_t i = 0; i < ciphertexts.size(); i++) {
+    try {
+      auto message = ciphertexts[i];
+      const auto header = peek_header(message);
+      inner->for_epoch(header.epoch).unprotect_in_place(message);
+      out[i] = std::move(message);
+    } catch (const std::exception& /* unused */) {
+      // Leave this message's result empty
+    }
+  }
+  return out;
 }
 
 bool
 operator==(const Session& lhs, const Session& rhs)
 {
+  lhs.inner->finish_prewarm();
+  rhs.inner->finish_prewarm();
+
   if (lhs.inner->encrypt_handshake != rhs.inner->encrypt_handshake) {
     return false;
   }
 
+  // Past epochs may have been compacted differently, so only their epoch
+  // numbers are compared
+  if (lhs.inner->current() != rhs.inner->current()) {
+    return false;
+  }
+
   auto size = std::min(lhs.inner->history.size(), rhs.inner->history.size());
-  for (size_t i = 0; i < size; i += 1) {
-    if (lhs.inner->history.at(i) != rhs.inner->history.at(i)) {
+  for (size_t i = 1; i < size; i += 1) {
+    const auto& lhs_past = lhs.inner->history.at(i);
+    const auto& rhs_past = rhs.inner->history.at(i);
+    if (lhs_past.epoch() != rhs_past.epoch()) {
+      return false;
+    }
+
+    const auto* lhs_state = std::get_if<State>(&lhs_past.state);
+    const auto* rhs_state = std::get_if<State>(&rhs_past.state);
+    if (lhs_state != nullptr && rhs_state != nullptr &&
+        *lhs_state != *rhs_state) {
       return false;
     }
   }
@@ -0,0 +1,376 @@
+#include <mls/session_manager.h>
+
+#include <mls/messages.h>
+
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <shared_mutex>
+#include <unordered_map>
+
+namespace mls {
+
+struct SessionManager::Group
+{
+  explicit Group(Session session_in)
+    : session(std::move(session_in))
+  {}
+
+  Session session;
+
+  // Handshake messages submitted but not yet processed
+  std::atomic<size_t> pending_handshakes{ 0 };
+};
+
+struct SessionManager::Task
+{
+  std::shared_ptr<Group> group;
+  bytes group_id;
+  bytes message;
+  bool handshake = false;
+  Callback done;
+};
+
+struct SessionManager::Shard
+{
+  mutable std::shared_mutex groups_mutex;
+  std::unordered_map<bytes, std::shared_ptr<Group>, BytesHash> groups;
+
+  std::mutex queue_mutex;
+  std::condition_variable ready;
+  std::deque<Task> queue;
+
+  // Set while the worker has nothing to do, so that it can be woken to steal
+  // when another shard gets work.  The wake flag is guarded by queue_mutex.
+  std::atomic<bool> idle{ false };
+  bool wake = false;
+
+  std::thread worker;
+};
+
+// How long an idle worker sleeps before it looks for work to steal again,
+// when it has not been woken.  The interval doubles up to the maximum while
+// there is nothing to steal, so that idle workers do not keep waking up.
+static const auto min_steal_interval = std::chrono::milliseconds(1);
+static const auto max_steal_interval = std::chrono::milliseconds(64);
+
+SessionManager::SessionManager(size_t shard_count_in)
+{
+  auto count = std::max<size_t>(shard_count_in, 1);
+  shards.reserve(count);
+  for (size_t i = 0; i < count; i++) {
+    shards.push_back(std::make_unique<Shard>());
+  }
+
+  // Workers are only started once every shard exists, since they may steal
+  // from any of them
+  for (size_t i = 0; i < count; i++) {
+    shards.at(i)->worker = std::thread([this, i]() { work(i); });
+  }
+}
+
+SessionManager::~SessionManager()
+{
+  // Workers finish the messages already queued for their shards
+  stopping = true;
+  for (auto& shard : shards) {
+    {
+      const auto lock = std::unique_lock(shard->queue_mutex);
+    }
+    shard->ready.notify_all();
+  }
+
+  for (auto& shard : shards) {
+    shard->worker.join();
+  }
+}
+
+///
+/// Registry
+///
+
+size_t
+SessionManager::shard_of(const bytes& group_id) const
+{
+  return BytesHash{}(group_id) % shards.size();
+}
+
+SessionManager::Shard&
+SessionManager::shard_for(const bytes& group_id) const
+{
+  return *shards.at(shard_of(group_id));
+}
+
+std::shared_ptr<SessionManager::Group>
+SessionManager::find(const bytes& group_id) const
+{
+  const auto& shard = shard_for(group_id);
+  const auto lock = std::shared_lock(shard.groups_mutex);
+  auto it = shard.groups.find(group_id);
+  if (it == shard.groups.end()) {
+    return nullptr;
+  }
+
+  return it->second;
+}
+
+void
+SessionManager::add(Session session)
+{
+  auto group_id = session.group_id();
+  auto& shard = shard_for(group_id);
+  const auto lock = std::unique_lock(shard.groups_mutex);
+  if (shard.groups.count(group_id) > 0) {
+    throw InvalidParameterError("Group is already managed");
+  }
+
+  auto group = std::make_shared<Group>(std::move(session));
+  shard.groups.emplace(std::move(group_id), std::move(group));
+}
+
+bool
+SessionManager::remove(const bytes& group_id)
+{
+  auto& shard = shard_for(group_id);
+  const auto lock = std::unique_lock(shard.groups_mutex);
+  return shard.groups.erase(group_id) > 0;
+}
+
+bool
+SessionManager::contains(const bytes& group_id) const
+{
+  return find(group_id) != nullptr;
+}
+
+size_t
+SessionManager::size() const
+{
+  auto size = size_t(0);
+  for (const auto& shard : shards) {
+    const auto lock = std::shared_lock(shard->groups_mutex);
+    size += shard->groups.size();
+  }
+  return size;
+}
+
+///
+/// Synchronous processing
+///
+
+bool
+SessionManager::handle(const bytes& handshake_data)
+{
+  auto group = find(peek_group_id(handshake_data));
+  if (!group) {
+    throw MissingStateError("Unknown group");
+  }
+
+  return group->session.handle(handshake_data);
+}
+
+bytes
+SessionManager::protect(const bytes& group_id, const bytes& plaintext)
+{
+  auto group = find(group_id);
+  if (!group) {
+    throw MissingStateError("Unknown group");
+  }
+
+  return group->session.protect(plaintext);
+}
+
+bytes
+SessionManager::unprotect(const bytes& ciphertext)
+{
+  auto group = find(peek_group_id(ciphertext));
+  if (!group) {
+    throw MissingStateError("Unknown group");
+  }
+
+  return group->session.unprotect(ciphertext);
+}
+
+///
+/// Asynchronous processing
+///
+
+void
+SessionManager::submit_handshake(bytes handshake_data, Callback done)
+{
+  submit(true, std::move(handshake_data), std::move(done));
+}
+
+void
+SessionManager::submit_application(bytes ciphertext, Callback done)
+{
+  submit(false, std::move(ciphertext), std::move(done));
+}
+
+void
+SessionManager::submit(bool handshake, bytes message, Callback done)
+{
+  auto task = Task{};
+  task.message = std::move(message);
+  task.handshake = handshake;
+  task.done = std::move(done);
+  try {
+    task.group_id = peek_group_id(task.message);
+    task.group = find(task.group_id);
+    if (!task.group) {
+      throw MissingStateError("Unknown group");
+    }
+  } catch (...) {
+    auto result = Result{};
+    result.group_id = std::move(task.group_id);
+    result.error = std::current_exception();
+    task.done(std::move(result));
+    return;
+  }
+
+  if (handshake) {
+    task.group->pending_handshakes += 1;
+  }
+
+  {
+    const auto lock = std::unique_lock(outstanding_mutex);
+    outstanding += 1;
+  }
+
+  const auto owner = shard_of(task.group_id);
+  auto& shard = *shards.at(owner);
+  {
+    const auto lock = std::unique_lock(shard.queue_mutex);
+    shard.queue.push_back(std::move(task));
+  }
+  shard.ready.notify_one();
+
+  // If the owner is busy, an idle worker is woken to steal the message
+  if (!handshake && !shard.idle) {
+    wake_thief(owner);
+  }
+}
+
+void
+SessionManager::wake_thief(size_t owner)
+{
+  for (size_t i = 1; i < shards.size(); i++) {
+    auto& thief = *shards.at((owner + i) % shards.size());
+    if (!thief.idle) {
+      continue;
+    }
+
+    {
+      const auto lock = std::unique_lock(thief.queue_mutex);
+      thief.wake = true;
+    }
+    thief.ready.notify_one();
+    return;
+  }
+}
+
+void
+SessionManager::drain()
+{
+  auto lock = std::unique_lock(outstanding_mutex);
+  all_done.wait(lock, [&]() { return outstanding == 0; });
+}
+
+void
+SessionManager::work(size_t index)
+{
+  auto& shard = *shards.at(index);
+  auto interval = min_steal_interval;
+  while (true) {
+    auto task = Task{};
+    auto have_task = false;
+
+    {
+      const auto lock = std::unique_lock(shard.queue_mutex);
+      if (!shard.queue.empty()) {
+        task = std::move(shard.queue.front());
+        shard.queue.pop_front();
+        have_task = true;
+      } else if (stopping) {
+        return;
+      }
+    }
+
+    // The worker is marked idle before it looks for work to steal, so that a
+    // message submitted after the look wakes it
+    if (!have_task) {
+      shard.idle = true;
+      have_task = steal(index, task);
+    }
+
+    if (!have_task) {
+      auto lock = std::unique_lock(shard.queue_mutex);
+      shard.ready.wait_for(lock, interval, [&]() {
+        return stopping || shard.wake || !shard.queue.empty();
+      });
+      shard.wake = false;
+      interval = std::min(2 * interval, max_steal_interval);
+      continue;
+    }
+
+    shard.idle = false;
+    interval = min_steal_interval;
+    run(task);
+  }
+}
+
+bool
+SessionManager::steal(size_t thief, Task& task)
+{
+  // Victims are tried in turn, skipping any whose queue is busy, and only
+  // application messages for groups with no pending handshake are taken
+  for (size_t i = 1; i < shards.size(); i++) {
+    auto& victim = *shards.at((thief + i) % shards.size());
+    auto lock = std::unique_lock(victim.queue_mutex, std::try_to_lock);
+    if (!lock.owns_lock()) {
+      continue;
+    }
+
+    auto& queue = victim.queue;
+    for (auto it = queue.rbegin(); it != queue.rend(); it++) {
+      if (it->handshake || it->group->pending_handshakes > 0) {
+        continue;
+      }
+
+      task = std::move(*it);
+      queue.erase(std::next(it).base());
+      return true;
+    }
+  }
+
+  return false;
+}
+
+void
+SessionManager::run(Task& task)
+{
+  auto result = Result{};
+  result.group_id = std::move(task.group_id);
+  try {
+    if (task.handshake) {
+      result.epoch_changed = task.group->session.handle(task.message);
+    } else {
+      result.data = task.group->session.unprotect(task.message);
+    }
+  } catch (...) {
+    result.error = std::current_exception();
+  }
+
+  if (task.handshake) {
+    task.group->pending_handshakes -= 1;
+  }
+
+  task.done(std::move(result));
+
+  const auto lock = std::unique_lock(outstanding_mutex);
+  outstanding -= 1;
+  if (outstanding == 0) {
+    all_done.notify_all();
+  }
+}
+
+} // namespace mls
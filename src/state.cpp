@@ -1,5 +1,12 @@
+#include <mls/compression.h>
+#include <mls/public_group.h>
 #include <mls/state.h>
 
+#include <algorithm>
+#include <condition_variable>
+#include <limits>
+#include <mutex>
+
 namespace mls {
 
 ///
@@ -29,9 +36,65 @@ State::State(const HPKEPrivateKey& init_priv,
              SignaturePrivateKey sig_priv,
              const KeyPackage& kp,
              const Welcome& welcome)
+  : State(init_priv, std::move(sig_priv), kp, Welcome(welcome))
+{}
+
+State::State(const HPKEPrivateKey& init_priv,
+             SignaturePrivateKey sig_priv,
+             const KeyPackage& kp,
+             Welcome&& welcome)
+  : _suite(welcome.cipher_suite)
+  , _tree(welcome.cipher_suite)
+  , _identity_priv(std::move(sig_priv))
+{
+  auto executor = SerialExecutor{};
+  join(init_priv, kp, std::move(welcome), std::nullopt, executor);
+}
+
+State::State(const HPKEPrivateKey& init_priv,
+             SignaturePrivateKey sig_priv,
+             const KeyPackage& kp,
+             Welcome&& welcome,
+             Executor& executor)
+  : _suite(welcome.cipher_suite)
+  , _tree(welcome.cipher_suite)
+  , _identity_priv(std::move(sig_priv))
+{
+  join(init_priv, kp, std::move(welcome), std::nullopt, executor);
+}
+
+State::State(const HPKEPrivateKey& init_priv,
+             SignaturePrivateKey sig_priv,
+             const KeyPackage& kp,
+             Welcome&& welcome,
+             TreeKEMPublicKey tree)
+  : _suite(welcome.cipher_suite)
+  , _tree(welcome.cipher_suite)
+  , _identity_priv(std::move(sig_priv))
+{
+  auto executor = SerialExecutor{};
+  join(init_priv, kp, std::move(welcome), std::move(tree), executor);
+}
+
+State::State(const HPKEPrivateKey& init_priv,
+             SignaturePrivateKey sig_priv,
+             const KeyPackage& kp,
+             Welcome&& welcome,
+             TreeKEMPublicKey tree,
+             Executor& executor)
   : _suite(welcome.cipher_suite)
   , _tree(welcome.cipher_suite)
   , _identity_priv(std::move(sig_priv))
+{
+  join(init_priv, kp, std::move(welcome), std::move(tree), executor);
+}
+
+void
+State::join(const HPKEPrivateKey& init_priv,
+            const KeyPackage& kp,
+            Welcome&& welcome,
+            std::optional<TreeKEMPublicKey> external_tree,
+            Executor& executor)
 {
   auto maybe_kpi = welcome.find(kp);
   if (!maybe_kpi.has_value()) {
@@ -48,27 +111,55 @@ State::State(const HPKEPrivateKey& init_priv,
   auto secrets_data = init_priv.decrypt(kp.cipher_suite, {}, secrets_ct);
   auto secrets = tls::get<GroupSecrets>(secrets_data);
 
+  // The GroupInfo may only be compressed in a way that the KeyPackage allows
+  auto compression = CompressionAlgorithm::none;
+  const auto compression_ext = secrets.extensions.find<CompressionExtension>();
+  if (compression_ext.has_value()) {
+    const auto& algorithms = compression_ext.value().algorithms;
+    if (algorithms.size() != 1 ||
+        !supports_compression(kp, algorithms.front())) {
+      throw ProtocolError("Unsupported Welcome compression");
+    }
+
+    compression = algorithms.front();
+  }
+
   // Decrypt the GroupInfo and fill in details
-  auto group_info = welcome.decrypt(secrets.joiner_secret, {});
-  group_info.tree.suite = kp.cipher_suite;
-  group_info.tree.set_hash_all();
+  auto group_info =
+    std::move(welcome).decrypt(secrets.joiner_secret, {}, compression);
+  auto tree_hash = group_info.extensions.find<ExternalTreeExtension>();
+  if (tree_hash.has_value() != external_tree.has_value()) {
+    throw InvalidParameterError(tree_hash.has_value()
+                                  ? "Welcome requires an external tree"
+                                  : "Welcome carries its own tree");
+  }
+
+  // The signature covers the GroupInfo as sent, i.e., without the tree
+  auto& tree = external_tree.has_value() ? external_tree.value()
+                                         : group_info.tree;
+  tree.suite = kp.cipher_suite;
+  tree.set_hash_all(executor);
+  if (tree_hash.has_value() &&
+      tree_hash.value().tree_hash != tree.root_hash()) {
+    throw InvalidParameterError("External tree does not match Welcome");
+  }
 
   // Verify the signature on the GroupInfo
-  if (!group_info.verify()) {
+  if (!group_info.verify(tree)) {
     throw InvalidParameterError("Invalid GroupInfo");
   }
 
   // Verify the incoming tree
-  if (!group_info.tree.parent_hash_valid()) {
+  if (!tree.parent_hash_valid(executor)) {
     throw InvalidParameterError("Invalid tree");
   }
 
   // Ingest the GroupSecrets and GroupInfo
   _epoch = group_info.epoch;
   _group_id = group_info.group_id;
-  _tree = group_info.tree;
-  _confirmed_transcript_hash = group_info.confirmed_transcript_hash;
-  _interim_transcript_hash = group_info.interim_transcript_hash;
+  _tree = std::move(tree);
+  _confirmed_transcript_hash = std::move(group_info.confirmed_transcript_hash);
+  _interim_transcript_hash = std::move(group_info.interim_transcript_hash);
 
   // Construct TreeKEM private key from partrs provided
   auto maybe_index = _tree.find(kp);
@@ -88,9 +179,12 @@ State::State(const HPKEPrivateKey& init_priv,
     _suite, _tree.size(), _index, init_priv, ancestor, path_secret);
 
   // Ratchet forward into the current epoch
-  auto group_ctx = tls::marshal(group_context());
-  _keys = KeyScheduleEpoch(
-    _suite, secrets.joiner_secret, {}, group_ctx, LeafCount(_tree.size()));
+  const auto encodings = epoch_encodings();
+  _keys = KeyScheduleEpoch(_suite,
+                           secrets.joiner_secret,
+                           {},
+                           encodings->encoded_context,
+                           LeafCount(_tree.size()));
 
   // Verify the confirmation
   if (!verify_confirmation(group_info.confirmation)) {
@@ -107,13 +201,15 @@ State::sign(const Proposal& proposal) const
 {
   auto sender = Sender{ SenderType::member, _index.val };
   auto pt = MLSPlaintext{ _group_id, _epoch, sender, proposal };
-  pt.sign(_suite, group_context(), _identity_priv);
-  pt.set_membership_tag(_suite, group_context(), _keys.membership_key);
+  const auto encodings = epoch_encodings();
+  const auto& context = encodings->encoded_context;
+  pt.sign(_suite, context, _identity_priv);
+  pt.set_membership_tag(_suite, context, _keys.membership_key);
   return pt;
 }
 
-MLSPlaintext
-State::add(const KeyPackage& key_package) const
+void
+State::check_key_package(const KeyPackage& key_package, uint64_t now) const
 {
   // Check that the key package is validly signed
   if (!key_package.verify()) {
@@ -121,7 +217,6 @@ State::add(const KeyPackage& key_package) const
   }
 
   // Check that the group's basic properties are supported
-  auto now = seconds_since_epoch();
   if (!key_package.verify_expiry(now)) {
     throw InvalidParameterError("Expired key package");
   }
@@ -131,10 +226,37 @@ State::add(const KeyPackage& key_package) const
     throw InvalidParameterError(
       "Key package does not support group's extensions");
   }
+}
 
+MLSPlaintext
+State::add(const KeyPackage& key_package) const
+{
+  check_key_package(key_package, seconds_since_epoch());
   return sign({ Add{ key_package } });
 }
 
+std::vector<MLSPlaintext>
+State::add_batch(const std::vector<KeyPackage>& key_packages) const
+{
+  auto executor = SerialExecutor{};
+  return add_batch(key_packages, executor);
+}
+
+std::vector<MLSPlaintext>
+State::add_batch(const std::vector<KeyPackage>& key_packages,
+                 Executor& executor) const
+{
+  const auto now = seconds_since_epoch();
+  auto pts = std::vector<MLSPlaintext>(key_packages.size());
+  executor.run(key_packages.size(), [&](size_t i) {
+    const auto& key_package = key_packages.at(i);
+    check_key_package(key_package, now);
+    pts.at(i) = sign({ Add{ key_package } });
+  });
+
+  return pts;
+}
+
 MLSPlaintext
 State::update(const bytes& leaf_secret)
 {
@@ -185,35 +307,104 @@ State::remove(LeafIndex removed) const
 std::tuple<MLSPlaintext, Welcome, State>
 State::commit(const bytes& leaf_secret) const
 {
-  // Construct a commit from cached proposals
-  // TODO(rlb) ignore some proposals:
-  // * Update after Update
-  // * Update after Remove
-  // * Remove after Remove
+  auto executor = SerialExecutor{};
+  return commit(leaf_secret, executor);
+}
+
+std::tuple<MLSPlaintext, Welcome, State>
+State::commit(const bytes& leaf_secret, Executor& executor) const
+{
+  return commit(leaf_secret, nullptr, executor);
+}
+
+struct State::CommitPlan
+{
+  Commit commit;
+  std::vector<KeyPackage> joiners;
+  std::vector<LeafIndex> joiner_locations;
+  bool path_required;
+  State next;
+};
+
+State::CommitPlan
+State::plan_commit(Executor& executor) const
+{
+  // Construct a commit from the cached proposals that are not superseded
   Commit commit;
   auto joiners = std::vector<KeyPackage>{};
-  for (const auto& pt : _pending_proposals) {
-    auto id = proposal_id(pt);
-    const auto& proposal = std::get<Proposal>(pt.content).content;
+  const auto superseded = find_superseded_proposals();
+  for (size_t i = 0; i < _proposals.entries.size(); i++) {
+    if (superseded.at(i)) {
+      continue;
+    }
+
+    const auto& entry = _proposals.entries.at(i);
+    const auto& proposal = std::get<Proposal>(entry.pt.content).content;
     if (std::holds_alternative<Add>(proposal)) {
       const auto& add = std::get<Add>(proposal);
       joiners.push_back(add.key_package);
     }
 
-    commit.proposals.push_back(id);
+    commit.proposals.push_back(entry.id);
   }
 
-  // Apply proposals
+  // Apply proposals, which consumes all of the cached ones
   State next = *this;
-  auto [has_updates, has_removes, joiner_locations] = next.apply(commit);
-  next._pending_proposals.clear();
+  auto [has_updates, has_removes, joiner_locations] =
+    next.apply(commit, executor);
 
-  // KEM new entropy to the group and the new joiners
   auto path_required = has_updates || has_removes || commit.proposals.empty();
+  return { std::move(commit),
+           std::move(joiners),
+           std::move(joiner_locations),
+           path_required,
+           std::move(next) };
+}
+
+State::PreparedCommit
+State::prepare_commit(const bytes& leaf_secret) const
+{
+  auto executor = SerialExecutor{};
+  auto plan = plan_commit(executor);
+  auto path = plan.next._tree.prepare_path(
+    _index, leaf_secret, _identity_priv, std::nullopt);
+  return { _epoch, leaf_secret, std::move(path) };
+}
+
+std::tuple<MLSPlaintext, Welcome, State>
+State::commit(const PreparedCommit& prepared) const
+{
+  auto executor = SerialExecutor{};
+  return commit(prepared, executor);
+}
+
+std::tuple<MLSPlaintext, Welcome, State>
+State::commit(const PreparedCommit& prepared, Executor& executor) const
+{
+  if (prepared.epoch != _epoch) {
+    throw InvalidParameterError("Prepared commit is for another epoch");
+  }
+
+  return commit(prepared.leaf_secret, &prepared.path, executor);
+}
+
+std::tuple<MLSPlaintext, Welcome, State>
+State::commit(const bytes& leaf_secret,
+              const PreparedPath* prepared,
+              Executor& executor) const
+{
+  const auto scope = Metrics::Scope(Metrics::Operation::commit);
+
+  auto plan = plan_commit(executor);
+  auto& commit = plan.commit;
+  auto& next = plan.next;
+  const auto& joiner_locations = plan.joiner_locations;
+
+  // KEM new entropy to the group and the new joiners
   auto update_secret = bytes(_suite.get().hpke.kdf.hash_size(), 0);
   auto path_secrets =
     std::vector<std::optional<bytes>>(joiner_locations.size());
-  if (path_required) {
+  if (plan.path_required) {
     auto ctx = tls::marshal(GroupContext{
       next._group_id,
       next._epoch + 1,
@@ -221,80 +412,139 @@ State::commit(const bytes& leaf_secret) const
       next._confirmed_transcript_hash,
       next._extensions,
     });
-    auto [new_priv, path] =
-      next._tree.encap(_index, ctx, leaf_secret, _identity_priv, std::nullopt);
-    next._tree_priv = new_priv;
-    commit.path = path;
-    update_secret = new_priv.update_secret;
 
+    // A prepared path is used if the tree still has the shape it was
+    // prepared for; otherwise the path is derived from the leaf secret here
+    auto fits = prepared != nullptr && prepared->from == _index &&
+                prepared->valid_for(next._tree);
+    auto [new_priv, path] =
+      fits ? next._tree.encap(*prepared, ctx, executor)
+           : next._tree.encap(_index,
+                              ctx,
+                              leaf_secret,
+                              _identity_priv,
+                              std::nullopt,
+                              executor);
     for (size_t i = 0; i < joiner_locations.size(); i++) {
       auto [overlap, shared_path_secret, ok] =
         new_priv.shared_path_secret(joiner_locations[i]);
       silence_unused(overlap);
       silence_unused(ok);
 
-      path_secrets[i] = shared_path_secret;
+      path_secrets[i] = std::move(shared_path_secret);
     }
+
+    update_secret = new_priv.update_secret;
+    next._tree_priv = std::move(new_priv);
+    commit.path = std::move(path);
   }
 
   // Create the Commit message and advance the transcripts / key schedule
-  auto pt = next.ratchet_and_sign(commit, update_secret, group_context());
+  auto pt = next.ratchet_and_sign(commit, update_secret, *epoch_encodings());
 
-  // Complete the GroupInfo and form the Welcome
+  // Complete the GroupInfo and form the Welcome.  With an external tree, the
+  // GroupInfo carries the tree hash in place of the tree.
   auto group_info = GroupInfo{
     next._group_id,
     next._epoch,
-    next._tree,
+    _external_tree ? TreeKEMPublicKey{ _suite } : next._tree,
     next._confirmed_transcript_hash,
     next._interim_transcript_hash,
     next._extensions,
     pt.confirmation_tag.value().mac_value,
   };
-  group_info.sign(_index, _identity_priv);
-
-  auto welcome = Welcome{ _suite, next._keys.joiner_secret, {}, group_info };
-  for (size_t i = 0; i < joiners.size(); i++) {
-    welcome.encrypt(joiners[i], path_secrets[i]);
+  if (_external_tree) {
+    group_info.extensions.add(ExternalTreeExtension{ next._tree.root_hash() });
   }
+  group_info.sign(next._tree, _index, _identity_priv);
 
-  return std::make_tuple(pt, welcome, next);
+  // The GroupInfo is compressed if every joiner can decompress it
+  auto welcome = Welcome{ _suite,
+                          next._keys.joiner_secret,
+                          {},
+                          group_info,
+                          common_compression(plan.joiners) };
+  welcome.encrypt(plan.joiners, path_secrets, executor);
+
+  return { std::move(pt), std::move(welcome), std::move(next) };
 }
 
 ///
 /// Message handlers
 ///
 
+// Each transcript hash covers the previous one followed by part of the
+// Commit, streamed into the digest without concatenating them
+static bytes
+transcript_hash(CipherSuite suite, const bytes& prev, const bytes& content)
+{
+  auto ctx = suite.get().digest.hash_context();
+  ctx->update(prev);
+  ctx->update(content);
+  return ctx->finalize();
+}
+
+EpochEncodings::EpochEncodings(GroupContext context_in)
+  : EpochEncodings(context_in, tls::marshal(context_in))
+{}
+
+EpochEncodings::EpochEncodings(GroupContext context_in,
+                               bytes encoded_context_in)
+  : context(std::move(context_in))
+  , encoded_context(std::move(encoded_context_in))
+{
+  auto w = tls::ostream{};
+  tls::vector<1>::encode(w, context.group_id);
+  w << context.epoch;
+  aad_prefix = w.take();
+}
+
 GroupContext
 State::group_context() const
 {
-  return GroupContext{
+  return epoch_encodings()->context;
+}
+
+std::shared_ptr<const EpochEncodings>
+State::epoch_encodings() const
+{
+  auto encodings = _epoch_cache.load();
+  if (encodings) {
+    return encodings;
+  }
+
+  encodings = std::make_shared<const EpochEncodings>(GroupContext{
     _group_id,   _epoch, _tree.root_hash(), _confirmed_transcript_hash,
     _extensions,
-  };
+  });
+
+  _epoch_cache.store(encodings);
+  return encodings;
 }
 
 MLSPlaintext
 State::ratchet_and_sign(const Commit& op,
                         const bytes& update_secret,
-                        const GroupContext& prev_ctx)
+                        const EpochEncodings& prev_epoch)
 {
   auto prev_membership_key = _keys.membership_key;
   auto sender = Sender{ SenderType::member, _index.val };
   auto pt = MLSPlaintext{ _group_id, _epoch, sender, op };
-  pt.sign(_suite, prev_ctx, _identity_priv);
+  pt.sign(_suite, prev_epoch.encoded_context, _identity_priv);
 
-  auto confirmed_transcript = _interim_transcript_hash + pt.commit_content();
-  _confirmed_transcript_hash = _suite.get().digest.hash(confirmed_transcript);
+  _confirmed_transcript_hash =
+    transcript_hash(_suite, _interim_transcript_hash, pt.commit_content());
   _epoch += 1;
   update_epoch_secrets(update_secret);
 
   auto confirmation = _suite.get().digest.hmac(_keys.confirmation_key,
                                                _confirmed_transcript_hash);
   pt.confirmation_tag = { std::move(confirmation) };
-  pt.set_membership_tag(_suite, prev_ctx, prev_membership_key);
+  pt.set_membership_tag(
+    _suite, prev_epoch.encoded_context, prev_membership_key);
 
-  auto interim_transcript = _confirmed_transcript_hash + pt.commit_auth_data();
-  _interim_transcript_hash = _suite.get().digest.hash(interim_transcript);
+  _interim_transcript_hash =
+    transcript_hash(_suite, _confirmed_transcript_hash, pt.commit_auth_data());
 
   return pt;
 }
@@ -302,7 +552,186 @@ State::ratchet_and_sign(const Commit& op,
 std::optional<State>
 State::handle(const MLSPlaintext& pt)
 {
+  auto executor = SerialExecutor{};
+  return handle(pt, executor);
+}
+
+std::optional<State>
+State::handle(const MLSPlaintext& pt, Executor& executor)
+{
+  const auto scope = Metrics::Scope(Metrics::Operation::handle);
+
   // Pre-validate the MLSPlaintext
+  check_epoch(pt);
+
+  if (!verify(pt)) {
+    throw ProtocolError("Invalid handshake message signature");
+  }
+
+  return handle_verified(pt, executor);
+}
+
+std::optional<State>
+State::handle(MLSPlaintext&& pt)
+{
+  auto executor = SerialExecutor{};
+  return handle(std::move(pt), executor);
+}
+
+std::optional<State>
+State::handle(MLSPlaintext&& pt, Executor& executor)
+{
+  const auto scope = Metrics::Scope(Metrics::Operation::handle);
+
+  check_epoch(pt);
+
+  if (!verify(pt)) {
+    throw ProtocolError("Invalid handshake message signature");
+  }
+
+  // A Proposal given up by the caller is cached without a copy
+  if (std::holds_alternative<Proposal>(pt.content)) {
+    cache_proposal(std::move(pt));
+    return std::nullopt;
+  }
+
+  return handle_verified(pt, executor);
+}
+
+std::optional<State>
+State::handle_batch(const std::vector<MLSPlaintext>& pts)
+{
+  auto executor = SerialExecutor{};
+  return handle_batch(pts, executor);
+}
+
+std::optional<State>
+State::handle_batch(const std::vector<MLSPlaintext>& pts, Executor& executor)
+{
+  const auto scope = Metrics::Scope(Metrics::Operation::handle);
+
+  // Messages after a Commit are signed under the next epoch's group context,
+  // so each epoch's messages are verified by the state for that epoch.
+  auto next = std::optional<State>{};
+  auto* state = this;
+  auto it = pts.begin();
+  while (it != pts.end()) {
+    auto run = std::vector<const MLSPlaintext*>{};
+    for (; it != pts.end(); it++) {
+      state->check_epoch(*it);
+      run.push_back(&*it);
+      if (std::holds_alternative<Commit>(it->content)) {
+        it++;
+        break;
+      }
+    }
+
+    auto valid = state->verify(run, executor);
+    if (std::find(valid.begin(), valid.end(), false) != valid.end()) {
+      throw ProtocolError("Invalid handshake message signature");
+    }
+
+    for (const auto* pt : run) {
+      auto maybe_next = state->handle_verified(*pt, executor);
+      if (maybe_next.has_value()) {
+        next = std::move(maybe_next);
+        state = &next.value();
+      }
+    }
+  }
+
+  return next;
+}
+
+std::vector<State>
+State::catch_up(const std::vector<MLSPlaintext>& pts, Executor& executor)
+{
+  const auto scope = Metrics::Scope(Metrics::Operation::handle);
+
+  // The stages share a count of messages whose signatures have been checked,
+  // and the error that stopped either one
+  auto mutex = std::mutex{};
+  auto checked_cv = std::condition_variable{};
+  auto checked = size_t(0);
+  auto check_error = std::exception_ptr{};
+  auto stopped = false;
+
+  auto check_stage = [&]() {
+    auto observer = PublicGroupState(*this);
+    for (const auto& pt : pts) {
+      try {
+        observer.handle(pt);
+      } catch (...) {
+        const auto lock = std::lock_guard(mutex);
+        check_error = std::current_exception();
+        checked_cv.notify_one();
+        return;
+      }
+
+      const auto lock = std::lock_guard(mutex);
+      if (stopped) {
+        return;
+      }
+
+      checked += 1;
+      checked_cv.notify_one();
+    }
+  };
+
+  // Applying a message also checks its membership tag, which depends on the
+  // epoch's secrets.  Nested batches are not allowed on the executor, so
+  // this stage runs its own work serially.
+  auto states = std::vector<State>{};
+  auto apply_stage = [&]() {
+    auto serial = SerialExecutor{};
+    auto* state = this;
+    try {
+      for (size_t i = 0; i < pts.size(); i++) {
+        {
+          auto lock = std::unique_lock(mutex);
+          checked_cv.wait(lock, [&]() { return checked > i || check_error; });
+          if (checked <= i) {
+            std::rethrow_exception(check_error);
+          }
+        }
+
+        const auto& pt = pts.at(i);
+        if (!pt.verify_membership_tag(_suite,
+                                      state->epoch_encodings()->encoded_context,
+                                      state->_keys.membership_key)) {
+          throw ProtocolError("Invalid handshake message signature");
+        }
+
+        auto next = state->handle_verified(pt, serial);
+        if (next.has_value()) {
+          states.push_back(std::move(next.value()));
+          state = &states.back();
+        }
+      }
+    } catch (...) {
+      const auto lock = std::lock_guard(mutex);
+      stopped = true;
+      throw;
+    }
+  };
+
+  // The checks run first when the executor runs the tasks in order, so the
+  // pipeline completes on any executor, and overlaps on one with two or
+  // more workers
+  executor.run(2, [&](size_t i) {
+    if (i == 0) {
+      check_stage();
+    } else {
+      apply_stage();
+    }
+  });
+
+  return states;
+}
+
+void
+State::check_epoch(const MLSPlaintext& pt) const
+{
   if (pt.group_id != _group_id) {
     throw InvalidParameterError("GroupID mismatch");
   }
@@ -310,14 +739,14 @@ State::handle(const MLSPlaintext& pt)
   if (pt.epoch != _epoch) {
     throw InvalidParameterError("Epoch mismatch");
   }
+}
 
-  if (!verify(pt)) {
-    throw ProtocolError("Invalid handshake message signature");
-  }
-
+std::optional<State>
+State::handle_verified(const MLSPlaintext& pt, Executor& executor)
+{
   // Proposals get queued, do not result in a state transition
   if (std::holds_alternative<Proposal>(pt.content)) {
-    _pending_proposals.push_back(pt);
+    cache_proposal(pt);
     return std::nullopt;
   }
 
@@ -337,7 +766,7 @@ State::handle(const MLSPlaintext& pt)
   // Apply the commit
   const auto& commit = std::get<Commit>(pt.content);
   State next = *this;
-  next.apply(commit);
+  next.apply(commit, executor);
 
   // Decapsulate and apply the UpdatePath, if provided
   auto update_secret = bytes(_suite.get().hpke.kdf.hash_size(), 0);
@@ -356,14 +785,20 @@ State::handle(const MLSPlaintext& pt)
     });
     next._tree_priv.decap(sender, next._tree, ctx, path);
     next._tree.merge(sender, path);
+
+    // Only the merged path needs checking; the rest of the tree keeps the
+    // verification done when it was received
+    if (!next._tree.parent_hash_valid(sender)) {
+      throw ProtocolError("Merged path has invalid parent hash");
+    }
     update_secret = next._tree_priv.update_secret;
   }
 
   // Update the transcripts and advance the key schedule
-  next._confirmed_transcript_hash = _suite.get().digest.hash(
-    next._interim_transcript_hash + pt.commit_content());
-  next._interim_transcript_hash = _suite.get().digest.hash(
-    next._confirmed_transcript_hash + pt.commit_auth_data());
+  next._confirmed_transcript_hash = transcript_hash(
+    _suite, next._interim_transcript_hash, pt.commit_content());
+  next._interim_transcript_hash = transcript_hash(
+    _suite, next._confirmed_transcript_hash, pt.commit_auth_data());
 
   next._epoch += 1;
   next.update_epoch_secrets(update_secret);
@@ -380,150 +815,699 @@ State::handle(const MLSPlaintext& pt)
   return next;
 }
 
-LeafIndex
-State::apply(const Add& add)
+ProposalID
+State::proposal_id(const MLSPlaintext& pt) const
 {
-  return _tree.add_leaf(add.key_package);
+  return ProposalID{ _suite.get().digest.hash(pt.commit_content()) };
 }
 
 void
-State::apply(LeafIndex target, const Update& update)
+State::cache_proposal(MLSPlaintext pt)
 {
-  _tree.update_leaf(target, update.key_package);
+  auto id = proposal_id(pt);
+  _proposals.add(std::move(id), std::move(pt));
 }
 
-void
-State::apply(LeafIndex target, const Update& update, const bytes& leaf_secret)
+std::vector<bool>
+State::find_superseded_proposals() const
 {
-  _tree.update_leaf(target, update.key_package);
-  _tree_priv.set_leaf_secret(leaf_secret);
-}
+  auto removed = std::set<LeafIndex>{};
+  auto last_update = std::map<LeafIndex, size_t>{};
+  auto superseded = std::vector<bool>(_proposals.entries.size(), false);
+  for (size_t i = 0; i < _proposals.entries.size(); i++) {
+    const auto& pt = _proposals.entries.at(i).pt;
+    const auto& proposal = std::get<Proposal>(pt.content).content;
+    if (std::holds_alternative<Update>(proposal)) {
+      auto sender = LeafIndex(pt.sender.sender);
+      auto [it, inserted] = last_update.emplace(sender, i);
+      if (!inserted) {
+        superseded.at(it->second) = true;
+        it->second = i;
+      }
+    } else if (std::holds_alternative<Remove>(proposal)) {
+      auto [it, inserted] = removed.insert(std::get<Remove>(proposal).removed);
+      silence_unused(it);
+      superseded.at(i) = !inserted;
+    }
+  }
 
-void
-State::apply(const Remove& remove)
-{
-  _tree.blank_path(remove.removed);
-}
+  for (const auto& [sender, i] : last_update) {
+    if (removed.count(sender) > 0) {
+      superseded.at(i) = true;
+    }
+  }
 
-ProposalID
-State::proposal_id(const MLSPlaintext& pt) const
-{
-  return ProposalID{ _suite.get().digest.hash(pt.commit_content()) };
+  return superseded;
 }
 
-std::optional<MLSPlaintext>
-State::find_proposal(const ProposalID& id)
+std::vector<ProposalID>
+State::superseded_proposals() const
 {
-  for (auto i = _pending_proposals.begin(); i != _pending_proposals.end();
-       i++) {
-    auto other_id = proposal_id(*i);
-    if (id == other_id) {
-      auto pt = *i;
-      _pending_proposals.erase(i);
-      return pt;
+  const auto superseded = find_superseded_proposals();
+  auto ids = std::vector<ProposalID>{};
+  for (size_t i = 0; i < _proposals.entries.size(); i++) {
+    if (superseded.at(i)) {
+      ids.push_back(_proposals.entries.at(i).id);
     }
   }
+  return ids;
+}
 
-  return std::nullopt;
+size_t
+State::pending_proposals() const
+{
+  const auto superseded = find_superseded_proposals();
+  return static_cast<size_t>(
+    std::count(superseded.begin(), superseded.end(), false));
 }
 
 std::vector<LeafIndex>
-State::apply(const std::vector<MLSPlaintext>& pts,
-             ProposalType::selector required_type)
+State::scheduled_committers() const
 {
-  auto locations = std::vector<LeafIndex>{};
-  for (const auto& pt : pts) {
-    auto proposal = std::get<Proposal>(pt.content).content;
-    auto proposal_type = std::get<Proposal>(pt.content).proposal_type();
-    if (proposal_type != required_type) {
-      continue;
+  auto removed = std::set<LeafIndex>{};
+  for (const auto& entry : _proposals.entries) {
+    const auto& proposal = std::get<Proposal>(entry.pt.content).content;
+    if (std::holds_alternative<Remove>(proposal)) {
+      removed.insert(std::get<Remove>(proposal).removed);
     }
+  }
 
-    switch (proposal_type) {
-      case ProposalType::selector::add: {
-        locations.push_back(apply(std::get<Add>(proposal)));
-        break;
-      }
-
-      case ProposalType::selector::update: {
-        auto& update = std::get<Update>(proposal);
-        auto sender = LeafIndex(pt.sender.sender);
-        if (sender != _index) {
-          apply(sender, update);
-          break;
-        }
-
-        auto id = proposal_id(pt);
-        if (_update_secrets.count(id.id) == 0) {
-          throw ProtocolError("Self-update with no cached secret");
-        }
-
-        apply(sender, update, _update_secrets[id.id]);
-        locations.push_back(sender);
-        break;
-      }
-
-      case ProposalType::selector::remove: {
-        const auto& remove = std::get<Remove>(proposal);
-        apply(remove);
-        locations.push_back(remove.removed);
-        break;
-      }
+  auto members = std::vector<LeafIndex>{};
+  auto remaining = std::vector<LeafIndex>{};
+  for (auto i = LeafIndex{ 0 }; i < _tree.size(); i.val++) {
+    if (_tree.blank(NodeIndex(i))) {
+      continue;
+    }
 
-      default:
-        throw ProtocolError("Unknown proposal type");
+    members.push_back(i);
+    if (removed.count(i) == 0) {
+      remaining.push_back(i);
     }
   }
 
-  return locations;
+  // If every member is being removed, any of them may commit
+  auto& candidates = remaining.empty() ? members : remaining;
+  const auto first = static_cast<ptrdiff_t>(_epoch % candidates.size());
+  std::rotate(
+    candidates.begin(), std::next(candidates.begin(), first), candidates.end());
+  return std::move(candidates);
 }
 
 std::tuple<bool, bool, std::vector<LeafIndex>>
-State::apply(const Commit& commit)
+State::apply(const Commit& commit, Executor& executor)
 {
-  auto pts = std::vector<MLSPlaintext>(commit.proposals.size());
-  std::transform(commit.proposals.begin(),
-                 commit.proposals.end(),
-                 pts.begin(),
-                 [&](auto& id) {
-                   auto maybe_pt = find_proposal(id);
-                   if (!maybe_pt.has_value()) {
-                     throw ProtocolError("Commit of unknown proposal");
-                   }
+  const auto pts = _proposals.take(commit);
+
+  // This member's own Updates replace its leaf secret with the one cached
+  // when the Update was proposed
+  auto leaf_secret = std::optional<bytes>{};
+  for (const auto& pt : pts) {
+    const auto& proposal = std::get<Proposal>(pt.content).content;
+    if (!std::holds_alternative<Update>(proposal) ||
+        LeafIndex(pt.sender.sender) != _index) {
+      continue;
+    }
 
-                   return maybe_pt.value();
-                 });
+    auto it = _update_secrets.find(proposal_id(pt).id);
+    if (it == _update_secrets.end()) {
+      throw ProtocolError("Self-update with no cached secret");
+    }
 
-  auto update_locations = apply(pts, ProposalType::selector::update);
-  auto remove_locations = apply(pts, ProposalType::selector::remove);
-  auto joiner_locations = apply(pts, ProposalType::selector::add);
+    leaf_secret = it->second;
+  }
 
-  auto has_updates = !update_locations.empty();
-  auto has_removes = !remove_locations.empty();
+  const auto applied = apply_proposals(_tree, pts, executor);
+  if (leaf_secret.has_value()) {
+    _tree_priv.set_leaf_secret(leaf_secret.value());
+  }
 
-  _tree.truncate();
   _tree_priv.truncate(_tree.size());
-  _tree.set_hash_all();
-  return std::make_tuple(has_updates, has_removes, joiner_locations);
+  _epoch_cache.store(nullptr);
+
+  auto has_updates = leaf_secret.has_value();
+  auto has_removes = !applied.removed.empty();
+  return std::make_tuple(has_updates, has_removes, applied.added);
 }
 
 ///
 /// Message protection
 ///
 
-MLSCiphertext
-State::protect(const bytes& pt)
+void
+State::leaf_placement(std::shared_ptr<const LeafPlacement> placement)
 {
-  auto sender = Sender{ SenderType::member, _index.val };
-  MLSPlaintext mpt{ _group_id, _epoch, sender, ApplicationData{ pt } };
-  mpt.sign(_suite, group_context(), _identity_priv);
-  mpt.set_membership_tag(_suite, group_context(), _keys.membership_key);
-  return encrypt(mpt);
+  _tree.leaf_placement(std::move(placement));
 }
 
-bytes
-State::unprotect(const MLSCiphertext& ct)
+void
+State::ratchet_policy(const RatchetPolicy& policy)
+{
+  _keys.keys.policy(policy);
+}
+
+void
+State::external_tree(bool enabled)
+{
+  _external_tree = enabled;
+}
+
+void
+State::key_prewarm(KeyPrewarm mode)
+{
+  _key_prewarm = mode;
+}
+
+void
+State::precompute_keys(Executor& executor)
+{
+  _keys.keys.precompute(executor);
+}
+
+void
+State::prewarm_keys(Executor& executor)
+{
+  switch (_key_prewarm) {
+    case KeyPrewarm::none:
+      return;
+
+    case KeyPrewarm::active: {
+      auto senders = _prior_senders;
+      senders.push_back(_index);
+      _keys.keys.prewarm(senders, executor);
+      return;
+    }
+
+    case KeyPrewarm::all:
+      _keys.keys.prewarm_all(executor);
+      return;
+
+    default:
+      throw InvalidParameterError("Unknown key prewarm mode");
+  }
+}
+
+RatchetStats
+State::ratchet_stats() const
+{
+  return _keys.keys.stats();
+}
+
+///
+/// Persistence
+///
+
+// struct {
+//     uint32 magic = 0x4d4c5353; // "MLSS"
+//     uint16 version = 1;
+//     uint8 type;
+//     CipherSuite cipher_suite;
+//     uint64 epoch;
+//     opaque group_id<0..255>;
+//     opaque salt<0..255>;
+// } StateSnapshotHeader;
+struct StateSnapshotHeader
+{
+  static constexpr uint32_t snapshot_magic = 0x4d4c5353;
+  static constexpr uint16_t snapshot_version = 1;
+  static constexpr size_t salt_size = 12;
+
+  uint32_t magic = 0;
+  uint16_t version = 0;
+  uint8_t type = 0;
+  CipherSuite suite;
+  epoch_t epoch = 0;
+  bytes group_id;
+  bytes salt;
+
+  TLS_SERIALIZABLE(magic, version, type, suite, epoch, group_id, salt)
+  TLS_TRAITS(tls::pass,
+             tls::pass,
+             tls::pass,
+             tls::pass,
+             tls::pass,
+             tls::vector<1>,
+             tls::vector<1>)
+};
+
+struct NodeSecretSnapshot
+{
+  NodeIndex node;
+  bytes secret;
+
+  TLS_SERIALIZABLE(node, secret)
+  TLS_TRAITS(tls::pass, tls::vector<1>)
+};
+
+struct NodePrivateKeySnapshot
+{
+  NodeIndex node;
+  HPKEPrivateKey priv;
+
+  TLS_SERIALIZABLE(node, priv)
+};
+
+struct UpdateSecretSnapshot
+{
+  bytes proposal_id;
+  bytes secret;
+
+  TLS_SERIALIZABLE(proposal_id, secret)
+  TLS_TRAITS(tls::vector<1>, tls::vector<1>)
+};
+
+// The tree nodes that changed since the state a delta applies to, which is
+// identified by its epoch and tree hash
+struct TreeDeltaSnapshot
+{
+  epoch_t base_epoch = 0;
+  TreeDiff tree;
+
+  TLS_SERIALIZABLE(base_epoch, tree)
+};
+
+// The plaintext of a snapshot is the tree, or a TreeDeltaSnapshot, followed
+// by the rest of the state
+struct State::Snapshot
+{
+  bytes confirmed_transcript_hash;
+  bytes interim_transcript_hash;
+  ExtensionList extensions;
+
+  LeafIndex index;
+  bytes identity_priv;
+
+  bytes update_secret;
+  std::vector<NodeSecretSnapshot> path_secrets;
+  std::vector<NodePrivateKeySnapshot> private_keys;
+
+  // The epoch secrets derived on first use are derived again after loading
+  bytes joiner_secret;
+  bytes member_secret;
+  bytes epoch_secret;
+  bytes sender_data_secret;
+  bytes encryption_secret;
+  bytes confirmation_key;
+  bytes membership_key;
+  bytes init_secret;
+  bytes key_source;
+
+  std::vector<MLSPlaintext> proposals;
+  std::vector<UpdateSecretSnapshot> update_secrets;
+
+  // The secrets are erased once the snapshot has been sealed, or loaded into
+  // a State, including when either fails part way
+  Snapshot() = default;
+  Snapshot(const Snapshot&) = delete;
+  Snapshot& operator=(const Snapshot&) = delete;
+  ~Snapshot();
+
+  TLS_SERIALIZABLE(confirmed_transcript_hash,
+                   interim_transcript_hash,
+                   extensions,
+                   index,
+                   identity_priv,
+                   update_secret,
+                   path_secrets,
+                   private_keys,
+                   joiner_secret,
+                   member_secret,
+                   epoch_secret,
+                   sender_data_secret,
+                   encryption_secret,
+                   confirmation_key,
+                   membership_key,
+                   init_secret,
+                   key_source,
+                   proposals,
+                   update_secrets)
+  TLS_TRAITS(tls::vector<1>,
+             tls::vector<1>,
+             tls::pass,
+             tls::pass,
+             tls::vector<2>,
+             tls::vector<1>,
+             tls::vector<4>,
+             tls::vector<4>,
+             tls::vector<1>,
+             tls::vector<1>,
+             tls::vector<1>,
+             tls::vector<1>,
+             tls::vector<1>,
+             tls::vector<1>,
+             tls::vector<1>,
+             tls::vector<1>,
+             tls::vector<4>,
+             tls::vector<4>,
+             tls::vector<4>)
+};
+
+State::Snapshot::~Snapshot()
+{
+  for (auto* secret : { &identity_priv,
+                        &update_secret,
+                        &joiner_secret,
+                        &member_secret,
+                        &epoch_secret,
+                        &sender_data_secret,
+                        &encryption_secret,
+                        &confirmation_key,
+                        &membership_key,
+                        &init_secret,
+                        &key_source }) {
+    zeroize(*secret);
+  }
+
+  for (auto& entry : path_secrets) {
+    zeroize(entry.secret);
+  }
+  for (auto& entry : private_keys) {
+    zeroize(entry.priv.data);
+  }
+  for (auto& entry : update_secrets) {
+    zeroize(entry.secret);
+  }
+}
+
+// Each snapshot is sealed under its own key, expanded from the storage
+// secret with the random salt in the header
+static KeyAndNonce
+snapshot_key_nonce(CipherSuite suite,
+                   const bytes& storage_secret,
+                   const bytes& salt)
+{
+  const auto& aead = suite.get().hpke.aead;
+  return { suite.expand_with_label(
+             storage_secret, "snapshot key", salt, aead.key_size()),
+           suite.expand_with_label(
+             storage_secret, "snapshot nonce", salt, aead.nonce_size()) };
+}
+
+StateSnapshot::StateSnapshot(const bytes& data)
+  : StateSnapshot(data.data(), data.size())
+{}
+
+StateSnapshot::StateSnapshot(const uint8_t* data, size_t size)
+  : _data(data)
+  , _size(size)
+{
+  auto header = StateSnapshotHeader{};
+  auto r = tls::istream(data, size);
+  r >> header;
+
+  if (header.magic != StateSnapshotHeader::snapshot_magic) {
+    throw InvalidParameterError("Not a state snapshot");
+  }
+
+  if (header.version != StateSnapshotHeader::snapshot_version) {
+    throw InvalidParameterError("Unsupported state snapshot version");
+  }
+
+  if (header.type > static_cast<uint8_t>(Type::decrypt_only)) {
+    throw InvalidParameterError("Unknown state snapshot type");
+  }
+
+  _suite = header.suite;
+  _group_id = std::move(header.group_id);
+  _epoch = header.epoch;
+  _type = static_cast<Type>(header.type);
+  _salt = std::move(header.salt);
+  _header_size = size - r.size();
+}
+
+bytes
+StateSnapshot::seal(Type type,
+                    CipherSuite suite,
+                    epoch_t epoch,
+                    const bytes& group_id,
+                    const bytes& body,
+                    const bytes& storage_secret)
+{
+  auto header = StateSnapshotHeader{ StateSnapshotHeader::snapshot_magic,
+                                     StateSnapshotHeader::snapshot_version,
+                                     static_cast<uint8_t>(type),
+                                     suite,
+                                     epoch,
+                                     group_id,
+                                     random_bytes(
+                                       StateSnapshotHeader::salt_size) };
+  auto [key, nonce] = snapshot_key_nonce(suite, storage_secret, header.salt);
+
+  auto out = tls::marshal(header);
+  auto ct = suite.get().hpke.aead.seal(key, nonce, out, body);
+  zeroize(key);
+
+  out.insert(out.end(), ct.begin(), ct.end());
+  return out;
+}
+
+bytes
+StateSnapshot::open(const bytes& storage_secret) const
+{
+  const auto& aead = _suite.get().hpke.aead;
+  const auto header = bytes(_data, _data + _header_size);
+
+  // The body is decrypted straight out of the caller's buffer
+  const auto* ct = _data + _header_size;
+  const auto ct_size = _size - _header_size;
+  if (ct_size < aead.tag_size()) {
+    throw ProtocolError("Truncated state snapshot");
+  }
+
+  auto [key, nonce] = snapshot_key_nonce(_suite, storage_secret, _salt);
+  auto pt = bytes(ct_size - aead.tag_size());
+  auto ok = aead.open_into(key, nonce, header, ct, ct_size, pt.data());
+  zeroize(key);
+  if (!ok) {
+    zeroize(pt);
+    throw ProtocolError("State snapshot decryption failed");
+  }
+
+  return pt;
+}
+
+bytes
+State::save(const bytes& storage_secret) const
+{
+  return seal_snapshot(false, tls::marshal(_tree), storage_secret);
+}
+
+bytes
+State::save_delta(const State& base, const bytes& storage_secret) const
+{
+  if (base._suite != _suite || base._group_id != _group_id) {
+    throw InvalidParameterError("Base state is for a different group");
+  }
+
+  // Nodes still shared with the base tree are unchanged, so finding the
+  // changes does not compare their contents
+  auto delta = TreeDeltaSnapshot{ base._epoch, _tree.diff(base._tree) };
+
+  return seal_snapshot(true, tls::marshal(delta), storage_secret);
+}
+
+bytes
+State::seal_snapshot(bool delta,
+                     const bytes& tree,
+                     const bytes& storage_secret) const
+{
+  auto body = Snapshot{};
+  body.confirmed_transcript_hash = _confirmed_transcript_hash;
+  body.interim_transcript_hash = _interim_transcript_hash;
+  body.extensions = _extensions;
+  body.index = _index;
+  body.identity_priv = _identity_priv.data;
+
+  body.update_secret = _tree_priv.update_secret;
+  for (const auto& [node, secret] : _tree_priv.path_secrets) {
+    body.path_secrets.push_back({ node, secret });
+  }
+  for (const auto& [node, priv] : _tree_priv.private_key_cache) {
+    body.private_keys.push_back({ node, priv });
+  }
+
+  body.joiner_secret = _keys.joiner_secret;
+  body.member_secret = _keys.member_secret;
+  body.epoch_secret = _keys.epoch_secret;
+  body.sender_data_secret = _keys.sender_data_secret;
+  body.encryption_secret = _keys.encryption_secret;
+  body.confirmation_key = _keys.confirmation_key;
+  body.membership_key = _keys.membership_key;
+  body.init_secret = _keys.init_secret;
+  body.key_source = _keys.keys.snapshot();
+
+  for (const auto& cached : _proposals.entries) {
+    if (!cached.consumed) {
+      body.proposals.push_back(cached.pt);
+    }
+  }
+  for (const auto& [id, secret] : _update_secrets) {
+    body.update_secrets.push_back({ id, secret });
+  }
+
+  auto pt = tree;
+  auto body_data = tls::marshal(body);
+  pt.insert(pt.end(), body_data.begin(), body_data.end());
+  zeroize(body_data);
+
+  auto type = delta ? StateSnapshot::Type::delta : StateSnapshot::Type::full;
+  auto out =
+    StateSnapshot::seal(type, _suite, _epoch, _group_id, pt, storage_secret);
+  zeroize(pt);
+  return out;
+}
+
+State
+State::load(const StateSnapshot& snapshot, const bytes& storage_secret)
+{
+  if (snapshot.delta()) {
+    throw InvalidParameterError("State delta loaded without a base state");
+  }
+
+  if (snapshot.decrypt_only()) {
+    throw InvalidParameterError("Not a full state snapshot");
+  }
+
+  auto pt = snapshot.open(storage_secret);
+  auto tree = TreeKEMPublicKey{};
+  auto body = Snapshot{};
+  auto r = tls::istream(pt);
+  r >> tree >> body;
+  zeroize(pt);
+  if (!r.empty()) {
+    throw ProtocolError("Extra data in state snapshot");
+  }
+
+  return { snapshot, std::move(tree), std::move(body) };
+}
+
+State
+State::load_delta(const StateSnapshot& delta,
+                  const bytes& storage_secret) const
+{
+  if (!delta.delta()) {
+    throw InvalidParameterError("Not a state delta");
+  }
+
+  if (delta.cipher_suite() != _suite || delta.group_id() != _group_id) {
+    throw InvalidParameterError("State delta is for a different group");
+  }
+
+  auto pt = delta.open(storage_secret);
+  auto tree_delta = TreeDeltaSnapshot{};
+  auto body = Snapshot{};
+  auto r = tls::istream(pt);
+  r >> tree_delta >> body;
+  zeroize(pt);
+  if (!r.empty()) {
+    throw ProtocolError("Extra data in state delta");
+  }
+
+  if (tree_delta.base_epoch != _epoch ||
+      tree_delta.tree.prev_tree_hash != _tree.root_hash()) {
+    throw InvalidParameterError("State delta does not apply to this state");
+  }
+
+  auto tree = _tree;
+  tree.apply_diff(tree_delta.tree);
+  return State(delta, std::move(tree), std::move(body));
+}
+
+State::State(const StateSnapshot& header,
+             TreeKEMPublicKey&& tree,
+             Snapshot&& body)
+  : _suite(header.cipher_suite())
+  , _group_id(header.group_id())
+  , _epoch(header.epoch())
+  , _tree(std::move(tree))
+  , _confirmed_transcript_hash(std::move(body.confirmed_transcript_hash))
+  , _interim_transcript_hash(std::move(body.interim_transcript_hash))
+  , _extensions(std::move(body.extensions))
+  , _index(body.index)
+  , _identity_priv(SignaturePrivateKey::parse(_suite, body.identity_priv))
+{
+  _tree.suite = _suite;
+  _tree.set_hash_all();
+
+  _tree_priv.suite = _suite;
+  _tree_priv.index = _index;
+  _tree_priv.update_secret = std::move(body.update_secret);
+  for (auto& entry : body.path_secrets) {
+    _tree_priv.path_secrets.emplace(entry.node, std::move(entry.secret));
+  }
+  for (auto& entry : body.private_keys) {
+    _tree_priv.private_key_cache.emplace(entry.node, std::move(entry.priv));
+  }
+
+  _keys.suite = _suite;
+  _keys.joiner_secret = std::move(body.joiner_secret);
+  _keys.member_secret = std::move(body.member_secret);
+  _keys.epoch_secret = std::move(body.epoch_secret);
+  _keys.sender_data_secret = std::move(body.sender_data_secret);
+  _keys.encryption_secret = std::move(body.encryption_secret);
+  _keys.confirmation_key = std::move(body.confirmation_key);
+  _keys.membership_key = std::move(body.membership_key);
+  _keys.init_secret = std::move(body.init_secret);
+  _keys.keys = GroupKeySource::restore(_suite, body.key_source);
+
+  for (auto& pt : body.proposals) {
+    cache_proposal(std::move(pt));
+  }
+  for (auto& entry : body.update_secrets) {
+    _update_secrets.emplace(std::move(entry.proposal_id),
+                            std::move(entry.secret));
+  }
+}
+
+MLSCiphertext
+State::protect(const bytes& pt)
+{
+  const auto scope = Metrics::Scope(Metrics::Operation::protect);
+  auto sender = Sender{ SenderType::member, _index.val };
+  MLSPlaintext mpt{ _group_id, _epoch, sender, ApplicationData{ pt } };
+  const auto encodings = epoch_encodings();
+  const auto& context = encodings->encoded_context;
+  mpt.sign(_suite, context, _identity_priv);
+  mpt.set_membership_tag(_suite, context, _keys.membership_key);
+  return encrypt(mpt);
+}
+
+void
+State::protect_into(const bytes& pt, bytes& out)
+{
+  const auto scope = Metrics::Scope(Metrics::Operation::protect);
+  auto sender = Sender{ SenderType::member, _index.val };
+  MLSPlaintext mpt{ _group_id, _epoch, sender, ApplicationData{ pt } };
+  const auto encodings = epoch_encodings();
+  const auto& context = encodings->encoded_context;
+  mpt.sign(_suite, context, _identity_priv);
+  mpt.set_membership_tag(_suite, context, _keys.membership_key);
+  encrypt_into(mpt, out);
+}
+
+std::vector<bytes>
+State::protect_batch(const std::vector<bytes>& pts)
+{
+  const auto scope = Metrics::Scope(Metrics::Operation::protect);
+  const auto sender = Sender{ SenderType::member, _index.val };
+  const auto encodings = epoch_encodings();
+  const auto& context = encodings->encoded_context;
+
+  auto mpts = std::vector<MLSPlaintext>{};
+  mpts.reserve(pts.size());
+  for (const auto& pt : pts) {
+    auto& mpt = mpts.emplace_back(
+      MLSPlaintext{ _group_id, _epoch, sender, ApplicationData{ pt } });
+    mpt.sign(_suite, context, _identity_priv);
+    mpt.set_membership_tag(_suite, context, _keys.membership_key);
+  }
+
+  return encrypt_batch(mpts);
+}
+
+bytes
+State::unprotect(const MLSCiphertext& ct)
 {
+  const auto scope = Metrics::Scope(Metrics::Operation::unprotect);
   MLSPlaintext pt = decrypt(ct);
 
   if (!verify(pt)) {
@@ -568,14 +1552,15 @@ operator!=(const State& lhs, const State& rhs)
 void
 State::update_epoch_secrets(const bytes& commit_secret)
 {
-  auto ctx = tls::marshal(GroupContext{
-    _group_id,
-    _epoch,
-    _tree.root_hash(),
-    _confirmed_transcript_hash,
-    _extensions,
-  });
-  _keys = _keys.next(commit_secret, {}, ctx, LeafCount{ _tree.size() });
+  // The epoch, transcript, and tree have changed, so the encodings are
+  // computed afresh, and kept for the messages of the new epoch
+  _epoch_cache.store(nullptr);
+  const auto encodings = epoch_encodings();
+  if (_key_prewarm == KeyPrewarm::active) {
+    _prior_senders = _keys.keys.active_senders();
+  }
+  _keys = _keys.next(
+    commit_secret, {}, encodings->encoded_context, LeafCount{ _tree.size() });
 }
 
 ///
@@ -590,8 +1575,9 @@ State::verify(const MLSPlaintext& pt) const
     throw InvalidParameterError("External senders not supported");
   }
 
+  const auto encodings = epoch_encodings();
   if (!pt.verify_membership_tag(
-        _suite, group_context(), _keys.membership_key)) {
+        _suite, encodings->encoded_context, _keys.membership_key)) {
     return false;
   }
 
@@ -601,7 +1587,56 @@ State::verify(const MLSPlaintext& pt) const
   }
 
   auto pub = maybe_kp.value().credential.public_key();
-  return pt.verify(_suite, group_context(), pub);
+  return pt.verify(_suite, encodings->encoded_context, pub);
+}
+
+std::vector<bool>
+State::verify(const std::vector<const MLSPlaintext*>& pts,
+              Executor& executor) const
+{
+  const auto encodings = epoch_encodings();
+  const auto& ctx = encodings->encoded_context;
+  auto valid = std::vector<bool>(pts.size(), false);
+  auto pubs = std::vector<SignaturePublicKey>();
+  auto tbs = std::vector<bytes>();
+  auto indices = std::vector<size_t>();
+  pubs.reserve(pts.size());
+  tbs.reserve(pts.size());
+  for (size_t i = 0; i < pts.size(); i++) {
+    const auto& pt = *pts.at(i);
+    if (pt.sender.sender_type != SenderType::member) {
+      // TODO(RLB) Support external senders
+      throw InvalidParameterError("External senders not supported");
+    }
+
+    if (!pt.verify_membership_tag(_suite, ctx, _keys.membership_key)) {
+      continue;
+    }
+
+    auto maybe_kp = _tree.key_package(LeafIndex(pt.sender.sender));
+    if (!maybe_kp.has_value()) {
+      throw InvalidParameterError("Signature from blank node");
+    }
+
+    pubs.push_back(maybe_kp.value().credential.public_key());
+    auto w = tls::ostream{};
+    pt.write_to_be_signed(w, ctx);
+    tbs.push_back(w.take());
+    indices.push_back(i);
+  }
+
+  auto items = std::vector<SignaturePublicKey::VerifyItem>();
+  items.reserve(indices.size());
+  for (size_t j = 0; j < indices.size(); j++) {
+    items.push_back({ pubs.at(j), tbs.at(j), pts.at(indices.at(j))->signature });
+  }
+
+  auto results = SignaturePublicKey::verify_batch(_suite, items, executor);
+  for (size_t j = 0; j < indices.size(); j++) {
+    valid.at(indices.at(j)) = results.at(j);
+  }
+
+  return valid;
 }
 
 bool
@@ -617,9 +1652,15 @@ State::do_export(const std::string& label,
                  const bytes& context,
                  size_t size) const
 {
-  auto secret = _suite.derive_secret(_keys.exporter_secret, label);
-  auto context_hash = _suite.get().digest.hash(context);
-  return _suite.expand_with_label(secret, "exporter", context_hash, size);
+  return _keys.do_export(label, context, size);
+}
+
+std::vector<bytes>
+State::do_export(const std::vector<std::string>& labels,
+                 const bytes& context,
+                 size_t size) const
+{
+  return _keys.do_export(labels, context, size);
 }
 
 std::vector<KeyPackage>
@@ -644,7 +1685,63 @@ State::roster() const
 bytes
 State::authentication_secret() const
 {
-  return _keys.authentication_secret;
+  return _keys.authentication_secret();
+}
+
+MemoryUsage
+State::memory_usage() const
+{
+  auto usage = MemoryUsage{};
+
+  // Tree nodes are counted by their serialized size, plus their cached hashes
+  // and encodings.  Sizes are computed from the values, without serializing
+  // them.
+  usage.tree = encoded_size(_tree);
+  for (auto i = NodeIndex{ 0 }; i.val < NodeCount(_tree.size()).val; i.val++) {
+    const auto& node = _tree.node_at(i);
+    usage.tree += sizeof(OptionalNode) + node.hash.size();
+    usage.tree += node.encoding.size();
+  }
+
+  // The path maps' slots are held inline, and counted with the object
+  usage.path_secrets = _tree_priv.update_secret.size();
+  for (const auto& entry : _tree_priv.path_secrets) {
+    usage.path_secrets += entry.second.size();
+  }
+  for (const auto& entry : _tree_priv.private_key_cache) {
+    usage.private_key_cache +=
+      entry.second.data.size() + entry.second.public_key.data.size();
+  }
+
+  usage.ratchets = _keys.keys.retained_bytes();
+  usage.key_schedule = _keys.retained_bytes() - usage.ratchets;
+
+  for (const auto& entry : _proposals.entries) {
+    usage.pending_proposals +=
+      sizeof(entry) + entry.id.id.size() + tls::encoded_size(entry.pt);
+  }
+  for (const auto& entry : _proposals.index) {
+    usage.pending_proposals += sizeof(entry) + entry.first.size();
+  }
+  for (const auto& entry : _update_secrets) {
+    usage.pending_proposals +=
+      sizeof(entry) + entry.first.size() + entry.second.size();
+  }
+
+  usage.other = sizeof(State) + _group_id.size();
+  usage.other +=
+    _confirmed_transcript_hash.size() + _interim_transcript_hash.size();
+  usage.other += tls::encoded_size(_extensions);
+  usage.other +=
+    _identity_priv.data.size() + _identity_priv.public_key.data.size();
+
+  return usage;
+}
+
+size_t
+State::retained_bytes() const
+{
+  return memory_usage().total();
 }
 
 // struct {
@@ -653,25 +1750,31 @@ State::authentication_secret() const
 //     ContentType content_type;
 //     opaque authenticated_data<0..2^32-1>;
 // } MLSCiphertextContentAAD;
-struct MLSCiphertextContentAAD
+//
+// The group ID and epoch are the AAD prefix of the epoch's encodings.
+static void
+write_content_aad(const EpochEncodings& encodings,
+                  ContentType::selector content_type,
+                  const bytes& authenticated_data,
+                  bytes& out)
 {
-  const bytes& group_id;
-  const epoch_t epoch;
-  const ContentType::selector content_type;
-  const bytes& authenticated_data;
-
-  TLS_SERIALIZABLE(group_id, epoch, content_type, authenticated_data)
-  TLS_TRAITS(tls::vector<1>, tls::pass, tls::pass, tls::vector<4>)
-};
+  out.clear();
+  auto w = tls::ostream(std::move(out));
+  w.reserve(encodings.aad_prefix.size() + 1 +
+            tls::vector<4>::size(authenticated_data));
+  w.write_raw(encodings.aad_prefix);
+  w << content_type;
+  tls::vector<4>::encode(w, authenticated_data);
+  out = w.take();
+}
 
 using ReuseGuard = std::array<uint8_t, 4>;
 
 static ReuseGuard
 new_reuse_guard()
 {
-  auto random = random_bytes(4);
   auto guard = ReuseGuard();
-  std::copy(random.begin(), random.end(), guard.begin());
+  random_bytes(guard.data(), guard.size());
   return guard;
 }
 
@@ -702,20 +1805,22 @@ struct MLSSenderData
 //     uint64 epoch;
 //     ContentType content_type;
 // } MLSSenderDataAAD;
-struct MLSSenderDataAAD
+static void
+write_sender_data_aad(const EpochEncodings& encodings,
+                      ContentType::selector content_type,
+                      bytes& out)
 {
-  const bytes& group_id;
-  const epoch_t epoch;
-  const ContentType::selector content_type;
-
-  TLS_SERIALIZABLE(group_id, epoch, content_type)
-  TLS_TRAITS(tls::vector<1>, tls::pass, tls::pass)
-};
+  out.clear();
+  auto w = tls::ostream(std::move(out));
+  w.reserve(encodings.aad_prefix.size() + 1);
+  w.write_raw(encodings.aad_prefix);
+  w << content_type;
+  out = w.take();
+}
 
-MLSCiphertext
-State::encrypt(const MLSPlaintext& pt)
+static GroupKeySource::RatchetType
+ratchet_type(const MLSPlaintext& pt)
 {
-  // Pull from the key schedule
   static const auto get_key_type = overloaded{
     [](const ApplicationData& /*unused*/) {
       return GroupKeySource::RatchetType::application;
@@ -728,69 +1833,288 @@ State::encrypt(const MLSPlaintext& pt)
     },
   };
 
-  auto key_type = std::visit(get_key_type, pt.content);
-  auto [generation, keys] = _keys.keys.next(key_type, _index);
+  return std::visit(get_key_type, pt.content);
+}
+
+MLSCiphertext
+State::encrypt(const MLSPlaintext& pt)
+{
+  const auto& aead = _suite.get().hpke.aead;
+  const auto tag_size = _suite.tag_size();
+  const auto encodings = epoch_encodings();
+
+  // Pull from the key schedule
+  auto [generation, keys] = _keys.keys.next(ratchet_type(pt), _index);
 
-  // Encrypt the content
-  // XXX(rlb@ipv.sx): Apply padding?
-  auto content = pt.marshal_content(0);
   auto content_type = pt.content_type();
-  auto content_aad = tls::marshal(MLSCiphertextContentAAD{
-    _group_id, _epoch, content_type, pt.authenticated_data });
+  auto content_aad = scratch_buffer();
+  write_content_aad(
+    *encodings, content_type, pt.authenticated_data, content_aad.data());
 
   auto reuse_guard = new_reuse_guard();
   apply_reuse_guard(reuse_guard, keys.nonce);
 
-  auto content_ct =
-    _suite.get().hpke.aead.seal(keys.key, keys.nonce, content_aad, content);
+  auto ct = MLSCiphertext{
+    _group_id, _epoch, content_type, {}, pt.authenticated_data, {},
+  };
+
+  // Encrypt the content in place, after room for the tag has been left
+  // XXX(rlb@ipv.sx): Apply padding?
+  const auto content_size = pt.content_size(0);
+  auto content = tls::ostream{};
+  content.reserve(content_size + tag_size);
+  pt.write_content(content, 0);
+  content.write_zeros(tag_size);
+  ct.ciphertext = content.take();
+  Metrics::timed(Metrics::Event::aead_seal, [&]() {
+    aead.seal_into(keys.key,
+                   keys.nonce,
+                   content_aad.data(),
+                   ct.ciphertext.data(),
+                   content_size,
+                   ct.ciphertext.data());
+  });
 
   // Encrypt the sender data
-  auto sender_data_obj = MLSSenderData{ _index.val, generation, reuse_guard };
-  auto sender_data = tls::marshal(sender_data_obj);
-
-  auto [sender_data_key, sender_data_nonce] = _keys.sender_data(content_ct);
-  auto sender_data_aad =
-    tls::marshal(MLSSenderDataAAD{ _group_id, _epoch, content_type });
-
-  auto encrypted_sender_data = _suite.get().hpke.aead.seal(
-    sender_data_key, sender_data_nonce, sender_data_aad, sender_data);
-
-  // Assemble the MLSCiphertext
-  MLSCiphertext ct;
-  ct.group_id = _group_id;
-  ct.epoch = _epoch;
-  ct.content_type = content_type;
-  ct.encrypted_sender_data = encrypted_sender_data;
-  ct.authenticated_data = pt.authenticated_data;
-  ct.ciphertext = content_ct;
+  auto [sender_data_key, sender_data_nonce] = _keys.sender_data(ct.ciphertext);
+  auto sender_data_aad = scratch_buffer();
+  write_sender_data_aad(*encodings, content_type, sender_data_aad.data());
+
+  const auto sender_data = MLSSenderData{ _index.val, generation, reuse_guard };
+  const auto sender_data_size = tls::encoded_size(sender_data);
+  auto sender_data_w = tls::ostream{};
+  sender_data_w.reserve(sender_data_size + tag_size);
+  sender_data_w << sender_data;
+  sender_data_w.write_zeros(tag_size);
+  ct.encrypted_sender_data = sender_data_w.take();
+  Metrics::timed(Metrics::Event::aead_seal, [&]() {
+    aead.seal_into(sender_data_key,
+                   sender_data_nonce,
+                   sender_data_aad.data(),
+                   ct.encrypted_sender_data.data(),
+                   sender_data_size,
+                   ct.encrypted_sender_data.data());
+  });
+
   return ct;
 }
 
-MLSPlaintext
-State::decrypt(const MLSCiphertext& ct)
+struct State::PendingCiphertext
+{
+  KeyAndNonce keys;
+  ContentType::selector content_type;
+  size_t sender_data_offset;
+  size_t sender_data_size;
+  size_t content_offset;
+  size_t content_size;
+};
+
+State::PendingCiphertext
+State::lay_out_ciphertext(const MLSPlaintext& pt,
+                          const EpochEncodings& encodings,
+                          bytes& content_aad,
+                          bytes& out)
+{
+  // Pull from the key schedule
+  auto [generation, keys] = _keys.keys.next(ratchet_type(pt), _index);
+
+  const auto tag_size = _suite.tag_size();
+  auto content_type = pt.content_type();
+  write_content_aad(
+    encodings, content_type, pt.authenticated_data, content_aad);
+
+  auto reuse_guard = new_reuse_guard();
+  apply_reuse_guard(reuse_guard, keys.nonce);
+
+  // Lay out the MLSCiphertext with each plaintext where its ciphertext goes,
+  // followed by room for the tag, so that both can be sealed in place
+  // XXX(rlb@ipv.sx): Apply padding?
+  auto sender_data = MLSSenderData{ _index.val, generation, reuse_guard };
+  auto sender_data_size = tls::encoded_size(sender_data);
+  auto content_size = pt.content_size(0);
+
+  // The length prefixes are written by hand below, so their ranges are
+  // checked here rather than by the tls::vector encoders
+  if (sender_data_size + tag_size > std::numeric_limits<uint8_t>::max()) {
+    throw tls::WriteError("Data too large for header size");
+  }
+
+  if (content_size + tag_size > std::numeric_limits<uint32_t>::max()) {
+    throw tls::WriteError("Data too large for header size");
+  }
+
+  out.clear();
+  auto w = tls::ostream(std::move(out));
+  w.reserve(tls::vector<1>::size(_group_id) + tls::encoded_size(_epoch) +
+            tls::encoded_size(content_type) + 1 + sender_data_size +
+            tls::vector<4>::size(pt.authenticated_data) + 4 + content_size +
+            2 * tag_size);
+
+  tls::vector<1>::encode(w, _group_id);
+  w << _epoch << content_type;
+
+  w << static_cast<uint8_t>(sender_data_size + tag_size);
+  auto sender_data_offset = w.size();
+  w << sender_data;
+  w.write_zeros(tag_size);
+
+  tls::vector<4>::encode(w, pt.authenticated_data);
+
+  w << static_cast<uint32_t>(content_size + tag_size);
+  auto content_offset = w.size();
+  pt.write_content(w, 0);
+  w.write_zeros(tag_size);
+
+  out = w.take();
+  return PendingCiphertext{ std::move(keys),    content_type,
+                            sender_data_offset, sender_data_size,
+                            content_offset,     content_size };
+}
+
+void
+State::encrypt_into(const MLSPlaintext& pt, bytes& out)
+{
+  const auto& aead = _suite.get().hpke.aead;
+  const auto tag_size = _suite.tag_size();
+  const auto encodings = epoch_encodings();
+  auto content_aad = scratch_buffer();
+  const auto layout =
+    lay_out_ciphertext(pt, *encodings, content_aad.data(), out);
+
+  // Encrypt the content
+  auto* content = out.data() + layout.content_offset;
+  Metrics::timed(Metrics::Event::aead_seal, [&]() {
+    aead.seal_into(layout.keys.key,
+                   layout.keys.nonce,
+                   content_aad.data(),
+                   content,
+                   layout.content_size,
+                   content);
+  });
+
+  // Encrypt the sender data
+  auto [sender_data_key, sender_data_nonce] =
+    _keys.sender_data(content, layout.content_size + tag_size);
+  auto sender_data_aad = scratch_buffer();
+  write_sender_data_aad(
+    *encodings, layout.content_type, sender_data_aad.data());
+
+  auto* sender_data_pt = out.data() + layout.sender_data_offset;
+  Metrics::timed(Metrics::Event::aead_seal, [&]() {
+    aead.seal_into(sender_data_key,
+                   sender_data_nonce,
+                   sender_data_aad.data(),
+                   sender_data_pt,
+                   layout.sender_data_size,
+                   sender_data_pt);
+  });
+}
+
+std::vector<bytes>
+State::encrypt_batch(const std::vector<MLSPlaintext>& pts)
+{
+  const auto& aead = _suite.get().hpke.aead;
+  const auto tag_size = _suite.tag_size();
+  const auto count = pts.size();
+
+  const auto encodings = epoch_encodings();
+  auto out = std::vector<bytes>(count);
+  auto content_aads = std::vector<bytes>(count);
+  auto layouts = std::vector<PendingCiphertext>{};
+  layouts.reserve(count);
+  for (size_t i = 0; i < count; i++) {
+    layouts.push_back(
+      lay_out_ciphertext(pts[i], *encodings, content_aads[i], out[i]));
+  }
+
+  // Encrypt the contents
+  auto items = std::vector<hpke::AEAD::BatchItem>{};
+  items.reserve(count);
+  for (size_t i = 0; i < count; i++) {
+    const auto& layout = layouts[i];
+    auto* content = out[i].data() + layout.content_offset;
+    items.push_back({ layout.keys.key,
+                      layout.keys.nonce,
+                      content_aads[i],
+                      content,
+                      layout.content_size,
+                      content });
+  }
+
+  Metrics::timed(Metrics::Event::aead_seal,
+                 [&]() { aead.seal_batch(items); });
+
+  // Encrypt the sender data, whose keys are sampled from the encrypted content
+  auto sender_data_keys = std::vector<KeyAndNonce>{};
+  auto sender_data_aads = std::vector<bytes>(count);
+  sender_data_keys.reserve(count);
+  for (size_t i = 0; i < count; i++) {
+    const auto& layout = layouts[i];
+    auto* content = out[i].data() + layout.content_offset;
+    sender_data_keys.push_back(
+      _keys.sender_data(content, layout.content_size + tag_size));
+    write_sender_data_aad(*encodings, layout.content_type, sender_data_aads[i]);
+  }
+
+  items.clear();
+  for (size_t i = 0; i < count; i++) {
+    const auto& layout = layouts[i];
+    auto* sender_data_pt = out[i].data() + layout.sender_data_offset;
+    items.push_back({ sender_data_keys[i].key,
+                      sender_data_keys[i].nonce,
+                      sender_data_aads[i],
+                      sender_data_pt,
+                      layout.sender_data_size,
+                      sender_data_pt });
+  }
+
+  Metrics::timed(Metrics::Event::aead_seal,
+                 [&]() { aead.seal_batch(items); });
+  return out;
+}
+
+static MLSPlaintext
+decrypt_ciphertext(const EpochEncodings& encodings,
+                   KeyScheduleEpoch& keys,
+                   const MLSCiphertext& ct)
 {
   // Verify the epoch
-  if (ct.group_id != _group_id) {
+  const auto& context = encodings.context;
+  if (ct.group_id != context.group_id) {
     throw InvalidParameterError("Ciphertext not from this group");
   }
 
-  if (ct.epoch != _epoch) {
+  if (ct.epoch != context.epoch) {
     throw InvalidParameterError("Ciphertext not from this epoch");
   }
 
   // Decrypt and parse the sender data
-  auto [sender_data_key, sender_data_nonce] = _keys.sender_data(ct.ciphertext);
-  auto sender_data_aad =
-    tls::marshal(MLSSenderDataAAD{ ct.group_id, ct.epoch, ct.content_type });
-  auto sender_data_pt = _suite.get().hpke.aead.open(sender_data_key,
-                                                    sender_data_nonce,
-                                                    sender_data_aad,
-                                                    ct.encrypted_sender_data);
-  if (!sender_data_pt.has_value()) {
+  auto [sender_data_key, sender_data_nonce] = keys.sender_data(ct.ciphertext);
+  auto sender_data_aad = scratch_buffer();
+  write_sender_data_aad(encodings, ct.content_type, sender_data_aad.data());
+
+  const auto& aead = keys.suite.get().hpke.aead;
+  const auto tag_size = keys.suite.tag_size();
+  const auto& sender_data_ct = ct.encrypted_sender_data;
+  if (sender_data_ct.size() < tag_size) {
+    throw ProtocolError("Ciphertext smaller than tag size");
+  }
+
+  auto sender_data_pt = scratch_buffer();
+  sender_data_pt.data().resize(sender_data_ct.size() - tag_size);
+  auto sender_data_ok = Metrics::timed(Metrics::Event::aead_open, [&]() {
+    return aead.open_into(sender_data_key,
+                          sender_data_nonce,
+                          sender_data_aad.data(),
+                          sender_data_ct.data(),
+                          sender_data_ct.size(),
+                          sender_data_pt.data().data());
+  });
+  if (!sender_data_ok) {
     throw ProtocolError("Sender data decryption failed");
   }
 
-  auto sender_data = tls::get<MLSSenderData>(sender_data_pt.value());
+  auto sender_data = tls::get<MLSSenderData>(sender_data_pt.data());
   auto sender = LeafIndex(sender_data.sender);
 
   // Pull from the key schedule
@@ -799,30 +2123,401 @@ State::decrypt(const MLSCiphertext& ct)
     key_type = GroupKeySource::RatchetType::application;
   }
 
-  auto [key, nonce] = _keys.keys.get(key_type, sender, sender_data.generation);
-  _keys.keys.erase(key_type, sender, sender_data.generation);
+  auto [key, nonce] = keys.keys.take(key_type, sender, sender_data.generation);
   apply_reuse_guard(sender_data.reuse_guard, nonce);
 
   // Compute the plaintext AAD and decrypt
-  auto content_aad = tls::marshal(MLSCiphertextContentAAD{
-    ct.group_id,
-    ct.epoch,
-    ct.content_type,
-    ct.authenticated_data,
+  auto content_aad = scratch_buffer();
+  write_content_aad(
+    encodings, ct.content_type, ct.authenticated_data, content_aad.data());
+  auto content = Metrics::timed(Metrics::Event::aead_open, [&]() {
+    return aead.open(key, nonce, content_aad.data(), ct.ciphertext);
   });
-  auto content =
-    _suite.get().hpke.aead.open(key, nonce, content_aad, ct.ciphertext);
   if (!content.has_value()) {
     throw ProtocolError("Content decryption failed");
   }
 
   // Set up a new plaintext based on the content
-  return MLSPlaintext{ _group_id,
-                       _epoch,
+  return MLSPlaintext{ context.group_id,
+                       context.epoch,
                        { SenderType::member, sender_data.sender },
                        ct.content_type,
                        ct.authenticated_data,
                        content.value() };
 }
 
+// An application message decrypted by decrypt_in_place(), with what is
+// needed to authenticate it
+struct InPlaceApplicationData
+{
+  LeafIndex sender;
+  bytes signature;
+};
+
+// Decrypts an encoded MLSCiphertext from the given epoch in its own buffer,
+// without decoding it into an MLSCiphertext or MLSPlaintext.  On return,
+// message holds just the application data, and tbs the content to verify
+// the signature over.
+static InPlaceApplicationData
+decrypt_in_place(const EpochEncodings& encodings,
+                 KeyScheduleEpoch& keys,
+                 bytes& message,
+                 bytes& tbs)
+{
+  const auto& context = encodings.context;
+  const auto& aead = keys.suite.get().hpke.aead;
+  const auto tag_size = keys.suite.tag_size();
+  auto r = tls::istream(message);
+  const auto offset = [&]() { return message.size() - r.size(); };
+
+  auto header = MessageHeader{};
+  r >> header;
+  if (header.group_id != context.group_id) {
+    throw InvalidParameterError("Ciphertext not from this group");
+  }
+
+  if (header.epoch != context.epoch) {
+    throw InvalidParameterError("Ciphertext not from this epoch");
+  }
+
+  const auto content_type = header.content_type;
+  if (content_type != ContentType::selector::application) {
+    throw ProtocolError("Unprotect of non-application message");
+  }
+
+  // The encrypted fields are only located, so that they can be decrypted
+  // where they are
+  auto sender_data_size = uint8_t(0);
+  r >> sender_data_size;
+  auto sender_data_offset = offset();
+  r.read_raw(sender_data_size);
+
+  auto authenticated_data = bytes{};
+  tls::vector<4>::decode(r, authenticated_data);
+
+  auto content_size = uint32_t(0);
+  r >> content_size;
+  auto content_offset = offset();
+  r.read_raw(content_size);
+
+  if (sender_data_size < tag_size || content_size < tag_size) {
+    throw ProtocolError("Ciphertext smaller than tag size");
+  }
+
+  // Decrypt and parse the sender data
+  auto* content = message.data() + content_offset;
+  auto* sender_data_ct = message.data() + sender_data_offset;
+  auto [sender_data_key, sender_data_nonce] =
+    keys.sender_data(content, content_size);
+  auto sender_data_aad = scratch_buffer();
+  write_sender_data_aad(encodings, content_type, sender_data_aad.data());
+  auto sender_data_ok = Metrics::timed(Metrics::Event::aead_open, [&]() {
+    return aead.open_into(sender_data_key,
+                          sender_data_nonce,
+                          sender_data_aad.data(),
+                          sender_data_ct,
+                          sender_data_size,
+                          sender_data_ct);
+  });
+  if (!sender_data_ok) {
+    throw ProtocolError("Sender data decryption failed");
+  }
+
+  auto sender_data = MLSSenderData{};
+  auto sender_data_r =
+    tls::istream(sender_data_ct, sender_data_size - tag_size);
+  sender_data_r >> sender_data;
+  auto sender = LeafIndex(sender_data.sender);
+
+  // Pull from the key schedule
+  auto key_type = GroupKeySource::RatchetType::application;
+  auto [key, nonce] = keys.keys.take(key_type, sender, sender_data.generation);
+  apply_reuse_guard(sender_data.reuse_guard, nonce);
+
+  // Compute the content AAD and decrypt
+  auto content_aad = scratch_buffer();
+  write_content_aad(
+    encodings, content_type, authenticated_data, content_aad.data());
+  auto content_ok = Metrics::timed(Metrics::Event::aead_open, [&]() {
+    return aead.open_into(
+      key, nonce, content_aad.data(), content, content_size, content);
+  });
+  if (!content_ok) {
+    throw ProtocolError("Content decryption failed");
+  }
+
+  // Parse the content and encode the signed content from it, with the
+  // same encoders as any other MLSPlaintext
+  auto pt = MLSPlaintext{ context.group_id,
+                          context.epoch,
+                          { SenderType::member, sender.val },
+                          content_type,
+                          std::move(authenticated_data),
+                          content,
+                          content_size - tag_size };
+
+  tbs.clear();
+  auto tbs_w = tls::ostream(std::move(tbs));
+  pt.write_to_be_signed(tbs_w, encodings.encoded_context);
+  tbs = tbs_w.take();
+
+  // Leave only the application data in the buffer
+  const auto& data = std::get<ApplicationData>(pt.content).data;
+  message.assign(data.begin(), data.end());
+
+  return { sender, std::move(pt.signature) };
+}
+
+MLSPlaintext
+State::decrypt(const MLSCiphertext& ct)
+{
+  return decrypt_ciphertext(*epoch_encodings(), _keys, ct);
+}
+
+void
+State::unprotect_in_place(bytes& message)
+{
+  const auto scope = Metrics::Scope(Metrics::Operation::unprotect);
+  auto tbs = scratch_buffer();
+  auto data =
+    decrypt_in_place(*epoch_encodings(), _keys, message, tbs.data());
+
+  auto maybe_kp = _tree.key_package(data.sender);
+  if (!maybe_kp.has_value()) {
+    throw InvalidParameterError("Signature from blank node");
+  }
+
+  auto pub = maybe_kp.value().credential.public_key();
+  if (!pub.verify(_suite, tbs.data(), data.signature)) {
+    throw ProtocolError("Invalid message signature");
+  }
+}
+
+///
+/// DecryptOnlyEpoch
+///
+
+DecryptOnlyEpoch::DecryptOnlyEpoch(const State& state)
+  : _epoch(*state.epoch_encodings())
+{
+  _keys.suite = state._suite;
+  _keys.sender_data_secret = state._keys.sender_data_secret;
+  _keys.keys = state._keys.keys;
+
+  for (auto i = LeafIndex{ 0 }; i < state._tree.size(); i.val++) {
+    auto maybe_kp = state._tree.key_package(i);
+    if (maybe_kp.has_value()) {
+      _signers.emplace(i.val, maybe_kp.value().credential.public_key());
+    }
+  }
+}
+
+const SignaturePublicKey&
+DecryptOnlyEpoch::signer(uint32_t sender) const
+{
+  auto it = _signers.find(sender);
+  if (it == _signers.end()) {
+    throw InvalidParameterError("Signature from blank node");
+  }
+
+  return it->second;
+}
+
+bytes
+DecryptOnlyEpoch::unprotect(const MLSCiphertext& ct)
+{
+  const auto scope = Metrics::Scope(Metrics::Operation::unprotect);
+  auto pt = decrypt_ciphertext(_epoch, _keys, ct);
+
+  const auto& pub = signer(pt.sender.sender);
+  if (!pt.verify(_keys.suite, _epoch.encoded_context, pub)) {
+    throw ProtocolError("Invalid message signature");
+  }
+
+  if (!std::holds_alternative<ApplicationData>(pt.content)) {
+    throw ProtocolError("Unprotect of non-application message");
+  }
+
+  // NOLINTNEXTLINE(cppcoreguidelines-slicing)
+  return std::get<ApplicationData>(pt.content).data;
+}
+
+void
+DecryptOnlyEpoch::unprotect_in_place(bytes& message)
+{
+  const auto scope = Metrics::Scope(Metrics::Operation::unprotect);
+  auto tbs = scratch_buffer();
+  auto data = decrypt_in_place(_epoch, _keys, message, tbs.data());
+
+  const auto& pub = signer(data.sender.val);
+  if (!pub.verify(_keys.suite, tbs.data(), data.signature)) {
+    throw ProtocolError("Invalid message signature");
+  }
+}
+
+MemoryUsage
+DecryptOnlyEpoch::memory_usage() const
+{
+  auto usage = MemoryUsage{};
+  usage.ratchets = _keys.keys.retained_bytes();
+  usage.key_schedule = _keys.retained_bytes() - usage.ratchets;
+
+  // Signature keys stand in for the tree
+  for (const auto& [sender, pub] : _signers) {
+    usage.tree += sizeof(sender) + pub.data.size();
+  }
+
+  usage.other = sizeof(DecryptOnlyEpoch) + _epoch.encoded_context.size() +
+                _epoch.aad_prefix.size();
+  return usage;
+}
+
+size_t
+DecryptOnlyEpoch::retained_bytes() const
+{
+  return memory_usage().total();
+}
+
+// struct {
+//     uint32 sender;
+//     SignaturePublicKey public_key;
+// } DecryptOnlySigner;
+struct DecryptOnlySigner
+{
+  uint32_t sender;
+  SignaturePublicKey public_key;
+
+  TLS_SERIALIZABLE(sender, public_key)
+};
+
+// struct {
+//     GroupContext context;
+//     opaque sender_data_secret<0..255>;
+//     opaque key_source<0..2^32-1>;
+//     DecryptOnlySigner signers<0..2^32-1>;
+// } DecryptOnlyEpochSnapshot;
+struct DecryptOnlyEpochSnapshot
+{
+  GroupContext context;
+  bytes sender_data_secret;
+  bytes key_source;
+  std::vector<DecryptOnlySigner> signers;
+
+  TLS_SERIALIZABLE(context, sender_data_secret, key_source, signers)
+  TLS_TRAITS(tls::pass, tls::vector<1>, tls::vector<4>, tls::vector<4>)
+};
+
+bytes
+DecryptOnlyEpoch::save(const bytes& storage_secret) const
+{
+  auto signers = std::vector<DecryptOnlySigner>{};
+  signers.reserve(_signers.size());
+  for (const auto& [sender, pub] : _signers) {
+    signers.push_back({ sender, pub });
+  }
+
+  auto snapshot = DecryptOnlyEpochSnapshot{ _epoch.context,
+                                            _keys.sender_data_secret,
+                                            _keys.keys.snapshot(),
+                                            std::move(signers) };
+  auto body = tls::marshal(snapshot);
+  zeroize(snapshot.sender_data_secret);
+  zeroize(snapshot.key_source);
+
+  auto out = StateSnapshot::seal(StateSnapshot::Type::decrypt_only,
+                                 _keys.suite,
+                                 _epoch.context.epoch,
+                                 _epoch.context.group_id,
+                                 body,
+                                 storage_secret);
+  zeroize(body);
+  return out;
+}
+
+DecryptOnlyEpoch
+DecryptOnlyEpoch::load(const StateSnapshot& snapshot,
+                       const bytes& storage_secret)
+{
+  if (!snapshot.decrypt_only()) {
+    throw InvalidParameterError("Not a decrypt-only epoch");
+  }
+
+  auto pt = snapshot.open(storage_secret);
+  auto body = tls::get<DecryptOnlyEpochSnapshot>(pt);
+  zeroize(pt);
+  if (body.context.group_id != snapshot.group_id() ||
+      body.context.epoch != snapshot.epoch()) {
+    throw ProtocolError("Decrypt-only epoch does not match its header");
+  }
+
+  auto out = DecryptOnlyEpoch{};
+  out._epoch = EpochEncodings(std::move(body.context));
+  out._keys.suite = snapshot.cipher_suite();
+  out._keys.sender_data_secret = std::move(body.sender_data_secret);
+  out._keys.keys = GroupKeySource::restore(out._keys.suite, body.key_source);
+  for (auto& signer : body.signers) {
+    out._signers.emplace(signer.sender, std::move(signer.public_key));
+  }
+  zeroize(body.key_source);
+  return out;
+}
+
+///
+/// StateJournal
+///
+
+StateJournal::StateJournal(bytes storage_secret, size_t compact_interval)
+  : _storage_secret(std::move(storage_secret))
+  , _compact_interval(compact_interval)
+{}
+
+std::tuple<bool, bytes>
+StateJournal::record(const State& state)
+{
+  const auto full = !_base.has_value() || _deltas >= _compact_interval ||
+                    _base->group_id() != state.group_id();
+  auto data = full ? state.save(_storage_secret)
+                   : state.save_delta(_base.value(), _storage_secret);
+
+  _deltas = full ? 0 : _deltas + 1;
+  _base = state;
+
+  // Records are framed like a tls::vector<4>
+  auto out = tls::marshal(static_cast<uint32_t>(data.size()));
+  out.insert(out.end(), data.begin(), data.end());
+  return { full, out };
+}
+
+State
+StateJournal::replay(const bytes& journal, const bytes& storage_secret)
+{
+  // Only the headers are read to find the last full snapshot
+  auto records = std::vector<StateSnapshot>{};
+  auto last_full = std::optional<size_t>{};
+  auto r = tls::istream(journal);
+  while (!r.empty()) {
+    auto size = uint32_t(0);
+    r >> size;
+    if (size > r.size()) {
+      throw ProtocolError("Truncated journal record");
+    }
+
+    records.emplace_back(r.read_raw(size), size);
+    if (!records.back().delta() && !records.back().decrypt_only()) {
+      last_full = records.size() - 1;
+    }
+  }
+
+  if (!last_full.has_value()) {
+    throw InvalidParameterError("Journal has no full snapshot");
+  }
+
+  auto state = State::load(records.at(last_full.value()), storage_secret);
+  for (auto i = last_full.value() + 1; i < records.size(); i++) {
+    state = state.load_delta(records.at(i), storage_secret);
+  }
+
+  return state;
+}
+
 } // namespace mls
@@ -1,5 +1,11 @@
+#include <mls/metrics.h>
 #include <mls/treekem.h>
 
+#include <algorithm>
+#include <limits>
+#include <unordered_map>
+#include <utility>
+
 namespace mls {
 
 ///
@@ -50,35 +56,53 @@ Node::parent_hash() const
 /// OptionalNode
 ///
 
+template<typename T>
 void
-OptionalNode::set_leaf_hash(CipherSuite suite, NodeIndex index)
+OptionalNode::write_content(tls::ostream& w)
 {
-  auto leaf = std::optional<KeyPackage>{};
   if (node.has_value()) {
-    leaf = std::get<KeyPackage>(node.value().node);
+    silence_unused(std::get<T>(node.value().node));
+  }
+
+  if (encoding.empty()) {
+    encoding = tls::marshal(*this);
+  }
+
+  // The encoding is the presence flag, then the node type and content for a
+  // node that is present
+  static constexpr size_t node_type_offset = 1;
+  w.write_raw(encoding.data(), node_type_offset);
+  if (node.has_value()) {
+    w.write_raw(encoding.data() + node_type_offset + 1,
+                encoding.size() - node_type_offset - 1);
   }
+}
 
+void
+OptionalNode::set_leaf_hash(CipherSuite suite, NodeIndex index)
+{
   tls::ostream w;
-  w << index << leaf;
-  hash = suite.get().digest.hash(w.bytes());
+  w << index;
+  write_content<KeyPackage>(w);
+  hash = suite.get().digest.hash(w.take());
 }
 
 void
 OptionalNode::set_parent_hash(CipherSuite suite,
                               NodeIndex index,
-                              const bytes& left,
-                              const bytes& right)
+                              const inline_bytes<max_hash_size>& left,
+                              const inline_bytes<max_hash_size>& right)
 {
-  auto parent = std::optional<ParentNode>{};
-  if (node.has_value()) {
-    parent = std::get<ParentNode>(node.value().node);
-  }
-
   tls::ostream w;
-  w << index << parent;
-  tls::vector<1>::encode(w, left);
-  tls::vector<1>::encode(w, right);
-  hash = suite.get().digest.hash(w.bytes());
+  w << index;
+  write_content<ParentNode>(w);
+
+  // As tls::vector<1>
+  w << static_cast<uint8_t>(left.size());
+  w.write_raw(left.data(), left.size());
+  w << static_cast<uint8_t>(right.size());
+  w.write_raw(right.data(), right.size());
+  hash = suite.get().digest.hash(w.take());
 }
 
 ///
@@ -187,7 +211,9 @@ TreeKEMPrivateKey::private_key(NodeIndex n)
 void
 TreeKEMPrivateKey::set_leaf_secret(const bytes& secret)
 {
+  // Drop any key derived from the previous leaf secret
   path_secrets[NodeIndex(index)] = secret;
+  private_key_cache.erase(NodeIndex(index));
 }
 
 std::tuple<NodeIndex, bytes, bool>
@@ -321,27 +347,268 @@ TreeKEMPrivateKey::consistent(const TreeKEMPublicKey& other) const
   return std::all_of(path_secrets.begin(), path_secrets.end(), public_match);
 }
 
+///
+/// LeafPlacement
+///
+
+LeafIndex
+LeftmostPlacement::place(const TreeKEMPublicKey& tree) const
+{
+  auto index = LeafIndex(0);
+  while (index.val < tree.size().val && !tree.blank(NodeIndex(index))) {
+    index.val++;
+  }
+  return index;
+}
+
+LeafIndex
+MinResolutionPlacement::place(const TreeKEMPublicKey& tree) const
+{
+  const auto width = NodeCount(tree.size());
+  auto best = std::optional<LeafIndex>{};
+  auto best_cost = size_t(0);
+  for (auto i = LeafIndex(0); i < tree.size(); i.val++) {
+    if (!tree.blank(NodeIndex(i))) {
+      continue;
+    }
+
+    // The number of blank ancestors below the nearest non-blank one
+    const auto dp = tree_math::dirpath(NodeIndex(i), width);
+    auto cost = size_t(0);
+    while (cost < dp.size() && tree.blank(dp[cost])) {
+      cost++;
+    }
+
+    if (!best.has_value() || cost < best_cost) {
+      best = i;
+      best_cost = cost;
+    }
+  }
+
+  return best.value_or(LeafIndex{ tree.size().val });
+}
+
+LeafIndex
+ClusteredPlacement::place(const TreeKEMPublicKey& tree) const
+{
+  if (tree.size().val == 0) {
+    return LeafIndex{ 0 };
+  }
+
+  const auto width = NodeCount(tree.size());
+  auto members = std::vector<uint32_t>(width.val, 0);
+  for (auto i = LeafIndex(0); i < tree.size(); i.val++) {
+    if (tree.blank(NodeIndex(i))) {
+      continue;
+    }
+
+    members.at(NodeIndex(i).val) += 1;
+    for (auto n : tree_math::dirpath(NodeIndex(i), width)) {
+      members.at(n.val) += 1;
+    }
+  }
+
+  auto best = std::optional<LeafIndex>{};
+  auto best_level = uint32_t(0);
+  for (auto i = LeafIndex(0); i < tree.size(); i.val++) {
+    if (!tree.blank(NodeIndex(i))) {
+      continue;
+    }
+
+    // The level of the highest ancestor with no members below it
+    auto level = uint32_t(0);
+    for (auto n : tree_math::dirpath(NodeIndex(i), width)) {
+      if (members.at(n.val) > 0) {
+        break;
+      }
+      level = tree_math::level(n);
+    }
+
+    if (!best.has_value() || level > best_level) {
+      best = i;
+      best_level = level;
+    }
+  }
+
+  return best.value_or(LeafIndex{ tree.size().val });
+}
+
 ///
 /// TreeKEMPublicKey
 ///
 
+struct TreeKEMPublicKey::LeafIndexTable
+{
+  // The keys under which each leaf is indexed, so that they can be removed
+  // when the leaf changes
+  struct Keys
+  {
+    bytes init_key;
+    std::optional<bytes> identity;
+  };
+
+  using Index = std::unordered_multimap<bytes, LeafIndex, BytesHash>;
+
+  Index by_init_key;
+  Index by_identity;
+  std::vector<std::optional<Keys>> keys;
+
+  static std::optional<LeafIndex> lowest(const Index& index, const bytes& key);
+  void erase(LeafIndex leaf);
+  void insert(LeafIndex leaf, const KeyPackage& kp);
+
+private:
+  static void erase(Index& index, const bytes& key, LeafIndex leaf);
+};
+
+std::optional<LeafIndex>
+TreeKEMPublicKey::LeafIndexTable::lowest(const Index& index, const bytes& key)
+{
+  auto out = std::optional<LeafIndex>{};
+  auto [begin, end] = index.equal_range(key);
+  for (auto it = begin; it != end; ++it) {
+    if (!out.has_value() || it->second < out.value()) {
+      out = it->second;
+    }
+  }
+  return out;
+}
+
+void
+TreeKEMPublicKey::LeafIndexTable::erase(LeafIndex leaf)
+{
+  if (leaf.val >= keys.size() || !keys[leaf.val].has_value()) {
+    return;
+  }
+
+  const auto& leaf_keys = keys[leaf.val].value();
+  erase(by_init_key, leaf_keys.init_key, leaf);
+  if (leaf_keys.identity.has_value()) {
+    erase(by_identity, leaf_keys.identity.value(), leaf);
+  }
+
+  keys[leaf.val].reset();
+}
+
+void
+TreeKEMPublicKey::LeafIndexTable::insert(LeafIndex leaf, const KeyPackage& kp)
+{
+  auto leaf_keys = Keys{ kp.init_key.data, std::nullopt };
+  if (kp.credential.type() == CredentialType::selector::basic) {
+    leaf_keys.identity = kp.credential.get<BasicCredential>().identity;
+  }
+
+  by_init_key.emplace(leaf_keys.init_key, leaf);
+  if (leaf_keys.identity.has_value()) {
+    by_identity.emplace(leaf_keys.identity.value(), leaf);
+  }
+
+  if (keys.size() <= leaf.val) {
+    keys.resize(leaf.val + 1);
+  }
+  keys[leaf.val] = std::move(leaf_keys);
+}
+
+void
+TreeKEMPublicKey::LeafIndexTable::erase(Index& index,
+                                        const bytes& key,
+                                        LeafIndex leaf)
+{
+  auto [begin, end] = index.equal_range(key);
+  for (auto it = begin; it != end; ++it) {
+    if (it->second == leaf) {
+      index.erase(it);
+      return;
+    }
+  }
+}
+
+TreeKEMPublicKey::LeafIndexCache::LeafIndexCache(const LeafIndexCache& other)
+{
+  const auto lock = std::lock_guard(other.mutex);
+  table = other.table;
+  stale = other.stale;
+  rebuild = other.rebuild;
+}
+
+TreeKEMPublicKey::LeafIndexCache&
+TreeKEMPublicKey::LeafIndexCache::operator=(const LeafIndexCache& other)
+{
+  if (this == &other) {
+    return *this;
+  }
+
+  const auto lock = std::scoped_lock(mutex, other.mutex);
+  table = other.table;
+  stale = other.stale;
+  rebuild = other.rebuild;
+  return *this;
+}
+
+TreeKEMPublicKey::ResolutionCache::ResolutionCache(const ResolutionCache& other)
+{
+  const auto lock = std::lock_guard(other.mutex);
+  entries = other.entries;
+}
+
+TreeKEMPublicKey::ResolutionCache&
+TreeKEMPublicKey::ResolutionCache::operator=(const ResolutionCache& other)
+{
+  if (this == &other) {
+    return *this;
+  }
+
+  const auto lock = std::scoped_lock(mutex, other.mutex);
+  entries = other.entries;
+  return *this;
+}
+
+TreeKEMPublicKey::ParentHashWatermark::ParentHashWatermark(
+  const ParentHashWatermark& other)
+{
+  const auto lock = std::lock_guard(other.mutex);
+  verified = other.verified;
+}
+
+TreeKEMPublicKey::ParentHashWatermark&
+TreeKEMPublicKey::ParentHashWatermark::operator=(
+  const ParentHashWatermark& other)
+{
+  if (this == &other) {
+    return *this;
+  }
+
+  const auto lock = std::scoped_lock(mutex, other.mutex);
+  verified = other.verified;
+  return *this;
+}
+
 TreeKEMPublicKey::TreeKEMPublicKey(CipherSuite suite_in)
   : suite(suite_in)
 {}
 
+void
+TreeKEMPublicKey::leaf_placement(std::shared_ptr<const LeafPlacement> placement)
+{
+  _placement = std::move(placement);
+}
+
 LeafIndex
 TreeKEMPublicKey::add_leaf(const KeyPackage& kp)
 {
-  // Find the leftmost free leaf
-  auto index = LeafIndex(0);
-  while (index.val < size().val && node_at(NodeIndex(index)).node.has_value()) {
-    index.val++;
+  // Find the free leaf chosen by the placement policy
+  auto index = _placement ? _placement->place(*this)
+                          : LeftmostPlacement{}.place(*this);
+  if (index.val > size().val ||
+      (index.val < size().val && !blank(NodeIndex(index)))) {
+    throw InvalidParameterError("Leaf placement chose an occupied leaf");
   }
 
   // Extend the tree if necessary
   auto ni = NodeIndex(index);
-  if (index.val >= size().val) {
-    nodes.resize(ni.val + 1);
+  while (nodes.size() < ni.val + 1) {
+    nodes.push_back(std::make_shared<OptionalNode>());
+    _blank.push_back(true);
   }
 
   // Set the leaf
@@ -349,7 +616,7 @@ TreeKEMPublicKey::add_leaf(const KeyPackage& kp)
 
   // Update the unmerged list
   for (auto& n : tree_math::dirpath(ni, NodeCount(size()))) {
-    if (!node_at(n).node.has_value()) {
+    if (blank(n)) {
       continue;
     }
 
@@ -416,14 +683,50 @@ void
 TreeKEMPublicKey::set_hash_all()
 {
   auto r = tree_math::root(NodeCount(size()));
-  get_hash(r);
+  get_hash(r, hash_count);
 }
 
-bytes
+void
+TreeKEMPublicKey::set_hash_all(Executor& executor)
+{
+  // Split the tree into up to 2^6 disjoint subtrees.  Each task only detaches
+  // and hashes the nodes within its own subtree.
+  static constexpr auto split_depth = 6;
+  const auto width = NodeCount(size());
+  const auto r = tree_math::root(width);
+
+  auto subtrees = std::vector<NodeIndex>{ r };
+  for (auto depth = 0; depth < split_depth; depth++) {
+    auto next = std::vector<NodeIndex>{};
+    for (const auto& n : subtrees) {
+      if (tree_math::level(n) == 0) {
+        next.push_back(n);
+        continue;
+      }
+
+      next.push_back(tree_math::left(n));
+      next.push_back(tree_math::right(n, width));
+    }
+    subtrees = std::move(next);
+  }
+
+  auto counts = std::vector<size_t>(subtrees.size(), 0);
+  executor.run(subtrees.size(),
+               [&](size_t i) { get_hash(subtrees[i], counts[i]); });
+
+  for (const auto count : counts) {
+    hash_count += count;
+  }
+
+  // The levels above the subtrees reuse the hashes just computed
+  get_hash(r, hash_count);
+}
+
+const inline_bytes<max_hash_size>&
 TreeKEMPublicKey::root_hash() const
 {
   auto r = tree_math::root(NodeCount(size()));
-  auto hash = node_at(r).hash;
+  const auto& hash = node_at(r).hash;
   if (hash.empty()) {
     throw InvalidParameterError("Root hash not set");
   }
@@ -431,6 +734,12 @@ TreeKEMPublicKey::root_hash() const
   return hash;
 }
 
+size_t
+TreeKEMPublicKey::hashes_computed() const
+{
+  return hash_count;
+}
+
 LeafCount
 TreeKEMPublicKey::size() const
 {
@@ -440,75 +749,167 @@ TreeKEMPublicKey::size() const
 bool
 TreeKEMPublicKey::parent_hash_valid() const
 {
+  const auto lock = std::lock_guard(_parent_hashes.mutex);
+  _parent_hashes.verified.resize(nodes.size(), false);
   for (auto i = NodeIndex{ 1 }; i.val < nodes.size(); i.val += 2) {
-    if (nodes[i.val].blank()) {
-      continue;
+    if (!parent_hash_valid_at(i)) {
+      return false;
     }
+  }
+  return true;
+}
 
-    auto self_hash = nodes[i.val].parent_node().hash(suite);
+bool
+TreeKEMPublicKey::parent_hash_valid(LeafIndex from) const
+{
+  const auto lock = std::lock_guard(_parent_hashes.mutex);
+  _parent_hashes.verified.resize(nodes.size(), false);
+  const auto dp = tree_math::dirpath(NodeIndex(from), NodeCount(size()));
+  return std::all_of(
+    dp.begin(), dp.end(), [&](auto n) { return parent_hash_valid_at(n); });
+}
 
-    auto l = tree_math::left(i);
-    auto ln = nodes[l.val].node;
-    auto l_match = (ln.has_value() && ln.value().parent_hash() == self_hash);
+bool
+TreeKEMPublicKey::parent_hash_valid(Executor& executor) const
+{
+  const auto lock = std::lock_guard(_parent_hashes.mutex);
+  _parent_hashes.verified.resize(nodes.size(), false);
 
-    auto r = tree_math::right(i, NodeCount(size()));
-    auto rn = nodes[r.val].node;
-    auto r_match = (rn.has_value() && rn.value().parent_hash() == self_hash);
+  auto unverified = std::vector<NodeIndex>{};
+  for (auto i = NodeIndex{ 1 }; i.val < nodes.size(); i.val += 2) {
+    if (!blank(i) && !_parent_hashes.verified.at(i.val)) {
+      unverified.push_back(i);
+    }
+  }
 
-    if (!l_match && !r_match) {
-      return false;
+  // Each task checks a contiguous run of nodes, so that a large tree does not
+  // queue one task per node
+  static constexpr auto max_tasks = size_t(64);
+  const auto tasks = std::min(max_tasks, unverified.size());
+  auto matches = std::vector<uint8_t>(unverified.size(), 0);
+  executor.run(tasks, [&](size_t t) {
+    const auto start = unverified.size() * t / tasks;
+    const auto end = unverified.size() * (t + 1) / tasks;
+    for (auto i = start; i < end; i++) {
+      matches[i] = parent_hash_matches(unverified[i]) ? 1 : 0;
     }
+  });
+
+  auto valid = true;
+  for (size_t i = 0; i < unverified.size(); i++) {
+    if (matches[i] == 0) {
+      valid = false;
+      continue;
+    }
+
+    _parent_hashes.verified.at(unverified[i].val) = true;
+  }
+
+  return valid;
+}
+
+bool
+TreeKEMPublicKey::parent_hash_valid_at(NodeIndex index) const
+{
+  if (blank(index) || _parent_hashes.verified.at(index.val)) {
+    return true;
+  }
+
+  if (!parent_hash_matches(index)) {
+    return false;
   }
+
+  _parent_hashes.verified.at(index.val) = true;
   return true;
 }
 
-std::vector<NodeIndex>
-TreeKEMPublicKey::resolve(NodeIndex index) const // NOLINT(misc-no-recursion)
+bool
+TreeKEMPublicKey::parent_hash_matches(NodeIndex index) const
 {
-  auto at_leaf = (tree_math::level(index) == 0);
-  if (nodes[index.val].node.has_value()) {
-    const auto& node = nodes[index.val].node.value();
-    auto out = std::vector<NodeIndex>{ index };
-    if (at_leaf) {
-      return out;
-    }
+  auto self_hash = node_at(index).parent_node().hash(suite);
+
+  auto l = tree_math::left(index);
+  const auto& ln = node_at(l).node;
+  auto l_match = (ln.has_value() && ln.value().parent_hash() == self_hash);
 
-    const auto& parent = std::get<ParentNode>(node.node);
-    const auto& unmerged = parent.unmerged_leaves;
-    std::transform(unmerged.begin(),
-                   unmerged.end(),
-                   std::back_inserter(out),
-                   [](LeafIndex x) -> NodeIndex { return NodeIndex(x); });
+  auto r = tree_math::right(index, NodeCount(size()));
+  const auto& rn = node_at(r).node;
+  auto r_match = (rn.has_value() && rn.value().parent_hash() == self_hash);
+
+  return l_match || r_match;
+}
+
+std::vector<NodeIndex>
+TreeKEMPublicKey::resolve(NodeIndex index) const
+{
+  const auto lock = std::lock_guard(_resolutions.mutex);
+  _resolutions.entries.resize(nodes.size());
+  return resolve_cached(index);
+}
 
-    return out;
+// NOLINTNEXTLINE(misc-no-recursion)
+const std::vector<NodeIndex>&
+TreeKEMPublicKey::resolve_cached(NodeIndex index) const
+{
+  auto& entry = _resolutions.entries.at(index.val);
+  if (entry) {
+    return *entry;
   }
 
-  if (at_leaf) {
-    return {};
+  auto at_leaf = (tree_math::level(index) == 0);
+  auto out = std::vector<NodeIndex>{};
+  if (!blank(index)) {
+    out.push_back(index);
+    if (!at_leaf) {
+      const auto& node = node_at(index).node.value();
+      const auto& parent = std::get<ParentNode>(node.node);
+      const auto& unmerged = parent.unmerged_leaves;
+      std::transform(unmerged.begin(),
+                     unmerged.end(),
+                     std::back_inserter(out),
+                     [](LeafIndex x) -> NodeIndex { return NodeIndex(x); });
+    }
+  } else if (!at_leaf) {
+    const auto& l = resolve_cached(tree_math::left(index));
+    const auto& r = resolve_cached(tree_math::right(index, NodeCount(size())));
+    out.reserve(l.size() + r.size());
+    out.insert(out.end(), l.begin(), l.end());
+    out.insert(out.end(), r.begin(), r.end());
   }
 
-  auto l = resolve(tree_math::left(index));
-  auto r = resolve(tree_math::right(index, NodeCount(size())));
-  l.insert(l.end(), r.begin(), r.end());
-  return l;
+  entry = std::make_shared<const std::vector<NodeIndex>>(std::move(out));
+  return *entry;
 }
 
 std::optional<LeafIndex>
 TreeKEMPublicKey::find(const KeyPackage& kp) const
 {
-  for (LeafIndex i{ 0 }; i < size(); i.val++) {
-    const auto& node = node_at(NodeIndex(i)).node;
-    if (!node.has_value()) {
+  const auto lock = std::lock_guard(_leaf_index.mutex);
+  const auto& table = refresh_leaf_index();
+
+  // Key packages that are equal have the same init key, but not necessarily
+  // the same signature, so candidates are confirmed by comparison
+  auto out = std::optional<LeafIndex>{};
+  auto [begin, end] = table.by_init_key.equal_range(kp.init_key.data);
+  for (auto it = begin; it != end; ++it) {
+    auto leaf = it->second;
+    if (out.has_value() && out.value() < leaf) {
       continue;
     }
 
-    const auto& node_kp = std::get<KeyPackage>(node.value().node);
-    if (kp == node_kp) {
-      return i;
+    if (key_package(leaf) == kp) {
+      out = leaf;
     }
   }
 
-  return std::nullopt;
+  return out;
+}
+
+std::optional<LeafIndex>
+TreeKEMPublicKey::find_identity(const bytes& identity) const
+{
+  const auto lock = std::lock_guard(_leaf_index.mutex);
+  return LeafIndexTable::lowest(refresh_leaf_index().by_identity, identity);
 }
 
 std::optional<KeyPackage>
@@ -528,60 +929,271 @@ TreeKEMPublicKey::encap(LeafIndex from,
                         const bytes& leaf_secret,
                         const SignaturePrivateKey& sig_priv,
                         const std::optional<KeyPackageOpts>& opts)
+{
+  auto executor = SerialExecutor{};
+  return encap(from, context, leaf_secret, sig_priv, opts, executor);
+}
+
+std::tuple<TreeKEMPrivateKey, UpdatePath>
+TreeKEMPublicKey::encap(LeafIndex from,
+                        const bytes& context,
+                        const bytes& leaf_secret,
+                        const SignaturePrivateKey& sig_priv,
+                        const std::optional<KeyPackageOpts>& opts,
+                        Executor& executor)
+{
+  auto prepared = prepare_path(from, leaf_secret, sig_priv, opts);
+  return encap(prepared, context, executor);
+}
+
+PreparedPath
+TreeKEMPublicKey::prepare_path(LeafIndex from,
+                               const bytes& leaf_secret,
+                               const SignaturePrivateKey& sig_priv,
+                               const std::optional<KeyPackageOpts>& opts) const
 {
   // Grab information about the sender
-  auto& maybe_node = node_at(NodeIndex(from)).node;
+  const auto& maybe_node = node_at(from).node;
   if (!maybe_node.has_value()) {
     throw InvalidParameterError("Cannot encap from blank node");
   }
 
-  auto path = UpdatePath{};
-  path.leaf_key_package = std::get<KeyPackage>(maybe_node.value().node);
-
-  // Generate path secrets
-  auto priv = TreeKEMPrivateKey::create(suite, size(), from, leaf_secret);
+  const auto& leaf_kp = std::get<KeyPackage>(maybe_node.value().node);
+  auto prepared = PreparedPath{
+    from,
+    size(),
+    tls::marshal(leaf_kp),
+    TreeKEMPrivateKey::create(suite, size(), from, leaf_secret),
+    UpdatePath{ leaf_kp, {} },
+  };
 
-  // Package into a UpdatePath
-  auto last = NodeIndex(from);
-  for (auto n : tree_math::dirpath(NodeIndex(from), NodeCount(size()))) {
-    auto path_secret = priv.path_secrets.at(n);
+  // Derive the key pair for each node on the direct path.  The private keys
+  // stay cached in the private key, so encap() does not derive them again.
+  auto& priv = prepared.priv;
+  auto dp = tree_math::dirpath(NodeIndex(from), NodeCount(size()));
+  for (auto n : dp) {
     auto node_priv = priv.private_key(n).value();
-    auto node = RatchetNode{ node_priv.public_key, {} };
+    prepared.path.nodes.push_back(RatchetNode{ node_priv.public_key, {} });
+  }
+
+  // The signature covers the parent hashes, which depend only on the public
+  // keys, so it can be computed before the encryptions
+  auto leaf_priv = priv.private_key(NodeIndex(from)).value();
+  prepared.path.sign(suite, leaf_priv.public_key, sig_priv, opts);
+  return prepared;
+}
 
+std::tuple<TreeKEMPrivateKey, UpdatePath>
+TreeKEMPublicKey::encap(const PreparedPath& prepared,
+                        const bytes& context,
+                        Executor& executor)
+{
+  if (!prepared.valid_for(*this)) {
+    throw InvalidParameterError("Prepared path does not fit the tree");
+  }
+
+  // Only const accessors are used until the merge, since the encryptions
+  // below run concurrently
+  const auto& self = std::as_const(*this);
+  const auto& priv = prepared.priv;
+  auto path = prepared.path;
+
+  // Leave a slot for each encrypted path secret
+  auto dp = tree_math::dirpath(NodeIndex(prepared.from), NodeCount(size()));
+  auto resolutions = std::vector<std::vector<NodeIndex>>{};
+  auto last = NodeIndex(prepared.from);
+  for (size_t i = 0; i < dp.size(); i++) {
     auto copath = tree_math::sibling(last, NodeCount(size()));
     auto res = resolve(copath);
-    for (auto nr : res) {
-      const auto& node_pub = node_at(nr).node.value().public_key();
-      auto ct = node_pub.encrypt(suite, context, path_secret);
-      node.node_secrets.push_back(ct);
-    }
 
-    path.nodes.push_back(node);
-    last = n;
+    path.nodes[i].node_secrets.resize(res.size());
+    resolutions.push_back(std::move(res));
+    last = dp[i];
   }
 
-  // Sign the UpdatePath
-  auto leaf_priv = priv.private_key(NodeIndex(from)).value();
-  path.sign(suite, leaf_priv.public_key, sig_priv, opts);
+  // Encrypt each path secret to each node in the corresponding resolution.
+  // Every task fills its own slot, so the result does not depend on how the
+  // executor schedules them.
+  struct Encryption
+  {
+    const bytes& path_secret;
+    NodeIndex recipient;
+    HPKECiphertext& ct;
+  };
+
+  auto encryptions = std::vector<Encryption>{};
+  for (size_t i = 0; i < dp.size(); i++) {
+    const auto& path_secret = priv.path_secrets.at(dp[i]);
+    for (size_t j = 0; j < resolutions[i].size(); j++) {
+      encryptions.push_back(
+        { path_secret, resolutions[i][j], path.nodes[i].node_secrets[j] });
+    }
+  }
+
+  executor.run(encryptions.size(), [&](size_t i) {
+    const auto& enc = encryptions.at(i);
+    const auto& node = self.node_at(enc.recipient).node.value();
+    enc.ct = node.public_key().encrypt(suite, context, enc.path_secret);
+  });
 
   // Update the pubic key itself
-  merge(from, path);
+  merge(prepared.from, path);
   return std::make_tuple(priv, path);
 }
 
+bool
+PreparedPath::valid_for(const TreeKEMPublicKey& pub) const
+{
+  if (pub.size().val != size.val || !(from < pub.size())) {
+    return false;
+  }
+
+  auto kp = pub.key_package(from);
+  return kp.has_value() && tls::marshal(kp.value()) == leaf_key_package;
+}
+
 void
 TreeKEMPublicKey::truncate()
 {
-  while (!nodes.empty() && !nodes.back().node.has_value()) {
+  auto width = nodes.size();
+  while (width > 0 && _blank.at(width - 1)) {
+    width -= 1;
+  }
+
+  resize(NodeCount{ static_cast<uint32_t>(width) });
+}
+
+std::vector<NodeIndex>
+TreeKEMPublicKey::changed_nodes(const TreeKEMPublicKey& other) const
+{
+  auto changed = std::vector<NodeIndex>{};
+  for (auto i = NodeIndex{ 0 }; i.val < nodes.size(); i.val++) {
+    if (i.val >= other.nodes.size()) {
+      changed.push_back(i);
+      continue;
+    }
+
+    const auto& node = nodes[i.val];
+    const auto& other_node = other.nodes[i.val];
+    if (node != other_node && node->node != other_node->node) {
+      changed.push_back(i);
+    }
+  }
+  return changed;
+}
+
+TreeDiff
+TreeKEMPublicKey::diff(const TreeKEMPublicKey& prev) const
+{
+  auto out = TreeDiff{ prev.root_hash(), root_hash(), NodeCount(size()), {} };
+  for (auto n : changed_nodes(prev)) {
+    out.nodes.push_back({ n, node_at(n) });
+  }
+  return out;
+}
+
+void
+TreeKEMPublicKey::apply_diff(const TreeDiff& diff)
+{
+  if (diff.prev_tree_hash != root_hash()) {
+    throw InvalidParameterError("Tree diff does not apply to this tree");
+  }
+
+  // The width is checked before any node is allocated for it.  A tree is
+  // 2n - 1 nodes wide, and it can only grow by the leaves the diff fills in.
+  const auto width = uint64_t(diff.width.val);
+  const auto max_leaves = uint64_t(size().val) + diff.nodes.size();
+  const auto max_width = (max_leaves == 0) ? 0 : 2 * max_leaves - 1;
+  const auto valid_shape = (width == 0) || (width % 2 == 1);
+  if (!valid_shape || width > max_width ||
+      width > DecodeLimits::current().max_tree_nodes) {
+    throw ProtocolError("Tree diff has an invalid width");
+  }
+
+  // Changes are made to a copy, which shares the unchanged nodes
+  auto next = *this;
+  next.resize(diff.width);
+  for (const auto& change : diff.nodes) {
+    if (change.index.val >= diff.width.val) {
+      throw ProtocolError("Tree diff changes a node outside the tree");
+    }
+
+    // Leaves are at even indices and parents at odd ones
+    const auto& node = change.node.node;
+    const auto leaf_index = (change.index.val % 2 == 0);
+    if (node.has_value() &&
+        std::holds_alternative<KeyPackage>(node.value().node) != leaf_index) {
+      throw ProtocolError("Tree diff puts a node of the wrong kind");
+    }
+
+    next.set_node(change.index, change.node);
+  }
+
+  next.set_hash_all();
+  if (next.root_hash() != diff.tree_hash) {
+    throw ProtocolError("Tree diff does not produce the expected tree");
+  }
+
+  *this = std::move(next);
+}
+
+void
+TreeKEMPublicKey::resize(NodeCount width)
+{
+  auto start_size = nodes.size();
+  while (nodes.size() < width.val) {
+    nodes.push_back(std::make_shared<OptionalNode>());
+    _blank.push_back(true);
+  }
+
+  while (nodes.size() > width.val) {
     nodes.pop_back();
+    _blank.pop_back();
+  }
+
+  if (_parent_hashes.verified.size() > nodes.size()) {
+    _parent_hashes.verified.resize(nodes.size());
+  }
+
+  if (_resolutions.entries.size() > nodes.size()) {
+    _resolutions.entries.resize(nodes.size());
+  }
+
+  // Leaves past the new end drop out of the leaf index
+  auto start_leaves = LeafCount(NodeCount(start_size));
+  for (auto i = LeafIndex{ size().val }; i < start_leaves; i.val++) {
+    mark_stale(i);
+  }
+
+  // Changing the width changes the right children of the nodes along the
+  // right edge, so their hashes have to be recomputed
+  if (!nodes.empty() && nodes.size() != start_size) {
+    clear_hash_path(LeafIndex(size().val - 1));
+  }
+}
+
+void
+TreeKEMPublicKey::set_node(NodeIndex index, OptionalNode node)
+{
+  if (index.val % 2 == 0) {
+    mark_stale(LeafIndex(index.val / 2));
+  }
+
+  node.hash.clear();
+  node.encoding.clear();
+  nodes.at(index.val) = std::make_shared<OptionalNode>(std::move(node));
+
+  clear_hash(index);
+  for (auto n : tree_math::dirpath(index, NodeCount(size()))) {
+    clear_hash(n);
   }
 }
 
 void
 TreeKEMPublicKey::clear_hash_all()
 {
-  for (auto& node : nodes) {
-    node.hash.resize(0);
+  for (auto i = NodeIndex{ 0 }; i.val < nodes.size(); i.val++) {
+    clear_hash(i);
   }
 }
 
@@ -589,28 +1201,236 @@ void
 TreeKEMPublicKey::clear_hash_path(LeafIndex index)
 {
   auto dp = tree_math::dirpath(NodeIndex(index), NodeCount(size()));
-  node_at(NodeIndex(index)).hash.resize(0);
+  clear_hash(NodeIndex(index));
   for (auto n : dp) {
-    node_at(n).hash.resize(0);
+    clear_hash(n);
   }
 }
 
-bytes
-TreeKEMPublicKey::get_hash(NodeIndex index) // NOLINT(misc-no-recursion)
+void
+TreeKEMPublicKey::clear_hash(NodeIndex index)
 {
-  if (!node_at(index).hash.empty()) {
-    return node_at(index).hash;
+  // The resolution and blankness of a node change only when its hash does
+  if (index.val < _resolutions.entries.size()) {
+    _resolutions.entries[index.val].reset();
+  }
+  if (index.val < _parent_hashes.verified.size()) {
+    _parent_hashes.verified[index.val] = false;
   }
+  _blank.at(index.val) = std::as_const(*this).node_at(index).blank();
+
+  // Avoid detaching nodes whose hash is already clear.  The node itself is
+  // unchanged, so its encoding is kept.
+  if (!std::as_const(*this).node_at(index).hash.empty()) {
+    detach(index).hash.resize(0);
+  }
+}
 
+// NOLINTNEXTLINE(misc-no-recursion)
+const inline_bytes<max_hash_size>&
+TreeKEMPublicKey::get_hash(NodeIndex index, size_t& count)
+{
+  // An empty hash marks a node whose subtree has changed since it was last
+  // hashed; all other hashes are reused as-is, without detaching the node
+  const auto& cached = std::as_const(*this).node_at(index);
+  if (!cached.hash.empty()) {
+    return cached.hash;
+  }
+
+  auto& node = detach(index);
+  count += 1;
   if (tree_math::level(index) == 0) {
-    node_at(index).set_leaf_hash(suite, index);
-    return node_at(index).hash;
+    const auto timer = Metrics::Timer(Metrics::Event::tree_hash);
+    node.set_leaf_hash(suite, index);
+    return node.hash;
+  }
+
+  // Only this node's own hash is timed, not those of its children
+  const auto& lh = get_hash(tree_math::left(index), count);
+  const auto& rh = get_hash(tree_math::right(index, NodeCount(size())), count);
+  const auto timer = Metrics::Timer(Metrics::Event::tree_hash);
+  node.set_parent_hash(suite, index, lh, rh);
+  return node.hash;
+}
+
+void
+TreeKEMPublicKey::mark_stale(LeafIndex index)
+{
+  // Past one entry per leaf, rebuilding is no more work than catching up
+  auto& cache = _leaf_index;
+  if (cache.rebuild) {
+    return;
+  }
+
+  if (cache.stale.size() >= size().val) {
+    cache.stale.clear();
+    cache.rebuild = true;
+    return;
+  }
+
+  cache.stale.push_back(index);
+}
+
+const TreeKEMPublicKey::LeafIndexTable&
+TreeKEMPublicKey::refresh_leaf_index() const
+{
+  auto& cache = _leaf_index;
+  if (cache.rebuild || !cache.table) {
+    cache.table = std::make_shared<LeafIndexTable>();
+    for (auto i = LeafIndex{ 0 }; i < size(); i.val++) {
+      auto kp = key_package(i);
+      if (kp.has_value()) {
+        cache.table->insert(i, kp.value());
+      }
+    }
+
+    cache.stale.clear();
+    cache.rebuild = false;
+    return *cache.table;
+  }
+
+  if (cache.stale.empty()) {
+    return *cache.table;
+  }
+
+  // Other trees may still be using the shared index
+  if (cache.table.use_count() > 1) {
+    cache.table = std::make_shared<LeafIndexTable>(*cache.table);
+  }
+
+  for (auto leaf : cache.stale) {
+    cache.table->erase(leaf);
+
+    auto kp = std::optional<KeyPackage>{};
+    if (leaf < size()) {
+      kp = key_package(leaf);
+    }
+
+    if (kp.has_value()) {
+      cache.table->insert(leaf, kp.value());
+    }
+  }
+
+  cache.stale.clear();
+  return *cache.table;
+}
+
+OptionalNode&
+TreeKEMPublicKey::node_at(NodeIndex n)
+{
+  // Any change to a leaf may change how it is indexed
+  if (n.val % 2 == 0) {
+    mark_stale(LeafIndex(n.val / 2));
   }
 
-  auto lh = get_hash(tree_math::left(index));
-  auto rh = get_hash(tree_math::right(index, NodeCount(size())));
-  node_at(index).set_parent_hash(suite, index, lh, rh);
-  return node_at(index).hash;
+  // Or how it is encoded
+  auto& node = detach(n);
+  node.encoding.clear();
+  return node;
+}
+
+OptionalNode&
+TreeKEMPublicKey::detach(NodeIndex n)
+{
+  auto& ptr = nodes.at(n.val);
+  if (ptr.use_count() > 1) {
+    ptr = std::make_shared<OptionalNode>(*ptr);
+  }
+
+  return *ptr;
+}
+
+tls::ostream&
+operator<<(tls::ostream& str, const TreeKEMPublicKey& obj)
+{
+  // The layout of a tls::vector<4>.  Hashed nodes are spliced in from their
+  // cached encodings; the others are encoded here.
+  auto fresh = std::vector<bytes>(obj.nodes.size());
+  auto size = size_t(0);
+  for (size_t i = 0; i < obj.nodes.size(); i++) {
+    const auto& node = *obj.nodes.at(i);
+    if (node.encoding.empty()) {
+      fresh.at(i) = tls::marshal(node);
+    }
+    size += node.encoding.empty() ? fresh.at(i).size() : node.encoding.size();
+  }
+
+  if (size > std::numeric_limits<uint32_t>::max()) {
+    throw tls::WriteError("Data too large for header size");
+  }
+
+  str << static_cast<uint32_t>(size);
+  str.reserve(size);
+  for (size_t i = 0; i < obj.nodes.size(); i++) {
+    const auto& node = *obj.nodes.at(i);
+    str.write_raw(node.encoding.empty() ? fresh.at(i) : node.encoding);
+  }
+  return str;
+}
+
+tls::istream&
+operator>>(tls::istream& str, TreeKEMPublicKey& obj)
+{
+  // The layout of a tls::vector<4>, with each node decoded straight into its
+  // shared storage rather than into a temporary vector of nodes
+  auto size = uint32_t(0);
+  str >> size;
+  if (size > str.size()) {
+    throw tls::ReadError("Declared size exceeds available data size");
+  }
+
+  obj.nodes.clear();
+  obj._blank.clear();
+  const auto max_nodes = DecodeLimits::current().max_tree_nodes;
+  auto r = tls::istream(str.read_raw(size), size);
+  while (!r.empty()) {
+    if (obj.nodes.size() == max_nodes) {
+      throw tls::ReadError("Too many tree nodes");
+    }
+
+    auto node = std::make_shared<OptionalNode>();
+    r >> *node;
+    obj._blank.push_back(node->blank());
+    obj.nodes.push_back(std::move(node));
+  }
+
+  obj._leaf_index.stale.clear();
+  obj._leaf_index.rebuild = true;
+  obj._resolutions.entries.clear();
+  obj._parent_hashes.verified.clear();
+  return str;
+}
+
+size_t
+encoded_size(const TreeKEMPublicKey& obj)
+{
+  // The same layout as tls::vector<4>
+  auto size = size_t(4);
+  for (const auto& node : obj.nodes) {
+    size += node->encoding.empty() ? tls::encoded_size(*node)
+                                   : node->encoding.size();
+  }
+  return size;
+}
+
+bool
+operator==(const TreeKEMPublicKey& lhs, const TreeKEMPublicKey& rhs)
+{
+  // Shared nodes are equal without comparing their contents
+  auto node_eq = [](const auto& lhs_node, const auto& rhs_node) {
+    return lhs_node == rhs_node || *lhs_node == *rhs_node;
+  };
+  return std::equal(lhs.nodes.begin(),
+                    lhs.nodes.end(),
+                    rhs.nodes.begin(),
+                    rhs.nodes.end(),
+                    node_eq);
+}
+
+bool
+operator!=(const TreeKEMPublicKey& lhs, const TreeKEMPublicKey& rhs)
+{
+  return !(lhs == rhs);
 }
 
 } // namespace mls
@@ -18,6 +18,37 @@ TEST_CASE("Basic Credential")
   REQUIRE(basic.identity == user_id);
 }
 
+TEST_CASE("Credential Interning")
+{
+  auto suite = CipherSuite{ CipherSuite::ID::P256_AES128GCM_SHA256_P256 };
+  auto user_id = bytes{ 0x04, 0x05, 0x06, 0x07 };
+  auto pub = SignaturePrivateKey::generate(suite).public_key;
+
+  const auto before = Credential::interned_count();
+  {
+    auto cred = Credential::basic(user_id, pub);
+    REQUIRE(Credential::interned_count() == before + 1);
+
+    // Decoded copies share the stored credential
+    auto encoded = tls::marshal(cred);
+    auto decoded_1 = tls::get<Credential>(encoded);
+    auto decoded_2 = tls::get<Credential>(encoded);
+    REQUIRE(decoded_1 == cred);
+    REQUIRE(tls::marshal(decoded_1) == encoded);
+    REQUIRE(&decoded_1.get<BasicCredential>() == &cred.get<BasicCredential>());
+    REQUIRE(&decoded_2.get<BasicCredential>() == &cred.get<BasicCredential>());
+    REQUIRE(Credential::interned_count() == before + 1);
+
+    // A different credential gets its own entry
+    auto other = Credential::basic(bytes{ 0x08 }, pub);
+    REQUIRE(other != cred);
+    REQUIRE(Credential::interned_count() == before + 2);
+  }
+
+  // Entries do not outlive the credentials that use them
+  REQUIRE(Credential::interned_count() == before);
+}
+
 TEST_CASE("X509 Credential Depth 2")
 {
   // Chain is of depth 2
@@ -47,6 +78,46 @@ TEST_CASE("X509 Credential Depth 2")
   CHECK(x509.der_chain == der_in);
 }
 
+TEST_CASE("X509 Credential Verification Cache")
+{
+  // Chain is of depth 2
+  const auto issuing_der = from_hex(
+    "3081e0308193a003020102021043694a3a0ac4d2f55ca765340f5e3893300506032b657030"
+    "00301e170d3230303932333034353632375a170d3230303932343034353632375a3000302a"
+    "300506032b657003210088c425c3ef49b8624f6bbf4332931b87b06f7300845b24049ff1c4"
+    "824353d385a3233021300e0603551d0f0101ff0404030202a4300f0603551d130101ff0405"
+    "30030101ff300506032b6570034100898a5cd71e8236ecfb8abc32d45b4aed3a9daff2c290"
+    "cfc8f23546cbf83b87f455ce8ba5e8ddbc4f3b18cde351bcca2f73417e2a0e6c8ca9d723ab"
+    "eb0bd9fb06");
+  const auto leaf_der =
+    from_hex("3081de308191a0030201020211008ab6ec20f45f128ecf9e05d912b5296d30050"
+             "6032b65703000301e170d3230303932333034353632375a170d32303039323430"
+             "34353632375a3000302a300506032b6570032100fa09d9259d7402e96146229a0"
+             "acbba85fd3f9d025981bce36a2e8d0e7d2302bba320301e300e0603551d0f0101"
+             "ff0404030202a4300c0603551d130101ff04023000300506032b6570034100305"
+             "a1a8c9a1eb85eaf36326ce66aab57bfe62713d2387e00f6af91fe86dffa6fefda"
+             "89868e0c280163e33876260a5e8524c39ee592427cad3e99a5539ceae903");
+
+  const auto der_in =
+    std::vector<X509Credential::CertData>{ { leaf_der }, { issuing_der } };
+
+  auto first = X509Credential(der_in);
+  const auto cached = X509Credential::cached_chain_count();
+  REQUIRE(cached > 0);
+
+  // A repeated chain is served from the cache
+  auto second = X509Credential(der_in);
+  REQUIRE(X509Credential::cached_chain_count() == cached);
+  REQUIRE(second.public_key() == first.public_key());
+
+  // Failed verifications are not cached
+  const auto reversed =
+    std::vector<X509Credential::CertData>{ { issuing_der }, { leaf_der } };
+  REQUIRE_THROWS(X509Credential(reversed));
+  REQUIRE_THROWS(X509Credential(reversed));
+  REQUIRE(X509Credential::cached_chain_count() == cached);
+}
+
 TEST_CASE("X509 Credential Depth 2 Marshal/Unmarshal")
 {
   // Chain is of depth 2
@@ -109,3 +109,97 @@ TEST_CASE("Signature Key Serializion")
     REQUIRE(gX2 == gX);
   }
 }
+
+TEST_CASE("Parsed Key Cache")
+{
+  const auto message = from_hex("01020304");
+  const auto aad = from_hex("05060708");
+
+  REQUIRE_FALSE(parsed_key_cache_enabled());
+  enable_parsed_key_cache(true);
+
+  for (auto suite_id : all_supported_suites) {
+    auto suite = CipherSuite{ suite_id };
+
+    // Copies share the parsed key and remain usable
+    auto a = SignaturePrivateKey::generate(suite);
+    auto a_copy = a;
+    auto sig = a_copy.sign(suite, message);
+    REQUIRE(a.public_key.verify(suite, message, sig));
+
+    // Replacing the key data invalidates the parsed key
+    auto b = SignaturePrivateKey::generate(suite);
+    auto cached_pub = a.public_key;
+    REQUIRE(cached_pub.verify(suite, message, sig));
+    cached_pub.data = b.public_key.data;
+    REQUIRE_FALSE(cached_pub.verify(suite, message, sig));
+    REQUIRE(cached_pub.verify(suite, message, b.sign(suite, message)));
+
+    auto x = HPKEPrivateKey::generate(suite);
+    auto y = HPKEPrivateKey::generate(suite);
+    auto pub = x.public_key;
+    auto ct = pub.encrypt(suite, aad, message);
+    REQUIRE(x.decrypt(suite, aad, ct) == message);
+
+    pub.data = y.public_key.data;
+    auto ct_y = pub.encrypt(suite, aad, message);
+    REQUIRE(y.decrypt(suite, aad, ct_y) == message);
+  }
+
+  // With the cache disabled, keys are parsed on each use
+  enable_parsed_key_cache(false);
+  for (auto suite_id : all_supported_suites) {
+    auto suite = CipherSuite{ suite_id };
+    auto a = SignaturePrivateKey::generate(suite);
+    auto b = SignaturePrivateKey::generate(suite);
+    auto pub = a.public_key;
+    REQUIRE(pub.verify(suite, message, a.sign(suite, message)));
+    pub.data = b.public_key.data;
+    REQUIRE(pub.verify(suite, message, b.sign(suite, message)));
+  }
+}
+
+TEST_CASE("Cipher Suite Traits")
+{
+  for (auto suite_id : all_supported_suites) {
+    auto suite = CipherSuite{ suite_id };
+    const auto& ciphers = suite.get();
+
+    REQUIRE(suite.secret_size() == ciphers.digest.hash_size());
+    REQUIRE(suite.secret_size() == ciphers.hpke.kdf.hash_size());
+    REQUIRE(suite.secret_size() <= max_hash_size);
+    REQUIRE(suite.key_size() == ciphers.hpke.aead.key_size());
+    REQUIRE(suite.nonce_size() == ciphers.hpke.aead.nonce_size());
+    REQUIRE(suite.tag_size() == ciphers.hpke.aead.tag_size());
+
+    auto dispatched_id =
+      suite.dispatch([](auto traits) { return decltype(traits)::id; });
+    REQUIRE(dispatched_id == suite_id);
+  }
+
+  REQUIRE_THROWS_AS(CipherSuite{ CipherSuite::ID::unknown }.tag_size(),
+                    InvalidParameterError);
+}
+
+TEST_CASE("Inline Bytes")
+{
+  const auto data = from_hex("00010203040506070809");
+  const auto small = inline_bytes<max_hash_size>(data);
+  REQUIRE(small.size() == data.size());
+  REQUIRE(small == data);
+  REQUIRE(bytes(small) == data);
+
+  auto copy = small;
+  REQUIRE(copy == small);
+
+  copy.resize(4);
+  REQUIRE(copy == from_hex("00010203"));
+  copy.resize(6);
+  REQUIRE(copy == from_hex("000102030000"));
+  REQUIRE(copy != small);
+
+  copy.clear();
+  REQUIRE(copy.empty());
+
+  REQUIRE_THROWS_AS(inline_bytes<4>(data), std::length_error);
+}
@@ -0,0 +1,78 @@
+#include <doctest/doctest.h>
+#include <mls/executor.h>
+
+#include <atomic>
+#include <stdexcept>
+
+using namespace mls;
+
+static void
+check_executor(Executor& executor)
+{
+  const auto count = size_t(1000);
+
+  // Every task runs exactly once
+  auto results = std::vector<size_t>(count, 0);
+  executor.run(count, [&](size_t i) { results.at(i) += i + 1; });
+  for (size_t i = 0; i < count; i++) {
+    REQUIRE(results.at(i) == i + 1);
+  }
+
+  // Empty batches are allowed
+  executor.run(0, [](size_t /* unused */) {
+    throw std::runtime_error("Should not run");
+  });
+
+  // Errors are reported to the caller
+  auto completed = std::atomic<size_t>(0);
+  REQUIRE_THROWS_AS(executor.run(count,
+                                 [&](size_t i) {
+                                   if (i == count / 2) {
+                                     throw std::runtime_error("Task failed");
+                                   }
+                                   completed += 1;
+                                 }),
+                    std::runtime_error);
+  REQUIRE(completed > 0);
+}
+
+TEST_CASE("Serial Executor")
+{
+  auto executor = SerialExecutor{};
+  check_executor(executor);
+}
+
+TEST_CASE("Thread Pool")
+{
+  auto pool = ThreadPool{ 4 };
+  REQUIRE(pool.size() == 4);
+  check_executor(pool);
+
+  // A pool can be reused
+  check_executor(pool);
+}
+
+TEST_CASE("Strand")
+{
+  const auto count = size_t(1000);
+  auto pool = ThreadPool{ 4 };
+
+  // Each strand runs its jobs in order, while sharing the pool
+  auto first = std::vector<size_t>{};
+  auto second = std::vector<size_t>{};
+  {
+    auto first_strand = Strand{ pool };
+    auto second_strand = Strand{ pool };
+    for (size_t i = 0; i < count; i++) {
+      first_strand.post([&first, i]() { first.push_back(i); });
+      second_strand.post([&second, i]() { second.push_back(i); });
+    }
+  }
+
+  REQUIRE(first.size() == count);
+  REQUIRE(second.size() == count);
+  for (size_t i = 0; i < count; i++) {
+    REQUIRE(first.at(i) == i);
+    REQUIRE(second.at(i) == i);
+  }
+}
@@ -46,16 +46,16 @@ TEST_CASE("Key Schedule Interop")
       REQUIRE(my_epoch.epoch_secret == epoch.epoch_secret);
       REQUIRE(my_epoch.sender_data_secret == epoch.sender_data_secret);
       REQUIRE(my_epoch.encryption_secret == epoch.encryption_secret);
-      REQUIRE(my_epoch.exporter_secret == epoch.exporter_secret);
-      REQUIRE(my_epoch.authentication_secret == epoch.authentication_secret);
-      REQUIRE(my_epoch.external_secret == epoch.external_secret);
+      REQUIRE(my_epoch.exporter_secret() == epoch.exporter_secret);
+      REQUIRE(my_epoch.authentication_secret() == epoch.authentication_secret);
+      REQUIRE(my_epoch.external_secret() == epoch.external_secret);
       REQUIRE(my_epoch.confirmation_key == epoch.confirmation_key);
       REQUIRE(my_epoch.membership_key == epoch.membership_key);
-      REQUIRE(my_epoch.resumption_secret == epoch.resumption_secret);
+      REQUIRE(my_epoch.resumption_secret() == epoch.resumption_secret);
       REQUIRE(my_epoch.init_secret == epoch.init_secret);
 
       // Check the derived keys
-      REQUIRE(my_epoch.external_priv.public_key == epoch.external_pub);
+      REQUIRE(my_epoch.external_priv().public_key == epoch.external_pub);
 
       static const auto key_type_hs = GroupKeySource::RatchetType::handshake;
       static const auto key_type_app = GroupKeySource::RatchetType::application;
@@ -78,3 +78,239 @@ TEST_CASE("Key Schedule Interop")
     }
   }
 }
+
+TEST_CASE("Sparse Secret Tree")
+{
+  const auto suite =
+    CipherSuite{ CipherSuite::ID::X25519_AES128GCM_SHA256_Ed25519 };
+  const auto group_size = LeafCount{ 1000 };
+  const auto secret_size = suite.get().hpke.kdf.hash_size();
+  const auto encryption_secret = random_bytes(secret_size);
+
+  // Only the root is stored up front
+  auto tree = SecretTree{ suite, group_size, encryption_secret };
+  auto initial = tree.retained_bytes();
+  REQUIRE(initial < 2 * secret_size + 128);
+
+  // Deriving a leaf secret leaves only the copath frontier behind
+  const auto senders = std::vector<LeafIndex>{
+    LeafIndex{ 0 }, LeafIndex{ 999 }, LeafIndex{ 500 }, LeafIndex{ 1 }
+  };
+  auto secrets = std::vector<bytes>{};
+  for (const auto& sender : senders) {
+    secrets.push_back(tree.get(sender));
+  }
+  REQUIRE(tree.retained_bytes() < NodeCount{ group_size }.val * sizeof(bytes));
+
+  // The order in which secrets are derived does not matter
+  auto reversed = SecretTree{ suite, group_size, encryption_secret };
+  for (size_t i = senders.size(); i > 0; i--) {
+    REQUIRE(reversed.get(senders[i - 1]) == secrets[i - 1]);
+  }
+
+  // Consumed secrets are gone
+  REQUIRE_THROWS_AS(tree.get(LeafIndex{ 0 }), InvalidParameterError);
+}
+
+TEST_CASE("Hash Ratchet Window")
+{
+  const auto suite =
+    CipherSuite{ CipherSuite::ID::X25519_AES128GCM_SHA256_Ed25519 };
+  const auto secret = random_bytes(suite.get().hpke.kdf.hash_size());
+  const auto node = NodeIndex{ LeafIndex{ 0 } };
+  const auto policy = RatchetPolicy{ 4 };
+
+  auto reference = HashRatchet{ suite, node, secret };
+  auto ratchet = HashRatchet{ suite, node, secret, policy };
+
+  // Keys within the window are retained, and match an unbounded ratchet
+  const auto last = uint32_t(10);
+  REQUIRE(ratchet.get(last).key == reference.get(last).key);
+  for (auto gen = last - policy.window + 1; gen <= last; gen++) {
+    REQUIRE(ratchet.get(gen).nonce == reference.get(gen).nonce);
+  }
+  REQUIRE(ratchet.cache.size() == policy.window);
+
+  // Older keys have been overwritten
+  REQUIRE_THROWS_AS(ratchet.get(last - policy.window), ProtocolError);
+
+  // Erased keys are gone, and their slot is reused by later generations
+  ratchet.erase(last);
+  REQUIRE_THROWS_AS(ratchet.get(last), ProtocolError);
+  REQUIRE(ratchet.get(last + policy.window).key ==
+          reference.get(last + policy.window).key);
+  REQUIRE(ratchet.cache.size() == policy.window);
+
+  REQUIRE_THROWS_AS(HashRatchet(suite, node, secret, RatchetPolicy{ 0 }),
+                    InvalidParameterError);
+}
+
+TEST_CASE("Hash Ratchet Skip-Ahead and Precompute")
+{
+  const auto suite =
+    CipherSuite{ CipherSuite::ID::X25519_AES128GCM_SHA256_Ed25519 };
+  const auto secret = random_bytes(suite.get().hpke.kdf.hash_size());
+  const auto node = NodeIndex{ LeafIndex{ 0 } };
+  const auto policy = RatchetPolicy{ 16, 8, 4 };
+
+  auto reference = HashRatchet{ suite, node, secret };
+
+  SUBCASE("Bounded skip-ahead")
+  {
+    auto ratchet = HashRatchet{ suite, node, secret, policy };
+    REQUIRE(ratchet.get(policy.max_forward).key ==
+            reference.get(policy.max_forward).key);
+    REQUIRE(ratchet.stats().keys_skipped == policy.max_forward);
+
+    // Jumping further than the limit derives nothing
+    auto too_far = ratchet.next_generation + policy.max_forward + 1;
+    REQUIRE_THROWS_AS(ratchet.get(too_far), ProtocolError);
+    REQUIRE(ratchet.next_generation == policy.max_forward + 1);
+
+    // Precomputed keys are served without further skipping
+    ratchet.precompute();
+    REQUIRE(ratchet.stats().keys_cached ==
+            policy.max_forward + 1 + policy.precompute);
+    REQUIRE(ratchet.get(policy.max_forward + 2).key ==
+            reference.get(policy.max_forward + 2).key);
+    REQUIRE(ratchet.stats().keys_skipped == policy.max_forward);
+  }
+
+  SUBCASE("Precomputed keys are handed out in order")
+  {
+    auto ratchet = HashRatchet{ suite, node, secret, policy };
+    ratchet.precompute();
+    REQUIRE(ratchet.next_generation == policy.precompute);
+
+    for (uint32_t i = 0; i < policy.precompute + 2; i++) {
+      auto [generation, key_nonce] = ratchet.next();
+      REQUIRE(generation == i);
+      REQUIRE(key_nonce.key == reference.get(i).key);
+    }
+  }
+
+  SUBCASE("Precompute for all active senders")
+  {
+    auto keys = GroupKeySource{ suite, LeafCount{ 4 }, secret };
+    keys.policy(policy);
+
+    const auto app = GroupKeySource::RatchetType::application;
+    keys.get(app, LeafIndex{ 1 }, 0);
+    REQUIRE(keys.stats().keys_cached == 1);
+
+    auto pool = ThreadPool{ 2 };
+    keys.precompute(pool);
+    REQUIRE(keys.stats().keys_cached == 1 + 2 * policy.precompute);
+    REQUIRE(keys.stats().keys_skipped == 0);
+  }
+
+  REQUIRE_THROWS_AS(HashRatchet(suite, node, secret, RatchetPolicy{ 4, 8, 4 }),
+                    InvalidParameterError);
+}
+
+TEST_CASE("Lazy Epoch Secrets")
+{
+  const auto suite = CipherSuite{ CipherSuite::ID::P256_AES128GCM_SHA256_P256 };
+  const auto epoch = KeyScheduleEpoch{ suite };
+  const auto base_size = epoch.retained_bytes();
+
+  // Nothing is derived until it is used
+  auto copy = epoch;
+  REQUIRE(copy.retained_bytes() == base_size);
+
+  const auto& external_priv = epoch.external_priv();
+  REQUIRE(epoch.retained_bytes() > base_size);
+  REQUIRE(external_priv.data ==
+          HPKEPrivateKey::derive(suite, epoch.external_secret()).data);
+  REQUIRE(epoch.exporter_secret() ==
+          suite.derive_secret(epoch.epoch_secret, "exporter"));
+
+  // An independent copy derives the same values, and later copies keep them
+  REQUIRE(copy.exporter_secret() == epoch.exporter_secret());
+  REQUIRE(copy.external_priv().public_key == external_priv.public_key);
+
+  auto later = epoch;
+  REQUIRE(later.retained_bytes() == epoch.retained_bytes());
+  REQUIRE(later == epoch);
+}
+
+TEST_CASE("Cached Exports")
+{
+  const auto suite = CipherSuite{ CipherSuite::ID::P256_AES128GCM_SHA256_P256 };
+  const auto epoch = KeyScheduleEpoch{ suite };
+  const auto context = bytes{ 0, 1, 2, 3 };
+  const auto size = size_t(16);
+
+  auto expected = [&](const std::string& label) {
+    auto secret = suite.derive_secret(epoch.exporter_secret(), label);
+    auto context_hash = suite.get().digest.hash(context);
+    return suite.expand_with_label(secret, "exporter", context_hash, size);
+  };
+
+  // A bulk export gives the same values as single ones, and caches them
+  const auto labels = std::vector<std::string>{ "EXTRACTOR-dtls_srtp", "a" };
+  const auto base_size = epoch.retained_bytes();
+  const auto bulk = epoch.do_export(labels, context, size);
+  REQUIRE(bulk.size() == labels.size());
+  REQUIRE(epoch.retained_bytes() > base_size);
+  for (size_t i = 0; i < labels.size(); i++) {
+    REQUIRE(bulk.at(i) == expected(labels.at(i)));
+    REQUIRE(epoch.do_export(labels.at(i), context, size) == bulk.at(i));
+  }
+
+  // The context and size are part of the key
+  REQUIRE(epoch.do_export(labels.at(0), {}, size) != bulk.at(0));
+  REQUIRE(epoch.do_export(labels.at(0), context, 32).size() == 32);
+
+  // Concurrent callers all see the same value
+  auto pool = ThreadPool{ 4 };
+  auto results = std::vector<bytes>(16);
+  pool.run(results.size(), [&](size_t i) {
+    results.at(i) = epoch.do_export("concurrent", context, size);
+  });
+  for (const auto& result : results) {
+    REQUIRE(result == expected("concurrent"));
+  }
+
+  // The next epoch starts with nothing exported
+  const auto next = epoch.next({}, {}, {}, LeafCount{ 2 });
+  REQUIRE(next.do_export(labels.at(0), context, size) != bulk.at(0));
+}
+
+TEST_CASE("Prewarmed Ratchets")
+{
+  const auto suite = CipherSuite{ CipherSuite::ID::P256_AES128GCM_SHA256_P256 };
+  const auto size = LeafCount{ 13 };
+  const auto secret = bytes(suite.secret_size(), 0xa0);
+  const auto app = GroupKeySource::RatchetType::application;
+  const auto handshake = GroupKeySource::RatchetType::handshake;
+  auto pool = ThreadPool{ 4 };
+
+  auto reference = GroupKeySource(suite, size, secret);
+  auto check = [&](GroupKeySource& keys) {
+    for (uint32_t i = 0; i < size.val; i++) {
+      auto sender = LeafIndex{ i };
+      REQUIRE(keys.get(app, sender, 0).key ==
+              reference.get(app, sender, 0).key);
+      REQUIRE(keys.get(handshake, sender, 1).key ==
+              reference.get(handshake, sender, 1).key);
+    }
+  };
+
+  // Every leaf, after one sender's ratchets were created on first use
+  auto all = GroupKeySource(suite, size, secret);
+  all.next(app, LeafIndex{ 3 });
+  all.prewarm_all(pool);
+  REQUIRE(all.active_senders() == std::vector<LeafIndex>{ LeafIndex{ 3 } });
+  check(all);
+
+  // Chosen senders, ignoring repeats and leaves outside the tree
+  auto some = GroupKeySource(suite, size, secret);
+  const auto senders = std::vector<LeafIndex>{
+    LeafIndex{ 5 }, LeafIndex{ 1 }, LeafIndex{ 5 }, LeafIndex{ 40 }
+  };
+  some.prewarm(senders, pool);
+  REQUIRE(some.active_senders().empty());
+  check(some);
+  REQUIRE(some.active_senders().size() == size.val);
+}
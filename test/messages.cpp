@@ -1,6 +1,9 @@
 #include "test_vectors.h"
 #include <doctest/doctest.h>
+#include <hpke/random.h>
+#include <mls/compression.h>
 #include <mls/messages.h>
+#include <mls/state.h>
 #include <tls/tls_syntax.h>
 
 using namespace mls;
@@ -13,6 +16,7 @@ tls_round_trip(const bytes& vector,
                Tp... args)
 {
   auto marshaled = tls::marshal(constructed);
+  REQUIRE(tls::encoded_size(constructed) == marshaled.size());
   if (reproducible) {
     REQUIRE(vector == marshaled);
   }
@@ -98,7 +102,7 @@ TEST_CASE("Messages Interop")
     group_info.signature = tv.random;
     tls_round_trip(tc.group_info, group_info, true, tc.cipher_suite);
 
-    auto group_secrets = GroupSecrets{ tv.random, std::nullopt };
+    auto group_secrets = GroupSecrets{ tv.random, std::nullopt, {} };
     tls_round_trip(tc.group_secrets, group_secrets, true);
 
     auto encrypted_group_secrets =
@@ -161,3 +165,294 @@ TEST_CASE("Messages Interop")
     tls_round_trip(tc.ciphertext, ciphertext, true);
   }
 }
+
+TEST_CASE("Key Package Memoized Hash")
+{
+  const auto suite = CipherSuite{ CipherSuite::ID::P256_AES128GCM_SHA256_P256 };
+  auto sig_priv = SignaturePrivateKey::generate(suite);
+  auto init_priv = HPKEPrivateKey::generate(suite);
+  auto cred = Credential::basic({ 0, 1, 2, 3 }, sig_priv.public_key);
+  auto kp = KeyPackage{ suite, init_priv.public_key, cred, sig_priv, {} };
+
+  // Results are the same when computed and when remembered, including in
+  // copies
+  const auto hash = suite.get().digest.hash(tls::marshal(kp));
+  REQUIRE(kp.hash() == hash);
+  REQUIRE(kp.hash() == hash);
+  REQUIRE(kp.verify());
+  REQUIRE(kp.verify());
+
+  const auto copy = kp;
+  REQUIRE(copy.hash() == hash);
+  REQUIRE(copy.verify());
+
+  // A change to any field is seen
+  kp.init_key = HPKEPrivateKey::generate(suite).public_key;
+  REQUIRE(kp.hash() != hash);
+  REQUIRE(kp.hash() == suite.get().digest.hash(tls::marshal(kp)));
+  REQUIRE_FALSE(kp.verify());
+
+  kp.sign(sig_priv, std::nullopt);
+  REQUIRE(kp.verify());
+
+  kp.signature.back() ^= 0x01;
+  REQUIRE_FALSE(kp.verify());
+
+  kp.signature.back() ^= 0x01;
+  REQUIRE(kp.verify());
+  kp.credential = Credential::basic({ 4, 5, 6, 7 }, sig_priv.public_key);
+  REQUIRE_FALSE(kp.verify());
+
+  // The copy is unaffected
+  REQUIRE(copy.hash() == hash);
+  REQUIRE(copy.verify());
+}
+
+TEST_CASE("Peek Message Header")
+{
+  const auto group_id = bytes{ 0, 1, 2, 3 };
+  const auto epoch = epoch_t(0x0102030405060708);
+  const auto sender = Sender{ SenderType::member, 5 };
+
+  auto pt = MLSPlaintext{ group_id, epoch, sender, ApplicationData{} };
+  pt.authenticated_data = bytes(300, 0xa0);
+  pt.signature = { 4, 5, 6 };
+  auto pt_data = tls::marshal(pt);
+
+  auto pt_header = peek_plaintext_header(pt_data);
+  REQUIRE(pt_header.group_id == group_id);
+  REQUIRE(pt_header.epoch == epoch);
+  REQUIRE(pt_header.content_type == ContentType::selector::application);
+  REQUIRE(peek_group_id(pt_data) == group_id);
+
+  auto ct = MLSCiphertext{
+    group_id, epoch, ContentType::selector::commit, { 1 }, { 2 }, { 3 },
+  };
+  auto ct_data = tls::marshal(ct);
+
+  auto ct_header = peek_header(ct_data);
+  REQUIRE(ct_header.group_id == group_id);
+  REQUIRE(ct_header.epoch == epoch);
+  REQUIRE(ct_header.content_type == ContentType::selector::commit);
+  REQUIRE(peek_group_id(ct_data) == group_id);
+
+  // Only the header needs to be present
+  auto truncated = bytes(ct_data.begin(), ct_data.begin() + 14);
+  REQUIRE(peek_header(truncated).epoch == epoch);
+  truncated.pop_back();
+  REQUIRE_THROWS(peek_header(truncated));
+}
+
+TEST_CASE("Sign with an Encoded Group Context")
+{
+  const auto suite = CipherSuite{ CipherSuite::ID::P256_AES128GCM_SHA256_P256 };
+  const auto priv = SignaturePrivateKey::generate(suite);
+  const auto mac_key = bytes(32, 0xa0);
+
+  const auto context = GroupContext{ { 0, 1, 2, 3 }, 7, { 4 }, { 5 }, {} };
+  const auto epoch = EpochEncodings{ context };
+  REQUIRE(epoch.encoded_context == tls::marshal(context));
+  REQUIRE(epoch.aad_prefix == from_hex("0400010203"
+                                       "0000000000000007"));
+
+  auto pt = MLSPlaintext{ context.group_id,
+                          context.epoch,
+                          { SenderType::member, 1 },
+                          ApplicationData{ { 8, 9 } } };
+  pt.sign(suite, epoch.encoded_context, priv);
+  pt.set_membership_tag(suite, epoch.encoded_context, mac_key);
+
+  // Each is the same as with the GroupContext itself
+  REQUIRE(pt.verify(suite, context, priv.public_key));
+  REQUIRE(pt.verify_membership_tag(suite, context, mac_key));
+
+  auto w = tls::ostream{};
+  pt.write_to_be_signed(w, epoch.encoded_context);
+  REQUIRE(w.take() == pt.to_be_signed(context));
+}
+
+TEST_CASE("Welcome Decryption in Place")
+{
+  const auto suite = CipherSuite{ CipherSuite::ID::P256_AES128GCM_SHA256_P256 };
+  const auto joiner_secret = bytes(32, 0xa0);
+
+  auto tree = TreeKEMPublicKey{ suite };
+  for (int i = 0; i < 3; i++) {
+    auto sig_priv = SignaturePrivateKey::generate(suite);
+    auto init_priv = HPKEPrivateKey::generate(suite);
+    auto cred = Credential::basic({ 0, 1, 2, 3 }, sig_priv.public_key);
+    tree.add_leaf(
+      { suite, init_priv.public_key, cred, sig_priv, std::nullopt });
+  }
+
+  auto group_info =
+    GroupInfo{ { 0, 1, 2, 3 }, 7, tree, { 4 }, { 5 }, {}, { 6 } };
+  const auto welcome = Welcome{ suite, joiner_secret, {}, group_info };
+
+  // Decrypting a Welcome that is no longer needed gives the same GroupInfo,
+  // and leaves no copy of it behind
+  auto consumed = welcome;
+  auto decrypted = std::move(consumed).decrypt(joiner_secret, {});
+  REQUIRE(decrypted == welcome.decrypt(joiner_secret, {}));
+  REQUIRE(decrypted.tree == tree);
+  // NOLINTNEXTLINE(bugprone-use-after-move,hicpp-invalid-access-moved)
+  REQUIRE(consumed.encrypted_group_info.empty());
+
+  auto wrong_key = welcome;
+  REQUIRE_THROWS_AS(std::move(wrong_key).decrypt(bytes(32, 0xb0), {}),
+                    ProtocolError);
+}
+
+TEST_CASE("Compression")
+{
+  const auto limit = size_t(1) << 20;
+  const auto repeated =
+    from_hex("0001000201ff0002000d0c000100020003000400050006");
+  auto inputs = std::vector<bytes>{ {}, { 0x42 }, bytes(1000, 0), repeated };
+  inputs.push_back(random_bytes(1000));
+
+  auto doubled = inputs.back();
+  doubled.insert(doubled.end(), inputs.back().begin(), inputs.back().end());
+  inputs.push_back(doubled);
+
+  for (const auto& data : inputs) {
+    for (auto alg :
+         { CompressionAlgorithm::none, CompressionAlgorithm::mls_lz }) {
+      auto compressed = compress(alg, data);
+      REQUIRE(decompress(alg, compressed, limit) == data);
+    }
+  }
+
+  // Repetition, including of the preset dictionary, is found
+  REQUIRE(compress(CompressionAlgorithm::mls_lz, bytes(1000, 0)).size() < 20);
+  REQUIRE(compress(CompressionAlgorithm::mls_lz, repeated).size() < 16);
+  REQUIRE(compress(CompressionAlgorithm::mls_lz, doubled).size() < 1020);
+
+  // Malformed or oversized data is rejected
+  auto compressed = compress(CompressionAlgorithm::mls_lz, bytes(1000, 0));
+  REQUIRE_THROWS_AS(decompress(CompressionAlgorithm::mls_lz, compressed, 999),
+                    ProtocolError);
+
+  auto truncated = bytes(compressed.begin(), compressed.end() - 1);
+  REQUIRE_THROWS_AS(decompress(CompressionAlgorithm::mls_lz, truncated, limit),
+                    ProtocolError);
+
+  auto bad_size = compressed;
+  bad_size.at(3) ^= 0x01;
+  REQUIRE_THROWS_AS(decompress(CompressionAlgorithm::mls_lz, bad_size, limit),
+                    ProtocolError);
+
+  // A size that the input could not produce is rejected even without a limit
+  auto huge = compressed;
+  huge.at(0) = 0xff;
+  REQUIRE_THROWS_AS(
+    decompress(CompressionAlgorithm::mls_lz, huge, DecodeLimits::unlimited),
+    ProtocolError);
+}
+
+TEST_CASE("Welcome Secret Lookup")
+{
+  const auto suite = CipherSuite{ CipherSuite::ID::P256_AES128GCM_SHA256_P256 };
+
+  auto kps = std::vector<KeyPackage>{};
+  for (int i = 0; i < 20; i++) {
+    auto sig_priv = SignaturePrivateKey::generate(suite);
+    auto init_priv = HPKEPrivateKey::generate(suite);
+    auto cred = Credential::basic({ 0, 1, 2, 3 }, sig_priv.public_key);
+    kps.emplace_back(
+      suite, init_priv.public_key, cred, sig_priv, std::nullopt);
+  }
+
+  auto welcome = Welcome{};
+  for (size_t i = 0; i < 10; i++) {
+    welcome.secrets.push_back({ kps[i].hash(), {} });
+  }
+
+  for (size_t i = 0; i < 10; i++) {
+    REQUIRE(welcome.find(kps[i]) == static_cast<int>(i));
+  }
+  REQUIRE_FALSE(welcome.find(kps[10]).has_value());
+
+  // Secrets appended after a lookup are found, as are those in a copy
+  for (size_t i = 10; i < 20; i++) {
+    welcome.secrets.push_back({ kps[i].hash(), {} });
+  }
+
+  const auto copy = welcome;
+  for (size_t i = 0; i < 20; i++) {
+    REQUIRE(welcome.find(kps[i]) == static_cast<int>(i));
+    REQUIRE(copy.find(kps[i]) == static_cast<int>(i));
+  }
+
+  // Secrets edited in place are still found at their new positions
+  std::swap(welcome.secrets[3], welcome.secrets[17]);
+  REQUIRE(welcome.find(kps[3]) == 17);
+  REQUIRE(welcome.find(kps[17]) == 3);
+
+  welcome.secrets.resize(5);
+  REQUIRE(welcome.find(kps[4]) == 4);
+  REQUIRE_FALSE(welcome.find(kps[12]).has_value());
+}
+
+TEST_CASE("Decode Limits")
+{
+  const auto suite = CipherSuite{ CipherSuite::ID::P256_AES128GCM_SHA256_P256 };
+
+  auto tree = TreeKEMPublicKey{ suite };
+  auto kps = std::vector<KeyPackage>{};
+  for (int i = 0; i < 3; i++) {
+    auto sig_priv = SignaturePrivateKey::generate(suite);
+    auto init_priv = HPKEPrivateKey::generate(suite);
+    auto cred = Credential::basic(bytes(100, 0xa0), sig_priv.public_key);
+    kps.emplace_back(
+      suite, init_priv.public_key, cred, sig_priv, std::nullopt);
+    tree.add_leaf(kps.back());
+  }
+
+  auto commit = Commit{};
+  for (uint8_t i = 0; i < 3; i++) {
+    commit.proposals.push_back({ { i } });
+  }
+  const auto pt = MLSPlaintext{ { 0, 1, 2, 3 }, 1, { SenderType::member, 0 },
+                                commit };
+  const auto pt_data = tls::marshal(pt);
+  const auto tree_data = tls::marshal(tree);
+  const auto kp_data = tls::marshal(kps[0]);
+
+  // Within the limits, messages decode as usual
+  auto limits = DecodeLimits{};
+  limits.max_message_size = std::max(pt_data.size(), tree_data.size());
+  limits.max_proposals = 3;
+  limits.max_tree_nodes = NodeCount(tree.size()).val;
+  limits.max_credential_size = 200;
+  REQUIRE(decode<MLSPlaintext>(pt_data, limits) == pt);
+  REQUIRE(decode<TreeKEMPublicKey>(tree_data, limits, suite) == tree);
+  REQUIRE(decode<KeyPackage>(kp_data, limits) == kps[0]);
+
+  // Beyond them, they are rejected
+  auto small = limits;
+  small.max_message_size = pt_data.size() - 1;
+  REQUIRE_THROWS_AS(decode<MLSPlaintext>(pt_data, small), tls::ReadError);
+
+  small = limits;
+  small.max_proposals = 2;
+  REQUIRE_THROWS_AS(decode<MLSPlaintext>(pt_data, small), tls::ReadError);
+
+  small = limits;
+  small.max_tree_nodes = NodeCount(tree.size()).val - 1;
+  REQUIRE_THROWS_AS(decode<TreeKEMPublicKey>(tree_data, small, suite),
+                    tls::ReadError);
+
+  small = limits;
+  small.max_credential_size = 100;
+  REQUIRE_THROWS_AS(decode<KeyPackage>(kp_data, small), tls::ReadError);
+
+  // The limits only apply within their scope
+  REQUIRE(tls::get<MLSPlaintext>(pt_data) == pt);
+  {
+    const auto scope = DecodeLimits::Scope(small);
+    REQUIRE(&DecodeLimits::current() == &small);
+  }
+  REQUIRE(DecodeLimits::current().max_credential_size ==
+          DecodeLimits::unlimited);
+}
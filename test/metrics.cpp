@@ -0,0 +1,93 @@
+#include "synthetic_group.h"
+#include <doctest/doctest.h>
+#include <hpke/random.h>
+#include <mls/metrics.h>
+#include <mls/state.h>
+
+using namespace mls;
+
+using Operation = Metrics::Operation;
+using Event = Metrics::Event;
+
+class MetricsTest
+{
+public:
+  MetricsTest()
+  {
+    auto opts = SyntheticGroup::Options{};
+    opts.suite = suite;
+    opts.size = 4;
+
+    auto group = SyntheticGroup::build(opts);
+    alice = group.state(0);
+    bob = group.state(1);
+
+    Metrics::set_sink(&counters);
+  }
+
+  ~MetricsTest() { Metrics::set_sink(nullptr); }
+
+protected:
+  const CipherSuite suite{ CipherSuite::ID::X25519_AES128GCM_SHA256_Ed25519 };
+  Metrics::Counters counters;
+  std::optional<State> alice;
+  std::optional<State> bob;
+
+  uint64_t count(Operation operation, Event event) const
+  {
+    return counters.get(operation, event).count;
+  }
+};
+
+TEST_CASE_FIXTURE(MetricsTest, "Metrics Attribution")
+{
+  auto message = random_bytes(32);
+  auto ct = alice->protect(message);
+  REQUIRE(bob->unprotect(ct) == message);
+
+  auto [commit, welcome, next] = alice->commit(random_bytes(32));
+  silence_unused(welcome);
+  silence_unused(next);
+  REQUIRE(bob->handle(commit).has_value());
+
+  if (!Metrics::enabled()) {
+    // Nothing is measured when the probes are compiled out
+    for (auto op : { Operation::other,
+                     Operation::commit,
+                     Operation::handle,
+                     Operation::protect,
+                     Operation::unprotect }) {
+      for (auto event : { Event::sign, Event::aead_seal, Event::state_copy }) {
+        REQUIRE(count(op, event) == 0);
+      }
+    }
+    return;
+  }
+
+  // Protect signs once and seals the sender data and the content
+  REQUIRE(count(Operation::protect, Event::sign) == 1);
+  REQUIRE(count(Operation::protect, Event::aead_seal) == 2);
+  REQUIRE(count(Operation::protect, Event::verify) == 0);
+
+  // Unprotect opens both and verifies the signature
+  REQUIRE(count(Operation::unprotect, Event::aead_open) == 2);
+  REQUIRE(count(Operation::unprotect, Event::verify) == 1);
+  REQUIRE(count(Operation::unprotect, Event::sign) == 0);
+
+  // The committer encapsulates to the other member, who decapsulates it.
+  // Each creates a new State, and hashes the updated tree.
+  REQUIRE(count(Operation::commit, Event::hpke_encap) > 0);
+  REQUIRE(count(Operation::commit, Event::sign) > 0);
+  REQUIRE(count(Operation::commit, Event::state_copy) > 0);
+  REQUIRE(count(Operation::commit, Event::tree_hash) > 0);
+  REQUIRE(count(Operation::handle, Event::hpke_decap) == 1);
+  REQUIRE(count(Operation::handle, Event::verify) > 0);
+  REQUIRE(count(Operation::handle, Event::hkdf_expand) > 0);
+  REQUIRE(count(Operation::handle, Event::hpke_encap) == 0);
+
+  // Removing the sink stops collection
+  Metrics::set_sink(nullptr);
+  counters.reset();
+  alice->protect(message);
+  REQUIRE(count(Operation::protect, Event::sign) == 0);
+}
@@ -0,0 +1,174 @@
+#include <doctest/doctest.h>
+#include <hpke/random.h>
+#include <mls/public_group.h>
+
+using namespace mls;
+
+class PublicGroupTest
+{
+public:
+  PublicGroupTest()
+  {
+    for (size_t i = 0; i < group_size; i += 1) {
+      auto identity_priv = SignaturePrivateKey::generate(suite);
+      auto credential = Credential::basic(user_id, identity_priv.public_key);
+      auto init_priv = HPKEPrivateKey::generate(suite);
+      auto key_package = KeyPackage{
+        suite, init_priv.public_key, credential, identity_priv, std::nullopt
+      };
+
+      init_privs.push_back(init_priv);
+      identity_privs.push_back(identity_priv);
+      key_packages.push_back(key_package);
+    }
+
+    states.emplace_back(
+      group_id, suite, init_privs[0], identity_privs[0], key_packages[0]);
+  }
+
+protected:
+  const CipherSuite suite{ CipherSuite::ID::P256_AES128GCM_SHA256_P256 };
+
+  const size_t group_size = 5;
+  const bytes group_id = { 0, 1, 2, 3 };
+  const bytes user_id = { 4, 5, 6, 7 };
+
+  std::vector<HPKEPrivateKey> init_privs;
+  std::vector<SignaturePrivateKey> identity_privs;
+  std::vector<KeyPackage> key_packages;
+  std::vector<State> states;
+
+  bytes fresh_secret() const
+  {
+    return random_bytes(suite.get().hpke.kdf.hash_size());
+  }
+
+  // Deliver handshake messages to the members other than the committer and
+  // to the observer
+  void broadcast(PublicGroupState& observer,
+                 const std::vector<MLSPlaintext>& proposals,
+                 const MLSPlaintext& commit,
+                 const State& committed)
+  {
+    for (const auto& pt : proposals) {
+      REQUIRE_FALSE(observer.handle(pt));
+    }
+    REQUIRE(observer.handle(commit));
+
+    const auto committer = LeafIndex{ commit.sender.sender };
+    for (auto& state : states) {
+      if (state.index() == committer) {
+        state = committed;
+        continue;
+      }
+
+      for (const auto& pt : proposals) {
+        state.handle(pt);
+      }
+      state = state.handle(commit).value();
+    }
+  }
+
+  // The transcript hashes are checked implicitly, since the signatures on
+  // the next epoch's messages cover them
+  void check_observer(const PublicGroupState& observer)
+  {
+    const auto ctx = observer.group_context();
+    for (const auto& state : states) {
+      REQUIRE(observer.epoch() == state.epoch());
+      REQUIRE(observer.tree() == state.tree());
+      REQUIRE(observer.roster() == state.roster());
+      REQUIRE(ctx.tree_hash == state.tree().root_hash());
+    }
+  }
+};
+
+TEST_CASE_FIXTURE(PublicGroupTest, "Public Group Follows Commits")
+{
+  auto observer = PublicGroupState(states[0]);
+
+  // Adds, with the key packages checked across a pool
+  auto adds = std::vector<MLSPlaintext>{};
+  for (size_t i = 1; i < group_size; i += 1) {
+    adds.push_back(states[0].add(key_packages[i]));
+    states[0].handle(adds.back());
+  }
+
+  auto [commit, welcome, new_state] = states[0].commit(fresh_secret());
+  for (const auto& pt : adds) {
+    REQUIRE_FALSE(observer.handle(pt));
+  }
+  auto pool = ThreadPool{ 2 };
+  REQUIRE(observer.handle(commit, pool));
+  states[0] = new_state;
+
+  for (size_t i = 1; i < group_size; i += 1) {
+    states.emplace_back(
+      init_privs[i], identity_privs[i], key_packages[i], welcome);
+  }
+  check_observer(observer);
+
+  // An Update committed with a path, which the observer merges without
+  // decrypting it
+  auto leaf_secret = fresh_secret();
+  auto update = states[1].update(leaf_secret);
+  states[1].handle(update);
+  auto [update_commit, update_welcome, updated] =
+    states[1].commit(leaf_secret);
+  silence_unused(update_welcome);
+  broadcast(observer, { update }, update_commit, updated);
+  check_observer(observer);
+
+  // A Remove
+  auto remove = states[3].remove(LeafIndex{ 2 });
+  states[3].handle(remove);
+  auto [remove_commit, remove_welcome, removed] =
+    states[3].commit(fresh_secret());
+  silence_unused(remove_welcome);
+  states.erase(states.begin() + 2);
+  broadcast(observer, { remove }, remove_commit, removed);
+  check_observer(observer);
+}
+
+TEST_CASE_FIXTURE(PublicGroupTest, "Public Group Rejects Invalid Commits")
+{
+  auto observer = PublicGroupState(states[0]);
+
+  auto add = states[0].add(key_packages[1]);
+  states[0].handle(add);
+  REQUIRE_FALSE(observer.handle(add));
+  auto [commit, welcome, new_state] = states[0].commit(fresh_secret());
+  silence_unused(welcome);
+  silence_unused(new_state);
+
+  // A bad signature or a missing confirmation leaves the observer as it was
+  auto tampered = commit;
+  tampered.signature.at(tampered.signature.size() - 1) ^= 0x01;
+  REQUIRE_THROWS_AS(observer.handle(tampered), ProtocolError);
+
+  auto unconfirmed = commit;
+  unconfirmed.confirmation_tag.reset();
+  REQUIRE_THROWS_AS(observer.handle(unconfirmed), ProtocolError);
+  REQUIRE(observer.epoch() == 0);
+  REQUIRE(observer.tree() == states[0].tree());
+
+  REQUIRE(observer.handle(commit));
+  REQUIRE(observer.epoch() == 1);
+  REQUIRE_THROWS_AS(observer.handle(commit), InvalidParameterError);
+}
+
+TEST_CASE_FIXTURE(PublicGroupTest, "Public Group from a GroupInfo")
+{
+  const auto& tree = states[0].tree();
+  auto group_info = GroupInfo{ group_id, 0, tree, { 1 }, { 2 }, {}, { 3 } };
+
+  // The GroupInfo must be signed by a member
+  REQUIRE_THROWS_AS(PublicGroupState(suite, group_info), InvalidParameterError);
+
+  group_info.sign(LeafIndex{ 0 }, identity_privs[0]);
+  auto decoded = tls::get<GroupInfo>(tls::marshal(group_info), suite);
+  auto observer = PublicGroupState(suite, decoded);
+  REQUIRE(observer.group_id() == group_id);
+  REQUIRE(observer.tree() == tree);
+  REQUIRE(observer.roster() == states[0].roster());
+}
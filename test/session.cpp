@@ -1,8 +1,13 @@
 #include "test_vectors.h"
 #include <doctest/doctest.h>
 #include <hpke/random.h>
+#include <mls/async_session.h>
+#include <mls/messages.h>
 #include <mls/session.h>
 
+#include <chrono>
+#include <thread>
+
 using namespace mls;
 
 class SessionTest
@@ -164,6 +169,429 @@ TEST_CASE_FIXTURE(RunningSessionTest, "Update within Session")
   }
 }
 
+TEST_CASE_FIXTURE(RunningSessionTest, "Asynchronous Session")
+{
+  auto crypto = ThreadPool{ 2 };
+  auto dispatch = ThreadPool{ 2 };
+  const auto initial_epoch = sessions[0].current_epoch();
+
+  sessions[0].crypto_executor(crypto);
+  auto async = AsyncSession(std::move(sessions[0]), dispatch);
+
+  // Calls are queued without waiting, and run in order
+  auto id_priv = new_identity_key();
+  auto cred = Credential::basic(user_id, id_priv.public_key);
+  auto join = Client(suite, id_priv, cred, std::nullopt).start_join();
+  const auto add = async.add(join.key_package()).get();
+  const auto update = async.update().get();
+  auto add_handled = async.handle(add);
+  auto update_handled = async.handle(update);
+  auto commit_future = async.commit();
+
+  REQUIRE_FALSE(add_handled.get());
+  REQUIRE_FALSE(update_handled.get());
+  auto [welcome, commit] = commit_future.get();
+  for (size_t i = 1; i < sessions.size(); i++) {
+    sessions[i].handle(add);
+    sessions[i].handle(update);
+    sessions[i].handle(commit);
+  }
+
+  auto joined =
+    AsyncSession::join(std::move(join), std::move(welcome), dispatch, crypto);
+  REQUIRE(async.handle(commit).get());
+
+  // A message protected after the Commit is handled is in the new epoch
+  auto plaintext = bytes{ 0, 1, 2, 3 };
+  auto ciphertext = async.protect(plaintext).get();
+  REQUIRE(sessions[1].unprotect(ciphertext) == plaintext);
+
+  // Errors come back through the future
+  REQUIRE_THROWS_AS(async.handle(commit).get(), InvalidParameterError);
+
+  sessions[0] = async.call([](Session& s) { return std::move(s); }).get();
+  sessions.push_back(joined.get());
+  check(initial_epoch);
+}
+
+TEST_CASE_FIXTURE(RunningSessionTest, "Catch Up within Session")
+{
+  auto crypto = ThreadPool{ 2 };
+  for (auto& session : sessions) {
+    session.encrypt_handshake(false);
+  }
+  sessions[0].crypto_executor(crypto);
+  const auto initial_epoch = sessions[0].current_epoch();
+
+  // Member 0 commits an update, then goes offline while members 1 and 2 do
+  // the same.  Its backlog includes its own Commit.
+  auto backlog = std::vector<bytes>{};
+  for (uint32_t i = 0; i <= 2; i += 1) {
+    auto update = sessions[i].update();
+    if (i == 0) {
+      broadcast(update);
+    } else {
+      broadcast(update, 0);
+      backlog.push_back(update);
+    }
+
+    auto [welcome, commit] = sessions[i].commit();
+    silence_unused(welcome);
+    broadcast(commit, 0);
+    backlog.push_back(commit);
+  }
+
+  REQUIRE(sessions[0].catch_up(backlog));
+  REQUIRE(sessions[0].current_epoch() == initial_epoch + 3);
+  check(initial_epoch);
+
+  // A backlog of proposals alone leaves the epoch as it was
+  auto update = sessions[1].update();
+  REQUIRE_FALSE(sessions[0].catch_up({ update }));
+}
+
+TEST_CASE_FIXTURE(RunningSessionTest, "Prewarmed Keys within Session")
+{
+  auto worker = ThreadPool{ 1 };
+  auto crypto = ThreadPool{ 2 };
+  sessions[0].crypto_executor(crypto);
+  sessions[0].key_prewarm(KeyPrewarm::all, worker);
+  sessions[1].key_prewarm(KeyPrewarm::active, worker);
+
+  // Messages are protected while the ratchets are being created, and later
+  // epochs are prewarmed in turn
+  for (int i = 0; i < group_size; i += 1) {
+    auto initial_epoch = sessions[0].current_epoch();
+
+    auto update = sessions[i].update();
+    broadcast(update);
+
+    auto welcome_commit = sessions[i].commit();
+    broadcast(std::get<1>(welcome_commit));
+
+    check(initial_epoch);
+  }
+
+  // The sessions must not outlive the worker
+  sessions.clear();
+}
+
+TEST_CASE_FIXTURE(RunningSessionTest, "Prepared Commit within Session")
+{
+  // Preparation can overlap with protecting messages
+  auto initial_epoch = sessions[0].current_epoch();
+  auto preparer = std::thread([&]() { sessions[1].prepare_commit(); });
+  auto encrypted = sessions[1].protect({ 0, 1, 2, 3 });
+  preparer.join();
+  REQUIRE(sessions[2].unprotect(encrypted) == bytes{ 0, 1, 2, 3 });
+
+  auto welcome_commit = sessions[1].commit();
+  broadcast(std::get<1>(welcome_commit));
+  check(initial_epoch);
+
+  // A prepared commit is dropped when the epoch changes underneath it
+  initial_epoch = sessions[0].current_epoch();
+  sessions[2].prepare_commit();
+  auto update = sessions[3].update();
+  broadcast(update);
+  broadcast(std::get<1>(sessions[3].commit()));
+
+  welcome_commit = sessions[2].commit();
+  broadcast(std::get<1>(welcome_commit));
+  check(initial_epoch);
+}
+
+TEST_CASE_FIXTURE(RunningSessionTest, "Scheduled Commits within Session")
+{
+  auto schedule = CommitSchedule{};
+  schedule.max_proposals = static_cast<size_t>(group_size);
+  for (auto& session : sessions) {
+    session.commit_schedule(schedule);
+  }
+
+  // Proposals are gathered until the batch is full, and then exactly one
+  // member commits them all
+  auto initial_epoch = sessions[0].current_epoch();
+  auto commits = std::vector<std::tuple<bytes, bytes>>{};
+  for (int i = 0; i < group_size; i += 1) {
+    broadcast(sessions[i].update());
+
+    for (auto& session : sessions) {
+      auto maybe_commit = session.commit_scheduled();
+      if (maybe_commit.has_value()) {
+        commits.push_back(maybe_commit.value());
+      }
+    }
+
+    REQUIRE(commits.size() == ((i == group_size - 1) ? 1 : 0));
+  }
+
+  // No second Commit is sent while the first is in flight
+  for (auto& session : sessions) {
+    REQUIRE_FALSE(session.commit_scheduled().has_value());
+  }
+
+  broadcast(std::get<1>(commits.at(0)));
+  check(initial_epoch);
+
+  // With nothing pending, nobody commits
+  for (auto& session : sessions) {
+    REQUIRE_FALSE(session.commit_scheduled().has_value());
+  }
+}
+
+TEST_CASE_FIXTURE(RunningSessionTest, "Stand-in Committers within Session")
+{
+  auto schedule = CommitSchedule{};
+  schedule.max_proposals = static_cast<size_t>(group_size) + 1;
+  schedule.max_delay = 1;
+  for (auto& session : sessions) {
+    session.commit_schedule(schedule);
+  }
+
+  // After two to three delays, the scheduled committer and one or two
+  // stand-ins are due, but not the rest of the group
+  auto initial_epoch = sessions[0].current_epoch();
+  broadcast(sessions[1].update());
+  std::this_thread::sleep_for(std::chrono::milliseconds(2100));
+
+  auto commits = std::vector<std::tuple<bytes, bytes>>{};
+  for (auto& session : sessions) {
+    auto maybe_commit = session.commit_scheduled();
+    if (maybe_commit.has_value()) {
+      commits.push_back(maybe_commit.value());
+    }
+  }
+
+  REQUIRE(commits.size() >= 2);
+  REQUIRE(commits.size() <= 3);
+
+  // The first Commit to be delivered wins
+  broadcast(std::get<1>(commits.at(0)));
+  check(initial_epoch);
+}
+
+TEST_CASE_FIXTURE(RunningSessionTest, "Journaled Session")
+{
+  const auto storage_secret = fresh_secret();
+  auto stored = bytes{};
+  auto store = [&]() {
+    auto [compacted, records] = sessions[2].journal_records();
+    if (compacted) {
+      stored.clear();
+    }
+    stored.insert(stored.end(), records.begin(), records.end());
+  };
+
+  sessions[2].journal(storage_secret, 2);
+  store();
+  REQUIRE(!stored.empty());
+
+  for (int i = 0; i < group_size; i += 1) {
+    auto initial_epoch = sessions[0].current_epoch();
+
+    auto update = sessions[i].update();
+    broadcast(update);
+
+    auto welcome_commit = sessions[i].commit();
+    broadcast(std::get<1>(welcome_commit));
+    store();
+
+    check(initial_epoch);
+  }
+
+  // The resumed member picks up where the journal left off, and commits
+  // before sending anything of its own
+  sessions[2] = Session::resume(stored, storage_secret);
+  auto initial_epoch = sessions[0].current_epoch();
+  auto update = sessions[2].update();
+  broadcast(update);
+  auto welcome_commit = sessions[2].commit();
+  broadcast(std::get<1>(welcome_commit));
+  check(initial_epoch);
+}
+
+TEST_CASE_FIXTURE(RunningSessionTest, "Migrate a Session")
+{
+  const auto transfer_secret = fresh_secret();
+  const auto plaintext = bytes{ 0, 1, 2, 3 };
+
+  // A message from the previous epoch, still to be decrypted after moving
+  auto late = sessions[3].protect(plaintext);
+  auto update = sessions[3].update();
+  broadcast(update);
+  auto [welcome, commit] = sessions[3].commit();
+  silence_unused(welcome);
+  broadcast(commit);
+
+  // Member 1 moves with a Commit of its own in flight
+  auto initial_epoch = sessions[0].current_epoch();
+  auto [welcome_1, commit_1] = sessions[1].commit();
+  silence_unused(welcome_1);
+
+  const auto data = sessions[1].serialize(transfer_secret);
+  REQUIRE_THROWS_AS(Session::restore(data, fresh_secret()), ProtocolError);
+
+  auto restored = Session::restore(data, transfer_secret);
+  REQUIRE(restored == sessions[1]);
+  REQUIRE(restored.retained_epochs() == sessions[1].retained_epochs());
+  REQUIRE(restored.unprotect(late) == plaintext);
+
+  sessions[1] = std::move(restored);
+  broadcast(commit_1);
+  check(initial_epoch);
+}
+
+TEST_CASE_FIXTURE(RunningSessionTest, "Decode Limits when Joining")
+{
+  auto id_priv = new_identity_key();
+  auto cred = Credential::basic(user_id, id_priv.public_key);
+  auto client = Client(suite, id_priv, cred, std::nullopt);
+  auto join = client.start_join();
+
+  broadcast(sessions[0].add(join.key_package()));
+  auto [welcome, commit] = sessions[0].commit();
+  silence_unused(commit);
+
+  // The tree in the Welcome is bigger than the limit allows
+  auto limits = DecodeLimits{};
+  limits.max_tree_nodes = 3;
+  join.decode_limits(limits);
+  REQUIRE_THROWS_AS(join.complete(welcome), tls::ReadError);
+
+  // The limits survive serialization when given to restore()
+  const auto transfer_secret = fresh_secret();
+  const auto stored = join.serialize(transfer_secret);
+  const auto restored_join =
+    PendingJoin::restore(stored, transfer_secret, limits);
+  REQUIRE_THROWS_AS(restored_join.complete(welcome), tls::ReadError);
+
+  limits.max_tree_nodes = DecodeLimits::unlimited;
+  join.decode_limits(limits);
+  auto joined = join.complete(welcome);
+  REQUIRE(joined.current_epoch() == sessions[0].current_epoch() + 1);
+
+  // A restored Session is decoded under the limits it is given
+  const auto data = sessions[1].serialize(transfer_secret);
+  limits.max_message_size = data.size() - 1;
+  REQUIRE_THROWS_AS(Session::restore(data, transfer_secret, limits),
+                    tls::ReadError);
+
+  limits.max_message_size = data.size();
+  REQUIRE(Session::restore(data, transfer_secret, limits) == sessions[1]);
+}
+
+TEST_CASE_FIXTURE(RunningSessionTest, "Capture and Replay a Session")
+{
+  const auto capture_secret = fresh_secret();
+  const auto plaintext = bytes{ 0, 1, 2, 3 };
+
+  sessions[2].capture(capture_secret);
+
+  auto message = sessions[0].protect(plaintext);
+  auto corrupt = message;
+  corrupt.back() ^= 1;
+  REQUIRE(sessions[2].unprotect(message) == plaintext);
+  REQUIRE_THROWS(sessions[2].unprotect(corrupt));
+
+  auto initial_epoch = sessions[0].current_epoch();
+  auto update = sessions[1].update();
+  broadcast(update);
+  auto [welcome, commit] = sessions[1].commit();
+  silence_unused(welcome);
+  broadcast(commit);
+
+  const auto data = sessions[2].end_capture();
+  REQUIRE_THROWS_AS(sessions[2].end_capture(), InvalidParameterError);
+  check(initial_epoch);
+
+  // The capture holds the inputs, but not the plaintexts
+  const auto capture = SessionCapture::decode(data);
+  REQUIRE(capture.origin == SessionCapture::Origin::session);
+  REQUIRE(capture.entries.size() == 4);
+  REQUIRE(capture.entries.at(0).input == SessionCapture::Input::application);
+  REQUIRE(capture.entries.at(0).messages.at(0).data == message);
+  REQUIRE(capture.entries.at(1).failed == 1);
+  REQUIRE(capture.entries.at(2).input == SessionCapture::Input::handshake);
+  REQUIRE(capture.entries.at(3).messages.at(0).data == commit);
+
+  // Replaying the inputs reaches the same state
+  auto replayed = Session::restore(capture.snapshot, capture_secret);
+  REQUIRE(replayed.unprotect(message) == plaintext);
+  replayed.handle(update);
+  replayed.handle(commit);
+  REQUIRE(replayed == sessions[2]);
+}
+
+TEST_CASE_FIXTURE(RunningSessionTest, "Capture a Joining Session")
+{
+  const auto capture_secret = fresh_secret();
+  auto id_priv = new_identity_key();
+  auto cred = Credential::basic(user_id, id_priv.public_key);
+  auto client = Client(suite, id_priv, cred, std::nullopt);
+  auto join = client.start_join();
+  join.capture(capture_secret);
+
+  // A PendingJoin can be kept until its Welcome arrives
+  const auto stored = join.serialize(capture_secret);
+  REQUIRE_THROWS_AS(PendingJoin::restore(stored, fresh_secret()),
+                    ProtocolError);
+  const auto restored_join = PendingJoin::restore(stored, capture_secret);
+  REQUIRE(restored_join.key_package() == join.key_package());
+
+  auto add = sessions[0].add(join.key_package());
+  broadcast(add);
+  auto [welcome, commit] = sessions[0].commit();
+  broadcast(commit);
+
+  auto joined = join.complete(welcome);
+  auto capture = SessionCapture::decode(joined.end_capture());
+  REQUIRE(capture.origin == SessionCapture::Origin::join);
+  REQUIRE(capture.entries.size() == 1);
+  REQUIRE(capture.entries.at(0).input == SessionCapture::Input::welcome);
+
+  const auto replay_join =
+    PendingJoin::restore(capture.snapshot, capture_secret);
+  REQUIRE(replay_join.complete(capture.entries.at(0).messages.at(0).data) ==
+          joined);
+}
+
+TEST_CASE_FIXTURE(RunningSessionTest, "Generate Key Packages for a Client")
+{
+  auto id_priv = new_identity_key();
+  auto cred = Credential::basic(user_id, id_priv.public_key);
+  auto client = Client(suite, id_priv, cred, std::nullopt);
+
+  auto pool = ThreadPool(4);
+  auto joins = client.generate_key_packages(6, pool);
+  REQUIRE(joins.size() == 6);
+
+  // Each is a valid key package with its own init key, the same as
+  // start_join() would have made
+  auto single = tls::get<KeyPackage>(client.start_join().key_package());
+  for (size_t i = 0; i < joins.size(); i++) {
+    auto kp = tls::get<KeyPackage>(joins[i].key_package());
+    REQUIRE(kp.verify());
+    REQUIRE(kp.credential == single.credential);
+    REQUIRE(kp.extensions == single.extensions);
+    for (size_t j = 0; j < i; j++) {
+      auto other = tls::get<KeyPackage>(joins[j].key_package());
+      REQUIRE(kp.init_key != other.init_key);
+    }
+  }
+
+  // Any of them can be used to join
+  auto initial_epoch = sessions[0].current_epoch();
+  auto add = sessions[0].add(joins[3].key_package());
+  broadcast(add);
+
+  auto [welcome, commit] = sessions[0].commit();
+  broadcast(commit);
+
+  sessions.push_back(joins[3].complete(welcome));
+  check(initial_epoch);
+}
+
 TEST_CASE_FIXTURE(RunningSessionTest, "Remove within Session")
 {
   for (int i = group_size - 1; i > 0; i -= 1) {
@@ -201,6 +629,279 @@ TEST_CASE_FIXTURE(RunningSessionTest, "Replace within Session")
   }
 }
 
+TEST_CASE_FIXTURE(RunningSessionTest, "Session History Policy")
+{
+  const auto max_past_epochs = size_t(2);
+  sessions[1].history_policy({ max_past_epochs, std::nullopt });
+  REQUIRE(sessions[1].retained_epochs() == max_past_epochs + 1);
+
+  // A message from an epoch that will fall out of the window
+  auto late_plaintext = bytes{ 4, 5, 6, 7 };
+  auto late_ciphertext = sessions[0].protect(late_plaintext);
+
+  for (size_t i = 0; i <= max_past_epochs; i += 1) {
+    auto initial_epoch = sessions[0].current_epoch();
+    auto update = sessions[0].update();
+    broadcast(update);
+    auto welcome_commit = sessions[0].commit();
+    broadcast(std::get<1>(welcome_commit));
+    check(initial_epoch);
+    REQUIRE(sessions[1].retained_epochs() == max_past_epochs + 1);
+  }
+
+  // Only sessions with a longer history can decrypt the late message
+  REQUIRE_THROWS_AS(sessions[1].unprotect(late_ciphertext), MissingStateError);
+  REQUIRE(sessions[2].unprotect(late_ciphertext) == late_plaintext);
+
+  // Tightening the policy releases memory right away
+  auto before = sessions[2].retained_bytes();
+  sessions[2].history_policy({ 0, std::nullopt });
+  REQUIRE(sessions[2].retained_epochs() == 1);
+  REQUIRE(sessions[2].retained_bytes() < before);
+}
+
+TEST_CASE_FIXTURE(RunningSessionTest, "Session Late Messages by Epoch")
+{
+  const auto epochs = size_t(4);
+  sessions[1].history_policy({ epochs, std::nullopt });
+
+  // One message from each epoch, decrypted newest first once the history
+  // window is full
+  auto late = std::vector<std::tuple<epoch_t, bytes>>{};
+  for (size_t i = 0; i < epochs; i += 1) {
+    auto initial_epoch = sessions[0].current_epoch();
+    late.emplace_back(initial_epoch, sessions[0].protect({ uint8_t(i) }));
+    broadcast(sessions[0].update());
+    broadcast(std::get<1>(sessions[0].commit()));
+    check(initial_epoch);
+  }
+
+  for (auto it = late.rbegin(); it != late.rend(); it++) {
+    const auto& [epoch, ct] = *it;
+    REQUIRE(peek_header(ct).epoch == epoch);
+    REQUIRE(sessions[1].unprotect(ct).size() == 1);
+  }
+
+  // Epochs that were never reached are refused like those dropped
+  auto future = std::get<1>(late.back());
+  future.at(future.at(0) + 8) += 2;
+  REQUIRE_THROWS_AS(sessions[1].unprotect(future), MissingStateError);
+}
+
+TEST_CASE_FIXTURE(RunningSessionTest, "Session Decrypt-Only Past Epochs")
+{
+  sessions[1].history_policy({ 4, std::nullopt, true });
+  sessions[2].history_policy({ 4, std::nullopt, false });
+
+  auto late_plaintext = bytes{ 4, 5, 6, 7 };
+  auto late_ciphertext = sessions[0].protect(late_plaintext);
+
+  for (size_t i = 0; i < 2; i += 1) {
+    auto initial_epoch = sessions[0].current_epoch();
+    auto update = sessions[0].update();
+    broadcast(update);
+    auto welcome_commit = sessions[0].commit();
+    broadcast(std::get<1>(welcome_commit));
+    check(initial_epoch);
+  }
+
+  // Compacted past epochs still decrypt and authenticate late messages, but
+  // retain less than full copies of the group state
+  REQUIRE(sessions[1].unprotect(late_ciphertext) == late_plaintext);
+  REQUIRE(sessions[2].unprotect(late_ciphertext) == late_plaintext);
+  REQUIRE(sessions[1].retained_epochs() == sessions[2].retained_epochs());
+  REQUIRE(sessions[1].retained_bytes() < sessions[2].retained_bytes());
+}
+
+TEST_CASE_FIXTURE(RunningSessionTest, "Session Memory Usage")
+{
+  sessions[1].history_policy({ 16, std::nullopt });
+
+  auto usage = sessions[1].memory_usage();
+  REQUIRE(usage.total() == sessions[1].retained_bytes());
+  REQUIRE(usage.tree > 0);
+  REQUIRE(usage.key_schedule > 0);
+  REQUIRE(usage.ratchets > 0);
+  REQUIRE(usage.other > 0);
+  REQUIRE(usage.pending_proposals == 0);
+
+  // Cached proposals are counted until a Commit consumes them
+  auto initial_epoch = sessions[0].current_epoch();
+  auto update = sessions[0].update();
+  broadcast(update);
+  REQUIRE(sessions[1].memory_usage().pending_proposals > 0);
+
+  // The prior epoch is then counted as history
+  auto history = usage.history;
+  auto welcome_commit = sessions[0].commit();
+  broadcast(std::get<1>(welcome_commit));
+  check(initial_epoch);
+
+  usage = sessions[1].memory_usage();
+  REQUIRE(usage.total() == sessions[1].retained_bytes());
+  REQUIRE(usage.pending_proposals == 0);
+  REQUIRE(usage.history > history);
+
+  // Decrypting a message caches the sender's remaining keys
+  auto before = usage.ratchets;
+  sessions[1].unprotect(sessions[0].protect(bytes{ 1, 2, 3 }));
+  REQUIRE(sessions[1].memory_usage().ratchets > before);
+}
+
+TEST_CASE_FIXTURE(RunningSessionTest, "Protect into Caller Buffer")
+{
+  // Messages shrink, so later calls reuse the capacity of the first
+  auto out = bytes{};
+  for (uint8_t i = 0; i < 4; i += 1) {
+    auto plaintext = bytes(size_t(32) >> i, i);
+    sessions[0].protect_into(plaintext, out);
+    for (int j = 1; j < group_size; j += 1) {
+      REQUIRE(sessions[j].unprotect(out) == plaintext);
+    }
+  }
+}
+
+TEST_CASE_FIXTURE(RunningSessionTest, "Unprotect in Place")
+{
+  sessions[1].history_policy({ 4, std::nullopt, true });
+  sessions[2].history_policy({ 4, std::nullopt, false });
+
+  auto plaintext = bytes{ 1, 2, 3, 4, 5 };
+  auto ciphertext = sessions[0].protect(plaintext);
+  auto late_ciphertext = sessions[0].protect(plaintext);
+
+  for (int i = 1; i < group_size; i += 1) {
+    auto message = sessions[0].protect(plaintext);
+    sessions[i].unprotect_in_place(message);
+    REQUIRE(message == plaintext);
+  }
+
+  auto tampered = ciphertext;
+  tampered.back() ^= 0xff;
+  REQUIRE_THROWS(sessions[1].unprotect_in_place(tampered));
+
+  // Past epochs decrypt in place whether or not they have been compacted
+  auto initial_epoch = sessions[0].current_epoch();
+  broadcast(sessions[0].update());
+  broadcast(std::get<1>(sessions[0].commit()));
+  check(initial_epoch);
+
+  for (int i = 1; i < 3; i += 1) {
+    auto message = late_ciphertext;
+    sessions[i].unprotect_in_place(message);
+    REQUIRE(message == plaintext);
+  }
+}
+
+TEST_CASE_FIXTURE(RunningSessionTest, "Batch Protection")
+{
+  const auto plaintexts = std::vector<bytes>{
+    { 0, 1, 2, 3 },
+    { 4, 5, 6, 7, 8 },
+    {},
+  };
+
+  auto ciphertexts = sessions[0].protect_batch(plaintexts);
+  REQUIRE(ciphertexts.size() == plaintexts.size());
+
+  // Batched ciphertexts can be unprotected one at a time
+  for (size_t i = 0; i < plaintexts.size(); i += 1) {
+    REQUIRE(sessions[1].unprotect(ciphertexts[i]) == plaintexts[i]);
+  }
+
+  // A bad message in a batch does not spoil the others
+  auto late_ciphertexts = sessions[0].protect_batch(plaintexts);
+  ciphertexts[1].back() ^= 0xff;
+  ciphertexts.push_back(late_ciphertexts[0]);
+
+  auto initial_epoch = sessions[0].current_epoch();
+  broadcast(sessions[0].update());
+  broadcast(std::get<1>(sessions[0].commit()));
+  check(initial_epoch);
+
+  // Messages from past and current epochs can be mixed
+  ciphertexts.push_back(sessions[0].protect(plaintexts[1]));
+  for (int i = 2; i < group_size; i += 1) {
+    auto results = sessions[i].unprotect_batch(ciphertexts);
+    REQUIRE(results.size() == ciphertexts.size());
+    REQUIRE(results[0] == plaintexts[0]);
+    REQUIRE_FALSE(results[1].has_value());
+    REQUIRE(results[2] == plaintexts[2]);
+    REQUIRE(results[3] == plaintexts[0]);
+    REQUIRE(results[4] == plaintexts[1]);
+  }
+}
+
+TEST_CASE_FIXTURE(RunningSessionTest, "Streaming Protection")
+{
+  for (const auto payload_size : { size_t(10000), size_t(10500), size_t(0) }) {
+    auto payload = bytes(payload_size);
+    for (size_t i = 0; i < payload.size(); i++) {
+      payload.at(i) = static_cast<uint8_t>(i * 7);
+    }
+
+    auto offset = size_t(0);
+    auto source = [&](uint8_t* data, size_t size) {
+      auto count = std::min(size, payload.size() - offset);
+      std::copy(payload.begin() + offset,
+                payload.begin() + offset + count,
+                data);
+      offset += count;
+      return count;
+    };
+
+    auto messages = std::vector<bytes>{};
+    auto sink = [&](const bytes& message) { messages.push_back(message); };
+    sessions[0].protect_stream(source, sink, 1000);
+    REQUIRE(messages.size() == payload_size / 1000 + 1);
+
+    // Each chunk is a message of its own, so they are reassembled in order
+    for (int i = 1; i < group_size; i += 1) {
+      auto received = bytes{};
+      auto stream_id = bytes{};
+      for (size_t j = 0; j < messages.size(); j += 1) {
+        auto message = messages.at(j);
+        auto chunk = (j == 0)
+                       ? sessions[i].unprotect_chunk(message)
+                       : sessions[i].unprotect_chunk(message, stream_id);
+        REQUIRE(chunk.index == j);
+        REQUIRE(chunk.last == (j == messages.size() - 1));
+        stream_id = chunk.stream_id;
+        received.insert(received.end(), message.begin(), message.end());
+      }
+      REQUIRE(received == payload);
+    }
+  }
+
+  // Each stream has its own ID, and a chunk spliced in from another stream
+  // is rejected
+  auto empty_stream = [&]() {
+    auto messages = std::vector<bytes>{};
+    sessions[0].protect_stream(
+      [](uint8_t* /* data */, size_t /* size */) { return size_t(0); },
+      [&](const bytes& message) { messages.push_back(message); },
+      1000);
+    return messages.at(0);
+  };
+
+  const auto stream_a = empty_stream();
+  const auto stream_b = empty_stream();
+  auto message_a = stream_a;
+  auto message_b = stream_b;
+  REQUIRE(sessions[1].unprotect_chunk(message_a).stream_id !=
+          sessions[1].unprotect_chunk(message_b).stream_id);
+
+  message_a = stream_a;
+  message_b = stream_b;
+  const auto stream_id = sessions[2].unprotect_chunk(message_a).stream_id;
+  REQUIRE_THROWS_AS(sessions[2].unprotect_chunk(message_b, stream_id),
+                    ProtocolError);
+
+  // A message that is not part of a stream is rejected
+  auto message = sessions[0].protect({ 1, 2 });
+  REQUIRE_THROWS_AS(sessions[1].unprotect_chunk(message), ProtocolError);
+}
+
 TEST_CASE_FIXTURE(RunningSessionTest, "Full Session Life-Cycle")
 {
   // 1. Group is created in the ctor
@@ -226,3 +927,61 @@ TEST_CASE_FIXTURE(RunningSessionTest, "Full Session Life-Cycle")
     check(initial_epoch);
   }
 }
+
+TEST_CASE_FIXTURE(RunningSessionTest, "Concurrent Unprotect")
+{
+  const auto threads = size_t(4);
+  const auto per_sender = size_t(8);
+  const auto senders = std::vector<size_t>{ 0, 2, 3, 4 };
+
+  // Every message is submitted twice, so that the two copies race for the
+  // same key
+  auto plaintexts = std::vector<bytes>{};
+  auto ciphertexts = std::vector<bytes>{};
+  for (auto sender : senders) {
+    for (size_t i = 0; i < per_sender; i++) {
+      auto pt =
+        bytes{ static_cast<uint8_t>(sender), static_cast<uint8_t>(i) };
+      auto ct = sessions[sender].protect(pt);
+      plaintexts.insert(plaintexts.end(), 2, pt);
+      ciphertexts.insert(ciphertexts.end(), 2, ct);
+    }
+  }
+
+  // Decrypt from several threads while another thread protects
+  auto results = std::vector<std::optional<bytes>>(ciphertexts.size());
+  auto outbound = std::vector<bytes>(per_sender);
+  auto workers = std::vector<std::thread>{};
+  for (size_t t = 0; t < threads; t++) {
+    workers.emplace_back([&, t]() {
+      for (auto i = t; i < ciphertexts.size(); i += threads) {
+        try {
+          results.at(i) = sessions[1].unprotect(ciphertexts.at(i));
+        } catch (const ProtocolError&) {
+          // The other copy of this message got the key
+        }
+      }
+    });
+  }
+  workers.emplace_back([&]() {
+    for (auto& ct : outbound) {
+      ct = sessions[1].protect(bytes{ 1 });
+    }
+  });
+  for (auto& worker : workers) {
+    worker.join();
+  }
+
+  // Each message was decrypted exactly once
+  for (size_t i = 0; i < ciphertexts.size(); i += 2) {
+    REQUIRE(results.at(i).has_value() != results.at(i + 1).has_value());
+    const auto& pt = results.at(i).has_value() ? results.at(i).value()
+                                               : results.at(i + 1).value();
+    REQUIRE(pt == plaintexts.at(i));
+  }
+
+  // Messages protected meanwhile used distinct keys
+  for (const auto& ct : outbound) {
+    REQUIRE(sessions[0].unprotect(ct) == bytes{ 1 });
+  }
+}
@@ -0,0 +1,151 @@
+#include <doctest/doctest.h>
+#include <hpke/random.h>
+#include <mls/session_manager.h>
+
+#include <mutex>
+
+using namespace mls;
+
+class SessionManagerTest
+{
+public:
+  SessionManagerTest()
+  {
+    // Each group has a member whose Session goes to the manager, and a peer
+    // who sends to it
+    for (size_t i = 0; i < group_count; i++) {
+      auto group_id = bytes{ 0, 1, 2, static_cast<uint8_t>(i) };
+      auto creator = new_client().begin_session(group_id);
+
+      auto join = new_client().start_join();
+      auto add = creator.add(join.key_package());
+      creator.handle(add);
+      auto [welcome, commit] = creator.commit();
+      creator.handle(commit);
+
+      managed.push_back(join.complete(welcome));
+      peers.push_back(std::move(creator));
+      group_ids.push_back(group_id);
+    }
+
+    for (auto& session : managed) {
+      manager.add(std::move(session));
+    }
+  }
+
+protected:
+  const CipherSuite suite{ CipherSuite::ID::X25519_AES128GCM_SHA256_Ed25519 };
+  const size_t group_count = 6;
+
+  SessionManager manager{ 3 };
+  std::vector<Session> managed;
+  std::vector<Session> peers;
+  std::vector<bytes> group_ids;
+
+  // Results are collected from the worker threads
+  std::mutex results_mutex;
+  std::vector<SessionManager::Result> results;
+
+  Client new_client() const
+  {
+    auto id_priv = SignaturePrivateKey::generate(suite);
+    auto cred = Credential::basic({ 0, 1, 2, 3 }, id_priv.public_key);
+    return Client(suite, id_priv, cred, std::nullopt);
+  }
+
+  SessionManager::Callback collect()
+  {
+    return [&](SessionManager::Result result) {
+      const auto lock = std::unique_lock(results_mutex);
+      results.push_back(std::move(result));
+    };
+  }
+};
+
+TEST_CASE_FIXTURE(SessionManagerTest, "Session Manager Registry")
+{
+  REQUIRE(manager.size() == group_count);
+  REQUIRE(manager.shard_count() == 3);
+  for (const auto& group_id : group_ids) {
+    REQUIRE(manager.contains(group_id));
+    REQUIRE(manager.shard_of(group_id) < manager.shard_count());
+  }
+
+  REQUIRE_THROWS_AS(manager.add(new_client().begin_session(group_ids[0])),
+                    InvalidParameterError);
+
+  REQUIRE(manager.remove(group_ids[0]));
+  REQUIRE_FALSE(manager.remove(group_ids[0]));
+  REQUIRE_FALSE(manager.contains(group_ids[0]));
+  REQUIRE(manager.size() == group_count - 1);
+
+  // Messages for a group that is not managed fail right away
+  auto ct = peers[0].protect({ 1, 2, 3 });
+  REQUIRE_THROWS_AS(manager.unprotect(ct), MissingStateError);
+  manager.submit_application(ct, collect());
+  REQUIRE(results.size() == 1);
+  REQUIRE(results[0].group_id == group_ids[0]);
+  REQUIRE(results[0].error);
+}
+
+TEST_CASE_FIXTURE(SessionManagerTest, "Session Manager Synchronous Routing")
+{
+  for (size_t i = 0; i < group_ids.size(); i++) {
+    auto pt = bytes{ static_cast<uint8_t>(i) };
+    REQUIRE(manager.unprotect(peers[i].protect(pt)) == pt);
+    REQUIRE(peers[i].unprotect(manager.protect(group_ids[i], pt)) == pt);
+  }
+}
+
+TEST_CASE_FIXTURE(SessionManagerTest, "Session Manager Dispatch")
+{
+  // Most of the traffic goes to one group, so that other workers steal it
+  const auto hot_messages = size_t(64);
+  auto expected = size_t(0);
+  for (size_t i = 0; i < hot_messages; i++) {
+    auto pt = bytes{ 0, static_cast<uint8_t>(i) };
+    manager.submit_application(peers[0].protect(pt), collect());
+    expected += 1;
+  }
+
+  // An epoch change, followed by messages in the new epoch.  The messages
+  // from before it are still decrypted.
+  auto update = peers[1].update();
+  peers[1].handle(update);
+  auto old_pt = bytes{ 1, 0 };
+  auto old_ct = peers[1].protect(old_pt);
+  auto [welcome, commit] = peers[1].commit();
+  peers[1].handle(commit);
+
+  manager.submit_handshake(update, collect());
+  manager.submit_handshake(commit, collect());
+  manager.submit_application(old_ct, collect());
+  manager.submit_application(peers[1].protect({ 1, 1 }), collect());
+  expected += 4;
+
+  for (size_t i = 2; i < group_ids.size(); i++) {
+    manager.submit_application(peers[i].protect({ 2, 2 }), collect());
+    expected += 1;
+  }
+
+  manager.drain();
+  REQUIRE(results.size() == expected);
+
+  auto hot = size_t(0);
+  auto epoch_changes = size_t(0);
+  for (const auto& result : results) {
+    REQUIRE_FALSE(result.error);
+    if (result.group_id == group_ids[0]) {
+      REQUIRE(result.data.size() == 2);
+      REQUIRE(result.data[0] == 0);
+      hot += 1;
+    }
+    if (result.epoch_changed) {
+      epoch_changes += 1;
+    }
+  }
+  REQUIRE(hot == hot_messages);
+  REQUIRE(epoch_changes == 1);
+  REQUIRE(peers[1].unprotect(manager.protect(group_ids[1], { 3 })) ==
+          bytes{ 3 });
+}
@@ -1,8 +1,13 @@
+#include "synthetic_group.h"
 #include "test_vectors.h"
 #include <doctest/doctest.h>
 #include <hpke/random.h>
+#include <mls/compression.h>
 #include <mls/state.h>
 
+#include <algorithm>
+#include <cstdio>
+
 using namespace mls;
 
 class StateTest
@@ -126,6 +131,241 @@ TEST_CASE_FIXTURE(StateTest, "Add Multiple Members")
   verify_group_functionality(states);
 }
 
+TEST_CASE_FIXTURE(StateTest, "Add Members with an External Tree")
+{
+  states.emplace_back(
+    group_id, suite, init_privs[0], identity_privs[0], key_packages[0]);
+
+  for (size_t i = 1; i < group_size; i += 1) {
+    auto add = states[0].add(key_packages[i]);
+    states[0].handle(add);
+  }
+
+  // The Welcome carries the tree hash instead of the tree
+  auto inline_tree = states[0];
+  auto [inline_commit, inline_welcome, inline_state] =
+    inline_tree.commit(fresh_secret());
+  silence_unused(inline_commit);
+  silence_unused(inline_state);
+
+  states[0].external_tree(true);
+  auto [commit, welcome, new_state] = states[0].commit(fresh_secret());
+  silence_unused(commit);
+  states[0] = new_state;
+  REQUIRE(welcome.encrypted_group_info.size() <
+          inline_welcome.encrypted_group_info.size());
+
+  // Joiners fetch the tree separately, e.g., from the delivery service
+  const auto tree_data = tls::marshal(states[0].tree());
+  for (size_t i = 1; i < group_size; i += 1) {
+    REQUIRE_THROWS_AS(
+      State(init_privs[i], identity_privs[i], key_packages[i], welcome),
+      InvalidParameterError);
+
+    states.emplace_back(init_privs[i],
+                        identity_privs[i],
+                        key_packages[i],
+                        Welcome(welcome),
+                        tls::get<TreeKEMPublicKey>(tree_data));
+  }
+
+  verify_group_functionality(states);
+
+  // A tree that does not match the hash is rejected, as is a tree for a
+  // Welcome that already carries one
+  REQUIRE_THROWS_AS(State(init_privs[1],
+                          identity_privs[1],
+                          key_packages[1],
+                          Welcome(welcome),
+                          inline_tree.tree()),
+                    InvalidParameterError);
+  REQUIRE_THROWS_AS(State(init_privs[1],
+                          identity_privs[1],
+                          key_packages[1],
+                          Welcome(inline_welcome),
+                          tls::get<TreeKEMPublicKey>(tree_data)),
+                    InvalidParameterError);
+}
+
+TEST_CASE_FIXTURE(StateTest, "Add Members with a Compressed Welcome")
+{
+  auto opts = KeyPackageOpts{};
+  opts.extensions.add(CompressionExtension{ { CompressionAlgorithm::mls_lz } });
+
+  auto compressing = key_packages;
+  for (size_t i = 0; i < group_size; i += 1) {
+    compressing[i].sign(identity_privs[i], opts);
+  }
+
+  auto add_all = [&](const std::vector<KeyPackage>& kps) {
+    auto creator =
+      State{ group_id, suite, init_privs[0], identity_privs[0], kps[0] };
+    for (size_t i = 1; i < group_size; i += 1) {
+      creator.handle(creator.add(kps[i]));
+    }
+
+    auto [commit, welcome, next] = creator.commit(fresh_secret());
+    silence_unused(commit);
+    return std::make_tuple(welcome, next);
+  };
+
+  // The GroupInfo is compressed when every joiner supports it
+  auto [plain_welcome, plain_state] = add_all(key_packages);
+  auto [welcome, creator] = add_all(compressing);
+  silence_unused(plain_state);
+  REQUIRE(welcome.encrypted_group_info.size() <
+          plain_welcome.encrypted_group_info.size());
+
+  states.push_back(creator);
+  for (size_t i = 1; i < group_size; i += 1) {
+    states.emplace_back(
+      init_privs[i], identity_privs[i], compressing[i], welcome);
+    REQUIRE(states.back() == creator);
+  }
+
+  verify_group_functionality(states);
+
+  // A joiner that does not support it keeps the GroupInfo uncompressed
+  auto mixed = compressing;
+  mixed[1] = key_packages[1];
+  auto [mixed_welcome, mixed_state] = add_all(mixed);
+
+  const auto& secrets_ct = mixed_welcome.secrets[1].encrypted_group_secrets;
+  auto secrets_data = init_privs[2].decrypt(suite, {}, secrets_ct);
+  auto secrets = tls::get<GroupSecrets>(secrets_data);
+  REQUIRE(secrets.extensions.extensions.empty());
+
+  auto joined =
+    State{ init_privs[2], identity_privs[2], mixed[2], mixed_welcome };
+  REQUIRE(joined == mixed_state);
+}
+
+TEST_CASE_FIXTURE(StateTest, "Duplicate Proposals")
+{
+  states.emplace_back(
+    group_id, suite, init_privs[0], identity_privs[0], key_packages[0]);
+
+  // A proposal received twice is only cached, and committed, once
+  auto add = states[0].add(key_packages[1]);
+  states[0].handle(add);
+  states[0].handle(add);
+
+  auto [commit, welcome, new_state] = states[0].commit(fresh_secret());
+  REQUIRE(std::get<Commit>(commit.content).proposals.size() == 1);
+  states[0] = new_state;
+
+  states.emplace_back(
+    init_privs[1], identity_privs[1], key_packages[1], welcome);
+  verify_group_functionality(states);
+}
+
+TEST_CASE_FIXTURE(StateTest, "Add Multiple Members in Parallel")
+{
+  auto pool = ThreadPool{ 4 };
+
+  // Initialize the creator's state
+  states.emplace_back(
+    group_id, suite, init_privs[0], identity_privs[0], key_packages[0]);
+
+  // Create and process an Add proposal for each new participant
+  for (size_t i = 1; i < group_size; i += 1) {
+    auto add = states[0].add(key_packages[i]);
+    states[0].handle(add);
+  }
+
+  // The Welcome lists the joiners in the same order as the serial version
+  auto [commit, welcome, new_state] = states[0].commit(fresh_secret(), pool);
+  silence_unused(commit);
+  states[0] = new_state;
+
+  REQUIRE(welcome.secrets.size() == group_size - 1);
+  for (size_t i = 1; i < group_size; i += 1) {
+    REQUIRE(welcome.secrets[i - 1].key_package_hash == key_packages[i].hash());
+    states.emplace_back(
+      init_privs[i], identity_privs[i], key_packages[i], welcome);
+
+    // Joining with the tree checked across the pool gives the same State
+    auto joined = State{
+      init_privs[i], identity_privs[i], key_packages[i], Welcome(welcome), pool
+    };
+    REQUIRE(joined == states.back());
+  }
+
+  verify_group_functionality(states);
+
+  // A Commit with an UpdatePath, encrypted in parallel
+  auto new_leaf = fresh_secret();
+  auto update = states[1].update(new_leaf);
+  states[1].handle(update);
+  auto [update_commit, update_welcome, updated] =
+    states[1].commit(new_leaf, pool);
+  silence_unused(update_welcome);
+
+  for (auto& state : states) {
+    if (state.index() == states[1].index()) {
+      continue;
+    }
+
+    state.handle(update);
+    state = state.handle(update_commit).value();
+  }
+  states[1] = updated;
+
+  verify_group_functionality(states);
+}
+
+TEST_CASE_FIXTURE(StateTest, "Add a Batch of Members")
+{
+  auto pool = ThreadPool{ 4 };
+
+  // Start with a two-member group, so that an existing member has to process
+  // the batch of joiners
+  auto first =
+    State{ group_id, suite, init_privs[0], identity_privs[0], key_packages[0] };
+  first.handle(first.add(key_packages[1]));
+  auto [commit1, welcome1, first1] = first.commit(fresh_secret());
+  silence_unused(commit1);
+  states.push_back(first1);
+  states.emplace_back(
+    init_privs[1], identity_privs[1], key_packages[1], welcome1);
+
+  // A key package with a bad signature fails the whole batch
+  auto joiners = std::vector<KeyPackage>(key_packages.begin() + 2,
+                                         key_packages.end());
+  auto tampered = joiners;
+  tampered.back().signature.at(0) ^= 0xff;
+  REQUIRE_THROWS_AS(states[0].add_batch(tampered, pool),
+                    InvalidParameterError);
+
+  // The proposals come back in the order of the key packages
+  auto adds = states[0].add_batch(joiners, pool);
+  REQUIRE(adds.size() == joiners.size());
+  for (size_t i = 0; i < adds.size(); i++) {
+    const auto& proposal = std::get<Proposal>(adds[i].content).content;
+    REQUIRE(std::get<Add>(proposal).key_package == joiners[i]);
+  }
+
+  for (auto& state : states) {
+    for (const auto& add : adds) {
+      state.handle(add, pool);
+    }
+  }
+
+  auto [commit2, welcome2, first2] = states[0].commit(fresh_secret(), pool);
+  states[1] = states[1].handle(commit2, pool).value();
+  states[0] = first2;
+  REQUIRE(states[0] == states[1]);
+
+  // Joiners are placed in the tree in order
+  for (size_t i = 2; i < group_size; i += 1) {
+    states.emplace_back(
+      init_privs[i], identity_privs[i], key_packages[i], welcome2);
+    REQUIRE(states.back().index() == LeafIndex{ static_cast<uint32_t>(i) });
+  }
+
+  verify_group_functionality(states);
+}
+
 TEST_CASE_FIXTURE(StateTest, "Full Size Group")
 {
   // Initialize the creator's state
@@ -219,6 +459,355 @@ TEST_CASE_FIXTURE(RunningGroupTest, "Update Everyone in a Group")
   }
 }
 
+TEST_CASE_FIXTURE(RunningGroupTest, "Handle a Batch of Handshake Messages")
+{
+  // Members 1 and 2 each update and commit in turn, while member 0 is offline
+  auto batch = std::vector<MLSPlaintext>{};
+  for (size_t i = 1; i <= 2; i += 1) {
+    auto new_leaf = fresh_secret();
+    auto update = states[i].update(new_leaf);
+    states[i].handle(update);
+    auto [commit, welcome, new_state] = states[i].commit(new_leaf);
+    silence_unused(welcome);
+
+    for (size_t j = 1; j < group_size; j += 1) {
+      if (j == i) {
+        states[j] = new_state;
+      } else {
+        states[j].handle(update);
+        states[j] = states[j].handle(commit).value();
+      }
+    }
+
+    batch.push_back(update);
+    batch.push_back(commit);
+  }
+
+  // A bad signature anywhere in the batch is rejected
+  auto tampered = batch;
+  tampered.back().signature.at(0) ^= 0xff;
+  auto offline = states[0];
+  REQUIRE_THROWS_AS(offline.handle_batch(tampered), ProtocolError);
+
+  // Verifying the signatures on a pool gives the same result
+  auto pool = ThreadPool{ 4 };
+  REQUIRE_THROWS_AS(offline.handle_batch(tampered, pool), ProtocolError);
+  auto pooled = states[0].handle_batch(batch, pool);
+  REQUIRE(pooled.has_value());
+
+  // Member 0 catches up with one call
+  auto caught_up = states[0].handle_batch(batch);
+  REQUIRE(caught_up.has_value());
+  REQUIRE(caught_up.value() == pooled.value());
+  states[0] = caught_up.value();
+  check_consistency();
+
+  // A batch with no Commit only queues proposals
+  auto update = states[1].update(fresh_secret());
+  REQUIRE_FALSE(states[0].handle_batch({ update }).has_value());
+}
+
+TEST_CASE_FIXTURE(RunningGroupTest, "Handle Moved Messages")
+{
+  // A Proposal that is moved in is cached just as a copied one
+  auto update = states[1].update(fresh_secret());
+  auto copied = states[0];
+  REQUIRE_FALSE(copied.handle(update).has_value());
+  REQUIRE_FALSE(states[0].handle(MLSPlaintext(update)).has_value());
+  REQUIRE(states[0] == copied);
+
+  auto remove = states[2].remove(RosterIndex{ 3 });
+  for (auto& state : states) {
+    if (state.index() != states[0].index()) {
+      state.handle(update);
+    }
+    state.handle(MLSPlaintext(remove));
+  }
+
+  auto [commit, welcome, new_state] = states[0].commit(fresh_secret());
+  silence_unused(welcome);
+  states[0] = std::move(new_state);
+  states.erase(states.begin() + 3);
+  for (size_t i = 1; i < states.size(); i += 1) {
+    states[i] = states[i].handle(MLSPlaintext(commit)).value();
+  }
+  check_consistency();
+}
+
+TEST_CASE_FIXTURE(RunningGroupTest, "Scheduled Committers")
+{
+  auto remove = states[2].remove(states[3].index());
+  for (auto& state : states) {
+    state.handle(remove);
+  }
+
+  // Every member with the same cached proposals computes the same order
+  const auto order = states[0].scheduled_committers();
+  for (const auto& state : states) {
+    REQUIRE(state.scheduled_committers() == order);
+  }
+
+  // The order covers the members that stay, starting from a place chosen by
+  // the epoch
+  auto remaining = std::vector<LeafIndex>{};
+  for (size_t i = 0; i < states.size(); i += 1) {
+    if (i != 3) {
+      remaining.push_back(states[i].index());
+    }
+  }
+  std::sort(remaining.begin(), remaining.end());
+
+  REQUIRE(order.size() == remaining.size());
+  const auto first = states[0].epoch() % remaining.size();
+  for (size_t i = 0; i < order.size(); i += 1) {
+    REQUIRE(order.at(i) == remaining.at((first + i) % remaining.size()));
+  }
+}
+
+TEST_CASE_FIXTURE(RunningGroupTest, "Catch Up on a Backlog in a Pipeline")
+{
+  // Members 1 and 2 each update and commit in turn, while member 0 is offline
+  auto backlog = std::vector<MLSPlaintext>{};
+  for (size_t i = 1; i <= 2; i += 1) {
+    auto new_leaf = fresh_secret();
+    auto update = states[i].update(new_leaf);
+    states[i].handle(update);
+    auto [commit, welcome, new_state] = states[i].commit(new_leaf);
+    silence_unused(welcome);
+
+    for (size_t j = 1; j < group_size; j += 1) {
+      if (j == i) {
+        states[j] = new_state;
+      } else {
+        states[j].handle(update);
+        states[j] = states[j].handle(commit).value();
+      }
+    }
+
+    backlog.push_back(update);
+    backlog.push_back(commit);
+  }
+
+  // A bad signature on a later epoch's message stops the pipeline
+  auto pool = ThreadPool{ 2 };
+  auto tampered = backlog;
+  tampered.back().signature.at(0) ^= 0xff;
+  auto offline = states[0];
+  REQUIRE_THROWS_AS(offline.catch_up(tampered, pool), ProtocolError);
+
+  // The pipeline gives the same states on a pool as serially
+  auto serial = SerialExecutor{};
+  auto serial_states = State(states[0]).catch_up(backlog, serial);
+  auto caught_up = states[0].catch_up(backlog, pool);
+  REQUIRE(caught_up.size() == 2);
+  REQUIRE(caught_up == serial_states);
+  REQUIRE(caught_up.front().epoch() == states[1].epoch() - 1);
+  states[0] = caught_up.back();
+  check_consistency();
+
+  // Proposals after the last Commit are cached in the last state
+  auto update = states[1].update(fresh_secret());
+  REQUIRE(states[0].catch_up({ update }, pool).empty());
+}
+
+TEST_CASE_FIXTURE(RunningGroupTest, "Prepared Commit")
+{
+  auto path_keys = [](const MLSPlaintext& pt) {
+    auto keys = std::vector<HPKEPublicKey>{};
+    for (const auto& node : std::get<Commit>(pt.content).path.value().nodes) {
+      keys.push_back(node.public_key);
+    }
+    return keys;
+  };
+
+  auto prepared_keys = [](const State::PreparedCommit& prepared) {
+    auto keys = std::vector<HPKEPublicKey>{};
+    for (const auto& node : prepared.path.path.nodes) {
+      keys.push_back(node.public_key);
+    }
+    return keys;
+  };
+
+  auto apply_commit = [&](size_t committer,
+                          const std::vector<MLSPlaintext>& proposals,
+                          const MLSPlaintext& commit,
+                          const State& new_state) {
+    for (auto& state : states) {
+      if (state.index().val == committer) {
+        state = new_state;
+        continue;
+      }
+
+      for (const auto& proposal : proposals) {
+        state.handle(proposal);
+      }
+      state = state.handle(commit).value();
+    }
+    check_consistency();
+  };
+
+  // A commit from a prepared path reuses its key pairs
+  auto prepared = states[1].prepare_commit(fresh_secret());
+  auto [commit, welcome, new_state] = states[1].commit(prepared);
+  silence_unused(welcome);
+  REQUIRE(path_keys(commit) == prepared_keys(prepared));
+  apply_commit(1, {}, commit, new_state);
+
+  // A prepared commit is only good for the epoch it was prepared in
+  REQUIRE_THROWS_AS(states[1].commit(prepared), InvalidParameterError);
+
+  // If a proposal changes the shape of the tree after the commit was
+  // prepared, the path is derived again
+  prepared = states[2].prepare_commit(fresh_secret());
+  auto remove = states[2].remove(LeafIndex{ 4 });
+  states[2].handle(remove);
+  auto [commit_2, welcome_2, new_state_2] = states[2].commit(prepared);
+  silence_unused(welcome_2);
+  REQUIRE(path_keys(commit_2) != prepared_keys(prepared));
+
+  states.pop_back();
+  apply_commit(2, { remove }, commit_2, new_state_2);
+}
+
+TEST_CASE_FIXTURE(RunningGroupTest, "Coalesce Superseded Proposals")
+{
+  // Member 1 updates twice, member 2 updates and is then removed twice
+  auto update_1a = states[1].update(fresh_secret());
+  auto update_1b = states[1].update(fresh_secret());
+  auto update_2 = states[2].update(fresh_secret());
+  auto remove_2a = states[0].remove(LeafIndex{ 2 });
+  auto remove_2b = states[3].remove(LeafIndex{ 2 });
+  const auto proposals = std::vector<MLSPlaintext>{
+    update_1a, update_1b, update_2, remove_2a, remove_2b
+  };
+
+  for (auto& state : states) {
+    for (const auto& pt : proposals) {
+      state.handle(pt);
+    }
+  }
+
+  const auto superseded = states[0].superseded_proposals();
+  REQUIRE(superseded.size() == 3);
+
+  auto [commit, welcome, new_state] = states[0].commit(fresh_secret());
+  silence_unused(welcome);
+  const auto& committed = std::get<Commit>(commit.content).proposals;
+  REQUIRE(committed.size() == 2);
+  for (const auto& dropped : superseded) {
+    REQUIRE(std::find(committed.begin(), committed.end(), dropped) ==
+            committed.end());
+  }
+
+  states.erase(states.begin() + 2);
+  for (auto& state : states) {
+    if (state.index() == new_state.index()) {
+      state = new_state;
+    } else {
+      state = state.handle(commit).value();
+    }
+
+    // Nothing superseded is left behind for the next Commit
+    REQUIRE(state.superseded_proposals().empty());
+  }
+
+  check_consistency();
+}
+
+TEST_CASE_FIXTURE(RunningGroupTest, "Save and Load State")
+{
+  // Leave member 2 with a retained key for a late message and a cached
+  // proposal, both of which have to survive the round trip
+  auto late = states[1].protect(test_message);
+  auto early = states[1].protect(test_message);
+  REQUIRE(states[2].unprotect(early) == test_message);
+
+  auto update = states[3].update(fresh_secret());
+  for (auto& state : states) {
+    state.handle(update);
+  }
+
+  const auto storage_secret = fresh_secret();
+  const auto saved = states[2].save(storage_secret);
+
+  const auto snapshot = StateSnapshot(saved);
+  REQUIRE(snapshot.cipher_suite() == suite);
+  REQUIRE(snapshot.group_id() == group_id);
+  REQUIRE(snapshot.epoch() == states[2].epoch());
+
+  REQUIRE_THROWS_AS(State::load(snapshot, fresh_secret()), ProtocolError);
+
+  auto loaded = State::load(snapshot, storage_secret);
+  REQUIRE(loaded == states[2]);
+  REQUIRE(loaded.index() == states[2].index());
+  REQUIRE(loaded.unprotect(late) == test_message);
+  states[2] = loaded;
+
+  auto [commit, welcome, new_state] = states[0].commit(fresh_secret());
+  silence_unused(welcome);
+  for (auto& state : states) {
+    if (state.index() == new_state.index()) {
+      state = new_state;
+    } else {
+      state = state.handle(commit).value();
+    }
+  }
+
+  check_consistency();
+}
+
+TEST_CASE_FIXTURE(RunningGroupTest, "Save State Deltas")
+{
+  const auto storage_secret = fresh_secret();
+  auto journal = StateJournal(storage_secret, 2);
+  auto stored = bytes{};
+  auto compactions = size_t(0);
+
+  for (size_t i = 0; i < group_size; i += 1) {
+    const auto base = states[0];
+
+    auto new_leaf = fresh_secret();
+    auto update = states[i].update(new_leaf);
+    states[i].handle(update);
+    auto [commit, welcome, new_state] = states[i].commit(new_leaf);
+    silence_unused(welcome);
+
+    for (auto& state : states) {
+      if (state.index().val == i) {
+        state = new_state;
+      } else {
+        state.handle(update);
+        state = state.handle(commit).value();
+      }
+    }
+
+    // A delta holds only the changed path, and reproduces the new state
+    const auto delta = states[0].save_delta(base, storage_secret);
+    REQUIRE(delta.size() < states[0].save(storage_secret).size());
+    const auto snapshot = StateSnapshot(delta);
+    REQUIRE(snapshot.delta());
+    REQUIRE(base.load_delta(snapshot, storage_secret) == states[0]);
+    REQUIRE_THROWS_AS(states[0].load_delta(snapshot, storage_secret),
+                      InvalidParameterError);
+    REQUIRE_THROWS_AS(State::load(snapshot, storage_secret),
+                      InvalidParameterError);
+
+    auto [full, record] = journal.record(states[0]);
+    if (full) {
+      stored.clear();
+      compactions += 1;
+    }
+    stored.insert(stored.end(), record.begin(), record.end());
+  }
+
+  REQUIRE(compactions == 2);
+
+  auto replayed = StateJournal::replay(stored, storage_secret);
+  REQUIRE(replayed == states[0]);
+  states[0] = replayed;
+  check_consistency();
+}
+
 TEST_CASE_FIXTURE(RunningGroupTest, "Remove Members from a Group")
 {
   for (int i = static_cast<int>(group_size) - 2; i > 0; i -= 1) {
@@ -286,3 +875,41 @@ TEST_CASE_FIXTURE(RunningGroupTest, "Roster Updates")
                  [](const auto& kp) { return kp.credential; });
   REQUIRE(expected_creds == roster_creds);
 }
+
+TEST_CASE_FIXTURE(StateTest, "Synthetic Group")
+{
+  auto opts = SyntheticGroup::Options{};
+  opts.suite = suite;
+  opts.size = 40;
+  opts.blank_fraction = 0.25;
+  opts.tracked = 3;
+
+  auto group = SyntheticGroup::build(opts);
+  REQUIRE(group.tree.size() == LeafCount{ opts.size });
+  REQUIRE(group.members.size() == opts.tracked);
+
+  // The tracked members share one epoch and can exchange messages
+  auto states = std::vector<State>{};
+  for (size_t i = 0; i < opts.tracked; i++) {
+    states.push_back(group.state(i));
+    REQUIRE(states.back() == states.front());
+  }
+  verify_group_functionality(states);
+
+  // A Commit from one tracked member is processed by the others
+  auto [commit, welcome, next] = states[1].commit(fresh_secret());
+  silence_unused(welcome);
+  for (auto i : { 0, 2 }) {
+    states[i] = states[i].handle(commit).value();
+  }
+  states[1] = next;
+  verify_group_functionality(states);
+
+  // A snapshot reloads to the same group
+  const auto file_name = std::string("synthetic_group_test.bin");
+  group.save(file_name);
+  auto loaded = SyntheticGroup::load(file_name);
+  std::remove(file_name.c_str());
+  REQUIRE(loaded.tree == group.tree);
+  REQUIRE(loaded.state(2) == group.state(2));
+}
@@ -0,0 +1,249 @@
+#include "synthetic_group.h"
+
+#include <hpke/random.h>
+
+#include <fstream>
+#include <iterator>
+
+// The encoded form of a snapshot.  Signature private keys are stored as their
+// raw data, since they are re-parsed on load.
+struct MemberSnapshot
+{
+  HPKEPrivateKey init_priv;
+  bytes identity_priv;
+  KeyPackage key_package;
+
+  TLS_SERIALIZABLE(init_priv, identity_priv, key_package)
+  TLS_TRAITS(tls::pass, tls::vector<2>, tls::pass)
+};
+
+struct GroupSnapshot
+{
+  CipherSuite suite;
+  TreeKEMPublicKey tree;
+  std::vector<MemberSnapshot> members;
+  Welcome welcome;
+
+  TLS_SERIALIZABLE(suite, tree, members, welcome)
+  TLS_TRAITS(tls::pass, tls::pass, tls::vector<4>, tls::pass)
+};
+
+SyntheticGroup::Member
+SyntheticGroup::Member::generate(CipherSuite suite)
+{
+  static const auto user_id = bytes{ 4, 5, 6, 7 };
+
+  auto init_priv = HPKEPrivateKey::generate(suite);
+  auto identity_priv = SignaturePrivateKey::generate(suite);
+  auto credential = Credential::basic(user_id, identity_priv.public_key);
+  auto key_package = KeyPackage{
+    suite, init_priv.public_key, credential, identity_priv, std::nullopt
+  };
+  return { init_priv, identity_priv, key_package };
+}
+
+SyntheticGroup
+SyntheticGroup::build(const Options& opts)
+{
+  static const auto group_id = bytes{ 0, 1, 2, 3 };
+  static constexpr size_t filler_pool_size = 16;
+  static constexpr epoch_t epoch = 1;
+
+  if (opts.tracked == 0 || opts.tracked > opts.size) {
+    throw InvalidParameterError("Invalid number of tracked members");
+  }
+
+  const auto& suite = opts.suite;
+  auto group = SyntheticGroup{};
+  group.suite = suite;
+  group.tree = TreeKEMPublicKey{ suite };
+
+  // Fill the tree, tracked members first
+  for (uint32_t i = 0; i < opts.tracked; i++) {
+    group.members.push_back(Member::generate(suite));
+    group.tree.add_leaf(group.members.back().key_package);
+  }
+
+  auto fillers = std::vector<Member>{};
+  for (size_t i = 0; i < filler_pool_size && i < opts.size - opts.tracked;
+       i++) {
+    fillers.push_back(Member::generate(suite));
+  }
+
+  const auto filler = [&](uint32_t i) -> const Member& {
+    return fillers.at(i % fillers.size());
+  };
+
+  for (uint32_t i = opts.tracked; i < opts.size; i++) {
+    group.tree.add_leaf(filler(i).key_package);
+  }
+
+  // Blank leaves spread evenly across the untracked part of the tree
+  auto untracked = opts.size - opts.tracked;
+  auto blanks = static_cast<uint32_t>(opts.blank_fraction * untracked);
+  for (uint32_t i = 0; i < blanks; i++) {
+    auto offset = static_cast<uint64_t>(i) * untracked / blanks;
+    group.tree.blank_path(LeafIndex{ opts.tracked + uint32_t(offset) });
+  }
+
+  // Untracked members commit to populate the parent nodes.  One member under
+  // each lowest parent commits, top-down so that each commit encrypts to few
+  // nodes.  The subtree holding the tracked members is left to leaf 0, so
+  // that they know the private keys for every node on their direct paths.
+  auto pool = ThreadPool{};
+  auto tracked_span = uint32_t(1);
+  while (tracked_span < opts.tracked) {
+    tracked_span <<= 1U;
+  }
+
+  auto pairs = (opts.size + 1) / 2;
+  auto pair_bits = uint32_t(0);
+  while ((uint32_t(1) << pair_bits) < pairs) {
+    pair_bits += 1;
+  }
+
+  auto committers = static_cast<uint32_t>(opts.populate_fraction * pairs);
+  auto committed = uint32_t(0);
+  for (uint32_t i = 0; i < (uint32_t(1) << pair_bits); i++) {
+    if (committed == committers) {
+      break;
+    }
+
+    // Visit the pairs in bit-reversed order
+    auto pair = uint32_t(0);
+    for (uint32_t bit = 0; bit < pair_bits; bit++) {
+      pair |= ((i >> bit) & 1U) << (pair_bits - 1 - bit);
+    }
+
+    for (auto leaf : { 2 * pair, 2 * pair + 1 }) {
+      auto index = LeafIndex{ leaf };
+      if (leaf < tracked_span || leaf >= opts.size ||
+          !group.tree.key_package(index).has_value()) {
+        continue;
+      }
+
+      auto leaf_secret = random_bytes(suite.get().hpke.kdf.hash_size());
+      auto [priv, path] = group.tree.encap(index,
+                                           group_id,
+                                           leaf_secret,
+                                           filler(leaf).identity_priv,
+                                           std::nullopt,
+                                           pool);
+      silence_unused(priv);
+      group.tree.merge(index, path);
+      group.tree.set_hash_all();
+      committed += 1;
+      break;
+    }
+  }
+
+  // Leaf 0 commits last, as the Commit adding everyone would.  Its key
+  // package is replaced in the process.
+  auto& creator = group.members.at(0);
+  auto leaf_secret = random_bytes(suite.get().hpke.kdf.hash_size());
+  auto [creator_priv, path] = group.tree.encap(LeafIndex{ 0 },
+                                               group_id,
+                                               leaf_secret,
+                                               creator.identity_priv,
+                                               std::nullopt,
+                                               pool);
+  group.tree.merge(LeafIndex{ 0 }, path);
+  group.tree.set_hash_all();
+  creator.key_package = path.leaf_key_package;
+  creator.init_priv = creator_priv.private_key(NodeIndex{ 0 }).value();
+
+  // The key schedule for the first epoch follows from a fresh joiner secret,
+  // as it would for a Commit that added everyone
+  auto joiner_secret = random_bytes(suite.get().hpke.kdf.hash_size());
+  auto confirmed_transcript_hash = random_bytes(suite.get().digest.hash_size());
+  auto interim_transcript_hash = random_bytes(suite.get().digest.hash_size());
+  auto context = GroupContext{ group_id,
+                               epoch,
+                               group.tree.root_hash(),
+                               confirmed_transcript_hash,
+                               {} };
+  auto keys = KeyScheduleEpoch(
+    suite, joiner_secret, {}, tls::marshal(context), group.tree.size());
+  auto confirmation =
+    suite.get().digest.hmac(keys.confirmation_key, confirmed_transcript_hash);
+
+  auto group_info = GroupInfo{ group_id,
+                               epoch,
+                               group.tree,
+                               confirmed_transcript_hash,
+                               interim_transcript_hash,
+                               {},
+                               confirmation };
+  group_info.sign(LeafIndex{ 0 }, group.members.at(0).identity_priv);
+
+  group.welcome = Welcome{ suite, joiner_secret, {}, group_info };
+  for (uint32_t i = 0; i < opts.tracked; i++) {
+    auto [overlap, path_secret, ok] =
+      creator_priv.shared_path_secret(LeafIndex{ i });
+    silence_unused(overlap);
+    if (!ok) {
+      throw ProtocolError("No path secret for tracked member");
+    }
+
+    group.welcome.encrypt(group.members.at(i).key_package, path_secret);
+  }
+
+  return group;
+}
+
+State
+SyntheticGroup::state(size_t i) const
+{
+  const auto& member = members.at(i);
+  return { member.init_priv,
+           member.identity_priv,
+           member.key_package,
+           welcome };
+}
+
+void
+SyntheticGroup::save(const std::string& file_name) const
+{
+  std::ofstream file(file_name, std::ios::out | std::ios::binary);
+  if (!file) {
+    throw std::invalid_argument("Could not create ofstream for: " + file_name);
+  }
+
+  auto snapshot = GroupSnapshot{ suite, tree, {}, welcome };
+  for (const auto& member : members) {
+    snapshot.members.push_back(
+      { member.init_priv, member.identity_priv.data, member.key_package });
+  }
+
+  auto data = tls::marshal(snapshot);
+  // NOLINTNEXTLINE(cppcoreguidelines-pro-type-reinterpret-cast)
+  file.write(reinterpret_cast<const char*>(data.data()), data.size());
+}
+
+SyntheticGroup
+SyntheticGroup::load(const std::string& file_name)
+{
+  std::ifstream file(file_name, std::ios::binary);
+  if (!file) {
+    throw std::invalid_argument("Could not open ifstream for: " + file_name);
+  }
+
+  auto data = bytes(std::istreambuf_iterator<char>(file),
+                    std::istreambuf_iterator<char>());
+  auto snapshot = tls::get<GroupSnapshot>(data);
+
+  auto group = SyntheticGroup{};
+  group.suite = snapshot.suite;
+  group.tree = std::move(snapshot.tree);
+  group.tree.suite = group.suite;
+  group.tree.set_hash_all();
+  group.welcome = std::move(snapshot.welcome);
+  for (auto& member : snapshot.members) {
+    auto identity_priv =
+      SignaturePrivateKey::parse(group.suite, member.identity_priv);
+    group.members.push_back({ std::move(member.init_priv),
+                              std::move(identity_priv),
+                              std::move(member.key_package) });
+  }
+  return group;
+}
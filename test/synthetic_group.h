@@ -0,0 +1,64 @@
+#pragma once
+
+#include <mls/state.h>
+#include <tls/tls_syntax.h>
+
+#include <string>
+#include <vector>
+
+using namespace mls;
+
+// A group of arbitrary size assembled directly, rather than through a
+// sequence of Add and Commit messages.  The tree is filled with leaves, some
+// of them blanked.  Parent nodes are populated by UpdatePaths from a share of
+// the members, as if they had each committed once, and last by the first
+// member.  A Welcome then admits the members whose private keys are kept, so
+// that each can get a State in the group's first epoch.
+//
+// Only the tracked members have distinct key packages.  The other leaves
+// cycle through a small pool, which keeps building a large group cheap.
+struct SyntheticGroup
+{
+  struct Member
+  {
+    HPKEPrivateKey init_priv;
+    SignaturePrivateKey identity_priv;
+    KeyPackage key_package;
+
+    static Member generate(CipherSuite suite);
+  };
+
+  struct Options
+  {
+    CipherSuite suite{ CipherSuite::ID::X25519_AES128GCM_SHA256_Ed25519 };
+    uint32_t size = 2;
+
+    // Fraction of the leaves to blank, excluding the tracked members
+    double blank_fraction = 0.0;
+
+    // Fraction of the lowest parent nodes under which a member commits.  With
+    // fewer commits, more of the tree is blank and each UpdatePath encrypts
+    // to more nodes.
+    double populate_fraction = 1.0;
+
+    // Members whose private keys are kept, at leaves 0 to tracked - 1
+    uint32_t tracked = 2;
+  };
+
+  CipherSuite suite;
+  TreeKEMPublicKey tree;
+  std::vector<Member> members;
+  Welcome welcome;
+
+  SyntheticGroup() = default;
+
+  static SyntheticGroup build(const Options& opts);
+
+  // A State for the ith tracked member
+  State state(size_t i) const;
+
+  // Snapshots hold the tree, the tracked members and the Welcome, so that a
+  // large group can be built once and reloaded
+  void save(const std::string& file_name) const;
+  static SyntheticGroup load(const std::string& file_name);
+};
@@ -266,7 +266,7 @@ struct TestTreeKEMPublicKey : public TreeKEMPublicKey
       auto secret = secrets[i];
       secret.push_back(0);
       auto pub = HPKEPrivateKey::derive(suite, secret).public_key;
-      nodes.at(2 * i + 1).node = Node{ ParentNode{ pub, {}, {} } };
+      node_at(NodeIndex{ 2 * i + 1 }).node = Node{ ParentNode{ pub, {}, {} } };
     }
   }
 
@@ -84,3 +84,42 @@ TEST_CASE_FIXTURE(TreeMathTest, "Tree Math")
     }
   }
 }
+
+// The index calculus can be evaluated at compile time
+static_assert(tree_math::level(NodeIndex{ 7 }) == 3);
+static_assert(tree_math::root(NodeCount{ LeafCount{ 11 } }).val == 15);
+static_assert(tree_math::parent(NodeIndex{ 20 }, NodeCount{ 21 }).val == 19);
+static_assert(tree_math::sibling(NodeIndex{ 20 }, NodeCount{ 21 }).val == 17);
+static_assert(tree_math::ancestor(LeafIndex{ 1 }, LeafIndex{ 2 }).val == 3);
+static_assert(tree_math::dirpath(NodeIndex{ 4 }, NodeCount{ 21 }).size() == 4);
+static_assert(tree_math::copath(NodeIndex{ 15 }, NodeCount{ 21 }).empty());
+
+TEST_CASE("Tree Math Paths")
+{
+  // A path through the deepest possible tree fits inline
+  const auto width = NodeCount{ 0xffffffff };
+  const auto leaf = NodeIndex{ 0 };
+  const auto dirpath = tree_math::dirpath(leaf, width);
+  const auto copath = tree_math::copath(leaf, width);
+  REQUIRE(dirpath.size() == 31);
+  REQUIRE(copath.size() == 31);
+  REQUIRE(dirpath.back() == tree_math::root(width));
+
+  auto last = leaf;
+  for (size_t i = 0; i < dirpath.size(); i++) {
+    REQUIRE(dirpath[i] == tree_math::parent(last, width));
+    REQUIRE(copath[i] == tree_math::sibling(last, width));
+    last = dirpath[i];
+  }
+
+  // Paths convert to and compare with vectors
+  const auto as_vector = std::vector<NodeIndex>(dirpath);
+  REQUIRE(dirpath == as_vector);
+  REQUIRE(as_vector.size() == dirpath.size());
+
+  auto full = NodePath{};
+  for (size_t i = 0; i < NodePath::max_size; i++) {
+    full.push_back(NodeIndex{ static_cast<uint32_t>(i) });
+  }
+  REQUIRE_THROWS_AS(full.push_back(NodeIndex{ 0 }), std::length_error);
+}
@@ -4,6 +4,8 @@
 #include <mls/common.h>
 #include <mls/treekem.h>
 
+#include <algorithm>
+
 using namespace mls;
 
 class TreeKEMTest
@@ -117,6 +119,12 @@ TEST_CASE_FIXTURE(TreeKEMTest, "TreeKEM Private Key")
   priv_joiner.set_leaf_secret(random2);
   REQUIRE(priv_joiner.path_secrets.find(NodeIndex(index))->second == random2);
 
+  // ... and replaces the leaf key cached from the previous leaf secret
+  const auto leaf_priv = priv_joiner.private_key(NodeIndex(index));
+  REQUIRE(leaf_priv.has_value());
+  REQUIRE(leaf_priv.value().public_key ==
+          HPKEPrivateKey::derive(suite, random2).public_key);
+
   // shared_path_secret() finds the correct ancestor
   auto [overlap, overlap_secret, found] =
     priv_joiner.shared_path_secret(LeafIndex(0));
@@ -135,6 +143,47 @@ TEST_CASE_FIXTURE(TreeKEMTest, "TreeKEM Private Key")
   REQUIRE_FALSE(priv_no.has_value());
 }
 
+TEST_CASE("TreeKEM Direct Path Map")
+{
+  // Leaf 2 and its direct path in a tree of five leaves
+  auto map = DirectPathMap<bytes>{};
+  REQUIRE(map.empty());
+  map[NodeIndex{ 7 }] = { 7 };
+  map[NodeIndex{ 4 }] = { 4 };
+  REQUIRE(map.emplace(NodeIndex{ 5 }, { 5 }).second);
+  REQUIRE(map.insert({ NodeIndex{ 3 }, { 3 } }).second);
+  REQUIRE(map.size() == 4);
+
+  // Entries already present keep their values, as in a std::map
+  REQUIRE_FALSE(map.emplace(NodeIndex{ 5 }, { 0 }).second);
+  REQUIRE(map.at(NodeIndex{ 5 }) == bytes{ 5 });
+
+  // A node at the same level as one on the path is not found
+  REQUIRE(map.find(NodeIndex{ 1 }) == map.end());
+  REQUIRE(map.count(NodeIndex{ 1 }) == 0);
+  REQUIRE_THROWS_AS(map.at(NodeIndex{ 0 }), std::out_of_range);
+  REQUIRE(map.erase(NodeIndex{ 1 }) == 0);
+
+  // Entries are visited from the leaf up
+  auto nodes = std::vector<uint32_t>{};
+  for (const auto& [node, value] : map) {
+    REQUIRE(value == bytes{ static_cast<uint8_t>(node.val) });
+    nodes.push_back(node.val);
+  }
+  REQUIRE(nodes == std::vector<uint32_t>{ 4, 5, 3, 7 });
+
+  // Copies are independent
+  auto copy = map;
+  REQUIRE(copy == map);
+  REQUIRE(copy.erase(NodeIndex{ 3 }) == 1);
+  REQUIRE(copy != map);
+  REQUIRE(copy.size() == 3);
+  REQUIRE(map.count(NodeIndex{ 3 }) == 1);
+
+  copy.clear();
+  REQUIRE(copy.empty());
+}
+
 //        _
 //    _
 //  X   _
@@ -205,6 +254,582 @@ TEST_CASE_FIXTURE(TreeKEMTest, "TreeKEM Public Key")
   REQUIRE(root_resolution == pub.resolve(root));
 }
 
+TEST_CASE_FIXTURE(TreeKEMTest, "TreeKEM Incremental Tree Hash")
+{
+  // An unbalanced tree, so that the last leaf is alone in the root's right
+  // subtree
+  const auto size = LeafCount{ 9 };
+
+  auto pub = TreeKEMPublicKey{ suite };
+  for (uint32_t i = 0; i < size.val; i++) {
+    auto [init_priv, sig_priv, kp] = new_key_package();
+    silence_unused(init_priv);
+    silence_unused(sig_priv);
+    pub.add_leaf(kp);
+  }
+
+  // Compare against a copy of the tree with no cached hashes
+  auto check_root_hash = [&]() {
+    auto fresh = tls::get<TreeKEMPublicKey>(tls::marshal(pub));
+    fresh.suite = suite;
+    fresh.set_hash_all();
+    REQUIRE(fresh.root_hash() == pub.root_hash());
+  };
+
+  pub.set_hash_all();
+  REQUIRE(pub.hashes_computed() == NodeCount(size).val);
+  check_root_hash();
+
+  // Rehashing an unchanged tree is free
+  auto before = pub.hashes_computed();
+  pub.set_hash_all();
+  REQUIRE(pub.hashes_computed() == before);
+
+  // Changing one leaf only rehashes that leaf and its direct path
+  auto [init_priv, sig_priv, kp] = new_key_package();
+  silence_unused(init_priv);
+  silence_unused(sig_priv);
+
+  const auto updated = LeafIndex{ 5 };
+  const auto dp = tree_math::dirpath(NodeIndex(updated), NodeCount(size));
+  pub.update_leaf(updated, kp);
+  pub.set_hash_all();
+  REQUIRE(pub.hashes_computed() - before == dp.size() + 1);
+  check_root_hash();
+
+  // Shrinking the tree changes the nodes along its new right edge, which are
+  // not on the removed leaf's direct path
+  pub.blank_path(LeafIndex{ size.val - 2 });
+  pub.truncate();
+  REQUIRE(pub.size() == size);
+  pub.set_hash_all();
+  check_root_hash();
+
+  pub.blank_path(LeafIndex{ size.val - 1 });
+  pub.truncate();
+  REQUIRE(pub.size().val == size.val - 2);
+  pub.set_hash_all();
+  check_root_hash();
+}
+
+TEST_CASE_FIXTURE(TreeKEMTest, "TreeKEM Copy-on-Write Nodes")
+{
+  const auto size = LeafCount{ 8 };
+
+  auto pub = TreeKEMPublicKey{ suite };
+  for (uint32_t i = 0; i < size.val; i++) {
+    auto [init_priv, sig_priv, kp] = new_key_package();
+    silence_unused(init_priv);
+    silence_unused(sig_priv);
+    pub.add_leaf(kp);
+  }
+  pub.set_hash_all();
+
+  // A copy shares every node with the original
+  auto copy = pub;
+  const auto& const_pub = pub;
+  const auto& const_copy = copy;
+  const auto width = NodeCount(size);
+  for (auto n = NodeIndex{ 0 }; n.val < width.val; n.val++) {
+    REQUIRE(&const_pub.node_at(n) == &const_copy.node_at(n));
+  }
+
+  // Modifying the copy only detaches the modified path
+  auto [init_priv, sig_priv, kp] = new_key_package();
+  silence_unused(init_priv);
+  silence_unused(sig_priv);
+
+  const auto updated = LeafIndex{ 2 };
+  auto path = tree_math::dirpath(NodeIndex(updated), width);
+  path.push_back(NodeIndex(updated));
+
+  copy.update_leaf(updated, kp);
+  copy.set_hash_all();
+  for (auto n = NodeIndex{ 0 }; n.val < width.val; n.val++) {
+    auto on_path = std::find(path.begin(), path.end(), n) != path.end();
+    REQUIRE((&const_pub.node_at(n) == &const_copy.node_at(n)) == !on_path);
+  }
+
+  // The original is unaffected
+  REQUIRE(pub != copy);
+  REQUIRE(pub.root_hash() != copy.root_hash());
+  REQUIRE(pub.key_package(updated) != copy.key_package(updated));
+  REQUIRE(copy.key_package(updated) == kp);
+}
+
+TEST_CASE_FIXTURE(TreeKEMTest, "TreeKEM Leaf Index")
+{
+  const auto size = LeafCount{ 8 };
+
+  auto make_kp = [&](uint8_t id) {
+    auto init_priv = HPKEPrivateKey::generate(suite);
+    auto sig_priv = SignaturePrivateKey::generate(suite);
+    auto cred = Credential::basic({ id }, sig_priv.public_key);
+    return KeyPackage{
+      suite, init_priv.public_key, cred, sig_priv, std::nullopt
+    };
+  };
+
+  auto pub = TreeKEMPublicKey{ suite };
+  auto kps = std::vector<KeyPackage>{};
+  for (uint32_t i = 0; i < size.val; i++) {
+    kps.push_back(make_kp(static_cast<uint8_t>(i)));
+    pub.add_leaf(kps.back());
+  }
+
+  for (uint32_t i = 0; i < size.val; i++) {
+    const auto id = bytes{ static_cast<uint8_t>(i) };
+    REQUIRE(pub.find(kps[i]) == LeafIndex{ i });
+    REQUIRE(pub.find_identity(id) == LeafIndex{ i });
+  }
+  REQUIRE_FALSE(pub.find(make_kp(0xff)).has_value());
+  REQUIRE_FALSE(pub.find_identity({ 0xff }).has_value());
+
+  // Changes to a copy are not visible in the original's index
+  auto copy = pub;
+  auto kp_update = make_kp(0xf0);
+  copy.update_leaf(LeafIndex{ 2 }, kp_update);
+  copy.blank_path(LeafIndex{ 5 });
+
+  REQUIRE(copy.find(kp_update) == LeafIndex{ 2 });
+  REQUIRE_FALSE(copy.find(kps[2]).has_value());
+  REQUIRE_FALSE(copy.find(kps[5]).has_value());
+  REQUIRE_FALSE(copy.find_identity({ 5 }).has_value());
+
+  REQUIRE(pub.find(kps[2]) == LeafIndex{ 2 });
+  REQUIRE(pub.find(kps[5]) == LeafIndex{ 5 });
+  REQUIRE_FALSE(pub.find(kp_update).has_value());
+
+  // A blanked leaf is reused, and the lowest leaf wins for a shared identity
+  auto kp_reuse = make_kp(7);
+  REQUIRE(copy.add_leaf(kp_reuse) == LeafIndex{ 5 });
+  REQUIRE(copy.find(kp_reuse) == LeafIndex{ 5 });
+  REQUIRE(copy.find_identity({ 7 }) == LeafIndex{ 5 });
+
+  // Truncated leaves drop out of the index
+  copy.blank_path(LeafIndex{ 7 });
+  copy.blank_path(LeafIndex{ 6 });
+  copy.truncate();
+  REQUIRE(copy.size().val == 6);
+  REQUIRE_FALSE(copy.find(kps[6]).has_value());
+  REQUIRE(copy.find_identity({ 7 }) == LeafIndex{ 5 });
+
+  // A deserialized tree builds its index from scratch
+  auto decoded = tls::get<TreeKEMPublicKey>(tls::marshal(copy));
+  REQUIRE(decoded.find(kp_update) == LeafIndex{ 2 });
+  REQUIRE(decoded.find(kp_reuse) == LeafIndex{ 5 });
+  REQUIRE(decoded.find_identity({ 0 }) == LeafIndex{ 0 });
+}
+
+// Resolution computed directly from the nodes, without the cache
+static std::vector<NodeIndex>
+uncached_resolution(const TreeKEMPublicKey& pub, NodeIndex index)
+{
+  if (!pub.node_at(index).blank()) {
+    auto out = std::vector<NodeIndex>{ index };
+    if (tree_math::level(index) > 0) {
+      for (auto leaf : pub.node_at(index).parent_node().unmerged_leaves) {
+        out.push_back(NodeIndex(leaf));
+      }
+    }
+    return out;
+  }
+
+  if (tree_math::level(index) == 0) {
+    return {};
+  }
+
+  auto width = NodeCount(pub.size());
+  auto out = uncached_resolution(pub, tree_math::left(index));
+  auto right = uncached_resolution(pub, tree_math::right(index, width));
+  out.insert(out.end(), right.begin(), right.end());
+  return out;
+}
+
+// Checks the cached resolutions and blank bits against the nodes
+static void
+check_node_caches(const TreeKEMPublicKey& pub)
+{
+  auto width = NodeCount(pub.size());
+  for (auto n = NodeIndex{ 0 }; n.val < width.val; n.val++) {
+    REQUIRE(pub.blank(n) == pub.node_at(n).blank());
+    REQUIRE(pub.resolve(n) == uncached_resolution(pub, n));
+  }
+}
+
+TEST_CASE_FIXTURE(TreeKEMTest, "TreeKEM Resolution Cache")
+{
+  const auto size = LeafCount{ 7 };
+
+  auto pub = TreeKEMPublicKey{ suite };
+  for (uint32_t i = 0; i < size.val; i++) {
+    auto [init_priv, sig_priv, kp] = new_key_package();
+    silence_unused(init_priv);
+    pub.add_leaf(kp);
+
+    // Fill in the direct path of every other leaf, so that later adds leave
+    // unmerged leaves behind
+    if (i % 2 == 0) {
+      auto index = LeafIndex{ i };
+      auto path = UpdatePath{ kp, {} };
+      auto dp = tree_math::dirpath(NodeIndex(index), NodeCount(pub.size()));
+      while (path.nodes.size() < dp.size()) {
+        auto node_pub = HPKEPrivateKey::generate(suite).public_key;
+        path.nodes.push_back({ node_pub, {} });
+      }
+
+      path.sign(suite, init_priv.public_key, sig_priv, std::nullopt);
+      pub.merge(index, path);
+    }
+
+    check_node_caches(pub);
+  }
+
+  // Copies diverge without disturbing each other's cached resolutions
+  auto copy = pub;
+  copy.blank_path(LeafIndex{ 2 });
+  check_node_caches(copy);
+  check_node_caches(pub);
+
+  auto [init_priv, sig_priv, kp] = new_key_package();
+  silence_unused(init_priv);
+  silence_unused(sig_priv);
+  REQUIRE(copy.add_leaf(kp) == LeafIndex{ 2 });
+  check_node_caches(copy);
+
+  copy.update_leaf(LeafIndex{ 4 }, kp);
+  check_node_caches(copy);
+
+  // Shrinking and regrowing the tree
+  copy.blank_path(LeafIndex{ 6 });
+  copy.blank_path(LeafIndex{ 5 });
+  copy.truncate();
+  REQUIRE(copy.size().val == 5);
+  check_node_caches(copy);
+
+  copy.add_leaf(kp);
+  copy.add_leaf(kp);
+  check_node_caches(copy);
+
+  auto decoded = tls::get<TreeKEMPublicKey>(tls::marshal(copy));
+  check_node_caches(decoded);
+  REQUIRE(decoded.resolve(tree_math::root(NodeCount(decoded.size()))) ==
+          copy.resolve(tree_math::root(NodeCount(copy.size()))));
+}
+
+TEST_CASE_FIXTURE(TreeKEMTest, "TreeKEM Parent Hash Watermark")
+{
+  const auto size = LeafCount{ 8 };
+
+  auto sign_path = [&](TreeKEMPublicKey& pub, LeafIndex index) {
+    auto [init_priv, sig_priv, kp] = new_key_package();
+    auto path = UpdatePath{ kp, {} };
+    auto dp = tree_math::dirpath(NodeIndex(index), NodeCount(pub.size()));
+    while (path.nodes.size() < dp.size()) {
+      auto node_pub = HPKEPrivateKey::generate(suite).public_key;
+      path.nodes.push_back({ node_pub, {} });
+    }
+
+    path.sign(suite, init_priv.public_key, sig_priv, std::nullopt);
+    return path;
+  };
+
+  auto pub = TreeKEMPublicKey{ suite };
+  for (uint32_t i = 0; i < size.val; i++) {
+    auto [init_priv, sig_priv, kp] = new_key_package();
+    silence_unused(init_priv);
+    silence_unused(sig_priv);
+    pub.add_leaf(kp);
+  }
+
+  for (auto i : { 0, 2, 6 }) {
+    auto index = LeafIndex{ static_cast<uint32_t>(i) };
+    pub.merge(index, sign_path(pub, index));
+    REQUIRE(pub.parent_hash_valid(index));
+  }
+  REQUIRE(pub.parent_hash_valid());
+
+  // A path whose leaf does not carry the parent hash fails both the path
+  // check and the full check, in the copy that merged it only
+  auto bad = pub;
+  auto bad_path = sign_path(bad, LeafIndex{ 5 });
+  bad_path.leaf_key_package = std::get<2>(new_key_package());
+  bad.merge(LeafIndex{ 5 }, bad_path);
+  REQUIRE_FALSE(bad.parent_hash_valid(LeafIndex{ 5 }));
+  REQUIRE_FALSE(bad.parent_hash_valid());
+  REQUIRE(pub.parent_hash_valid());
+
+  // A valid path is accepted by a copy that was already verified, and the
+  // decoded tree starts out unverified but agrees
+  auto good = pub;
+  good.merge(LeafIndex{ 5 }, sign_path(good, LeafIndex{ 5 }));
+  REQUIRE(good.parent_hash_valid(LeafIndex{ 5 }));
+  REQUIRE(good.parent_hash_valid());
+
+  auto decoded = tls::get<TreeKEMPublicKey>(tls::marshal(good));
+  decoded.suite = suite;
+  decoded.set_hash_all();
+  REQUIRE(decoded.parent_hash_valid());
+}
+
+TEST_CASE_FIXTURE(TreeKEMTest, "TreeKEM Parallel Validation")
+{
+  // An odd width, so that the split into subtrees is uneven
+  const auto size = LeafCount{ 77 };
+  auto pool = ThreadPool{ 4 };
+
+  auto pub = TreeKEMPublicKey{ suite };
+  for (uint32_t i = 0; i < size.val; i++) {
+    auto [init_priv, sig_priv, kp] = new_key_package();
+    silence_unused(init_priv);
+    silence_unused(sig_priv);
+    pub.add_leaf(kp);
+  }
+
+  auto sign_path = [&](TreeKEMPublicKey& tree, LeafIndex index) {
+    auto [init_priv, sig_priv, kp] = new_key_package();
+    auto path = UpdatePath{ kp, {} };
+    auto dp = tree_math::dirpath(NodeIndex(index), NodeCount(tree.size()));
+    while (path.nodes.size() < dp.size()) {
+      auto node_pub = HPKEPrivateKey::generate(suite).public_key;
+      path.nodes.push_back({ node_pub, {} });
+    }
+
+    path.sign(suite, init_priv.public_key, sig_priv, std::nullopt);
+    return path;
+  };
+
+  for (auto i : { 3, 40, 76 }) {
+    auto index = LeafIndex{ static_cast<uint32_t>(i) };
+    pub.merge(index, sign_path(pub, index));
+  }
+
+  // Decoded trees hashed and checked across the pool agree with the serial
+  // versions, and compute the same number of hashes
+  const auto encoded = tls::marshal(pub);
+  auto serial = tls::get<TreeKEMPublicKey>(encoded);
+  serial.suite = suite;
+  serial.set_hash_all();
+
+  auto parallel = tls::get<TreeKEMPublicKey>(encoded);
+  parallel.suite = suite;
+  parallel.set_hash_all(pool);
+
+  REQUIRE(parallel.root_hash() == serial.root_hash());
+  REQUIRE(parallel.root_hash() == pub.root_hash());
+  REQUIRE(parallel.hashes_computed() == serial.hashes_computed());
+  REQUIRE(parallel.parent_hash_valid(pool));
+  REQUIRE(serial.parent_hash_valid());
+
+  // Hashing again computes nothing
+  const auto before = parallel.hashes_computed();
+  parallel.set_hash_all(pool);
+  REQUIRE(parallel.hashes_computed() == before);
+
+  // A parent node that no child covers is caught, and the nodes that were
+  // covered are still marked as verified
+  auto bad_path = sign_path(parallel, LeafIndex{ 20 });
+  bad_path.leaf_key_package = std::get<2>(new_key_package());
+  parallel.merge(LeafIndex{ 20 }, bad_path);
+  REQUIRE_FALSE(parallel.parent_hash_valid(pool));
+  REQUIRE_FALSE(parallel.parent_hash_valid());
+  REQUIRE(parallel.parent_hash_valid(LeafIndex{ 40 }));
+}
+
+TEST_CASE_FIXTURE(TreeKEMTest, "TreeKEM Diff")
+{
+  const auto size = LeafCount{ 16 };
+
+  auto pub = TreeKEMPublicKey{ suite };
+  for (uint32_t i = 0; i < size.val; i++) {
+    auto [init_priv, sig_priv, kp] = new_key_package();
+    silence_unused(init_priv);
+    silence_unused(sig_priv);
+    pub.add_leaf(kp);
+  }
+  pub.set_hash_all();
+
+  // A mirror decoded from the full tree shares no nodes with it
+  auto mirror = tls::get<TreeKEMPublicKey>(tls::marshal(pub));
+  mirror.suite = suite;
+  mirror.set_hash_all();
+
+  // Only the changed path is sent, and the mirror follows it
+  auto prev = pub;
+  auto [init_priv, sig_priv, kp] = new_key_package();
+  silence_unused(init_priv);
+  silence_unused(sig_priv);
+  pub.update_leaf(LeafIndex{ 5 }, kp);
+  pub.set_hash_all();
+
+  // The direct path was already blank, so only the leaf differs, even though
+  // the path nodes were detached when they were blanked
+  auto diff = pub.diff(prev);
+  REQUIRE(diff.nodes.size() == 1);
+  REQUIRE(tls::marshal(diff).size() < tls::marshal(pub).size() / 4);
+
+  auto decoded = tls::get<TreeDiff>(tls::marshal(diff));
+  mirror.apply_diff(decoded);
+  REQUIRE(mirror == pub);
+  REQUIRE(mirror.root_hash() == pub.root_hash());
+  REQUIRE(mirror.find(kp) == LeafIndex{ 5 });
+
+  // A diff that grows the tree, computed against the mirror
+  auto grown = mirror;
+  grown.add_leaf(std::get<2>(new_key_package()));
+  grown.set_hash_all();
+  auto grow_diff = grown.diff(mirror);
+  pub.apply_diff(grow_diff);
+  REQUIRE(pub == grown);
+  REQUIRE(pub.size() == grown.size());
+
+  // Diffs for another tree, or that do not produce the tree they name, are
+  // rejected without changing the tree
+  REQUIRE_THROWS_AS(prev.apply_diff(grow_diff), InvalidParameterError);
+
+  auto bad = grow_diff;
+  bad.nodes.pop_back();
+  auto before = mirror;
+  REQUIRE_THROWS_AS(mirror.apply_diff(bad), ProtocolError);
+  REQUIRE(mirror == before);
+  REQUIRE(mirror.size() == before.size());
+  REQUIRE(mirror.root_hash() == before.root_hash());
+
+  // Widths that no tree could have, or that the diff could not fill, are
+  // rejected before the tree is resized
+  auto wide = grow_diff;
+  wide.width = NodeCount{ 0xffffffff };
+  REQUIRE_THROWS_AS(mirror.apply_diff(wide), ProtocolError);
+
+  wide.width = NodeCount{ mirror.size().val * 2 };
+  REQUIRE_THROWS_AS(mirror.apply_diff(wide), ProtocolError);
+
+  // A leaf at a parent's index, or a parent at a leaf's, is rejected
+  auto misplaced = grow_diff;
+  auto leaf = std::find_if(
+    misplaced.nodes.begin(), misplaced.nodes.end(), [](const auto& change) {
+      return !change.node.blank() &&
+             std::holds_alternative<KeyPackage>(change.node.node.value().node);
+    });
+  REQUIRE(leaf != misplaced.nodes.end());
+  leaf->index = NodeIndex{ 1 };
+  REQUIRE_THROWS_AS(mirror.apply_diff(misplaced), ProtocolError);
+  REQUIRE(mirror == before);
+
+  auto parent = OptionalNode{ Node{ ParentNode{ kp.init_key, {}, {} } }, {} };
+  misplaced.nodes.front() = { NodeIndex{ 0 }, parent };
+  REQUIRE_THROWS_AS(mirror.apply_diff(misplaced), ProtocolError);
+  REQUIRE(mirror == before);
+
+  auto limits = DecodeLimits{};
+  limits.max_tree_nodes = size.val;
+  const auto scope = DecodeLimits::Scope(limits);
+  REQUIRE_THROWS_AS(mirror.apply_diff(grow_diff), ProtocolError);
+  REQUIRE(mirror == before);
+}
+
+TEST_CASE_FIXTURE(TreeKEMTest, "TreeKEM Cached Node Encodings")
+{
+  auto pub = TreeKEMPublicKey{ suite };
+  for (uint32_t i = 0; i < 5; i++) {
+    auto [init_priv, sig_priv, kp] = new_key_package();
+    silence_unused(init_priv);
+    silence_unused(sig_priv);
+    pub.add_leaf(kp);
+  }
+
+  // Encodings are cached when the nodes are hashed, and give the same tree
+  // encoding as encoding each node afresh
+  const auto unhashed = tls::marshal(pub);
+  const auto& leaf = std::as_const(pub).node_at(LeafIndex{ 0 });
+  REQUIRE(leaf.encoding.empty());
+  pub.set_hash_all();
+  REQUIRE(leaf.encoding == tls::marshal(leaf));
+  REQUIRE(tls::marshal(pub) == unhashed);
+  REQUIRE(encoded_size(pub) == unhashed.size());
+
+  // A changed node is encoded again, and a copy made before the change keeps
+  // the old encoding
+  auto prev = pub;
+  auto [init_priv, sig_priv, kp] = new_key_package();
+  silence_unused(init_priv);
+  silence_unused(sig_priv);
+  pub.update_leaf(LeafIndex{ 2 }, kp);
+  pub.set_hash_all();
+  REQUIRE(pub.key_package(LeafIndex{ 2 }) == kp);
+  REQUIRE(tls::marshal(prev) == unhashed);
+
+  auto decoded = tls::get<TreeKEMPublicKey>(tls::marshal(pub));
+  decoded.suite = suite;
+  decoded.set_hash_all();
+  REQUIRE(decoded == pub);
+  REQUIRE(decoded.root_hash() == pub.root_hash());
+}
+
+TEST_CASE_FIXTURE(TreeKEMTest, "TreeKEM Leaf Placement")
+{
+  const auto size = LeafCount{ 8 };
+
+  auto pub = TreeKEMPublicKey{ suite };
+  auto members = std::vector<std::tuple<HPKEPrivateKey, SignaturePrivateKey>>{};
+  for (uint32_t i = 0; i < size.val; i++) {
+    auto [init_priv, sig_priv, kp] = new_key_package();
+    members.emplace_back(init_priv, sig_priv);
+    pub.add_leaf(kp);
+  }
+
+  // Leaves 1, 4, 5, and 7 are blank.  Leaf 6 then fills in its direct path,
+  // so that leaf 7 has a non-blank parent, leaves 4 and 5 a non-blank
+  // grandparent, and leaf 1 only a non-blank root.
+  for (auto i : { 1, 4, 5, 7 }) {
+    pub.blank_path(LeafIndex{ static_cast<uint32_t>(i) });
+  }
+
+  const auto committer = LeafIndex{ 6 };
+  const auto& [init_priv, sig_priv] = members.at(committer.val);
+  auto path = UpdatePath{ pub.key_package(committer).value(), {} };
+  auto dp = tree_math::dirpath(NodeIndex(committer), NodeCount(pub.size()));
+  while (path.nodes.size() < dp.size()) {
+    auto node_pub = HPKEPrivateKey::generate(suite).public_key;
+    path.nodes.push_back({ node_pub, {} });
+  }
+  path.sign(suite, init_priv.public_key, sig_priv, std::nullopt);
+  pub.merge(committer, path);
+
+  REQUIRE(LeftmostPlacement{}.place(pub) == LeafIndex{ 1 });
+  REQUIRE(MinResolutionPlacement{}.place(pub) == LeafIndex{ 7 });
+  REQUIRE(ClusteredPlacement{}.place(pub) == LeafIndex{ 4 });
+
+  // The policy is carried over to copies of the tree
+  auto [joiner_init, joiner_sig, joiner] = new_key_package();
+  silence_unused(joiner_init);
+  silence_unused(joiner_sig);
+  pub.leaf_placement(std::make_shared<MinResolutionPlacement>());
+  auto copy = pub;
+  REQUIRE(copy.add_leaf(joiner) == LeafIndex{ 7 });
+  REQUIRE(copy.add_leaf(joiner) == LeafIndex{ 4 });
+  check_node_caches(copy);
+
+  // An empty tree gets its first leaf, and a full tree is extended
+  auto full = TreeKEMPublicKey{ suite };
+  REQUIRE(MinResolutionPlacement{}.place(full) == LeafIndex{ 0 });
+  REQUIRE(ClusteredPlacement{}.place(full) == LeafIndex{ 0 });
+  full.add_leaf(joiner);
+  REQUIRE(MinResolutionPlacement{}.place(full) == LeafIndex{ 1 });
+  REQUIRE(ClusteredPlacement{}.place(full) == LeafIndex{ 1 });
+
+  // A policy may not choose an occupied leaf
+  struct FirstLeaf : public LeafPlacement
+  {
+    LeafIndex place(const TreeKEMPublicKey& /* tree */) const override
+    {
+      return LeafIndex{ 0 };
+    }
+  };
+  full.leaf_placement(std::make_shared<FirstLeaf>());
+  REQUIRE_THROWS_AS(full.add_leaf(joiner), InvalidParameterError);
+}
+
 TEST_CASE_FIXTURE(TreeKEMTest, "TreeKEM encap/decap")
 {
   const auto size = LeafCount{ 10 };
@@ -264,6 +889,59 @@ TEST_CASE_FIXTURE(TreeKEMTest, "TreeKEM encap/decap")
   }
 }
 
+TEST_CASE_FIXTURE(TreeKEMTest, "TreeKEM Parallel encap")
+{
+  const auto size = LeafCount{ 8 };
+  const auto from = LeafIndex{ 0 };
+  const auto context = bytes{ 0, 1, 2, 3 };
+  const auto leaf_secret = random_bytes(32);
+
+  // With only leaves populated, every copath resolution is a set of leaves
+  auto pub = TreeKEMPublicKey{ suite };
+  auto init_privs = std::vector<HPKEPrivateKey>{};
+  auto sig_privs = std::vector<SignaturePrivateKey>{};
+  for (uint32_t i = 0; i < size.val; i++) {
+    auto [init_priv, sig_priv, kp] = new_key_package();
+    init_privs.push_back(init_priv);
+    sig_privs.push_back(sig_priv);
+    pub.add_leaf(kp);
+  }
+
+  auto serial_pub = pub;
+  auto [serial_priv, serial_path] =
+    serial_pub.encap(from, context, leaf_secret, sig_privs[0], std::nullopt);
+
+  auto pool = ThreadPool{ 4 };
+  auto parallel_pub = pub;
+  auto [parallel_priv, parallel_path] = parallel_pub.encap(
+    from, context, leaf_secret, sig_privs[0], std::nullopt, pool);
+
+  REQUIRE(parallel_priv.path_secrets == serial_priv.path_secrets);
+  REQUIRE(parallel_path.nodes.size() == serial_path.nodes.size());
+
+  auto last = NodeIndex(from);
+  auto dp = tree_math::dirpath(NodeIndex(from), NodeCount(size));
+  for (size_t i = 0; i < dp.size(); i++) {
+    const auto& serial_node = serial_path.nodes[i];
+    const auto& parallel_node = parallel_path.nodes[i];
+    REQUIRE(parallel_node.public_key == serial_node.public_key);
+
+    auto res = pub.resolve(tree_math::sibling(last, NodeCount(size)));
+    REQUIRE(parallel_node.node_secrets.size() == res.size());
+    REQUIRE(serial_node.node_secrets.size() == res.size());
+
+    // Each ciphertext is in the same position as in the serial encap
+    const auto& path_secret = parallel_priv.path_secrets.at(dp[i]);
+    for (size_t j = 0; j < res.size(); j++) {
+      const auto& init_priv = init_privs.at(res[j].val / 2);
+      const auto& ct = parallel_node.node_secrets[j];
+      REQUIRE(init_priv.decrypt(suite, context, ct) == path_secret);
+    }
+
+    last = dp[i];
+  }
+}
+
 TEST_CASE_FIXTURE(TreeKEMTest, "TreeKEM Interop")
 {
   for (size_t i = 0; i < tv.cases.size(); ++i) {